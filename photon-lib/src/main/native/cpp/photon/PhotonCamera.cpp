@@ -24,15 +24,18 @@
 
 #include "photon/PhotonCamera.h"
 
+#include <mutex>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #include <net/TimeSyncServer.h>
 #include <opencv2/core.hpp>
 #include <opencv2/core/utility.hpp>
 #include <wpi/hal/UsageReporting.hpp>
+#include <wpi/nt/ntcore_cpp.hpp>
 #include <wpi/system/Errors.hpp>
 #include <wpi/system/RobotController.hpp>
 #include <wpi/system/Timer.hpp>
@@ -45,6 +48,12 @@
 
 static constexpr wpi::units::second_t WARN_DEBOUNCE_SEC = 5_s;
 static constexpr wpi::units::second_t HEARTBEAT_DEBOUNCE_SEC = 500_ms;
+static constexpr wpi::units::second_t TIMESYNC_STATS_PERIOD = 1_s;
+
+static wpi::tsp::TimeSyncServer& GetTspServer() {
+  static wpi::tsp::TimeSyncServer timesyncServer{5810};
+  return timesyncServer;
+}
 
 // bit of a hack -- start a TimeSync server on port 5810 (hard-coded). We want
 // to avoid calling this from static initialization
@@ -53,11 +62,10 @@ static void InitTspServer() {
   // from different threads, so i guess we need this?
   static std::mutex g_timeSyncServerMutex;
   static bool g_timeSyncServerStarted{false};
-  static wpi::tsp::TimeSyncServer timesyncServer{5810};
 
   std::lock_guard lock{g_timeSyncServerMutex};
   if (!g_timeSyncServerStarted) {
-    timesyncServer.Start();
+    GetTspServer().Start();
     g_timeSyncServerStarted = true;
   }
 }
@@ -101,6 +109,9 @@ PhotonCamera::PhotonCamera(wpi::nt::NetworkTableInstance instance,
       ledModePub(mainTable->GetIntegerTopic("ledModeRequest").Publish()),
       ledModeSub(mainTable->GetIntegerTopic("ledModeState").Subscribe(0)),
       versionEntry(mainTable->GetStringTopic("version").Subscribe("")),
+      timeSyncClientsPublisher(mainTable->GetSubTable(".timesyncServer")
+                                   ->GetStringTopic("clients")
+                                   .Publish()),
       cameraIntrinsicsSubscriber(
           rootTable->GetDoubleArrayTopic("cameraIntrinsics").Subscribe({})),
       cameraDistortionSubscriber(
@@ -146,6 +157,7 @@ PhotonPipelineResult PhotonCamera::GetLatestResult() {
 
   // Prints warning if not connected
   VerifyVersion();
+  PublishTimeSyncClients();
 
   // Fill the packet with latest data and populate result.
   wpi::units::microsecond_t now =
@@ -173,6 +185,7 @@ std::vector<PhotonPipelineResult> PhotonCamera::GetAllUnreadResults() {
   // Prints warning if not connected
   VerifyVersion();
   UpdateDisconnectAlert();
+  PublishTimeSyncClients();
 
   const auto changes = rawBytesEntry.ReadQueue();
 
@@ -208,6 +221,44 @@ void PhotonCamera::UpdateDisconnectAlert() {
   disconnectAlert.Set(!IsConnected());
 }
 
+std::vector<wpi::tsp::TimeSyncClientStats> PhotonCamera::GetTimeSyncClients() {
+  return GetTspServer().GetClientStats();
+}
+
+void PhotonCamera::PublishTimeSyncClients() {
+  // Every camera shares the one server, so whichever camera gets here first
+  // each period publishes for all of them
+  static std::mutex publishMutex;
+  static wpi::units::second_t lastPublishTime = -TIMESYNC_STATS_PERIOD;
+  {
+    std::lock_guard lock{publishMutex};
+    const auto now = wpi::Timer::GetMonotonicTimestamp();
+    if (now < lastPublishTime + TIMESYNC_STATS_PERIOD) {
+      return;
+    }
+    lastPublishTime = now;
+  }
+
+  // The server stamps pings with NT time
+  const auto now = static_cast<int64_t>(wpi::nt::Now());
+  wpi::util::json clients = wpi::util::json::array();
+  for (const auto& client : GetTimeSyncClients()) {
+    wpi::util::json entry = {
+        {"address", client.address},
+        {"pingsReceived", client.pingsReceived},
+        {"pingRate", client.pingRate},
+        {"secondsSinceLastPing",
+         (now - static_cast<int64_t>(client.lastPingTime)) / 1e6},
+    };
+    if (client.reportsStats) {
+      entry["rtt2Us"] = client.rtt2;
+      entry["offsetUs"] = client.offset;
+    }
+    clients.push_back(std::move(entry));
+  }
+  timeSyncClientsPublisher.Set(clients.dump());
+}
+
 void PhotonCamera::CheckTimeSyncOrWarn(photon::PhotonPipelineResult& result) {
   if (result.metadata.timeSinceLastPong > 5L * 1000000L) {
     std::string warningText =
@@ -295,19 +346,25 @@ bool PhotonCamera::IsConnected() {
   return (now - prevHeartbeatChangeTime) < HEARTBEAT_DEBOUNCE_SEC;
 }
 
-std::optional<PhotonCamera::CameraMatrix> PhotonCamera::GetCameraMatrix() {
+void PhotonCamera::UpdateCalibration() {
+  const int64_t intrinsicsChange = cameraIntrinsicsSubscriber.GetLastChange();
+  const int64_t distortionChange = cameraDistortionSubscriber.GetLastChange();
+  if (intrinsicsChange == intrinsicsLastChange &&
+      distortionChange == distortionLastChange) {
+    return;
+  }
+  intrinsicsLastChange = intrinsicsChange;
+  distortionLastChange = distortionChange;
+
   auto camCoeffs = cameraIntrinsicsSubscriber.Get();
   if (camCoeffs.size() == 9) {
-    PhotonCamera::CameraMatrix retVal =
+    cachedCameraMatrix =
         Eigen::Map<const Eigen::Matrix<double, 3, 3, Eigen::RowMajor>>(
             camCoeffs.data());
-    return retVal;
+  } else {
+    cachedCameraMatrix = std::nullopt;
   }
 
-  return std::nullopt;
-}
-
-std::optional<PhotonCamera::DistortionMatrix> PhotonCamera::GetDistCoeffs() {
   auto distCoeffs = cameraDistortionSubscriber.Get();
   auto bound = distCoeffs.size();
   if (bound > 0 && bound <= 8) {
@@ -317,9 +374,34 @@ std::optional<PhotonCamera::DistortionMatrix> PhotonCamera::GetDistCoeffs() {
     Eigen::Map<const Eigen::VectorXd> map(distCoeffs.data(), bound);
     retVal.block(0, 0, bound, 1) = map;
 
-    return retVal;
+    cachedDistCoeffs = retVal;
+  } else {
+    cachedDistCoeffs = std::nullopt;
+  }
+
+  if (cachedCameraMatrix && cachedDistCoeffs) {
+    cachedCalibration.emplace(*cachedCameraMatrix, *cachedDistCoeffs);
+  } else {
+    cachedCalibration = std::nullopt;
   }
-  return std::nullopt;
+}
+
+std::optional<PhotonCamera::CameraMatrix> PhotonCamera::GetCameraMatrix() {
+  std::scoped_lock lock{*calibrationMutex};
+  UpdateCalibration();
+  return cachedCameraMatrix;
+}
+
+std::optional<PhotonCamera::DistortionMatrix> PhotonCamera::GetDistCoeffs() {
+  std::scoped_lock lock{*calibrationMutex};
+  UpdateCalibration();
+  return cachedDistCoeffs;
+}
+
+std::optional<CameraCalibration> PhotonCamera::GetCalibration() {
+  std::scoped_lock lock{*calibrationMutex};
+  UpdateCalibration();
+  return cachedCalibration;
 }
 
 void PhotonCamera::VerifyVersion() {
@@ -311,6 +311,12 @@ PhotonPoseEstimator::EstimateCoprocMultiTagPose(
 std::optional<EstimatedRobotPose> PhotonPoseEstimator::EstimateRioMultiTagPose(
     PhotonPipelineResult cameraResult, PhotonCamera::CameraMatrix cameraMatrix,
     PhotonCamera::DistortionMatrix distCoeffs) {
+  return EstimateRioMultiTagPose(std::move(cameraResult),
+                                 CameraCalibration{cameraMatrix, distCoeffs});
+}
+
+std::optional<EstimatedRobotPose> PhotonPoseEstimator::EstimateRioMultiTagPose(
+    PhotonPipelineResult cameraResult, const CameraCalibration& calibration) {
   // Need at least 2 targets
   if (cameraResult.GetTargets().size() < 2 || !ShouldEstimate(cameraResult)) {
     return std::nullopt;
@@ -346,15 +352,9 @@ std::optional<EstimatedRobotPose> PhotonPoseEstimator::EstimateRioMultiTagPose(
   cv::Mat const rvec(3, 1, cv::DataType<double>::type);
   cv::Mat const tvec(3, 1, cv::DataType<double>::type);
 
-  {
-    cv::Mat cameraMatCV(cameraMatrix.rows(), cameraMatrix.cols(), CV_64F);
-    cv::eigen2cv(cameraMatrix, cameraMatCV);
-    cv::Mat distCoeffsMatCV(distCoeffs.rows(), distCoeffs.cols(), CV_64F);
-    cv::eigen2cv(distCoeffs, distCoeffsMatCV);
-
-    cv::solvePnP(objectPoints, imagePoints, cameraMatCV, distCoeffsMatCV, rvec,
-                 tvec, false, cv::SOLVEPNP_SQPNP);
-  }
+  cv::solvePnP(objectPoints, imagePoints, calibration.GetCvCameraMatrix(),
+               calibration.GetCvDistCoeffs(), rvec, tvec, false,
+               cv::SOLVEPNP_SQPNP);
 
   const wpi::math::Pose3d pose = detail::ToPose3d(tvec, rvec);
 
@@ -480,6 +480,16 @@ PhotonPoseEstimator::EstimateConstrainedSolvepnpPose(
     photon::PhotonCamera::CameraMatrix cameraMatrix,
     photon::PhotonCamera::DistortionMatrix distCoeffs,
     wpi::math::Pose3d seedPose, bool headingFree, double headingScaleFactor) {
+  return EstimateConstrainedSolvepnpPose(
+      std::move(cameraResult), CameraCalibration{cameraMatrix, distCoeffs},
+      seedPose, headingFree, headingScaleFactor);
+}
+
+std::optional<EstimatedRobotPose>
+PhotonPoseEstimator::EstimateConstrainedSolvepnpPose(
+    photon::PhotonPipelineResult cameraResult,
+    const photon::CameraCalibration& calibration, wpi::math::Pose3d seedPose,
+    bool headingFree, double headingScaleFactor) {
   if (!ShouldEstimate(cameraResult)) {
     return std::nullopt;
   }
@@ -500,8 +510,8 @@ PhotonPoseEstimator::EstimateConstrainedSolvepnpPose(
 
   std::optional<photon::PnpResult> pnpResult =
       VisionEstimation::EstimateRobotPoseConstrainedSolvePNP(
-          cameraMatrix, distCoeffs, targets, m_robotToCamera, seedPose,
-          aprilTags, photon::kAprilTag36h11, headingFree,
+          calibration, targets, m_robotToCamera, seedPose, aprilTags,
+          photon::kAprilTag36h11, headingFree,
           wpi::math::Rotation2d{
               headingBuffer.Sample(cameraResult.GetTimestamp()).value()},
           headingScaleFactor);
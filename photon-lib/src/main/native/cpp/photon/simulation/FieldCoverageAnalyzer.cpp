@@ -0,0 +1,252 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "photon/simulation/FieldCoverageAnalyzer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <numbers>
+#include <optional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include <opencv2/imgproc.hpp>
+#include <wpi/system/Errors.hpp>
+
+namespace photon {
+
+namespace {
+struct CellTotals {
+  double tags{0};
+  double multiTag{0};
+  double estimates{0};
+  double error{0};
+};
+
+// The camera's field pose as estimated from one frame, if any
+std::optional<wpi::math::Pose3d> EstimateCameraPose(
+    const PhotonPipelineResult& result,
+    const std::unordered_map<int, wpi::math::Pose3d>& tagPoses) {
+  if (result.MultiTagResult()) {
+    const auto& fieldToCamera = result.MultiTagResult()->estimatedPose.best;
+    return wpi::math::Pose3d{} + fieldToCamera;
+  }
+  for (const auto& target : result.GetTargets()) {
+    auto tagPose = tagPoses.find(target.GetFiducialId());
+    if (tagPose != tagPoses.end()) {
+      return tagPose->second.TransformBy(
+          target.GetBestCameraToTarget().Inverse());
+    }
+  }
+  return std::nullopt;
+}
+
+double Mean(const std::vector<double>& values) {
+  double total = 0;
+  for (double value : values) {
+    total += value;
+  }
+  return values.empty() ? 0.0 : total / values.size();
+}
+}  // namespace
+
+double FieldCoverageMap::EstimateFraction() const {
+  return Mean(estimateFraction);
+}
+
+double FieldCoverageMap::MultiTagFraction() const {
+  return Mean(multiTagFraction);
+}
+
+double FieldCoverageMap::MeanPoseError() const {
+  // Every cell simulates the same number of frames, so weighting each cell's
+  // mean by its estimate fraction weights every estimate equally
+  double total = 0;
+  double weight = 0;
+  for (size_t cell = 0; cell < poseError.size(); cell++) {
+    if (!std::isnan(poseError[cell])) {
+      total += poseError[cell] * estimateFraction[cell];
+      weight += estimateFraction[cell];
+    }
+  }
+  return weight > 0 ? total / weight
+                    : std::numeric_limits<double>::quiet_NaN();
+}
+
+cv::Mat FieldCoverageMap::Heatmap(std::span<const double> values,
+                                  double maxValue, int pixelsPerCell) const {
+  if (values.size() != static_cast<size_t>(columns) * rows) {
+    WPILIB_ReportError(wpi::err::Error,
+                       "Heatmap needs one value per cell, got {} for {} cells",
+                       values.size(), static_cast<size_t>(columns) * rows);
+    return cv::Mat{};
+  }
+  cv::Mat scaled{rows, columns, CV_8UC1};
+  cv::Mat missing{rows, columns, CV_8UC1};
+  for (int row = 0; row < rows; row++) {
+    // Image rows go down, field rows go up
+    const int imageRow = rows - 1 - row;
+    for (int column = 0; column < columns; column++) {
+      const double value = values[Index(column, row)];
+      missing.at<uint8_t>(imageRow, column) = std::isnan(value) ? 255 : 0;
+      scaled.at<uint8_t>(imageRow, column) = static_cast<uint8_t>(
+          std::isnan(value)
+              ? 0
+              : std::clamp(value / maxValue, 0.0, 1.0) * 255.0 + 0.5);
+    }
+  }
+
+  cv::Mat colored;
+  cv::applyColorMap(scaled, colored, cv::COLORMAP_VIRIDIS);
+  colored.setTo(cv::Scalar{0, 0, 0}, missing);
+  cv::Mat heatmap;
+  cv::resize(colored, heatmap,
+             cv::Size{columns * pixelsPerCell, rows * pixelsPerCell}, 0, 0,
+             cv::INTER_NEAREST);
+  return heatmap;
+}
+
+FieldCoverageAnalyzer::FieldCoverageAnalyzer(
+    const SimCameraProperties& prop,
+    const wpi::apriltag::AprilTagFieldLayout& tagLayout,
+    const FieldCoverageConfig& config)
+    : config{config},
+      fieldLength{tagLayout.GetFieldLength()},
+      fieldWidth{tagLayout.GetFieldWidth()},
+      columns{std::max(
+          1, static_cast<int>(std::ceil((fieldLength / config.cellSize)
+                                            .to<double>())))},
+      rows{std::max(1, static_cast<int>(std::ceil(
+                           (fieldWidth / config.cellSize).to<double>())))},
+      ntInstance{wpi::nt::NetworkTableInstance::Create()},
+      pool{config.threads > 0 ? config.threads
+                              : std::thread::hardware_concurrency()} {
+  for (const wpi::apriltag::AprilTag& tag : tagLayout.GetTags()) {
+    tags.emplace_back(tag.pose, kAprilTag36h11, tag.ID);
+    tagPoses.emplace(tag.ID, tag.pose);
+  }
+  for (const auto& tag : tags) {
+    tagPtrs.push_back(&tag);
+  }
+
+  lanes.resize(pool.GetThreadCount());
+  for (size_t i = 0; i < lanes.size(); i++) {
+    lanes[i].camera = std::make_unique<PhotonCamera>(
+        ntInstance, "coverage" + std::to_string(i));
+    lanes[i].cameraSim = std::make_unique<PhotonCameraSim>(
+        lanes[i].camera.get(), prop, tagLayout, true);
+  }
+}
+
+FieldCoverageAnalyzer::~FieldCoverageAnalyzer() {
+  lanes.clear();
+  wpi::nt::NetworkTableInstance::Destroy(ntInstance);
+}
+
+FieldCoverageMap FieldCoverageAnalyzer::Evaluate(
+    const wpi::math::Transform3d& robotToCamera) {
+  return std::move(
+      Evaluate(std::span<const wpi::math::Transform3d>{&robotToCamera, 1})
+          .front());
+}
+
+std::vector<FieldCoverageMap> FieldCoverageAnalyzer::Evaluate(
+    std::span<const wpi::math::Transform3d> robotToCameras) {
+  const size_t cells = static_cast<size_t>(columns) * rows;
+  const int headings = std::max(1, config.headings);
+  const int samples = std::max(1, config.samplesPerPose);
+  const double frames = static_cast<double>(headings) * samples;
+
+  std::vector<FieldCoverageMap> maps(robotToCameras.size());
+  for (auto& map : maps) {
+    map.columns = columns;
+    map.rows = rows;
+    map.cellSize = config.cellSize;
+    map.tagsVisible.resize(cells);
+    map.estimateFraction.resize(cells);
+    map.multiTagFraction.resize(cells);
+    map.poseError.resize(cells);
+  }
+
+  // Each thread takes a lane and then claims cells until none are left
+  std::atomic<size_t> nextTask{0};
+  const size_t taskCount = cells * robotToCameras.size();
+  pool.ParallelFor(lanes.size(), [&](size_t lane) {
+    PhotonCameraSim& cameraSim = *lanes[lane].cameraSim;
+    for (size_t task = nextTask++; task < taskCount; task = nextTask++) {
+      const size_t mount = task / cells;
+      const size_t cell = task % cells;
+      const int column = static_cast<int>(cell % columns);
+      const int row = static_cast<int>(cell / columns);
+      const wpi::units::meter_t x = (column + 0.5) * config.cellSize;
+      const wpi::units::meter_t y = (row + 0.5) * config.cellSize;
+
+      // Seed by cell so the noise doesn't depend on which thread ran it, and
+      // every mount sees the same noise at the same cell
+      cameraSim.prop.SetRandomSeed(config.seed);
+      cameraSim.prop.SetRandomStream(cell);
+
+      CellTotals totals;
+      for (int heading = 0; heading < headings; heading++) {
+        const wpi::math::Pose3d robotPose{
+            x, y, 0_m,
+            wpi::math::Rotation3d{
+                0_rad, 0_rad,
+                wpi::units::radian_t{2 * std::numbers::pi * heading /
+                                     headings}}};
+        const wpi::math::Pose3d cameraPose =
+            robotPose + robotToCameras[mount];
+        for (int sample = 0; sample < samples; sample++) {
+          cameraSim.prop.BeginNoiseFrame();
+          PhotonPipelineResult result =
+              cameraSim.Process(0_s, cameraPose, tagPtrs);
+          totals.tags += result.GetTargets().size();
+          totals.multiTag += result.MultiTagResult() ? 1 : 0;
+          auto estimate = EstimateCameraPose(result, tagPoses);
+          if (estimate) {
+            totals.estimates++;
+            totals.error += estimate->Translation()
+                                .Distance(cameraPose.Translation())
+                                .value();
+          }
+        }
+      }
+
+      FieldCoverageMap& map = maps[mount];
+      map.tagsVisible[cell] = totals.tags / frames;
+      map.estimateFraction[cell] = totals.estimates / frames;
+      map.multiTagFraction[cell] = totals.multiTag / frames;
+      map.poseError[cell] = totals.estimates > 0
+                                ? totals.error / totals.estimates
+                                : std::numeric_limits<double>::quiet_NaN();
+    }
+  });
+  return maps;
+}
+
+}  // namespace photon
@@ -25,6 +25,9 @@
 #include "photon/simulation/PhotonCameraSim.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <span>
 #include <string>
 #include <utility>
 #include <vector>
@@ -32,12 +35,87 @@
 #include <wpi/apriltag/AprilTagFieldLayout.hpp>
 #include <wpi/apriltag/AprilTagFields.hpp>
 
+#include "photon/estimation/CameraProjection.h"
 #include "photon/estimation/CameraTargetRelation.h"
 #include "photon/estimation/RotTrlTransform3d.h"
 #include "photon/estimation/VisionEstimation.h"
+#include "photon/simulation/SimRandom.h"
 #include "photon/simulation/VideoSimUtil.h"
 
 namespace photon {
+namespace {
+// Occlusion silhouettes are clipped this far in front of the camera, so
+// geometry reaching behind it still projects to finite pixels
+constexpr double kOcclusionNearPlane = 0.05;
+// How far behind the nearest surface still counts as visible, so a target
+// isn't hidden by whatever it is mounted on
+constexpr float kOcclusionTolerance = 0.02f;
+// A tag can't be decoded with more than a sliver of it covered
+constexpr double kMinTagVisibleFraction = 0.95;
+
+struct Silhouette {
+  std::vector<cv::Point2f> points;
+  std::vector<float> depths;
+};
+
+/**
+ * Projects a convex set of field points to its outline in the image, with
+ * the depth of each outline vertex. The set is first clipped at the near
+ * plane: the clipped shape is the hull of the points in front of it and of
+ * where the segments from those to the points behind it cross the plane.
+ */
+Silhouette ProjectSilhouette(
+    const CameraCalibration& calibration, const RotTrlTransform3d& camRt,
+    const std::vector<wpi::math::Translation3d>& vertices) {
+  std::vector<double> depths;
+  depths.reserve(vertices.size());
+  for (const auto& vertex : vertices) {
+    depths.push_back(camRt.Apply(vertex).X().value());
+  }
+
+  std::vector<wpi::math::Translation3d> clipped;
+  std::vector<float> clippedDepths;
+  for (size_t i = 0; i < vertices.size(); i++) {
+    if (depths[i] < kOcclusionNearPlane) {
+      continue;
+    }
+    clipped.push_back(vertices[i]);
+    clippedDepths.push_back(static_cast<float>(depths[i]));
+    for (size_t j = 0; j < vertices.size(); j++) {
+      if (depths[j] >= kOcclusionNearPlane) {
+        continue;
+      }
+      double t = (depths[i] - kOcclusionNearPlane) / (depths[i] - depths[j]);
+      clipped.push_back(vertices[i] + (vertices[j] - vertices[i]) * t);
+      clippedDepths.push_back(static_cast<float>(kOcclusionNearPlane));
+    }
+  }
+
+  Silhouette silhouette;
+  if (clipped.size() < 3) {
+    return silhouette;
+  }
+  std::vector<cv::Point2f> projected =
+      OpenCVHelp::ProjectPoints(calibration, camRt, clipped);
+  std::vector<int> hull;
+  cv::convexHull(projected, hull, false, false);
+  for (int index : hull) {
+    silhouette.points.push_back(projected[index]);
+    silhouette.depths.push_back(clippedDepths[index]);
+  }
+  return silhouette;
+}
+
+// The time since mark, moving mark up to now
+wpi::units::second_t Lap(std::chrono::steady_clock::time_point& mark) {
+  auto now = std::chrono::steady_clock::now();
+  wpi::units::second_t elapsed =
+      std::chrono::duration<double>{now - mark}.count() * 1_s;
+  mark = now;
+  return elapsed;
+}
+}  // namespace
+
 PhotonCameraSim::PhotonCameraSim(PhotonCamera* camera)
     : PhotonCameraSim(camera, photon::SimCameraProperties::PERFECT_90DEG(),
                       wpi::apriltag::AprilTagFieldLayout::LoadField(
@@ -46,15 +124,26 @@ PhotonCameraSim::PhotonCameraSim(PhotonCamera* camera)
 PhotonCameraSim::PhotonCameraSim(
     PhotonCamera* camera, const SimCameraProperties& props,
     const wpi::apriltag::AprilTagFieldLayout& tagLayout)
-    : prop{props}, cam{camera}, tagLayout{tagLayout} {
+    : PhotonCameraSim(camera, props, tagLayout, false) {}
+
+PhotonCameraSim::PhotonCameraSim(
+    PhotonCamera* camera, const SimCameraProperties& props,
+    const wpi::apriltag::AprilTagFieldLayout& tagLayout, bool headless)
+    : prop{props}, cam{camera}, tagLayout{tagLayout}, headless{headless} {
   SetMinTargetAreaPixels(kDefaultMinAreaPx);
-  videoSimRaw =
-      wpi::CameraServer::PutVideo(std::string{camera->GetCameraName()} + "-raw",
-                                  prop.GetResWidth(), prop.GetResHeight());
-  videoSimRaw.SetPixelFormat(wpi::util::PixelFormat::GRAY);
-  videoSimProcessed = wpi::CameraServer::PutVideo(
-      std::string{camera->GetCameraName()} + "-processed", prop.GetResWidth(),
-      prop.GetResHeight());
+  prop.SetRandomStream(SimRandom::HashName(camera->GetCameraName()));
+  if (headless) {
+    videoSimRawEnabled = false;
+    videoSimProcEnabled = false;
+  } else {
+    videoSimRaw = wpi::CameraServer::PutVideo(
+        std::string{camera->GetCameraName()} + "-raw", prop.GetResWidth(),
+        prop.GetResHeight());
+    videoSimRaw.SetPixelFormat(wpi::util::PixelFormat::GRAY);
+    videoSimProcessed = wpi::CameraServer::PutVideo(
+        std::string{camera->GetCameraName()} + "-processed",
+        prop.GetResWidth(), prop.GetResHeight());
+  }
   ts.subTable = cam->GetCameraTable();
   ts.UpdateEntries();
 }
@@ -89,13 +178,14 @@ bool PhotonCameraSim::CanSeeCorner(const std::vector<cv::Point2f>& points) {
   return true;
 }
 std::optional<uint64_t> PhotonCameraSim::ConsumeNextEntryTime() {
-  int64_t now = wpi::nt::Now();
+  int64_t now = clock->NowMicros();
   int64_t timestamp{};
   bool hasTimestamp = false;
   int iter = 0;
   while (now >= nextNTEntryTime) {
     timestamp = nextNTEntryTime;
     hasTimestamp = true;
+    prop.BeginNoiseFrame();
     int64_t frameTime = prop.EstSecUntilNextFrame()
                             .convert<wpi::units::microseconds>()
                             .to<int64_t>();
@@ -114,99 +204,194 @@ std::optional<uint64_t> PhotonCameraSim::ConsumeNextEntryTime() {
     return std::nullopt;
   }
 }
+std::vector<double> PhotonCameraSim::ComputeVisibleFractions(
+    const wpi::math::Pose3d& cameraPose,
+    std::span<const VisionTargetSim* const> targets,
+    std::span<const std::vector<wpi::math::Translation3d>> targetVertices) {
+  // Occlusion is purely geometric, so work in the undistorted image where
+  // silhouette edges stay straight
+  const CameraCalibration& calibration = prop.GetPinholeCalibration();
+  const RotTrlTransform3d camRt = RotTrlTransform3d::MakeRelativeTo(cameraPose);
+  occlusionBuffer.Reset(prop.GetResWidth(), prop.GetResHeight());
+
+  for (const auto& occluder : occluders) {
+    Silhouette silhouette =
+        ProjectSilhouette(calibration, camRt, occluder.GetFieldVertices());
+    occlusionBuffer.Add(silhouette.points, silhouette.depths);
+  }
+  std::vector<Silhouette> silhouettes;
+  silhouettes.reserve(targetVertices.size());
+  for (const auto& vertices : targetVertices) {
+    silhouettes.push_back(ProjectSilhouette(calibration, camRt, vertices));
+    occlusionBuffer.Add(silhouettes.back().points, silhouettes.back().depths);
+  }
+
+  std::vector<double> fractions(targets.size(), 1.0);
+  for (size_t i = 0; i < targets.size() && i < silhouettes.size(); i++) {
+    const Silhouette& silhouette = silhouettes[i];
+    double fraction = occlusionBuffer.VisibleFraction(
+        silhouette.points, silhouette.depths, kOcclusionTolerance);
+    if (targets[i]->GetFiducialId() >= 0 && !silhouette.points.empty()) {
+      // A tag also needs every corner. Test them just inside the tag, at its
+      // nearest depth, so the tag's own slant and a neighbor sharing the
+      // corner's cell don't hide them.
+      bool cornersVisible = fraction >= kMinTagVisibleFraction;
+      const float nearest = *std::min_element(silhouette.depths.begin(),
+                                              silhouette.depths.end());
+      const cv::Point2f centroid = OpenCVHelp::AvgPoint(silhouette.points);
+      for (const auto& corner : silhouette.points) {
+        cornersVisible =
+            cornersVisible &&
+            occlusionBuffer.IsVisible(corner + (centroid - corner) * 0.1f,
+                                      nearest, kOcclusionTolerance);
+      }
+      fraction = cornersVisible ? 1 : 0;
+    }
+    fractions[i] = fraction;
+  }
+  return fractions;
+}
+
+PhotonPipelineResult PhotonCameraSim::Process(
+    wpi::units::second_t latency, const wpi::math::Pose3d& cameraPose,
+    const std::vector<VisionTargetSim>& targets) {
+  std::vector<const VisionTargetSim*> targetPtrs{};
+  targetPtrs.reserve(targets.size());
+  for (const auto& tgt : targets) {
+    targetPtrs.push_back(&tgt);
+  }
+  return Process(latency, cameraPose, targetPtrs);
+}
 PhotonPipelineResult PhotonCameraSim::Process(
     wpi::units::second_t latency, const wpi::math::Pose3d& cameraPose,
-    std::vector<VisionTargetSim> targets) {
-  std::sort(targets.begin(), targets.end(),
-            [cameraPose](const VisionTargetSim& t1, const VisionTargetSim& t2) {
-              wpi::units::meter_t dist1 =
-                  t1.GetPose().Translation().Distance(cameraPose.Translation());
-              wpi::units::meter_t dist2 =
-                  t2.GetPose().Translation().Distance(cameraPose.Translation());
-              return dist1 > dist2;
-            });
-
-  std::vector<std::pair<VisionTargetSim, std::vector<cv::Point2f>>>
+    std::span<const VisionTargetSim* const> targetPtrs) {
+  auto mark = std::chrono::steady_clock::now();
+  // Sort furthest first, measuring each target once rather than per compare
+  std::vector<std::pair<double, const VisionTargetSim*>> sortedTargets{};
+  sortedTargets.reserve(targetPtrs.size());
+  for (const VisionTargetSim* tgt : targetPtrs) {
+    sortedTargets.emplace_back(
+        tgt->GetPose().Translation().Distance(cameraPose.Translation()).value(),
+        tgt);
+  }
+  std::sort(sortedTargets.begin(), sortedTargets.end(),
+            [](const auto& a, const auto& b) { return a.first > b.first; });
+
+  std::vector<std::pair<const VisionTargetSim*, std::vector<cv::Point2f>>>
       visibleTgts{};
   std::vector<PhotonTrackedTarget> detectableTgts{};
+  // Fiducials are solved together after the loop, so remember which detected
+  // target each PnP problem belongs to
+  std::vector<size_t> pnpTgtIndices{};
+  std::vector<std::vector<wpi::math::Translation3d>> pnpModels{};
+  std::vector<std::vector<cv::Point2f>> pnpCorners{};
+  // Only kept for the occlusion pass
+  std::vector<std::vector<wpi::math::Translation3d>> visibleVertices{};
   RotTrlTransform3d camRt = RotTrlTransform3d::MakeRelativeTo(cameraPose);
 
-  VideoSimUtil::UpdateVideoProp(videoSimRaw, prop);
-  VideoSimUtil::UpdateVideoProp(videoSimProcessed, prop);
-  cv::Size videoFrameSize{prop.GetResWidth(), prop.GetResHeight()};
-  cv::Mat blankFrame = cv::Mat::zeros(videoFrameSize, CV_8UC1);
-  blankFrame.assignTo(videoSimFrameRaw);
+  // Spheres are projected together after the loop, straight from their
+  // centers and radii
+  std::vector<size_t> sphereIndices{};
+  std::vector<Eigen::Vector3d> sphereCenters{};
+  std::vector<double> sphereRadii{};
 
-  for (const auto& tgt : targets) {
-    if (detectableTgts.size() >= 50) {
-      break;
+  for (const auto& sorted : sortedTargets) {
+    const VisionTargetSim& tgt = *sorted.second;
+    if (!CanSeeTargetPose(cameraPose, tgt)) {
+      continue;
     }
 
-    if (!CanSeeTargetPose(cameraPose, tgt)) {
+    if (tgt.GetModel().GetIsSpherical()) {
+      if (occlusionEnabled) {
+        visibleVertices.push_back(
+            tgt.GetModel().GetFieldVertices(TargetModel::GetOrientedPose(
+                tgt.GetPose().Translation(), cameraPose.Translation())));
+      }
+      sphereIndices.push_back(visibleTgts.size());
+      sphereCenters.push_back(tgt.GetPose().Translation().ToVector());
+      sphereRadii.push_back(
+          tgt.GetModel().GetVertices().front().Norm().value());
+      visibleTgts.emplace_back(&tgt, std::vector<cv::Point2f>(4));
       continue;
     }
 
     std::vector<wpi::math::Translation3d> fieldCorners = tgt.GetFieldVertices();
-    if (tgt.GetModel().GetIsSpherical()) {
-      TargetModel model = tgt.GetModel();
-      fieldCorners = model.GetFieldVertices(TargetModel::GetOrientedPose(
-          tgt.GetPose().Translation(), cameraPose.Translation()));
+    std::vector<cv::Point2f> imagePoints =
+        OpenCVHelp::ProjectPoints(prop.GetCalibration(), camRt, fieldCorners);
+    if (occlusionEnabled) {
+      visibleVertices.push_back(std::move(fieldCorners));
     }
+    visibleTgts.emplace_back(&tgt, std::move(imagePoints));
+  }
 
-    std::vector<cv::Point2f> imagePoints = OpenCVHelp::ProjectPoints(
-        prop.GetIntrinsics(), prop.GetDistCoeffs(), camRt, fieldCorners);
-    if (tgt.GetModel().GetIsSpherical()) {
-      cv::Point2d center = OpenCVHelp::AvgPoint(imagePoints);
-      int l = 0;
-      int t = 0;
-      int b = 0;
-      int r = 0;
-      for (int i = 0; i < 4; i++) {
-        if (imagePoints[i].x < imagePoints[l].x) {
-          l = i;
-        }
+  if (!sphereIndices.empty()) {
+    const Eigen::Matrix3d nwuToEdn = OpenCVHelp::NWU_TO_EDN.ToMatrix();
+    const Eigen::Matrix3d rotation = nwuToEdn * camRt.GetRotation().ToMatrix();
+    const Eigen::Vector3d translation =
+        nwuToEdn * camRt.GetTranslation().ToVector();
+    Eigen::Matrix3Xd centers(3, sphereCenters.size());
+    for (size_t i = 0; i < sphereCenters.size(); i++) {
+      centers.col(i) = rotation * sphereCenters[i] + translation;
+    }
+    Eigen::Matrix2Xd corners(2, 4 * sphereCenters.size());
+    CameraProjection::ProjectSphereBounds(
+        prop.GetCalibration().GetCameraMatrix(),
+        prop.GetCalibration().GetDistCoeffs(), centers, sphereRadii, corners);
+
+    std::vector<bool> invalid(visibleTgts.size(), false);
+    bool anyInvalid = false;
+    for (size_t i = 0; i < sphereIndices.size(); i++) {
+      auto& imagePoints = visibleTgts[sphereIndices[i]].second;
+      for (int j = 0; j < 4; j++) {
+        imagePoints[j] = cv::Point2f{static_cast<float>(corners(0, 4 * i + j)),
+                                     static_cast<float>(corners(1, 4 * i + j))};
       }
-      cv::Point2d lc = imagePoints[l];
-      std::array<double, 4> angles{};
-      t = (l + 1) % 4;
-      b = (l + 1) % 4;
-      for (int i = 0; i < 4; i++) {
-        if (i == l) {
-          continue;
-        }
-        cv::Point2d ic = imagePoints[i];
-        angles[i] = std::atan2(lc.y - ic.y, ic.x - lc.x);
-        if (angles[i] >= angles[t]) {
-          t = i;
-        }
-        if (angles[i] <= angles[b]) {
-          b = i;
-        }
+      // Spheres reaching behind the camera have no elliptical image
+      if (std::isnan(corners(0, 4 * i))) {
+        invalid[sphereIndices[i]] = true;
+        anyInvalid = true;
       }
-      for (int i = 0; i < 4; i++) {
-        if (i != t && i != l && i != b) {
-          r = i;
+    }
+    for (size_t i = visibleTgts.size(); anyInvalid && i-- > 0;) {
+      if (invalid[i]) {
+        visibleTgts.erase(visibleTgts.begin() + i);
+        if (occlusionEnabled) {
+          visibleVertices.erase(visibleVertices.begin() + i);
         }
       }
-      cv::RotatedRect rect{cv::Point2d{center.x, center.y},
-                           cv::Size2d{imagePoints[r].x - lc.x,
-                                      imagePoints[b].y - imagePoints[t].y},
-                           wpi::units::radian_t{-angles[r]}
-                               .convert<wpi::units::degrees>()
-                               .to<float>()};
-      std::vector<cv::Point2f> points{};
-      rect.points(points);
-
-      // Can't find an easier way to convert from Point2f to Point2d
-      imagePoints.clear();
-      std::transform(points.begin(), points.end(),
-                     std::back_inserter(imagePoints),
-                     [](const cv::Point2f& p) { return (cv::Point2d)p; });
     }
+  }
+
+  // Occlusion uses the noiseless geometry, so it doesn't change the noise
+  std::vector<double> visibleFractions(visibleTgts.size(), 1.0);
+  if (occlusionEnabled) {
+    std::vector<const VisionTargetSim*> visiblePtrs{};
+    visiblePtrs.reserve(visibleTgts.size());
+    for (const auto& visible : visibleTgts) {
+      visiblePtrs.push_back(visible.first);
+    }
+    visibleFractions =
+        ComputeVisibleFractions(cameraPose, visiblePtrs, visibleVertices);
+  }
 
-    visibleTgts.emplace_back(std::make_pair(tgt, imagePoints));
-    std::vector<cv::Point2f> noisyTargetCorners =
-        prop.EstPixelNoise(imagePoints);
+  // Add noise to every visible corner in one batch
+  std::vector<cv::Point2f> noisyCorners{};
+  for (const auto& visible : visibleTgts) {
+    noisyCorners.insert(noisyCorners.end(), visible.second.begin(),
+                        visible.second.end());
+  }
+  prop.EstPixelNoise(std::span<cv::Point2f>{noisyCorners});
+
+  auto nextCorners = noisyCorners.cbegin();
+  for (size_t i = 0; i < visibleTgts.size(); i++) {
+    const auto& [tgtPtr, imagePoints] = visibleTgts[i];
+    if (detectableTgts.size() >= 50) {
+      break;
+    }
+    const VisionTargetSim& tgt = *tgtPtr;
+    std::vector<cv::Point2f> noisyTargetCorners(
+        nextCorners, nextCorners + imagePoints.size());
+    nextCorners += imagePoints.size();
     cv::RotatedRect minAreaRect =
         OpenCVHelp::GetMinAreaRect(noisyTargetCorners);
     std::vector<cv::Point2f> minAreaRectPts;
@@ -214,18 +399,19 @@ PhotonPipelineResult PhotonCameraSim::Process(
     minAreaRect.points(minAreaRectPts);
     cv::Point2d centerPt = minAreaRect.center;
     wpi::math::Rotation3d centerRot = prop.GetPixelRot(centerPt);
-    double areaPercent = prop.GetContourAreaPercent(noisyTargetCorners);
+    double areaPercent =
+        prop.GetContourAreaPercent(noisyTargetCorners) * visibleFractions[i];
 
-    if (!(CanSeeCorner(noisyTargetCorners) &&
+    if (!(visibleFractions[i] > 0 && CanSeeCorner(noisyTargetCorners) &&
           areaPercent >= minTargetAreaPercent)) {
       continue;
     }
 
-    std::optional<photon::PnpResult> pnpSim = std::nullopt;
-    if (tgt.GetFiducialId() >= 0 && tgt.GetFieldVertices().size() == 4) {
-      pnpSim = OpenCVHelp::SolvePNP_Square(
-          prop.GetIntrinsics(), prop.GetDistCoeffs(),
-          tgt.GetModel().GetVertices(), noisyTargetCorners);
+    if (tgt.GetFiducialId() >= 0 &&
+        tgt.GetModel().GetVertices().size() == 4) {
+      pnpTgtIndices.push_back(detectableTgts.size());
+      pnpModels.push_back(tgt.GetModel().GetVertices());
+      pnpCorners.push_back(noisyTargetCorners);
     }
 
     // Compute object detection confidence if this is an obj det target
@@ -256,46 +442,92 @@ PhotonPipelineResult PhotonCameraSim::Process(
         -centerRot.Z().convert<wpi::units::degrees>().to<double>(),
         -centerRot.Y().convert<wpi::units::degrees>().to<double>(), areaPercent,
         centerRot.X().convert<wpi::units::degrees>().to<double>(),
-        tgt.GetFiducialId(), classId, conf,
-        pnpSim ? pnpSim->best : wpi::math::Transform3d{},
-        pnpSim ? pnpSim->alt : wpi::math::Transform3d{},
-        pnpSim ? pnpSim->ambiguity : -1, smallVec, cornersDouble);
+        tgt.GetFiducialId(), classId, conf, wpi::math::Transform3d{},
+        wpi::math::Transform3d{}, -1, smallVec, cornersDouble);
+  }
+
+  stageTimings.projection += Lap(mark);
+  auto pnpResults = OpenCVHelp::SolvePNP_SquareBatch(
+      prop.GetCalibration(), pnpModels, pnpCorners);
+  for (size_t i = 0; i < pnpResults.size(); i++) {
+    if (pnpResults[i]) {
+      PhotonTrackedTarget& detected = detectableTgts[pnpTgtIndices[i]];
+      detected.bestCameraToTarget = pnpResults[i]->best;
+      detected.altCameraToTarget = pnpResults[i]->alt;
+      detected.poseAmbiguity = pnpResults[i]->ambiguity;
+    }
   }
 
+  stageTimings.pnp += Lap(mark);
+
+  UpdateVideoSources();
+  cv::Size videoFrameSize{prop.GetResWidth(), prop.GetResHeight()};
+
   if (videoSimRawEnabled) {
+    // Draw into whichever buffer wasn't handed out last frame, reusing its
+    // memory unless the resolution changed
+    rawFrameIndex = (rawFrameIndex + 1) % rawFrameBuffers.size();
+    cv::Mat& rawFrame = rawFrameBuffers[rawFrameIndex];
+    rawFrame.create(videoFrameSize, CV_8UC1);
+
+    // With lens distortion, draw a pinhole image and then distort all of it
+    // at once, so the pixels line up with the distorted corners
+    const bool distort = prop.HasDistortionMaps();
+    cv::Mat& canvas = distort ? pinholeFrame : rawFrame;
+    canvas.create(videoFrameSize, CV_8UC1);
+    canvas.setTo(cv::Scalar{0});
+
     if (videoSimWireframeEnabled) {
       VideoSimUtil::DrawFieldWireFrame(camRt, prop, videoSimWireframeResolution,
                                        1.5, cv::Scalar{80}, 6, 1,
-                                       cv::Scalar{30}, videoSimFrameRaw);
+                                       cv::Scalar{30}, canvas, distort);
+    }
+
+    std::vector<cv::Point2f> drawnCorners;
+    for (const auto& pair : visibleTgts) {
+      drawnCorners.insert(drawnCorners.end(), pair.second.begin(),
+                          pair.second.end());
+    }
+    if (distort) {
+      prop.UndistortPixels(drawnCorners);
     }
 
+    size_t cornerOffset = 0;
     for (const auto& pair : visibleTgts) {
-      VisionTargetSim tgt = pair.first;
-      std::vector<cv::Point2f> corners = pair.second;
+      const VisionTargetSim& tgt = *pair.first;
+      auto cornersBegin = drawnCorners.begin() + cornerOffset;
+      std::vector<cv::Point2f> corners{cornersBegin,
+                                       cornersBegin + pair.second.size()};
+      cornerOffset += pair.second.size();
 
-      if (tgt.GetFiducialId() > 0) {
+      if (tgt.GetFiducialId() >= 0) {
         VideoSimUtil::Warp165h5TagImage(tgt.GetFiducialId(), corners, true,
-                                        videoSimFrameRaw);
+                                        canvas);
       } else if (!tgt.GetModel().GetIsSpherical()) {
         std::vector<cv::Point2f> contour = corners;
         if (!tgt.GetModel().GetIsPlanar()) {
           contour = OpenCVHelp::GetConvexHull(contour);
         }
-        VideoSimUtil::DrawPoly(contour, -1, cv::Scalar{255}, true,
-                               videoSimFrameRaw);
+        VideoSimUtil::DrawPoly(contour, -1, cv::Scalar{255}, true, canvas);
       } else {
-        VideoSimUtil::DrawInscribedEllipse(corners, cv::Scalar{255},
-                                           videoSimFrameRaw);
+        VideoSimUtil::DrawInscribedEllipse(corners, cv::Scalar{255}, canvas);
       }
     }
+    if (distort) {
+      prop.ApplyDistortion(pinholeFrame, rawFrame);
+    }
+    videoSimFrameRaw = rawFrame;
     videoSimRaw.PutFrame(videoSimFrameRaw);
-  } else {
-    videoSimRaw.SetConnectionStrategy(
-        wpi::cs::VideoSource::ConnectionStrategy::kConnectionForceClose);
   }
 
   if (videoSimProcEnabled) {
-    cv::cvtColor(videoSimFrameRaw, videoSimFrameProcessed, cv::COLOR_GRAY2BGR);
+    if (videoSimRawEnabled) {
+      cv::cvtColor(videoSimFrameRaw, videoSimFrameProcessed,
+                   cv::COLOR_GRAY2BGR);
+    } else {
+      videoSimFrameProcessed.create(videoFrameSize, CV_8UC3);
+      videoSimFrameProcessed.setTo(cv::Scalar{0, 0, 0});
+    }
     cv::drawMarker(
         videoSimFrameProcessed,
         cv::Point2d{prop.GetResWidth() / 2.0, prop.GetResHeight() / 2.0},
@@ -334,11 +566,10 @@ PhotonPipelineResult PhotonCameraSim::Process(
       }
     }
     videoSimProcessed.PutFrame(videoSimFrameProcessed);
-  } else {
-    videoSimProcessed.SetConnectionStrategy(
-        wpi::cs::VideoSource::ConnectionStrategy::kConnectionForceClose);
   }
 
+  stageTimings.render += Lap(mark);
+
   std::optional<MultiTargetPNPResult> multiTagResults = std::nullopt;
 
   std::vector<wpi::apriltag::AprilTag> visibleLayoutTags =
@@ -351,68 +582,114 @@ PhotonPipelineResult PhotonCameraSim::Process(
                    [](const wpi::apriltag::AprilTag& tag) { return tag.ID; });
     std::sort(usedIds.begin(), usedIds.end());
     auto pnpResult = VisionEstimation::EstimateCamPosePNP(
-        prop.GetIntrinsics(), prop.GetDistCoeffs(), detectableTgts, tagLayout,
-        kAprilTag36h11);
+        prop.GetCalibration(), detectableTgts, tagLayout, kAprilTag36h11);
     if (pnpResult) {
       multiTagResults = MultiTargetPNPResult{*pnpResult, usedIds};
     }
   }
 
+  stageTimings.pnp += Lap(mark);
+  stageTimings.frames++;
+
   return PhotonPipelineResult{
       PhotonPipelineMetadata{heartbeatCounter, 0,
                              wpi::units::microsecond_t{latency}.to<int64_t>(),
                              1000000},
       detectableTgts, multiTagResults};
 }
+void PhotonCameraSim::UpdateVideoSources() {
+  if (headless) {
+    return;
+  }
+
+  VideoMode mode{prop.GetResWidth(), prop.GetResHeight(),
+                 prop.GetFPS().to<int>()};
+  if (videoSimRawEnabled && mode != rawVideoMode) {
+    VideoSimUtil::UpdateVideoProp(videoSimRaw, prop);
+    rawVideoMode = mode;
+  }
+  if (videoSimProcEnabled && mode != processedVideoMode) {
+    VideoSimUtil::UpdateVideoProp(videoSimProcessed, prop);
+    processedVideoMode = mode;
+  }
+
+  // Only touch the connection strategy when a stream is toggled
+  auto updateStrategy = [](wpi::cs::CvSource& source, bool enabled,
+                           bool& open) {
+    if (enabled != open) {
+      source.SetConnectionStrategy(
+          enabled
+              ? wpi::cs::VideoSource::ConnectionStrategy::kConnectionAutoManage
+              : wpi::cs::VideoSource::ConnectionStrategy::
+                    kConnectionForceClose);
+      open = enabled;
+    }
+  };
+  updateStrategy(videoSimRaw, videoSimRawEnabled, rawStreamOpen);
+  updateStrategy(videoSimProcessed, videoSimProcEnabled, processedStreamOpen);
+}
+
 void PhotonCameraSim::SubmitProcessedFrame(const PhotonPipelineResult& result) {
-  SubmitProcessedFrame(result, wpi::nt::Now());
+  SubmitProcessedFrame(result, clock->NowMicros());
 }
 void PhotonCameraSim::SubmitProcessedFrame(const PhotonPipelineResult& result,
                                            uint64_t ReceiveTimestamp) {
+  StageProcessedFrame(result, ReceiveTimestamp);
+  ts.subTable->GetInstance().Flush();
+}
+
+void PhotonCameraSim::StageProcessedFrame(const PhotonPipelineResult& result,
+                                          uint64_t receiveTimestamp) {
+  auto mark = std::chrono::steady_clock::now();
   ts.latencyMillisEntry.Set(
       result.GetLatency().convert<wpi::units::milliseconds>().to<double>(),
-      ReceiveTimestamp);
-
-  Packet newPacket{};
-  newPacket.Pack(result);
+      receiveTimestamp);
 
-  ts.rawBytesEntry.Set(newPacket.GetData(), ReceiveTimestamp);
+  resultPacket.Clear();
+  resultPacket.Pack(result);
+  ts.rawBytesEntry.Set(resultPacket.GetData(), receiveTimestamp);
 
   bool hasTargets = result.HasTargets();
-  ts.hasTargetEntry.Set(hasTargets, ReceiveTimestamp);
+  ts.hasTargetEntry.Set(hasTargets, receiveTimestamp);
   if (!hasTargets) {
-    ts.targetPitchEntry.Set(0.0, ReceiveTimestamp);
-    ts.targetYawEntry.Set(0.0, ReceiveTimestamp);
-    ts.targetAreaEntry.Set(0.0, ReceiveTimestamp);
-    ts.targetPoseEntry.Set(wpi::math::Transform3d{}, ReceiveTimestamp);
-    ts.targetSkewEntry.Set(0.0, ReceiveTimestamp);
+    ts.targetPitchEntry.Set(0.0, receiveTimestamp);
+    ts.targetYawEntry.Set(0.0, receiveTimestamp);
+    ts.targetAreaEntry.Set(0.0, receiveTimestamp);
+    ts.targetPoseEntry.Set(wpi::math::Transform3d{}, receiveTimestamp);
+    ts.targetSkewEntry.Set(0.0, receiveTimestamp);
   } else {
-    PhotonTrackedTarget bestTarget = result.GetBestTarget();
+    const PhotonTrackedTarget& bestTarget = result.GetTargets().front();
 
-    ts.targetPitchEntry.Set(bestTarget.GetPitch(), ReceiveTimestamp);
-    ts.targetYawEntry.Set(bestTarget.GetYaw(), ReceiveTimestamp);
-    ts.targetAreaEntry.Set(bestTarget.GetArea(), ReceiveTimestamp);
-    ts.targetSkewEntry.Set(bestTarget.GetSkew(), ReceiveTimestamp);
+    ts.targetPitchEntry.Set(bestTarget.GetPitch(), receiveTimestamp);
+    ts.targetYawEntry.Set(bestTarget.GetYaw(), receiveTimestamp);
+    ts.targetAreaEntry.Set(bestTarget.GetArea(), receiveTimestamp);
+    ts.targetSkewEntry.Set(bestTarget.GetSkew(), receiveTimestamp);
 
     ts.targetPoseEntry.Set(bestTarget.GetBestCameraToTarget(),
-                           ReceiveTimestamp);
+                           receiveTimestamp);
   }
 
-  Eigen::Matrix<double, 3, 3, Eigen::RowMajor> intrinsics =
+  // The calibration rarely changes, and NT hands new subscribers the last
+  // value anyway, so only send it when it does
+  std::array<double, 9> intrinsics;
+  Eigen::Map<Eigen::Matrix<double, 3, 3, Eigen::RowMajor>>{intrinsics.data()} =
       prop.GetIntrinsics();
-  std::span<double> intrinsicsView{intrinsics.data(),
-                                   intrinsics.data() + intrinsics.size()};
-  ts.cameraIntrinsicsPublisher.Set(intrinsicsView, ReceiveTimestamp);
+  if (publishedIntrinsics != intrinsics) {
+    ts.cameraIntrinsicsPublisher.Set(intrinsics, receiveTimestamp);
+    publishedIntrinsics = intrinsics;
+  }
 
-  auto distortion = prop.GetDistCoeffs();
-  std::vector<double> distortionView{distortion.data(),
-                                     distortion.data() + distortion.size()};
-  ts.cameraDistortionPublisher.Set(distortionView, ReceiveTimestamp);
+  std::array<double, 8> distortion;
+  Eigen::Map<Eigen::Matrix<double, 8, 1>>{distortion.data()} =
+      prop.GetDistCoeffs();
+  if (publishedDistortion != distortion) {
+    ts.cameraDistortionPublisher.Set(distortion, receiveTimestamp);
+    publishedDistortion = distortion;
+  }
 
-  ts.heartbeatPublisher.Set(heartbeatCounter, ReceiveTimestamp);
+  ts.heartbeatPublisher.Set(heartbeatCounter, receiveTimestamp);
   heartbeatCounter++;
-
-  ts.subTable->GetInstance().Flush();
+  stageTimings.publish += Lap(mark);
 }
 
 }  // namespace photon
@@ -25,9 +25,11 @@
 #include "photon/simulation/SimCameraProperties.h"
 
 #include <algorithm>
+#include <limits>
 #include <utility>
 #include <vector>
 
+#include <opencv2/imgproc.hpp>
 #include <wpi/system/Errors.hpp>
 
 using namespace photon;
@@ -67,8 +69,8 @@ void SimCameraProperties::SetCalibration(
     const Eigen::Matrix<double, 8, 1>& newDistCoeffs) {
   resWidth = width;
   resHeight = height;
-  camIntrinsics = newCamIntrinsics;
-  distCoeffs = newDistCoeffs;
+  calibration = CameraCalibration{newCamIntrinsics, newDistCoeffs};
+  distortMap = calibration.GetUndistortionMap(width, height);
 
   std::array<wpi::math::Translation3d, 4> p{
       wpi::math::Translation3d{
@@ -109,6 +111,38 @@ void SimCameraProperties::SetCalibration(
   }
 }
 
+void SimCameraProperties::ApplyDistortion(const cv::Mat& pinhole,
+                                          cv::Mat& distorted) const {
+  if (!HasDistortionMaps()) {
+    pinhole.copyTo(distorted);
+    return;
+  }
+  cv::remap(pinhole, distorted, distortMap.map1, distortMap.map2,
+            cv::INTER_LINEAR, cv::BORDER_CONSTANT, cv::Scalar{0});
+}
+
+void SimCameraProperties::UndistortPixels(
+    std::span<cv::Point2f> points) const {
+  const size_t n = points.size();
+  if (n == 0 || !calibration.HasDistortion()) {
+    return;
+  }
+  Eigen::Matrix2Xd pixels(2, n);
+  for (size_t i = 0; i < n; i++) {
+    pixels(0, i) = points[i].x;
+    pixels(1, i) = points[i].y;
+  }
+  Eigen::Matrix2Xd normalized(2, n);
+  calibration.UndistortPoints(pixels, normalized);
+  const auto& camIntrinsics = calibration.GetCameraMatrix();
+  for (size_t i = 0; i < n; i++) {
+    points[i].x = static_cast<float>(camIntrinsics(0, 0) * normalized(0, i) +
+                                     camIntrinsics(0, 2));
+    points[i].y = static_cast<float>(camIntrinsics(1, 1) * normalized(1, i) +
+                                     camIntrinsics(1, 2));
+  }
+}
+
 std::pair<std::optional<double>, std::optional<double>>
 SimCameraProperties::GetVisibleLine(const RotTrlTransform3d& camRt,
                                     const wpi::math::Translation3d& a,
@@ -231,3 +265,43 @@ SimCameraProperties::GetVisibleLine(const RotTrlTransform3d& camRt,
     return {std::nullopt, std::nullopt};
   }
 }
+
+void SimCameraProperties::GetVisibleLines(
+    const RotTrlTransform3d& camRt,
+    const Eigen::Ref<const Eigen::Matrix3Xd>& starts,
+    const Eigen::Ref<const Eigen::Matrix3Xd>& ends,
+    Eigen::Ref<Eigen::Matrix2Xd> visibleRanges) const {
+  // Move the view planes into the field frame instead of moving every
+  // segment into the camera frame
+  Eigen::Matrix<double, 4, 3> normals;
+  for (size_t i = 0; i < viewplanes.size(); i++) {
+    normals.row(i) = viewplanes[i].transpose();
+  }
+  const Eigen::Matrix<double, 4, 3> fieldNormals =
+      normals * camRt.GetRotation().ToMatrix();
+  const Eigen::Vector4d offsets = normals * camRt.GetTranslation().ToVector();
+
+  // Signed distance of every endpoint from every plane, positive inside
+  const Eigen::Array4Xd distA =
+      ((fieldNormals * starts).colwise() + offsets).array();
+  const Eigen::Array4Xd distB =
+      ((fieldNormals * ends).colwise() + offsets).array();
+  // Where each segment crosses each plane. Only used where the endpoints are
+  // on opposite sides, so it never divides by zero.
+  const Eigen::Array4Xd crossing = distA / (distA - distB);
+
+  const auto entering = (distA < 0) && (distB >= 0);
+  const auto leaving = (distA >= 0) && (distB < 0);
+  const auto outside = (distA < 0) && (distB < 0);
+
+  const Eigen::Array<double, 1, Eigen::Dynamic> tMin =
+      entering.select(crossing, 0.0).colwise().maxCoeff();
+  const Eigen::Array<double, 1, Eigen::Dynamic> tMax =
+      leaving.select(crossing, 1.0).colwise().minCoeff();
+  const Eigen::Array<bool, 1, Eigen::Dynamic> hidden =
+      outside.colwise().any() || (tMin >= tMax);
+
+  const double nan = std::numeric_limits<double>::quiet_NaN();
+  visibleRanges.row(0) = hidden.select(nan, tMin).matrix();
+  visibleRanges.row(1) = hidden.select(nan, tMax).matrix();
+}
@@ -0,0 +1,339 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "photon/simulation/VideoSimUtil.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+#include <opencv2/imgproc.hpp>
+
+namespace photon {
+namespace VideoSimUtil {
+
+namespace {
+struct CachedTag {
+  std::once_flag built;
+  TagImagePyramid pyramid;
+};
+
+FieldWireframe BuildFieldWireframe(int floorSubdivisions) {
+  std::vector<std::vector<wpi::math::Translation3d>> lines =
+      GetFieldFloorLines(floorSubdivisions);
+  const size_t floorLines = lines.size();
+  for (auto& wall : GetFieldWallLines()) {
+    lines.emplace_back(std::move(wall));
+  }
+
+  std::vector<Eigen::Vector3d> starts;
+  std::vector<Eigen::Vector3d> ends;
+  Eigen::Index floorSegments = 0;
+  for (size_t i = 0; i < lines.size(); i++) {
+    for (size_t j = 0; j + 1 < lines[i].size(); j++) {
+      starts.emplace_back(lines[i][j].ToVector());
+      ends.emplace_back(lines[i][j + 1].ToVector());
+    }
+    if (i + 1 == floorLines) {
+      floorSegments = starts.size();
+    }
+  }
+
+  FieldWireframe wireframe;
+  wireframe.starts.resize(3, starts.size());
+  wireframe.ends.resize(3, ends.size());
+  for (size_t i = 0; i < starts.size(); i++) {
+    wireframe.starts.col(i) = starts[i];
+    wireframe.ends.col(i) = ends[i];
+  }
+  wireframe.floorSegments = floorSegments;
+  return wireframe;
+}
+}  // namespace
+
+const TagImagePyramid* Get36h11TagPyramid(int id) {
+  if (id < 0 || id >= kNumTags36h11) {
+    return nullptr;
+  }
+  static std::array<CachedTag, kNumTags36h11> cache;
+  CachedTag& entry = cache[id];
+  std::call_once(entry.built, [&] {
+    auto& levels = entry.pyramid.levels;
+    levels.push_back(Get36h11TagImage(id));
+    for (int level = 1; level <= TagImagePyramid::kMaxLevel; level++) {
+      cv::Mat scaled;
+      cv::resize(levels.back(), scaled, cv::Size{}, 2, 2, cv::INTER_NEAREST);
+      levels.push_back(scaled);
+    }
+  });
+  return &entry.pyramid;
+}
+
+const FieldWireframe& GetFieldWireframe(int floorSubdivisions) {
+  static std::mutex mutex;
+  static std::map<int, FieldWireframe> cache;
+  std::scoped_lock lock{mutex};
+  auto it = cache.find(floorSubdivisions);
+  if (it == cache.end()) {
+    it = cache.emplace(floorSubdivisions,
+                       BuildFieldWireframe(floorSubdivisions))
+             .first;
+  }
+  return it->second;
+}
+
+void Warp165h5TagImage(int tagId, const std::vector<cv::Point2f>& dstPoints,
+                       bool antialiasing, cv::Mat& destination) {
+  const TagImagePyramid* pyramid = Get36h11TagPyramid(tagId);
+  if (!pyramid) {
+    return;
+  }
+  const cv::Mat& tagImage = pyramid->levels.front();
+  std::vector<cv::Point2f> tagPoints{kTag36h11MarkPts};
+  std::vector<cv::Point2f> tagImageCorners{GetImageCorners(tagImage.size())};
+  std::vector<cv::Point2f> dstPointMat = dstPoints;
+  cv::Rect boundingRect = cv::boundingRect(dstPointMat);
+  cv::Mat perspecTrf = cv::getPerspectiveTransform(tagPoints, dstPointMat);
+  std::vector<cv::Point2f> extremeCorners{};
+  cv::perspectiveTransform(tagImageCorners, extremeCorners, perspecTrf);
+  boundingRect = cv::boundingRect(extremeCorners);
+
+  double warpedContourArea = cv::contourArea(extremeCorners);
+  double warpedTagUpscale =
+      std::sqrt(warpedContourArea) / std::sqrt(tagImage.size().area());
+  int warpStrat = cv::INTER_NEAREST;
+
+  int supersampling = 6;
+  supersampling = static_cast<int>(std::ceil(supersampling / warpedTagUpscale));
+  supersampling = std::max(std::min(supersampling, 10), 1);
+
+  cv::Mat scaledTagImage{};
+  if (warpedTagUpscale > 2.0) {
+    warpStrat = cv::INTER_LINEAR;
+    int scaleFactor = static_cast<int>(warpedTagUpscale / 3.0) + 2;
+    scaleFactor = std::max(std::min(scaleFactor, 40), 1);
+    scaleFactor *= supersampling;
+    int levelScale = 1;
+    scaledTagImage = pyramid->GetLevel(scaleFactor, levelScale);
+    tagPoints = Get36h11MarkerPts(levelScale);
+  } else {
+    scaledTagImage = tagImage;
+  }
+
+  boundingRect.x -= 1;
+  boundingRect.y -= 1;
+  boundingRect.width += 2;
+  boundingRect.height += 2;
+  if (boundingRect.x < 0) {
+    boundingRect.width += boundingRect.x;
+    boundingRect.x = 0;
+  }
+  if (boundingRect.y < 0) {
+    boundingRect.height += boundingRect.y;
+    boundingRect.y = 0;
+  }
+  boundingRect.width =
+      std::min(destination.size().width - boundingRect.x, boundingRect.width);
+  boundingRect.height =
+      std::min(destination.size().height - boundingRect.y, boundingRect.height);
+  if (boundingRect.width <= 0 || boundingRect.height <= 0) {
+    return;
+  }
+
+  std::vector<cv::Point2f> scaledDstPts{};
+  if (supersampling > 1) {
+    cv::multiply(dstPointMat,
+                 cv::Scalar{static_cast<double>(supersampling),
+                            static_cast<double>(supersampling)},
+                 scaledDstPts);
+    boundingRect.x *= supersampling;
+    boundingRect.y *= supersampling;
+    boundingRect.width *= supersampling;
+    boundingRect.height *= supersampling;
+  } else {
+    scaledDstPts = dstPointMat;
+  }
+
+  cv::subtract(scaledDstPts,
+               cv::Scalar{static_cast<double>(boundingRect.tl().x),
+                          static_cast<double>(boundingRect.tl().y)},
+               scaledDstPts);
+  perspecTrf = cv::getPerspectiveTransform(tagPoints, scaledDstPts);
+
+  cv::Mat tempRoi{};
+  cv::warpPerspective(scaledTagImage, tempRoi, perspecTrf, boundingRect.size(),
+                      warpStrat);
+
+  if (supersampling > 1) {
+    boundingRect.x /= supersampling;
+    boundingRect.y /= supersampling;
+    boundingRect.width /= supersampling;
+    boundingRect.height /= supersampling;
+    cv::resize(tempRoi, tempRoi, boundingRect.size(), 0, 0, cv::INTER_AREA);
+  }
+
+  cv::Mat tempMask{cv::Mat::zeros(tempRoi.size(), CV_8UC1)};
+  cv::subtract(extremeCorners,
+               cv::Scalar{static_cast<float>(boundingRect.tl().x),
+                          static_cast<float>(boundingRect.tl().y)},
+               extremeCorners);
+  cv::Point2f tempCenter{};
+  tempCenter.x =
+      std::accumulate(extremeCorners.begin(), extremeCorners.end(), 0.0,
+                      [extremeCorners](float acc, const cv::Point2f& p2) {
+                        return acc + p2.x / extremeCorners.size();
+                      });
+  tempCenter.y =
+      std::accumulate(extremeCorners.begin(), extremeCorners.end(), 0.0,
+                      [extremeCorners](float acc, const cv::Point2f& p2) {
+                        return acc + p2.y / extremeCorners.size();
+                      });
+
+  for (auto& corner : extremeCorners) {
+    float xDiff = corner.x - tempCenter.x;
+    float yDiff = corner.y - tempCenter.y;
+    xDiff += 1 * mathutil::sgn(xDiff);
+    yDiff += 1 * mathutil::sgn(yDiff);
+    corner = cv::Point2f{tempCenter.x + xDiff, tempCenter.y + yDiff};
+  }
+
+  std::vector<cv::Point> extremeCornerInt{extremeCorners.begin(),
+                                          extremeCorners.end()};
+  cv::fillConvexPoly(tempMask, extremeCornerInt, cv::Scalar{255});
+
+  cv::copyTo(tempRoi, destination(boundingRect), tempMask);
+}
+
+
+void DrawFieldWireFrame(const RotTrlTransform3d& camRt,
+                        const SimCameraProperties& prop, double resolution,
+                        double wallThickness, const cv::Scalar& wallColor,
+                        int floorSubdivisions, double floorThickness,
+                        const cv::Scalar& floorColor, cv::Mat& destination,
+                        bool pinhole) {
+  const FieldWireframe& wireframe = GetFieldWireframe(floorSubdivisions);
+  const Eigen::Index numSegments = wireframe.starts.cols();
+  Eigen::Matrix2Xd ranges(2, numSegments);
+  prop.GetVisibleLines(camRt, wireframe.starts, wireframe.ends, ranges);
+
+  std::vector<Eigen::Index> visible;
+  for (Eigen::Index i = 0; i < numSegments; i++) {
+    if (!std::isnan(ranges(0, i))) {
+      visible.push_back(i);
+    }
+  }
+  if (visible.empty()) {
+    return;
+  }
+
+  // Go straight from NWU field points to EDN camera points, like
+  // OpenCVHelp::ProjectPoints
+  const Eigen::Matrix3d nwuToEdn = OpenCVHelp::NWU_TO_EDN.ToMatrix();
+  const Eigen::Matrix3d rotation = nwuToEdn * camRt.GetRotation().ToMatrix();
+  const Eigen::Vector3d translation =
+      nwuToEdn * camRt.GetTranslation().ToVector();
+  const CameraCalibration& calibration =
+      pinhole ? prop.GetPinholeCalibration() : prop.GetCalibration();
+  auto project = [&](const Eigen::Matrix3Xd& points) {
+    Eigen::Matrix2Xd pixels(2, points.cols());
+    CameraProjection::ProjectPoints(calibration.GetCameraMatrix(),
+                                    calibration.GetDistCoeffs(), rotation,
+                                    translation, points, pixels);
+    return pixels;
+  };
+
+  // Project the clipped endpoints of every visible segment at once
+  const Eigen::Index numVisible = visible.size();
+  Eigen::Matrix3Xd clipped(3, 2 * numVisible);
+  for (Eigen::Index k = 0; k < numVisible; k++) {
+    const Eigen::Index i = visible[k];
+    const Eigen::Vector3d delta =
+        wireframe.ends.col(i) - wireframe.starts.col(i);
+    clipped.col(2 * k) = wireframe.starts.col(i) + delta * ranges(0, i);
+    clipped.col(2 * k + 1) = wireframe.starts.col(i) + delta * ranges(1, i);
+  }
+  const Eigen::Matrix2Xd clippedPx = project(clipped);
+
+  // Then subdivide the segments that are long on screen, so distortion bends
+  // them, and project all of the new points at once as well. Without
+  // distortion they stay straight and need no subdividing.
+  const double resolutionPx =
+      std::hypot(destination.size().height, destination.size().width) *
+      resolution;
+  std::vector<int> subdivisions(numVisible);
+  Eigen::Index numSubPts = 0;
+  for (Eigen::Index k = 0; k < numVisible; k++) {
+    const double pxDist =
+        (clippedPx.col(2 * k + 1) - clippedPx.col(2 * k)).norm();
+    subdivisions[k] = calibration.HasDistortion()
+                          ? static_cast<int>(pxDist / resolutionPx)
+                          : 0;
+    numSubPts += subdivisions[k];
+  }
+  Eigen::Matrix3Xd subPts(3, numSubPts);
+  for (Eigen::Index k = 0, col = 0; k < numVisible; k++) {
+    const Eigen::Vector3d subDelta =
+        (clipped.col(2 * k + 1) - clipped.col(2 * k)) / (subdivisions[k] + 1);
+    for (int j = 0; j < subdivisions[k]; j++) {
+      subPts.col(col++) = clipped.col(2 * k) + subDelta * (j + 1);
+    }
+  }
+  const Eigen::Matrix2Xd subPx = project(subPts);
+
+  auto toPoint = [](const auto& px) {
+    return cv::Point{cvRound(px(0)), cvRound(px(1))};
+  };
+  std::vector<std::vector<cv::Point>> floorPolys;
+  std::vector<std::vector<cv::Point>> wallPolys;
+  for (Eigen::Index k = 0, col = 0; k < numVisible; k++) {
+    auto& polys = visible[k] < wireframe.floorSegments ? floorPolys : wallPolys;
+    std::vector<cv::Point>& poly = polys.emplace_back();
+    poly.reserve(subdivisions[k] + 2);
+    poly.push_back(toPoint(clippedPx.col(2 * k)));
+    for (int j = 0; j < subdivisions[k]; j++) {
+      poly.push_back(toPoint(subPx.col(col++)));
+    }
+    poly.push_back(toPoint(clippedPx.col(2 * k + 1)));
+  }
+
+  if (!floorPolys.empty()) {
+    cv::polylines(destination, floorPolys, false, floorColor,
+                  static_cast<int>(std::round(
+                      GetScaledThickness(floorThickness, destination))),
+                  cv::LINE_AA);
+  }
+  if (!wallPolys.empty()) {
+    cv::polylines(destination, wallPolys, false, wallColor,
+                  static_cast<int>(std::round(
+                      GetScaledThickness(wallThickness, destination))),
+                  cv::LINE_AA);
+  }
+}
+}  // namespace VideoSimUtil
+}  // namespace photon
@@ -25,9 +25,12 @@
 #pragma once
 
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <string>
 #include <vector>
 
+#include <net/TimeSyncClientStats.h>
 #include <wpi/driverstation/Alert.hpp>
 #include <wpi/nt/BooleanTopic.hpp>
 #include <wpi/nt/DoubleArrayTopic.hpp>
@@ -40,6 +43,7 @@
 #include <wpi/nt/StringTopic.hpp>
 #include <wpi/units/time.hpp>
 
+#include "photon/estimation/CameraCalibration.h"
 #include "photon/targeting/PhotonPipelineResult.h"
 
 namespace cv {
@@ -215,6 +219,16 @@ class PhotonCamera {
    */
   std::optional<DistortionMatrix> GetDistCoeffs();
 
+  /**
+   * Returns the camera's calibration, with the OpenCV forms of the matrices
+   * already built. This is only rebuilt when the coprocessor publishes a new
+   * calibration, so prefer passing it to the estimators over the raw matrices.
+   *
+   * @return The calibration, if both the camera matrix and distortion
+   * coefficients are published by the camera. Empty otherwise.
+   */
+  std::optional<CameraCalibration> GetCalibration();
+
   /**
    * Sets whether or not coprocessor version checks will occur. Setting this to
    * true will silence all console warnings about coproccessor connection, so be
@@ -225,6 +239,17 @@ class PhotonCamera {
    */
   static void SetVersionCheckEnabled(bool enabled);
 
+  /**
+   * Returns every coprocessor syncing its clock with the robot's time sync
+   * server, with how often each pings and how in sync it thinks it is. Use
+   * this to spot a coprocessor that has fallen out of sync. The same stats
+   * are published as JSON to /photonvision/.timesyncServer/clients about once
+   * a second.
+   *
+   * @return One entry per coprocessor, sorted by address.
+   */
+  static std::vector<wpi::tsp::TimeSyncClientStats> GetTimeSyncClients();
+
   std::shared_ptr<wpi::nt::NetworkTable> GetCameraTable() const {
     return rootTable;
   }
@@ -246,6 +271,7 @@ class PhotonCamera {
   wpi::nt::IntegerPublisher ledModePub;
   wpi::nt::IntegerSubscriber ledModeSub;
   wpi::nt::StringSubscriber versionEntry;
+  wpi::nt::StringPublisher timeSyncClientsPublisher;
 
   wpi::nt::DoubleArraySubscriber cameraIntrinsicsSubscriber;
   wpi::nt::DoubleArraySubscriber cameraDistortionSubscriber;
@@ -279,9 +305,24 @@ class PhotonCamera {
   int prevHeartbeatValue = -1;
   wpi::units::second_t prevHeartbeatChangeTime = 0_s;
 
+  // Calibration parsed from NT, refreshed when either topic changes. The
+  // getters may be called from several threads, so all of it is guarded by
+  // calibrationMutex, which is boxed to keep PhotonCamera movable.
+  std::unique_ptr<std::mutex> calibrationMutex =
+      std::make_unique<std::mutex>();
+  int64_t intrinsicsLastChange = -1;
+  int64_t distortionLastChange = -1;
+  std::optional<CameraMatrix> cachedCameraMatrix;
+  std::optional<DistortionMatrix> cachedDistCoeffs;
+  std::optional<CameraCalibration> cachedCalibration;
+
+  // Must be called with calibrationMutex held
+  void UpdateCalibration();
+
   void VerifyVersion();
 
   void UpdateDisconnectAlert();
+  void PublishTimeSyncClients();
   void CheckTimeSyncOrWarn(photon::PhotonPipelineResult& result);
 
   std::vector<std::string> tablesThatLookLikePhotonCameras();
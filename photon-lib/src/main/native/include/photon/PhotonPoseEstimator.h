@@ -244,6 +244,20 @@ class PhotonPoseEstimator {
       PhotonPipelineResult cameraResult, PhotonCamera::CameraMatrix camMat,
       PhotonCamera::DistortionMatrix distCoeffs);
 
+  /**
+   * Return the estimated position of the robot by using all visible tags to
+   * compute a single pose estimate on the RoboRIO.
+   *
+   * @param cameraResult A pipeline result from the camera.
+   * @param calibration The camera's calibration, e.g. from
+   * PhotonCamera::GetCalibration.
+   * @return An EstimatedRobotPose with an estimated pose, timestamp, and
+   * targets used to create the estimate, or std::nullopt if there's less than 2
+   * targets visible or SolvePnP fails.
+   */
+  std::optional<EstimatedRobotPose> EstimateRioMultiTagPose(
+      PhotonPipelineResult cameraResult, const CameraCalibration& calibration);
+
   /**
    * Return the estimated position of the robot by using distance data from best
    * visible tag to compute a Pose. This runs on the RoboRIO in order to access
@@ -304,6 +318,29 @@ class PhotonPoseEstimator {
       photon::PhotonCamera::DistortionMatrix distCoeffs,
       wpi::math::Pose3d seedPose, bool headingFree, double headingScaleFactor);
 
+  /**
+   * Return the estimated position of the robot by solving a constrained version
+   * of the Perspective-n-Point problem with the robot's drivebase flat on the
+   * floor. See the overload taking the raw calibration matrices.
+   *
+   * @param cameraResult A pipeline result from the camera.
+   * @param calibration The camera's calibration, e.g. from
+   * PhotonCamera::GetCalibration.
+   * @param seedPose An initial guess at robot pose, refined via optimization.
+   * @param headingFree If true, heading is completely free to vary. If false,
+   * heading excursions from the provided heading measurement will be penalized
+   * @param headingScaleFactor If headingFree is false, this weights the cost of
+   * changing our robot heading estimate against the tag corner reprojection
+   * error cost.
+   * @return An EstimatedRobotPose with an estimated pose, timestamp, and
+   * targets used to create the estimate, or std::nullopt if there's no targets
+   * or heading data, or if the solver fails to solve the problem.
+   */
+  std::optional<EstimatedRobotPose> EstimateConstrainedSolvepnpPose(
+      photon::PhotonPipelineResult cameraResult,
+      const photon::CameraCalibration& calibration, wpi::math::Pose3d seedPose,
+      bool headingFree, double headingScaleFactor);
+
  private:
   wpi::apriltag::AprilTagFieldLayout aprilTags;
 
@@ -0,0 +1,178 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <unordered_map>
+#include <vector>
+
+#include <opencv2/core/mat.hpp>
+#include <wpi/apriltag/AprilTagFieldLayout.hpp>
+#include <wpi/math/geometry/Transform3d.hpp>
+#include <wpi/nt/NetworkTableInstance.hpp>
+#include <wpi/units/angle.hpp>
+#include <wpi/units/length.hpp>
+
+#include "photon/PhotonCamera.h"
+#include "photon/simulation/PhotonCameraSim.h"
+#include "photon/simulation/SimCameraProperties.h"
+#include "photon/simulation/VisionTargetSim.h"
+#include "photon/util/WorkerPool.h"
+
+namespace photon {
+/** How FieldCoverageAnalyzer samples the field. */
+struct FieldCoverageConfig {
+  /** The side length of each grid cell. Robots are placed at cell centers. */
+  wpi::units::meter_t cellSize{0.25_m};
+  /** How many robot headings to try at each cell, evenly spaced. */
+  int headings{8};
+  /** How many noisy frames to simulate at each cell and heading. */
+  int samplesPerPose{1};
+  /** Seed for the simulated pixel noise. */
+  uint64_t seed{0};
+  /**
+   * Total threads to use, including the caller. Zero uses the number of
+   * hardware threads.
+   */
+  unsigned int threads{0};
+};
+
+/**
+ * Per-cell statistics of one camera mount over a field grid. Cells are stored
+ * row by row, starting from the field origin, with x along a row.
+ */
+struct FieldCoverageMap {
+  int columns{0};
+  int rows{0};
+  wpi::units::meter_t cellSize{0_m};
+
+  /** The mean number of tags detected. */
+  std::vector<double> tagsVisible;
+  /** The fraction of frames with any pose estimate. */
+  std::vector<double> estimateFraction;
+  /** The fraction of frames with a multi-tag pose estimate. */
+  std::vector<double> multiTagFraction;
+  /**
+   * The mean distance, in meters, between the estimated and true camera
+   * positions. Uses the multi-tag estimate when there is one, and otherwise
+   * the best single-tag solve. NaN where no frame had an estimate.
+   */
+  std::vector<double> poseError;
+
+  /** The index of the cell at the given column and row. */
+  size_t Index(int column, int row) const {
+    return static_cast<size_t>(row) * columns + column;
+  }
+
+  /** The fraction of all frames that had any pose estimate. */
+  double EstimateFraction() const;
+
+  /** The fraction of all frames that had a multi-tag pose estimate. */
+  double MultiTagFraction() const;
+
+  /** The mean pose error over every frame that had an estimate, in meters. */
+  double MeanPoseError() const;
+
+  /**
+   * Renders one of this map's metrics as a color image, with the field's +y
+   * up. Cells with NaN values are black.
+   *
+   * @param values One of the metrics above, or anything else with one value
+   * per cell
+   * @param maxValue The value drawn at the top of the color scale
+   * @param pixelsPerCell The side length each cell is drawn with
+   * @return A CV_8UC3 image, or an empty one if values doesn't have exactly
+   * one value per cell
+   */
+  cv::Mat Heatmap(std::span<const double> values, double maxValue,
+                  int pixelsPerCell = 8) const;
+};
+
+/**
+ * Evaluates where on the field a camera mount can localize the robot, by
+ * placing the robot at every cell of a grid and simulating a frame with
+ * PhotonCameraSim::Process. Detection and pose estimation are the same as in
+ * VisionSystemSim, including the multi-tag estimate from
+ * VisionEstimation::EstimateCamPosePNP, but nothing is drawn or published.
+ *
+ * Cells are spread across a thread pool, with each thread processing frames
+ * through its own headless camera. Noise is seeded per cell, so results don't
+ * depend on the number of threads.
+ */
+class FieldCoverageAnalyzer {
+ public:
+  /**
+   * @param prop The camera's properties, including its noise
+   * @param tagLayout The tags on the field, which also sets the field size
+   * @param config How to sample the field
+   */
+  FieldCoverageAnalyzer(const SimCameraProperties& prop,
+                        const wpi::apriltag::AprilTagFieldLayout& tagLayout,
+                        const FieldCoverageConfig& config = {});
+  ~FieldCoverageAnalyzer();
+
+  FieldCoverageAnalyzer(const FieldCoverageAnalyzer&) = delete;
+  FieldCoverageAnalyzer& operator=(const FieldCoverageAnalyzer&) = delete;
+
+  /**
+   * Evaluates one camera mount.
+   *
+   * @param robotToCamera Where the camera is on the robot
+   */
+  FieldCoverageMap Evaluate(const wpi::math::Transform3d& robotToCamera);
+
+  /**
+   * Evaluates several candidate camera mounts. Every cell of every candidate
+   * is scheduled at once, so this keeps all threads busy even for a coarse
+   * grid.
+   *
+   * @param robotToCameras Where each candidate camera is on the robot
+   * @return One map per candidate, in order
+   */
+  std::vector<FieldCoverageMap> Evaluate(
+      std::span<const wpi::math::Transform3d> robotToCameras);
+
+ private:
+  struct Lane {
+    std::unique_ptr<PhotonCamera> camera;
+    std::unique_ptr<PhotonCameraSim> cameraSim;
+  };
+
+  FieldCoverageConfig config;
+  wpi::units::meter_t fieldLength;
+  wpi::units::meter_t fieldWidth;
+  int columns;
+  int rows;
+  std::vector<VisionTargetSim> tags;
+  std::vector<const VisionTargetSim*> tagPtrs;
+  std::unordered_map<int, wpi::math::Pose3d> tagPoses;
+  // Keeps the per-thread cameras off the robot's NetworkTables
+  wpi::nt::NetworkTableInstance ntInstance;
+  WorkerPool pool;
+  std::vector<Lane> lanes;
+};
+}  // namespace photon
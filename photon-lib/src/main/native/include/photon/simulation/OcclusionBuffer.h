@@ -0,0 +1,217 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <limits>
+#include <span>
+#include <vector>
+
+#include <opencv2/core/types.hpp>
+
+namespace photon {
+/**
+ * A coarse depth buffer for deciding which simulated targets are hidden behind
+ * nearer geometry. Convex silhouettes are sampled once per cell of
+ * cellSize x cellSize pixels, so even a target filling the whole image costs
+ * only a few thousand samples to draw or test.
+ *
+ * Depths are distances along the camera's optical axis and must be positive.
+ * They are interpolated perspective-correctly across each silhouette.
+ */
+class OcclusionBuffer {
+ public:
+  static constexpr int kDefaultCellSize = 8;
+
+  /**
+   * Empties the buffer and sizes it for an image. The storage is reused when
+   * the size doesn't change.
+   *
+   * @param imageWidth The image width in pixels
+   * @param imageHeight The image height in pixels
+   * @param newCellSize The side length of each cell in pixels
+   */
+  void Reset(int imageWidth, int imageHeight,
+             int newCellSize = kDefaultCellSize) {
+    cellSize = std::max(newCellSize, 1);
+    cols = std::max((imageWidth + cellSize - 1) / cellSize, 0);
+    rows = std::max((imageHeight + cellSize - 1) / cellSize, 0);
+    depths.assign(static_cast<size_t>(cols) * rows, kEmpty);
+  }
+
+  int Cols() const { return cols; }
+  int Rows() const { return rows; }
+
+  /**
+   * Draws a convex polygon, keeping the nearest depth in each cell.
+   *
+   * @param points The polygon's vertices in pixels, in order
+   * @param pointDepths The depth of each vertex
+   */
+  void Add(std::span<const cv::Point2f> points,
+           std::span<const float> pointDepths) {
+    ForEachSample(points, pointDepths, [&](size_t cell, float depth) {
+      depths[cell] = std::min(depths[cell], depth);
+    });
+  }
+
+  /**
+   * The fraction of a convex polygon that is no more than tolerance behind
+   * the nearest surface drawn so far. A polygon too small to cover any cell's
+   * sample is tested at its centroid instead.
+   *
+   * @param points The polygon's vertices in pixels, in order
+   * @param pointDepths The depth of each vertex
+   * @param tolerance How far behind the nearest surface still counts as
+   * visible, so a polygon isn't hidden by itself or by a surface it sits on
+   * @return A fraction from 0 to 1
+   */
+  double VisibleFraction(std::span<const cv::Point2f> points,
+                         std::span<const float> pointDepths,
+                         float tolerance) const {
+    size_t total = 0;
+    size_t visible = 0;
+    ForEachSample(points, pointDepths, [&](size_t cell, float depth) {
+      total++;
+      if (depth <= depths[cell] + tolerance) {
+        visible++;
+      }
+    });
+    if (total > 0) {
+      return static_cast<double>(visible) / total;
+    }
+
+    const size_t n = std::min(points.size(), pointDepths.size());
+    if (n == 0) {
+      return 1;
+    }
+    cv::Point2f centroid{0, 0};
+    float depth = 0;
+    for (size_t i = 0; i < n; i++) {
+      centroid += points[i];
+      depth += pointDepths[i];
+    }
+    centroid /= static_cast<float>(n);
+    return IsVisible(centroid, depth / n, tolerance) ? 1 : 0;
+  }
+
+  /**
+   * Whether a point is no more than tolerance behind the nearest surface in
+   * its cell. Points outside the image are always visible.
+   */
+  bool IsVisible(cv::Point2f point, float depth, float tolerance) const {
+    if (!std::isfinite(point.x) || !std::isfinite(point.y)) {
+      return true;
+    }
+    // Pixel centers are at integer coordinates, so pixel 0 spans [-0.5, 0.5)
+    const float col = std::floor((point.x + 0.5f) / cellSize);
+    const float row = std::floor((point.y + 0.5f) / cellSize);
+    if (col < 0 || row < 0 || col >= cols || row >= rows) {
+      return true;
+    }
+    return depth <= depths[static_cast<size_t>(row) * cols +
+                           static_cast<size_t>(col)] +
+                        tolerance;
+  }
+
+ private:
+  static constexpr float kEmpty = std::numeric_limits<float>::infinity();
+
+  static float Cross(const cv::Point2f& a, const cv::Point2f& b,
+                     const cv::Point2f& p) {
+    return (b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x);
+  }
+
+  /** Calls f(cell, depth) for every cell whose sample is in the polygon. */
+  template <typename F>
+  void ForEachSample(std::span<const cv::Point2f> points,
+                     std::span<const float> pointDepths, F&& f) const {
+    const size_t n = std::min(points.size(), pointDepths.size());
+    for (size_t i = 1; i + 1 < n; i++) {
+      ForEachTriangleSample(points[0], points[i], points[i + 1],
+                            pointDepths[0], pointDepths[i],
+                            pointDepths[i + 1], f);
+    }
+  }
+
+  template <typename F>
+  void ForEachTriangleSample(const cv::Point2f& a, const cv::Point2f& b,
+                             const cv::Point2f& c, float depthA, float depthB,
+                             float depthC, F& f) const {
+    const float area = Cross(a, b, c);
+    // Also rejects NaN and infinite vertices
+    if (!(std::abs(area) > 1e-6f) || !std::isfinite(area)) {
+      return;
+    }
+
+    // Each cell is sampled at its center pixel
+    const float half = (cellSize - 1) / 2.0f;
+    auto firstCell = [&](float lo) {
+      return std::max(static_cast<int>(std::ceil((lo - half) / cellSize)), 0);
+    };
+    auto lastCell = [&](float hi, int count) {
+      return std::min(static_cast<int>(std::floor((hi - half) / cellSize)),
+                      count - 1);
+    };
+    // Clamp before converting to cells, since far-off vertices can project
+    // to enormous pixel coordinates
+    const float width = static_cast<float>(cols * cellSize);
+    const float height = static_cast<float>(rows * cellSize);
+    const float minX = std::clamp(std::min({a.x, b.x, c.x}), -1.0f, width);
+    const float maxX = std::clamp(std::max({a.x, b.x, c.x}), -1.0f, width);
+    const float minY = std::clamp(std::min({a.y, b.y, c.y}), -1.0f, height);
+    const float maxY = std::clamp(std::max({a.y, b.y, c.y}), -1.0f, height);
+    const int col0 = firstCell(minX);
+    const int col1 = lastCell(maxX, cols);
+    const int row0 = firstCell(minY);
+    const int row1 = lastCell(maxY, rows);
+
+    const float invArea = 1.0f / area;
+    const float invDepthA = 1.0f / depthA;
+    const float invDepthB = 1.0f / depthB;
+    const float invDepthC = 1.0f / depthC;
+    for (int row = row0; row <= row1; row++) {
+      for (int col = col0; col <= col1; col++) {
+        const cv::Point2f p{col * cellSize + half, row * cellSize + half};
+        const float wA = Cross(b, c, p) * invArea;
+        const float wB = Cross(c, a, p) * invArea;
+        const float wC = 1.0f - wA - wB;
+        if (wA < 0 || wB < 0 || wC < 0) {
+          continue;
+        }
+        const float invDepth = wA * invDepthA + wB * invDepthB + wC * invDepthC;
+        f(static_cast<size_t>(row) * cols + col, 1.0f / invDepth);
+      }
+    }
+  }
+
+  int cellSize{kDefaultCellSize};
+  int cols{0};
+  int rows{0};
+  std::vector<float> depths;
+};
+}  // namespace photon
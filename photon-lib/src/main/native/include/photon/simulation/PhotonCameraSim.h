@@ -24,12 +24,19 @@
 
 #pragma once
 
+#include <array>
 #include <limits>
+#include <memory>
+#include <optional>
+#include <span>
+#include <utility>
 #include <vector>
 
 #include <photon/PhotonCamera.h>
 #include <photon/networktables/NTTopicSet.h>
+#include <photon/simulation/OcclusionBuffer.h>
 #include <photon/simulation/SimCameraProperties.h>
+#include <photon/simulation/SimClock.h>
 #include <photon/simulation/VisionTargetSim.h>
 #include <wpi/apriltag/AprilTagFieldLayout.hpp>
 #include <wpi/apriltag/AprilTagFields.hpp>
@@ -41,6 +48,23 @@
 namespace photon {
 class PhotonCameraSim {
  public:
+  /** Total wall time spent in each stage of simulating this camera. */
+  struct StageTimings {
+    /**
+     * Projecting and adding noise to targets, and occlusion. Not the view
+     * cone query VisionSystemSim::Update runs before Process.
+     */
+    wpi::units::second_t projection{0_s};
+    /** Single-tag and multi-tag pose solves */
+    wpi::units::second_t pnp{0_s};
+    /** Drawing the raw and processed video frames */
+    wpi::units::second_t render{0_s};
+    /** Staging results on NetworkTables, not including flushes */
+    wpi::units::second_t publish{0_s};
+    /** The number of frames processed */
+    int64_t frames{0};
+  };
+
   /**
    * Constructs a handle for simulating PhotonCamera values. Processing
    * simulated targets through this class will change the associated
@@ -73,6 +97,24 @@ class PhotonCameraSim {
                       wpi::apriltag::AprilTagFieldLayout::LoadField(
                           wpi::apriltag::AprilTagField::kDefaultField));
 
+  /**
+   * Constructs a handle for simulating PhotonCamera values. Processing
+   * simulated targets through this class will change the associated
+   * PhotonCamera's results.
+   *
+   * A headless camera never creates its raw and processed video streams and
+   * skips all drawing, which is much faster when only the results matter.
+   *
+   * @param camera The camera to be simulated
+   * @param prop Properties of this camera such as FOV and FPS
+   * @param tagLayout The AprilTagFieldLayout used to solve for tag
+   * positions.
+   * @param headless Whether to skip the simulated video streams entirely
+   */
+  PhotonCameraSim(PhotonCamera* camera, const SimCameraProperties& props,
+                  const wpi::apriltag::AprilTagFieldLayout& tagLayout,
+                  bool headless);
+
   /**
    * Constructs a handle for simulating PhotonCamera values. Processing
    * simulated targets through this class will change the associated
@@ -123,7 +165,43 @@ class PhotonCameraSim {
    * @return The distance
    */
   inline wpi::units::meter_t GetMaxSightRange() { return maxSightRange; }
+
+  /**
+   * Returns whether this camera was constructed without video streams.
+   *
+   * @return If the camera is headless
+   */
+  inline bool IsHeadless() const { return headless; }
+
+  /**
+   * Returns the clock this camera uses to decide when frames are ready and to
+   * timestamp its results.
+   *
+   * @return The clock
+   */
+  inline const SimClock& GetClock() const { return *clock; }
+
+  /**
+   * Sets the clock this camera uses to decide when frames are ready and to
+   * timestamp its results. The next frame is scheduled for the clock's
+   * current time. VisionSystemSim sets this for the cameras added to it.
+   *
+   * @param newClock The clock
+   */
+  void SetClock(std::shared_ptr<const SimClock> newClock) {
+    clock = std::move(newClock);
+    nextNTEntryTime = clock->NowMicros();
+  }
+
   inline const wpi::cs::CvSource& GetVideoSimRaw() { return videoSimRaw; }
+
+  /**
+   * Gets the latest raw frame. Its pixels live in one of two buffers the
+   * camera draws into in turn, so they're overwritten two frames later, even
+   * through a copy of the cv::Mat. clone() it to keep it longer.
+   *
+   * @return The latest raw frame
+   */
   inline const cv::Mat& GetVideoSimFrameRaw() { return videoSimFrameRaw; }
 
   /**
@@ -189,13 +267,16 @@ class PhotonCameraSim {
   }
 
   /**
-   * Sets whether the raw video stream simulation is enabled.
+   * Sets whether the raw video stream simulation is enabled. Headless
+   * cameras ignore this.
    *
    * Note: This may increase loop times.
    *
    * @param enabled Whether or not to enable the raw video stream
    */
-  inline void EnableRawStream(bool enabled) { videoSimRawEnabled = enabled; }
+  inline void EnableRawStream(bool enabled) {
+    videoSimRawEnabled = enabled && !headless;
+  }
 
   /**
    * Sets whether a wireframe of the field is drawn to the raw video stream.
@@ -222,30 +303,125 @@ class PhotonCameraSim {
   }
 
   /**
-   * Sets whether the processed video stream simulation is enabled.
+   * Sets whether the processed video stream simulation is enabled. Headless
+   * cameras ignore this.
    *
    * @param enabled Whether or not to enable the processed video stream
    */
   inline void EnabledProcessedStream(double enabled) {
-    videoSimProcEnabled = enabled;
+    videoSimProcEnabled = enabled && !headless;
   }
+
+  /**
+   * Sets whether targets hidden behind nearer targets or occluders are left
+   * out of results. A fiducial is dropped unless its corners and nearly all
+   * of it are in view. Other targets are kept while any part of them is
+   * visible, with their area reduced to the visible part. Off by default.
+   *
+   * @param enabled Whether or not to check for occlusion
+   */
+  inline void EnableOcclusion(bool enabled) { occlusionEnabled = enabled; }
+
+  /**
+   * Sets static geometry, such as field elements, that hides targets behind
+   * it when occlusion is enabled. Occluders are never detected or drawn
+   * themselves, and their models should be convex.
+   *
+   * @param newOccluders The occluders, replacing any set before
+   */
+  inline void SetOccluders(std::vector<VisionTargetSim> newOccluders) {
+    occluders = std::move(newOccluders);
+  }
+
   PhotonPipelineResult Process(wpi::units::second_t latency,
                                const wpi::math::Pose3d& cameraPose,
-                               std::vector<VisionTargetSim> targets);
+                               const std::vector<VisionTargetSim>& targets);
+  /**
+   * Like Process, but reads the targets in place instead of taking copies.
+   * The targets must not change until this returns.
+   */
+  PhotonPipelineResult Process(
+      wpi::units::second_t latency, const wpi::math::Pose3d& cameraPose,
+      std::span<const VisionTargetSim* const> targets);
 
   void SubmitProcessedFrame(const PhotonPipelineResult& result);
   void SubmitProcessedFrame(const PhotonPipelineResult& result,
                             uint64_t ReceiveTimestamp);
 
+  /**
+   * Publishes a result like SubmitProcessedFrame, but leaves flushing the
+   * NetworkTables instance to the caller. This lets several cameras share a
+   * single flush. The camera's intrinsics and distortion are only published
+   * when they change.
+   *
+   * @param result The result to publish
+   * @param receiveTimestamp The NT timestamp of the result, in microseconds
+   */
+  void StageProcessedFrame(const PhotonPipelineResult& result,
+                           uint64_t receiveTimestamp);
+
+  /**
+   * Returns how long each stage of simulating this camera has taken since it
+   * was constructed or ResetStageTimings was called.
+   *
+   * @return The cumulative timings
+   */
+  const StageTimings& GetStageTimings() const { return stageTimings; }
+
+  /** Sets all stage timings back to zero. */
+  void ResetStageTimings() { stageTimings = {}; }
+
+  /**
+   * Returns the NetworkTables instance this camera publishes to.
+   *
+   * @return The instance
+   */
+  wpi::nt::NetworkTableInstance GetNetworkTableInstance() const {
+    return ts.subTable->GetInstance();
+  }
+
   SimCameraProperties prop;
 
  private:
+  struct VideoMode {
+    int width;
+    int height;
+    int fps;
+
+    bool operator==(const VideoMode&) const = default;
+  };
+
+  /**
+   * Pushes resolution and FPS to the video sources and opens or closes them,
+   * but only when something changed since the last frame.
+   */
+  void UpdateVideoSources();
+
+  /**
+   * How much of each target is visible past nearer targets and occluders,
+   * from 0 to 1. Fiducials are always either 0 or 1.
+   *
+   * @param targets The targets in view
+   * @param targetVertices The field vertices of each target, as projected
+   */
+  std::vector<double> ComputeVisibleFractions(
+      const wpi::math::Pose3d& cameraPose,
+      std::span<const VisionTargetSim* const> targets,
+      std::span<const std::vector<wpi::math::Translation3d>> targetVertices);
+
   PhotonCamera* cam;
 
   NTTopicSet ts{};
   int64_t heartbeatCounter{0};
+  StageTimings stageTimings{};
+  // Reused for every result so packing doesn't allocate once warm
+  Packet resultPacket{};
+  // What was last published to the static calibration topics
+  std::optional<std::array<double, 9>> publishedIntrinsics{};
+  std::optional<std::array<double, 8>> publishedDistortion{};
 
-  int64_t nextNTEntryTime{wpi::nt::Now()};
+  std::shared_ptr<const SimClock> clock{SimClock::GetDefault()};
+  int64_t nextNTEntryTime{clock->NowMicros()};
 
   wpi::units::meter_t maxSightRange{std::numeric_limits<double>::max()};
   static constexpr double kDefaultMinAreaPx{100};
@@ -253,13 +429,29 @@ class PhotonCameraSim {
 
   wpi::apriltag::AprilTagFieldLayout tagLayout;
 
+  bool occlusionEnabled{false};
+  std::vector<VisionTargetSim> occluders{};
+  OcclusionBuffer occlusionBuffer{};
+
   wpi::cs::CvSource videoSimRaw;
+  // The last finished raw frame. Frames are drawn alternately into the two
+  // buffers, so this stays intact while the next frame is drawn.
   cv::Mat videoSimFrameRaw{};
+  std::array<cv::Mat, 2> rawFrameBuffers{};
+  size_t rawFrameIndex{0};
+  // Where frames are drawn before lens distortion is applied, if any
+  cv::Mat pinholeFrame{};
   bool videoSimRawEnabled{true};
   bool videoSimWireframeEnabled{false};
   double videoSimWireframeResolution{0.1};
   wpi::cs::CvSource videoSimProcessed;
   cv::Mat videoSimFrameProcessed{};
   bool videoSimProcEnabled{true};
+  // What the video sources were last set to. Sources start out open.
+  VideoMode rawVideoMode{0, 0, 0};
+  VideoMode processedVideoMode{0, 0, 0};
+  bool rawStreamOpen{true};
+  bool processedStreamOpen{true};
+  bool headless{false};
 };
 }  // namespace photon
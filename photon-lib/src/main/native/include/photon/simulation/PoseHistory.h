@@ -0,0 +1,201 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <optional>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <wpi/math/geometry/Pose3d.hpp>
+#include <wpi/units/time.hpp>
+
+namespace photon {
+/**
+ * A time-ordered history of poses covering a fixed length of time, sampled
+ * with interpolation. This follows the semantics of
+ * wpi::math::TimeInterpolatableBuffer<Pose3d>, but keeps samples in a ring
+ * buffer that only reallocates when the history grows. Lookups are a binary
+ * search, and many timestamps can be looked up in one pass.
+ */
+class PoseHistory {
+ public:
+  /**
+   * @param historyLength How far back from the newest sample to keep samples
+   */
+  explicit PoseHistory(wpi::units::second_t historyLength)
+      : historyLength(historyLength.value()) {}
+
+  /**
+   * Records a pose. A sample at an existing timestamp replaces it, and
+   * samples older than the history length before this one are dropped.
+   *
+   * @param time When the pose was observed
+   * @param pose The pose
+   */
+  void AddSample(wpi::units::second_t time, const wpi::math::Pose3d& pose) {
+    const double t = time.value();
+    if (count == 0 || t > At(count - 1).time) {
+      PushBack({t, pose});
+    } else {
+      const size_t i = LowerBound(0, t);
+      if (At(i).time == t) {
+        At(i).pose = pose;
+      } else {
+        // Out of order, so shift everything after it up by one
+        PushBack(At(count - 1));
+        for (size_t j = count - 2; j > i; j--) {
+          At(j) = At(j - 1);
+        }
+        At(i) = {t, pose};
+      }
+    }
+
+    while (count > 0 && t - At(0).time > historyLength) {
+      head = (head + 1) & (ring.size() - 1);
+      count--;
+    }
+  }
+
+  /** Removes every sample. The storage is kept for reuse. */
+  void Clear() {
+    head = 0;
+    count = 0;
+  }
+
+  bool Empty() const { return count == 0; }
+
+  size_t Size() const { return count; }
+
+  /**
+   * Gets the pose at a time, interpolating between the samples around it.
+   * Times outside the history get the oldest or newest sample.
+   *
+   * @param time The time to sample at
+   * @return The pose, or an empty optional if there are no samples
+   */
+  std::optional<wpi::math::Pose3d> Sample(wpi::units::second_t time) const {
+    if (count == 0) {
+      return std::nullopt;
+    }
+    return SampleFrom(0, time.value()).second;
+  }
+
+  /**
+   * Samples at many times in one call. Times in increasing order are found by
+   * walking forward from the previous one instead of searching again.
+   *
+   * @param times The times to sample at
+   * @param poses Receives the pose for each time, as Sample() would return
+   */
+  void SampleMany(std::span<const wpi::units::second_t> times,
+                  std::span<std::optional<wpi::math::Pose3d>> poses) const {
+    const size_t n = std::min(times.size(), poses.size());
+    size_t cursor = 0;
+    double lastTime = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (count == 0) {
+        poses[i] = std::nullopt;
+        continue;
+      }
+      const double t = times[i].value();
+      if (i == 0 || t < lastTime) {
+        cursor = 0;
+      }
+      auto [upper, pose] = SampleFrom(cursor, t);
+      poses[i] = pose;
+      cursor = upper;
+      lastTime = t;
+    }
+  }
+
+ private:
+  struct Entry {
+    double time;
+    wpi::math::Pose3d pose;
+  };
+
+  Entry& At(size_t i) { return ring[(head + i) & (ring.size() - 1)]; }
+  const Entry& At(size_t i) const {
+    return ring[(head + i) & (ring.size() - 1)];
+  }
+
+  // Takes the entry by value, since it may point into the ring being grown
+  void PushBack(Entry entry) {
+    if (count == ring.size()) {
+      std::vector<Entry> grown(std::max<size_t>(ring.size() * 2, 16));
+      for (size_t i = 0; i < count; i++) {
+        grown[i] = At(i);
+      }
+      ring = std::move(grown);
+      head = 0;
+    }
+    ring[(head + count) & (ring.size() - 1)] = std::move(entry);
+    count++;
+  }
+
+  /** The first index at or after start whose time is not before t. */
+  size_t LowerBound(size_t start, double t) const {
+    size_t lo = start;
+    size_t hi = count;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (At(mid).time < t) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  /**
+   * Samples at t, assuming it is after every sample before start. Also
+   * returns the index of the sample found after t, to start from next time.
+   */
+  std::pair<size_t, wpi::math::Pose3d> SampleFrom(size_t start,
+                                                  double t) const {
+    if (t <= At(0).time) {
+      return {0, At(0).pose};
+    }
+    if (t >= At(count - 1).time) {
+      return {count - 1, At(count - 1).pose};
+    }
+    const size_t upper = LowerBound(std::max<size_t>(start, 1), t);
+    const Entry& a = At(upper - 1);
+    const Entry& b = At(upper);
+    const double fraction = (t - a.time) / (b.time - a.time);
+    return {upper, a.pose + (b.pose - a.pose) * fraction};
+  }
+
+  double historyLength;
+  // Power-of-two sized, oldest sample at head
+  std::vector<Entry> ring;
+  size_t head{0};
+  size_t count{0};
+};
+}  // namespace photon
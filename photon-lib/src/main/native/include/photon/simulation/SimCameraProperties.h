@@ -24,18 +24,23 @@
 
 #pragma once
 
-#include <random>
+#include <array>
+#include <cstdint>
+#include <span>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include <Eigen/Core>
+#include <photon/estimation/CameraCalibration.h>
 #include <photon/estimation/OpenCVHelp.h>
 #include <wpi/math/geometry/Rotation2d.hpp>
 #include <wpi/math/geometry/Translation3d.hpp>
 #include <wpi/units/frequency.hpp>
 #include <wpi/units/time.hpp>
 
+#include "photon/simulation/SimRandom.h"
+
 namespace photon {
 
 /**
@@ -146,7 +151,9 @@ class SimCameraProperties {
     return static_cast<double>(resWidth) / static_cast<double>(resHeight);
   }
 
-  Eigen::Matrix<double, 3, 3> GetIntrinsics() const { return camIntrinsics; }
+  const Eigen::Matrix<double, 3, 3>& GetIntrinsics() const {
+    return calibration.GetCameraMatrix();
+  }
 
   /**
    * Returns the camera calibration's distortion coefficients, in OPENCV8 form.
@@ -154,7 +161,47 @@ class SimCameraProperties {
    *
    * @return The distortion coefficients in an 8x1 matrix
    */
-  Eigen::Matrix<double, 8, 1> GetDistCoeffs() const { return distCoeffs; }
+  const Eigen::Matrix<double, 8, 1>& GetDistCoeffs() const {
+    return calibration.GetDistCoeffs();
+  }
+
+  /**
+   * Returns the intrinsics and distortion together, with their OpenCV forms
+   * prebuilt. This is rebuilt only by SetCalibration.
+   */
+  const CameraCalibration& GetCalibration() const { return calibration; }
+
+  /**
+   * The same intrinsics as GetCalibration() with no distortion. Simulated
+   * video is drawn through this and then distorted with ApplyDistortion().
+   */
+  const CameraCalibration& GetPinholeCalibration() const {
+    return calibration.GetPinhole();
+  }
+
+  /**
+   * Whether ApplyDistortion() changes anything, i.e. whether any distortion
+   * coefficient is nonzero.
+   */
+  bool HasDistortionMaps() const { return !distortMap.map1.empty(); }
+
+  /**
+   * Warps an image drawn through GetPinholeCalibration() into what this
+   * camera's lens would see. The remap tables are fixed-point and cached by
+   * the calibration, so this costs one cv::remap per frame.
+   *
+   * @param pinhole The undistorted image, at this camera's resolution
+   * @param distorted The output image. Must not be the same as pinhole.
+   */
+  void ApplyDistortion(const cv::Mat& pinhole, cv::Mat& distorted) const;
+
+  /**
+   * Moves distorted pixels to where they would be in the undistorted image
+   * that ApplyDistortion() expects, in place.
+   *
+   * @param points The pixels to undistort
+   */
+  void UndistortPixels(std::span<cv::Point2f> points) const;
 
   /**
    * Gets the FPS of the simulated camera.
@@ -206,8 +253,8 @@ class SimCameraProperties {
   /** The yaw from the principal point of this camera to the pixel x value.
    * Positive values left. */
   wpi::math::Rotation2d GetPixelYaw(double pixelX) const {
-    double fx = camIntrinsics(0, 0);
-    double cx = camIntrinsics(0, 2);
+    double fx = calibration.GetCameraMatrix()(0, 0);
+    double cx = calibration.GetCameraMatrix()(0, 2);
     double xOffset = cx - pixelX;
     return wpi::math::Rotation2d{fx, xOffset};
   }
@@ -220,8 +267,8 @@ class SimCameraProperties {
    * #getCorrectedPixelRot(const cv::Point2d).
    */
   wpi::math::Rotation2d GetPixelPitch(double pixelY) const {
-    double fy = camIntrinsics(1, 1);
-    double cy = camIntrinsics(1, 2);
+    double fy = calibration.GetCameraMatrix()(1, 1);
+    double cy = calibration.GetCameraMatrix()(1, 2);
     double yOffset = cy - pixelY;
     return wpi::math::Rotation2d{fy, -yOffset};
   }
@@ -263,12 +310,12 @@ class SimCameraProperties {
    * camera from the given pixel (roll is zero).
    */
   wpi::math::Rotation3d GetCorrectedPixelRot(const cv::Point2d& point) const {
-    double fx = camIntrinsics(0, 0);
-    double cx = camIntrinsics(0, 2);
+    double fx = calibration.GetCameraMatrix()(0, 0);
+    double cx = calibration.GetCameraMatrix()(0, 2);
     double xOffset = cx - point.x;
 
-    double fy = camIntrinsics(1, 1);
-    double cy = camIntrinsics(1, 2);
+    double fy = calibration.GetCameraMatrix()(1, 1);
+    double cy = calibration.GetCameraMatrix()(1, 2);
     double yOffset = cy - point.y;
 
     wpi::math::Rotation2d yaw{fx, xOffset};
@@ -322,6 +369,23 @@ class SimCameraProperties {
       const RotTrlTransform3d& camRt, const wpi::math::Translation3d& a,
       const wpi::math::Translation3d& b) const;
 
+  /**
+   * Clips many line segments against the camera's frustum at once. This is
+   * GetVisibleLine() for every segment, except that segments which only touch
+   * the frustum at a single point count as not visible.
+   *
+   * @param camRt The change in basis from world coordinates to camera
+   * coordinates. See RotTrlTransform3d#makeRelativeTo(wpi::math::Pose3d).
+   * @param starts 3xN initial translations of the lines, as columns
+   * @param ends 3xN final translations of the lines, as columns
+   * @param visibleRanges 2xN output. Each column is the visible range of t,
+   * minimum first, or NaN if that segment is not visible.
+   */
+  void GetVisibleLines(const RotTrlTransform3d& camRt,
+                       const Eigen::Ref<const Eigen::Matrix3Xd>& starts,
+                       const Eigen::Ref<const Eigen::Matrix3Xd>& ends,
+                       Eigen::Ref<Eigen::Matrix2Xd> visibleRanges) const;
+
   /**
    * Returns these points after applying this camera's estimated noise.
    *
@@ -330,21 +394,38 @@ class SimCameraProperties {
    */
   std::vector<cv::Point2f> EstPixelNoise(
       const std::vector<cv::Point2f>& points) {
-    if (avgErrorPx == 0 && errorStdDevPx == 0) {
-      return points;
+    std::vector<cv::Point2f> noisyPts{points};
+    EstPixelNoise(std::span<cv::Point2f>{noisyPts});
+    return noisyPts;
+  }
+
+  /**
+   * Applies this camera's estimated noise to every point in place. Passing
+   * all of a frame's corners at once lets the random draws and trigonometry
+   * run as one batch.
+   *
+   * @param points The points to add noise to
+   */
+  void EstPixelNoise(std::span<cv::Point2f> points) {
+    if ((avgErrorPx == 0 && errorStdDevPx == 0) || points.empty()) {
+      return;
     }
 
-    std::vector<cv::Point2f> noisyPts;
-    noisyPts.reserve(points.size());
-    for (size_t i = 0; i < points.size(); i++) {
-      cv::Point2f p = points[i];
-      float error = avgErrorPx + gaussian(generator) * errorStdDevPx;
-      float errorAngle =
-          uniform(generator) * 2 * std::numbers::pi - std::numbers::pi;
-      noisyPts.emplace_back(cv::Point2f{p.x + error * std::cos(errorAngle),
-                                        p.y + error * std::sin(errorAngle)});
+    const size_t n = points.size();
+    Eigen::ArrayXd error(n);
+    Eigen::ArrayXd errorAngle(n);
+    random.FillNormal(NextDraws(kPixelErrorDraws, n),
+                      std::span<double>{error.data(), n});
+    random.FillUniform(NextDraws(kPixelAngleDraws, n),
+                       std::span<double>{errorAngle.data(), n});
+    error = avgErrorPx + error * errorStdDevPx;
+    errorAngle = errorAngle * 2 * std::numbers::pi - std::numbers::pi;
+    Eigen::ArrayXd dx = error * errorAngle.cos();
+    Eigen::ArrayXd dy = error * errorAngle.sin();
+    for (size_t i = 0; i < n; i++) {
+      points[i].x += static_cast<float>(dx(i));
+      points[i].y += static_cast<float>(dy(i));
     }
-    return noisyPts;
   }
 
   /**
@@ -354,9 +435,56 @@ class SimCameraProperties {
    */
   wpi::units::second_t EstLatency() {
     return wpi::units::math::max(
-        avgLatency + gaussian(generator) * latencyStdDev, 0_s);
+        avgLatency +
+            random.Normal(NextDraws(kLatencyDraws, 1)) * latencyStdDev,
+        0_s);
   }
 
+  /**
+   * Seeds this camera's noise. Runs with the same seed and stream produce
+   * identical noise, regardless of what other cameras are doing. Resets the
+   * noise sequence to its start. The seed is 0 until this is called.
+   *
+   * @param seed The seed
+   */
+  void SetRandomSeed(uint64_t seed) {
+    random = SimRandom{seed, random.GetStream()};
+    noiseFrame = 0;
+    drawCounts.fill(0);
+  }
+
+  /**
+   * Selects which noise stream this camera draws from, so cameras sharing a
+   * seed still get independent noise. PhotonCameraSim sets this from the
+   * camera's name. Resets the noise sequence to its start.
+   *
+   * @param stream The stream
+   */
+  void SetRandomStream(uint64_t stream) {
+    random = SimRandom{random.GetSeed(), stream};
+    noiseFrame = 0;
+    drawCounts.fill(0);
+  }
+
+  /**
+   * Starts a new frame's noise. Each frame draws from its own counters, so
+   * its noise depends only on the seed, the stream, how many frames came
+   * before it and what is drawn within it. Adding or removing a target only
+   * changes the noise of the frames it's in. PhotonCameraSim calls this once
+   * per frame.
+   */
+  void BeginNoiseFrame() {
+    noiseFrame++;
+    drawCounts.fill(0);
+  }
+
+  /**
+   * Gets the seed for this camera's noise.
+   *
+   * @return The seed
+   */
+  uint64_t GetRandomSeed() const { return random.GetSeed(); }
+
   /**
    * Estimates how long until the next frame should be processed.
    *
@@ -525,14 +653,37 @@ class SimCameraProperties {
   }
 
  private:
-  std::mt19937 generator{std::random_device{}()};
-  std::normal_distribution<float> gaussian{0.0, 1.0};
-  std::uniform_real_distribution<float> uniform{0.0, 1.0};
+  // Each kind of noise draws from its own range of counters, so e.g.
+  // enabling pixel noise doesn't change the simulated latencies
+  enum DrawKind {
+    kLatencyDraws,
+    kPixelErrorDraws,
+    kPixelAngleDraws,
+    kNumDraws
+  };
+
+  // Counters are the draw kind in the top 8 bits, the frame in the next 32,
+  // then the draw within the frame in the low 24
+  uint64_t NextDraws(DrawKind kind, uint64_t count) {
+    uint64_t start = (static_cast<uint64_t>(kind) << 56) |
+                     ((noiseFrame & 0xFFFFFFFF) << 24) |
+                     (drawCounts[kind] & 0xFFFFFF);
+    drawCounts[kind] += count;
+    return start;
+  }
+
+  // A fixed default seed, so an unseeded sim is reproducible too
+  SimRandom random{};
+  uint64_t noiseFrame = 0;
+  std::array<uint64_t, kNumDraws> drawCounts{};
 
   int resWidth;
   int resHeight;
-  Eigen::Matrix<double, 3, 3> camIntrinsics;
-  Eigen::Matrix<double, 8, 1> distCoeffs;
+  CameraCalibration calibration{Eigen::Matrix<double, 3, 3>::Identity(),
+                                Eigen::Matrix<double, 8, 1>::Zero()};
+  // The calibration's remap tables at this resolution, fetched once by
+  // SetCalibration so frames don't go through its cache
+  CameraCalibration::UndistortionMap distortMap;
   double avgErrorPx{0};
   double errorStdDevPx{0};
   wpi::units::second_t frameSpeed{0};
@@ -0,0 +1,99 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+#include <wpi/nt/ntcore_cpp.hpp>
+#include <wpi/units/time.hpp>
+
+namespace photon {
+/**
+ * The time source for the vision simulation. Times are in microseconds on the
+ * NetworkTables timebase, which is what wpi::nt::Now() and
+ * wpi::Timer::GetMonotonicTimestamp() both read.
+ */
+class SimClock {
+ public:
+  virtual ~SimClock() = default;
+
+  /** The current time in microseconds. */
+  virtual int64_t NowMicros() const = 0;
+
+  /** The current time. */
+  wpi::units::second_t Now() const {
+    return wpi::units::microsecond_t{static_cast<double>(NowMicros())};
+  }
+
+  /** The wall clock, shared by every simulation that doesn't set its own. */
+  static std::shared_ptr<const SimClock> GetDefault();
+};
+
+/** Wall-clock time, read from NetworkTables. */
+class RealSimClock : public SimClock {
+ public:
+  int64_t NowMicros() const override { return wpi::nt::Now(); }
+};
+
+/**
+ * A clock that only moves when stepped. Together with headless cameras this
+ * lets the simulation run as fast as it can be computed rather than in real
+ * time, e.g. for Monte Carlo runs in CI.
+ */
+class VirtualSimClock : public SimClock {
+ public:
+  /**
+   * @param start The initial time. Defaults to one second so that the first
+   * frames don't land on timestamp zero.
+   */
+  explicit VirtualSimClock(wpi::units::second_t start = 1_s)
+      : now(ToMicros(start)) {}
+
+  int64_t NowMicros() const override { return now.load(); }
+
+  /** Advances the clock. */
+  void Step(wpi::units::second_t dt) { now += ToMicros(dt); }
+
+  /**
+   * Sets the clock. Going backwards is allowed, but poses already recorded at
+   * later times will still be sampled.
+   */
+  void Set(wpi::units::second_t time) { now = ToMicros(time); }
+
+ private:
+  static int64_t ToMicros(wpi::units::second_t time) {
+    return wpi::units::microsecond_t{time}.to<int64_t>();
+  }
+
+  std::atomic<int64_t> now;
+};
+
+inline std::shared_ptr<const SimClock> SimClock::GetDefault() {
+  static const auto clock = std::make_shared<const RealSimClock>();
+  return clock;
+}
+}  // namespace photon
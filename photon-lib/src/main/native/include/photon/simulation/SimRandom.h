@@ -0,0 +1,124 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <numbers>
+#include <span>
+#include <string_view>
+
+#include <Eigen/Core>
+
+namespace photon {
+/**
+ * A counter-based random number generator. Each draw is a hash of the seed,
+ * the stream, and the draw's counter, so there is no hidden state: any draw
+ * can be reproduced on its own, and generators for different streams (e.g.
+ * one per camera) never affect each other regardless of which thread uses
+ * them or in what order.
+ */
+class SimRandom {
+ public:
+  /**
+   * @param seed Seed shared by every stream of a simulation run
+   * @param stream Identifies this sequence among others with the same seed
+   */
+  explicit SimRandom(uint64_t seed = 0, uint64_t stream = 0)
+      : seed(seed), stream(stream), key(Mix(seed + Mix(stream))) {}
+
+  uint64_t GetSeed() const { return seed; }
+  uint64_t GetStream() const { return stream; }
+
+  /** 64 random bits for the given counter. */
+  uint64_t Bits(uint64_t counter) const {
+    return Mix(key + counter * kGolden);
+  }
+
+  /** A uniform double in [0, 1) for the given counter. */
+  double Uniform(uint64_t counter) const {
+    return static_cast<double>(Bits(counter) >> 11) * 0x1.0p-53;
+  }
+
+  /** A standard normal for the given counter. */
+  double Normal(uint64_t counter) const {
+    double value;
+    FillNormal(counter, {&value, 1});
+    return value;
+  }
+
+  /** Sets out[i] to Uniform(start + i). */
+  void FillUniform(uint64_t start, std::span<double> out) const {
+    for (size_t i = 0; i < out.size(); i++) {
+      out[i] = Uniform(start + i);
+    }
+  }
+
+  /**
+   * Sets out[i] to a standard normal for counter start + i. Each uses the
+   * Box-Muller transform on the two halves of one draw, with the
+   * transcendental math done over the whole batch at once.
+   */
+  void FillNormal(uint64_t start, std::span<double> out) const {
+    const Eigen::Index n = static_cast<Eigen::Index>(out.size());
+    Eigen::ArrayXd u1(n);
+    Eigen::ArrayXd u2(n);
+    for (Eigen::Index i = 0; i < n; i++) {
+      uint64_t bits = Bits(start + i);
+      // (0, 1] so the log is finite
+      u1(i) = (static_cast<double>(bits >> 32) + 1.0) * 0x1.0p-32;
+      u2(i) = static_cast<double>(bits & 0xFFFFFFFF) * 0x1.0p-32;
+    }
+    Eigen::Map<Eigen::ArrayXd>{out.data(), n} =
+        (-2.0 * u1.log()).sqrt() * (2.0 * std::numbers::pi * u2).cos();
+  }
+
+  /**
+   * A stable 64-bit hash of a name (FNV-1a), for deriving a stream from e.g.
+   * a camera name. Unlike std::hash this is the same on every platform.
+   */
+  static constexpr uint64_t HashName(std::string_view name) {
+    uint64_t hash = 0xCBF29CE484222325;
+    for (char c : name) {
+      hash ^= static_cast<unsigned char>(c);
+      hash *= 0x100000001B3;
+    }
+    return hash;
+  }
+
+ private:
+  static constexpr uint64_t kGolden = 0x9E3779B97F4A7C15;
+
+  // SplitMix64's finalizer
+  static constexpr uint64_t Mix(uint64_t z) {
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+    return z ^ (z >> 31);
+  }
+
+  uint64_t seed;
+  uint64_t stream;
+  uint64_t key;
+};
+}  // namespace photon
@@ -0,0 +1,212 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Core>
+#include <wpi/math/geometry/Pose3d.hpp>
+#include <wpi/math/geometry/Translation3d.hpp>
+#include <wpi/units/length.hpp>
+
+namespace photon {
+/**
+ * A uniform grid over the field's XY plane for finding which targets a camera
+ * could possibly see without testing every target on the field. Entries are
+ * identified by a caller-chosen index and can be moved or removed one at a
+ * time.
+ */
+class TargetSpatialIndex {
+ public:
+  /**
+   * @param cellSize The side length of each grid cell. Cells a few meters
+   * across keep the cell count small on an FRC field.
+   */
+  explicit TargetSpatialIndex(wpi::units::meter_t cellSize = 2_m)
+      : cellSize(cellSize.value()) {}
+
+  /** Adds an entry at the given position. Replaces it if it already exists. */
+  void Insert(size_t id, const wpi::math::Translation3d& position) {
+    if (id < entries.size() && entries[id].live) {
+      Move(id, position);
+      return;
+    }
+    if (id >= entries.size()) {
+      entries.resize(id + 1);
+    }
+    Entry& entry = entries[id];
+    entry.position = position.ToVector();
+    entry.cell = CellKey(entry.position);
+    entry.live = true;
+    cells[entry.cell].push_back(id);
+    liveCount++;
+  }
+
+  /** Updates an entry's position. The grid only changes if its cell does. */
+  void Move(size_t id, const wpi::math::Translation3d& position) {
+    if (id >= entries.size() || !entries[id].live) {
+      Insert(id, position);
+      return;
+    }
+    Entry& entry = entries[id];
+    entry.position = position.ToVector();
+    int64_t cell = CellKey(entry.position);
+    if (cell != entry.cell) {
+      EraseFromCell(entry.cell, id);
+      entry.cell = cell;
+      cells[cell].push_back(id);
+    }
+  }
+
+  /** Removes an entry, if it exists. */
+  void Remove(size_t id) {
+    if (id >= entries.size() || !entries[id].live) {
+      return;
+    }
+    EraseFromCell(entries[id].cell, id);
+    entries[id].live = false;
+    liveCount--;
+  }
+
+  void Clear() {
+    entries.clear();
+    cells.clear();
+    liveCount = 0;
+  }
+
+  size_t Size() const { return liveCount; }
+
+  /**
+   * Finds every entry that may be inside a camera's view. This is
+   * conservative: an entry is kept if it is within maxRange of the camera and
+   * the angle between the camera's +X axis and the direction to it is within
+   * acos(minCosAngle).
+   *
+   * @param cameraPose The camera's field pose, looking down its +X axis
+   * @param minCosAngle Cosine of the largest angle off of the camera's axis
+   * @param maxRange Entries further than this from the camera are skipped
+   * @param ids Output, cleared first. Sorted by id.
+   */
+  void QueryCone(const wpi::math::Pose3d& cameraPose, double minCosAngle,
+                 wpi::units::meter_t maxRange, std::vector<size_t>& ids) const {
+    ids.clear();
+    const Eigen::Vector3d origin = cameraPose.Translation().ToVector();
+    const Eigen::Vector3d forward =
+        cameraPose.Rotation().ToMatrix().col(0).normalized();
+    const double range = maxRange.value();
+
+    auto test = [&](size_t id) {
+      const Eigen::Vector3d offset = entries[id].position - origin;
+      const double dist = offset.norm();
+      if (dist > range) {
+        return;
+      }
+      // Leave a little slack so borderline targets still reach the exact test
+      if (dist == 0 || offset.dot(forward) >= (minCosAngle - 1e-9) * dist) {
+        ids.push_back(id);
+      }
+    };
+
+    const double cellsAcross = 2 * range / cellSize + 1;
+    if (!std::isfinite(range) ||
+        cellsAcross * cellsAcross > static_cast<double>(cells.size())) {
+      // Cheaper to look at every occupied cell than every cell in range
+      for (const auto& [key, cellIds] : cells) {
+        for (size_t id : cellIds) {
+          test(id);
+        }
+      }
+    } else {
+      const int64_t minX = CellCoord(origin.x() - range);
+      const int64_t maxX = CellCoord(origin.x() + range);
+      const int64_t minY = CellCoord(origin.y() - range);
+      const int64_t maxY = CellCoord(origin.y() + range);
+      for (int64_t x = minX; x <= maxX; x++) {
+        for (int64_t y = minY; y <= maxY; y++) {
+          auto it = cells.find(PackKey(x, y));
+          if (it == cells.end()) {
+            continue;
+          }
+          for (size_t id : it->second) {
+            test(id);
+          }
+        }
+      }
+    }
+    // Keep results independent of hash map order
+    std::sort(ids.begin(), ids.end());
+  }
+
+ private:
+  struct Entry {
+    Eigen::Vector3d position{Eigen::Vector3d::Zero()};
+    int64_t cell{0};
+    bool live{false};
+  };
+
+  int64_t CellCoord(double v) const {
+    return static_cast<int64_t>(std::floor(v / cellSize));
+  }
+
+  static int64_t PackKey(int64_t x, int64_t y) {
+    return static_cast<int64_t>((static_cast<uint64_t>(x) << 32) ^
+                                static_cast<uint32_t>(y));
+  }
+
+  int64_t CellKey(const Eigen::Vector3d& position) const {
+    return PackKey(CellCoord(position.x()), CellCoord(position.y()));
+  }
+
+  void EraseFromCell(int64_t cell, size_t id) {
+    auto it = cells.find(cell);
+    if (it == cells.end()) {
+      return;
+    }
+    auto& cellIds = it->second;
+    for (size_t i = 0; i < cellIds.size(); i++) {
+      if (cellIds[i] == id) {
+        cellIds[i] = cellIds.back();
+        cellIds.pop_back();
+        break;
+      }
+    }
+    if (cellIds.empty()) {
+      cells.erase(it);
+    }
+  }
+
+  double cellSize;
+  std::vector<Entry> entries;
+  std::unordered_map<int64_t, std::vector<size_t>> cells;
+  size_t liveCount = 0;
+};
+}  // namespace photon
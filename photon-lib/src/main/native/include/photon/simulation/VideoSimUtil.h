@@ -25,12 +25,11 @@
 #pragma once
 
 #include <algorithm>
-#include <numeric>
 #include <string>
-#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <Eigen/Core>
 #include <opencv2/core.hpp>
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/objdetect.hpp>
@@ -49,9 +48,8 @@ int sgn(T val) {
 
 namespace photon {
 namespace VideoSimUtil {
-// Tag IDs start at 0, this should be set to 1 greater than the maximum tag ID
-// required
-static constexpr int kNumTags36h11 = 40;
+// Tag IDs start at 0. This is the size of the whole 36h11 family.
+static constexpr int kNumTags36h11 = 587;
 
 static constexpr wpi::units::meter_t fieldLength{16.54175_m};
 static constexpr wpi::units::meter_t fieldWidth{8.0137_m};
@@ -65,15 +63,6 @@ static cv::Mat Get36h11TagImage(int id) {
   return markerClone;
 }
 
-static std::unordered_map<int, cv::Mat> LoadAprilTagImages() {
-  std::unordered_map<int, cv::Mat> retVal{};
-  for (int i = 0; i < kNumTags36h11; i++) {
-    cv::Mat tagImage = Get36h11TagImage(i);
-    retVal[i] = tagImage;
-  }
-  return retVal;
-}
-
 /**
  * Gets the points representing the corners of this image. Because image pixels
  * are accessed through a cv::Mat, the point (0,0) actually represents the
@@ -122,10 +111,48 @@ static std::vector<cv::Point2f> Get36h11MarkerPts() {
   return Get36h11MarkerPts(1);
 }
 
-static const std::unordered_map<int, cv::Mat> kTag36h11Images =
-    LoadAprilTagImages();
 static const std::vector<cv::Point2f> kTag36h11MarkPts = Get36h11MarkerPts();
 
+/**
+ * A 36h11 tag image pre-scaled by powers of two with nearest-neighbor
+ * sampling, so drawing a tag at any size only has to pick a level instead of
+ * resizing the source every frame.
+ */
+struct TagImagePyramid {
+  /** The largest upscale kept, as a power of two. */
+  static constexpr int kMaxLevel = 6;
+
+  /** levels[i] is the 10x10 tag image scaled up by 2^i. */
+  std::vector<cv::Mat> levels;
+
+  /**
+   * Picks the smallest level scaled up by at least the given factor, or the
+   * largest level if none is.
+   *
+   * @param scale The desired upscale
+   * @param levelScale Set to the chosen level's actual upscale
+   * @return The level's image
+   */
+  const cv::Mat& GetLevel(double scale, int& levelScale) const {
+    size_t level = 0;
+    while (level + 1 < levels.size() && (1 << level) < scale) {
+      level++;
+    }
+    levelScale = 1 << level;
+    return levels[level];
+  }
+};
+
+/**
+ * Gets the image pyramid for a 36h11 tag. Each tag is generated the first
+ * time it is asked for and then kept for the life of the process. Safe to
+ * call from multiple threads.
+ *
+ * @param id The tag ID
+ * @return The pyramid, or nullptr if the ID isn't in the 36h11 family
+ */
+const TagImagePyramid* Get36h11TagPyramid(int id);
+
 /** Updates the properties of this cs::CvSource video stream with the given
  * camera properties. */
 [[maybe_unused]] static void UpdateVideoProp(wpi::cs::CvSource& video,
@@ -146,127 +173,8 @@ static const std::vector<cv::Point2f> kTag36h11MarkPts = Get36h11MarkerPts();
  * stream, but can hurt performance.
  * @param destination The destination image to place the warped tag image onto.
  */
-[[maybe_unused]] static void Warp165h5TagImage(
-    int tagId, const std::vector<cv::Point2f>& dstPoints, bool antialiasing,
-    cv::Mat& destination) {
-  if (!kTag36h11Images.contains(tagId)) {
-    return;
-  }
-  cv::Mat tagImage = kTag36h11Images.at(tagId);
-  std::vector<cv::Point2f> tagPoints{kTag36h11MarkPts};
-  std::vector<cv::Point2f> tagImageCorners{GetImageCorners(tagImage.size())};
-  std::vector<cv::Point2f> dstPointMat = dstPoints;
-  cv::Rect boundingRect = cv::boundingRect(dstPointMat);
-  cv::Mat perspecTrf = cv::getPerspectiveTransform(tagPoints, dstPointMat);
-  std::vector<cv::Point2f> extremeCorners{};
-  cv::perspectiveTransform(tagImageCorners, extremeCorners, perspecTrf);
-  boundingRect = cv::boundingRect(extremeCorners);
-
-  double warpedContourArea = cv::contourArea(extremeCorners);
-  double warpedTagUpscale =
-      std::sqrt(warpedContourArea) / std::sqrt(tagImage.size().area());
-  int warpStrat = cv::INTER_NEAREST;
-
-  int supersampling = 6;
-  supersampling = static_cast<int>(std::ceil(supersampling / warpedTagUpscale));
-  supersampling = std::max(std::min(supersampling, 10), 1);
-
-  cv::Mat scaledTagImage{};
-  if (warpedTagUpscale > 2.0) {
-    warpStrat = cv::INTER_LINEAR;
-    int scaleFactor = static_cast<int>(warpedTagUpscale / 3.0) + 2;
-    scaleFactor = std::max(std::min(scaleFactor, 40), 1);
-    scaleFactor *= supersampling;
-    cv::resize(tagImage, scaledTagImage, cv::Size{}, scaleFactor, scaleFactor,
-               cv::INTER_NEAREST);
-    tagPoints = Get36h11MarkerPts(scaleFactor);
-  } else {
-    scaledTagImage = tagImage;
-  }
-
-  boundingRect.x -= 1;
-  boundingRect.y -= 1;
-  boundingRect.width += 2;
-  boundingRect.height += 2;
-  if (boundingRect.x < 0) {
-    boundingRect.width += boundingRect.x;
-    boundingRect.x = 0;
-  }
-  if (boundingRect.y < 0) {
-    boundingRect.height += boundingRect.y;
-    boundingRect.y = 0;
-  }
-  boundingRect.width =
-      std::min(destination.size().width - boundingRect.x, boundingRect.width);
-  boundingRect.height =
-      std::min(destination.size().height - boundingRect.y, boundingRect.height);
-  if (boundingRect.width <= 0 || boundingRect.height <= 0) {
-    return;
-  }
-
-  std::vector<cv::Point2f> scaledDstPts{};
-  if (supersampling > 1) {
-    cv::multiply(dstPointMat,
-                 cv::Scalar{static_cast<double>(supersampling),
-                            static_cast<double>(supersampling)},
-                 scaledDstPts);
-    boundingRect.x *= supersampling;
-    boundingRect.y *= supersampling;
-    boundingRect.width *= supersampling;
-    boundingRect.height *= supersampling;
-  } else {
-    scaledDstPts = dstPointMat;
-  }
-
-  cv::subtract(scaledDstPts,
-               cv::Scalar{static_cast<double>(boundingRect.tl().x),
-                          static_cast<double>(boundingRect.tl().y)},
-               scaledDstPts);
-  perspecTrf = cv::getPerspectiveTransform(tagPoints, scaledDstPts);
-
-  cv::Mat tempRoi{};
-  cv::warpPerspective(scaledTagImage, tempRoi, perspecTrf, boundingRect.size(),
-                      warpStrat);
-
-  if (supersampling > 1) {
-    boundingRect.x /= supersampling;
-    boundingRect.y /= supersampling;
-    boundingRect.width /= supersampling;
-    boundingRect.height /= supersampling;
-    cv::resize(tempRoi, tempRoi, boundingRect.size(), 0, 0, cv::INTER_AREA);
-  }
-
-  cv::Mat tempMask{cv::Mat::zeros(tempRoi.size(), CV_8UC1)};
-  cv::subtract(extremeCorners,
-               cv::Scalar{static_cast<float>(boundingRect.tl().x),
-                          static_cast<float>(boundingRect.tl().y)},
-               extremeCorners);
-  cv::Point2f tempCenter{};
-  tempCenter.x =
-      std::accumulate(extremeCorners.begin(), extremeCorners.end(), 0.0,
-                      [extremeCorners](float acc, const cv::Point2f& p2) {
-                        return acc + p2.x / extremeCorners.size();
-                      });
-  tempCenter.y =
-      std::accumulate(extremeCorners.begin(), extremeCorners.end(), 0.0,
-                      [extremeCorners](float acc, const cv::Point2f& p2) {
-                        return acc + p2.y / extremeCorners.size();
-                      });
-
-  for (auto& corner : extremeCorners) {
-    float xDiff = corner.x - tempCenter.x;
-    float yDiff = corner.y - tempCenter.y;
-    xDiff += 1 * mathutil::sgn(xDiff);
-    yDiff += 1 * mathutil::sgn(yDiff);
-    corner = cv::Point2f{tempCenter.x + xDiff, tempCenter.y + yDiff};
-  }
-
-  std::vector<cv::Point> extremeCornerInt{extremeCorners.begin(),
-                                          extremeCorners.end()};
-  cv::fillConvexPoly(tempMask, extremeCornerInt, cv::Scalar{255});
-
-  cv::copyTo(tempRoi, destination(boundingRect), tempMask);
-}
+void Warp165h5TagImage(int tagId, const std::vector<cv::Point2f>& dstPoints,
+                       bool antialiasing, cv::Mat& destination);
 
 /**
  * Given a line thickness in a 640x480 image, try to scale to the given
@@ -499,7 +407,31 @@ static std::vector<std::vector<cv::Point2f>> PolyFrom3dLines(
 }
 
 /**
- * Draw a wireframe of the field to the given image.
+ * The field wireframe as flat lists of line segments in field coordinates.
+ * Column i of starts and ends holds the endpoints of segment i. The floor grid
+ * comes first, followed by the walls.
+ */
+struct FieldWireframe {
+  Eigen::Matrix3Xd starts;
+  Eigen::Matrix3Xd ends;
+  /** How many segments, from the front, belong to the floor grid. */
+  Eigen::Index floorSegments{0};
+};
+
+/**
+ * Gets the segments of GetFieldFloorLines() and GetFieldWallLines(). They are
+ * built the first time each subdivision count is asked for and then kept for
+ * the life of the process. Safe to call from multiple threads.
+ *
+ * @param floorSubdivisions How many "subdivisions" along the width/length of
+ * the floor.
+ * @return The wireframe
+ */
+const FieldWireframe& GetFieldWireframe(int floorSubdivisions);
+
+/**
+ * Draw a wireframe of the field to the given image. Every segment is clipped
+ * and projected in one batch.
  *
  * @param camRt The change in basis from world coordinates to camera
  * coordinates. See RotTrlTransform3d#makeRelativeTo(wpi::math::Pose3d).
@@ -516,32 +448,15 @@ static std::vector<std::vector<cv::Point2f>> PolyFrom3dLines(
  * grid in pixels. This is scaled by #getScaledThickness(double, cv::Mat).
  * @param floorColor Color of the lines used for drawing the field floor grid.
  * @param destination The destination image to draw to.
+ * @param pinhole Whether to draw through the camera's pinhole calibration, for
+ * images that are distorted afterwards with
+ * SimCameraProperties#ApplyDistortion.
  */
-[[maybe_unused]] static void DrawFieldWireFrame(
-    const RotTrlTransform3d& camRt, const SimCameraProperties& prop,
-    double resolution, double wallThickness, const cv::Scalar& wallColor,
-    int floorSubdivisions, double floorThickness, const cv::Scalar& floorColor,
-    cv::Mat& destination) {
-  for (const auto& trls : GetFieldFloorLines(floorSubdivisions)) {
-    auto polys =
-        PolyFrom3dLines(camRt, prop, trls, resolution, false, destination);
-    for (const auto& poly : polys) {
-      DrawPoly(poly,
-               static_cast<int>(
-                   std::round(GetScaledThickness(floorThickness, destination))),
-               floorColor, false, destination);
-    }
-  }
-  for (const auto& trls : GetFieldWallLines()) {
-    auto polys =
-        PolyFrom3dLines(camRt, prop, trls, resolution, false, destination);
-    for (const auto& poly : polys) {
-      DrawPoly(poly,
-               static_cast<int>(
-                   std::round(GetScaledThickness(wallThickness, destination))),
-               wallColor, false, destination);
-    }
-  }
-}
+void DrawFieldWireFrame(const RotTrlTransform3d& camRt,
+                        const SimCameraProperties& prop, double resolution,
+                        double wallThickness, const cv::Scalar& wallColor,
+                        int floorSubdivisions, double floorThickness,
+                        const cv::Scalar& floorColor, cv::Mat& destination,
+                        bool pinhole = false);
 }  // namespace VideoSimUtil
 }  // namespace photon
@@ -24,18 +24,27 @@
 
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
-#include <wpi/math/interpolation/TimeInterpolatableBuffer.hpp>
 #include <wpi/smartdashboard/Field2d.hpp>
 #include <wpi/smartdashboard/FieldObject2d.hpp>
 #include <wpi/smartdashboard/SmartDashboard.hpp>
-#include <wpi/system/Timer.hpp>
 
 #include "photon/simulation/PhotonCameraSim.h"
+#include "photon/simulation/PoseHistory.h"
+#include "photon/simulation/SimClock.h"
+#include "photon/simulation/VisionTargetStore.h"
+#include "photon/util/WorkerPool.h"
 
 namespace photon {
 /**
@@ -58,11 +67,71 @@ class VisionSystemSim {
    * @param visionSystemName The specific identifier for this vision system in
    * NetworkTables.
    */
-  explicit VisionSystemSim(std::string visionSystemName) {
+  explicit VisionSystemSim(std::string visionSystemName)
+      : VisionSystemSim(std::move(visionSystemName), SimClock::GetDefault()) {}
+
+  /**
+   * A simulated vision system which reads time from the given clock instead
+   * of the wall clock. With a VirtualSimClock, step the clock and call Update
+   * in a loop to run the simulation faster than real time.
+   *
+   * @param visionSystemName The specific identifier for this vision system in
+   * NetworkTables.
+   * @param clock The clock used by this system and every camera added to it
+   */
+  VisionSystemSim(std::string visionSystemName,
+                  std::shared_ptr<const SimClock> clock)
+      : clock(std::move(clock)) {
     std::string tableName = "VisionSystemSim-" + visionSystemName;
     wpi::SmartDashboard::PutData(tableName + "/Sim Field", &dbgField);
   }
 
+  /**
+   * Returns the clock this system reads time from.
+   *
+   * @return The clock
+   */
+  const SimClock& GetClock() const { return *clock; }
+
+  /**
+   * Switches this system and its cameras to a different clock. The pose
+   * history is recorded against the old clock, so it is reset to the latest
+   * robot pose and camera transforms.
+   *
+   * @param newClock The new clock
+   */
+  void SetClock(std::shared_ptr<const SimClock> newClock) {
+    wpi::math::Pose3d robotPose = GetRobotPose();
+    std::unordered_map<PhotonCameraSim*, wpi::math::Transform3d> robotToCams;
+    for (const auto& [camSim, trfBuffer] : camTrfMap) {
+      robotToCams[camSim] =
+          GetRobotToCamera(camSim).value_or(wpi::math::Transform3d{});
+    }
+
+    clock = std::move(newClock);
+    ResetRobotPose(robotPose);
+    for (auto& [camSim, trfBuffer] : camTrfMap) {
+      camSim->SetClock(clock);
+      trfBuffer.Clear();
+      trfBuffer.AddSample(clock->Now(),
+                          wpi::math::Pose3d{} + robotToCams.at(camSim));
+    }
+  }
+
+  /**
+   * Seeds the noise of every camera in this system, including cameras added
+   * later. Each camera still draws from its own stream, derived from its
+   * name, so runs with the same seed and cameras are reproducible.
+   *
+   * @param seed The seed
+   */
+  void SetRandomSeed(uint64_t seed) {
+    randomSeed = seed;
+    for (const auto& [name, camSim] : camSimMap) {
+      camSim->prop.SetRandomSeed(seed);
+    }
+  }
+
   /** Get one of the simulated cameras. */
   std::optional<PhotonCameraSim*> GetCameraSim(std::string name) {
     auto it = camSimMap.find(name);
@@ -97,12 +166,13 @@ class VisionSystemSim {
     if (found == camSimMap.end()) {
       camSimMap[std::string{cameraSim->GetCamera()->GetCameraName()}] =
           cameraSim;
-      camTrfMap.insert(
-          std::make_pair(std::move(cameraSim),
-                         wpi::math::TimeInterpolatableBuffer<wpi::math::Pose3d>{
-                             bufferLength}));
-      camTrfMap.at(cameraSim).AddSample(wpi::Timer::GetMonotonicTimestamp(),
-                                        wpi::math::Pose3d{} + robotToCamera);
+      cameraSim->SetClock(clock);
+      if (randomSeed) {
+        cameraSim->prop.SetRandomSeed(*randomSeed);
+      }
+      camTrfMap.insert_or_assign(cameraSim, PoseHistory{bufferLength})
+          .first->second.AddSample(clock->Now(),
+                                   wpi::math::Pose3d{} + robotToCamera);
     }
   }
 
@@ -138,7 +208,7 @@ class VisionSystemSim {
    */
   std::optional<wpi::math::Transform3d> GetRobotToCamera(
       PhotonCameraSim* cameraSim) {
-    return GetRobotToCamera(cameraSim, wpi::Timer::GetMonotonicTimestamp());
+    return GetRobotToCamera(cameraSim, clock->Now());
   }
 
   /**
@@ -152,19 +222,15 @@ class VisionSystemSim {
    */
   std::optional<wpi::math::Transform3d> GetRobotToCamera(
       PhotonCameraSim* cameraSim, wpi::units::second_t time) {
-    if (camTrfMap.find(cameraSim) != camTrfMap.end()) {
-      wpi::math::TimeInterpolatableBuffer<wpi::math::Pose3d> trfBuffer =
-          camTrfMap.at(cameraSim);
-      std::optional<wpi::math::Pose3d> sample = trfBuffer.Sample(time);
-      if (!sample) {
-        return std::nullopt;
-      } else {
-        return std::make_optional(wpi::math::Transform3d{
-            wpi::math::Pose3d{}, sample.value_or(wpi::math::Pose3d{})});
-      }
-    } else {
+    auto found = camTrfMap.find(cameraSim);
+    if (found == camTrfMap.end()) {
+      return std::nullopt;
+    }
+    std::optional<wpi::math::Pose3d> sample = found->second.Sample(time);
+    if (!sample) {
       return std::nullopt;
     }
+    return wpi::math::Transform3d{wpi::math::Pose3d{}, *sample};
   }
 
   /**
@@ -175,7 +241,7 @@ class VisionSystemSim {
    * @return The pose of this camera, or an empty optional if it is invalid
    */
   std::optional<wpi::math::Pose3d> GetCameraPose(PhotonCameraSim* cameraSim) {
-    return GetCameraPose(cameraSim, wpi::Timer::GetMonotonicTimestamp());
+    return GetCameraPose(cameraSim, clock->Now());
   }
 
   /**
@@ -196,6 +262,33 @@ class VisionSystemSim {
     }
   }
 
+  /**
+   * Get the field poses of several cameras at once, each at its own time.
+   * The robot pose history is walked once for all of them, which is cheapest
+   * when the times are in increasing order.
+   *
+   * @param cameraSims The cameras to get the field poses of
+   * @param times When each camera's pose should be observed
+   * @param poses Receives the pose of each camera, or an empty optional if it
+   * is invalid
+   */
+  void GetCameraPoses(std::span<PhotonCameraSim* const> cameraSims,
+                      std::span<const wpi::units::second_t> times,
+                      std::span<std::optional<wpi::math::Pose3d>> poses) {
+    const size_t n =
+        std::min({cameraSims.size(), times.size(), poses.size()});
+    std::vector<std::optional<wpi::math::Pose3d>> robotPoses(n);
+    robotPoseBuffer.SampleMany(times.first(n), robotPoses);
+    for (size_t i = 0; i < n; i++) {
+      auto robotToCamera = GetRobotToCamera(cameraSims[i], times[i]);
+      if (!robotToCamera) {
+        poses[i] = std::nullopt;
+      } else {
+        poses[i] = robotPoses[i].value_or(wpi::math::Pose3d{}) + *robotToCamera;
+      }
+    }
+  }
+
   /**
    * Adjust a camera's position relative to the robot. Use this if your camera
    * is on a gimbal or turret or some other mobile platform.
@@ -207,7 +300,7 @@ class VisionSystemSim {
   bool AdjustCamera(PhotonCameraSim* cameraSim,
                     const wpi::math::Transform3d& robotToCamera) {
     if (camTrfMap.find(cameraSim) != camTrfMap.end()) {
-      camTrfMap.at(cameraSim).AddSample(wpi::Timer::GetMonotonicTimestamp(),
+      camTrfMap.at(cameraSim).AddSample(clock->Now(),
                                         wpi::math::Pose3d{} + robotToCamera);
       return true;
     } else {
@@ -230,18 +323,17 @@ class VisionSystemSim {
    * @return If the cameraSim was valid and transforms were reset
    */
   bool ResetCameraTransforms(PhotonCameraSim* cameraSim) {
-    wpi::units::second_t now = wpi::Timer::GetMonotonicTimestamp();
-    if (camTrfMap.find(cameraSim) != camTrfMap.end()) {
-      auto trfBuffer = camTrfMap.at(cameraSim);
-      wpi::math::Transform3d lastTrf{
-          wpi::math::Pose3d{},
-          trfBuffer.Sample(now).value_or(wpi::math::Pose3d{})};
-      trfBuffer.Clear();
-      AdjustCamera(cameraSim, lastTrf);
-      return true;
-    } else {
+    wpi::units::second_t now = clock->Now();
+    auto found = camTrfMap.find(cameraSim);
+    if (found == camTrfMap.end()) {
       return false;
     }
+    PoseHistory& trfBuffer = found->second;
+    wpi::math::Pose3d lastTrf =
+        trfBuffer.Sample(now).value_or(wpi::math::Pose3d{});
+    trfBuffer.Clear();
+    trfBuffer.AddSample(now, lastTrf);
+    return true;
   }
 
   /**
@@ -250,13 +342,8 @@ class VisionSystemSim {
    * @return The vision targets
    */
   std::vector<VisionTargetSim> GetVisionTargets() {
-    std::vector<VisionTargetSim> all{};
-    for (const auto& entry : targetSets) {
-      for (const auto& target : entry.second) {
-        all.emplace_back(target);
-      }
-    }
-    return all;
+    auto all = targetStore.Targets();
+    return {all.begin(), all.end()};
   }
 
   /**
@@ -266,7 +353,38 @@ class VisionSystemSim {
    * @return The vision targets
    */
   std::vector<VisionTargetSim> GetVisionTargets(std::string type) {
-    return targetSets[type];
+    std::vector<VisionTargetSim> ofType{};
+    auto all = targetStore.Targets();
+    for (size_t i = 0; i < all.size(); i++) {
+      if (targetStore.TypeAt(i) == type) {
+        ofType.emplace_back(all[i]);
+      }
+    }
+    return ofType;
+  }
+
+  /**
+   * Returns a vision target by its handle.
+   *
+   * @param handle The handle returned when the target was added
+   * @return The target, or nullptr if it has been removed
+   */
+  const VisionTargetSim* GetVisionTarget(VisionTargetHandle handle) const {
+    return targetStore.Get(handle);
+  }
+
+  /**
+   * Adds a target on the field which your vision system is designed to
+   * detect, returning a handle that can be used to move or remove it without
+   * searching every target.
+   *
+   * @param type Type of target (e.g. "cargo").
+   * @param target Target to add to the simulated field
+   * @return A handle to the added target
+   */
+  VisionTargetHandle AddVisionTarget(std::string_view type,
+                                     const VisionTargetSim& target) {
+    return targetStore.Add(type, target);
   }
 
   /**
@@ -278,9 +396,11 @@ class VisionSystemSim {
    * By default these are added under the type "targets".
    *
    * @param targets Targets to add to the simulated field
+   * @return Handles to the added targets, in the same order
    */
-  void AddVisionTargets(const std::vector<VisionTargetSim>& targets) {
-    AddVisionTargets("targets", targets);
+  std::vector<VisionTargetHandle> AddVisionTargets(
+      const std::vector<VisionTargetSim>& targets) {
+    return AddVisionTargets("targets", targets);
   }
 
   /**
@@ -291,15 +411,16 @@ class VisionSystemSim {
    *
    * @param type Type of target (e.g. "cargo").
    * @param targets Targets to add to the simulated field
+   * @return Handles to the added targets, in the same order
    */
-  void AddVisionTargets(std::string type,
-                        const std::vector<VisionTargetSim>& targets) {
-    if (!targetSets.contains(type)) {
-      targetSets[type] = std::vector<VisionTargetSim>{};
-    }
+  std::vector<VisionTargetHandle> AddVisionTargets(
+      std::string type, const std::vector<VisionTargetSim>& targets) {
+    std::vector<VisionTargetHandle> handles{};
+    handles.reserve(targets.size());
     for (const auto& tgt : targets) {
-      targetSets[type].emplace_back(tgt);
+      handles.push_back(targetStore.Add(type, tgt));
     }
+    return handles;
   }
 
   /**
@@ -316,15 +437,38 @@ class VisionSystemSim {
    * @param layout The field tag layout to get Apriltag poses and IDs from
    */
   void AddAprilTags(const wpi::apriltag::AprilTagFieldLayout& layout) {
-    std::vector<VisionTargetSim> targets;
     for (const wpi::apriltag::AprilTag& tag : layout.GetTags()) {
-      targets.emplace_back(VisionTargetSim{layout.GetTagPose(tag.ID).value(),
-                                           photon::kAprilTag36h11, tag.ID});
+      targetStore.Add("apriltag",
+                      VisionTargetSim{layout.GetTagPose(tag.ID).value(),
+                                      photon::kAprilTag36h11, tag.ID});
     }
-    AddVisionTargets("apriltag", targets);
   }
+
+  /**
+   * Moves a vision target in place. Cheap enough to call every loop for
+   * moving game pieces.
+   *
+   * @param handle The handle returned when the target was added
+   * @param pose The target's new field pose
+   * @return If the target exists and was moved
+   */
+  bool SetVisionTargetPose(VisionTargetHandle handle,
+                           const wpi::math::Pose3d& pose) {
+    return targetStore.SetPose(handle, pose);
+  }
+
+  /**
+   * Removes a single vision target from the simulated field.
+   *
+   * @param handle The handle returned when the target was added
+   * @return If the target existed and was removed
+   */
+  bool RemoveVisionTarget(VisionTargetHandle handle) {
+    return targetStore.Remove(handle);
+  }
+
   /** Removes every VisionTargetSim from the simulated field. */
-  void ClearVisionTargets() { targetSets.clear(); }
+  void ClearVisionTargets() { targetStore.Clear(); }
   /** Removes all simulated AprilTag targets from the simulated field. */
   void ClearAprilTags() { RemoveVisionTargets("apriltag"); }
 
@@ -334,13 +478,13 @@ class VisionSystemSim {
    *
    * @param type Type of target (e.g. "cargo"). Same as the type passed into
    *  #addVisionTargets(String, VisionTargetSim...)
-   * @return The removed targets, or null if no targets of the specified type
-   * exist
    */
-  void RemoveVisionTargets(std::string type) { targetSets.erase(type); }
+  void RemoveVisionTargets(std::string type) { targetStore.RemoveType(type); }
 
   /**
-   * Removes the specified VisionTargetSims from the simulated field.
+   * Removes the specified VisionTargetSims from the simulated field. Prefer
+   * RemoveVisionTarget when the handle is known, which doesn't have to compare
+   * against every target.
    *
    * @param targets The targets to remove
    * @return The targets that were actually removed
@@ -348,18 +492,17 @@ class VisionSystemSim {
   std::vector<VisionTargetSim> RemoveVisionTargets(
       const std::vector<VisionTargetSim>& targets) {
     std::vector<VisionTargetSim> removedList;
-    for (auto& entry : targetSets) {
-      auto& vec = entry.second;
-      auto it = vec.begin();
-      while (it != vec.end()) {
-        if (std::find(targets.begin(), targets.end(), *it) != targets.end()) {
-          removedList.emplace_back(*it);
-          it = vec.erase(it);
-        } else {
-          ++it;
-        }
+    std::vector<VisionTargetHandle> toRemove;
+    auto all = targetStore.Targets();
+    for (size_t i = 0; i < all.size(); i++) {
+      if (std::find(targets.begin(), targets.end(), all[i]) != targets.end()) {
+        removedList.emplace_back(all[i]);
+        toRemove.push_back(targetStore.HandleAt(i));
       }
     }
+    for (const auto& handle : toRemove) {
+      targetStore.Remove(handle);
+    }
     return removedList;
   }
 
@@ -369,7 +512,7 @@ class VisionSystemSim {
    * @return The latest robot pose
    */
   wpi::math::Pose3d GetRobotPose() {
-    return GetRobotPose(wpi::Timer::GetMonotonicTimestamp());
+    return GetRobotPose(clock->Now());
   }
 
   /**
@@ -398,7 +541,7 @@ class VisionSystemSim {
    */
   void ResetRobotPose(const wpi::math::Pose3d& robotPose) {
     robotPoseBuffer.Clear();
-    robotPoseBuffer.AddSample(wpi::Timer::GetMonotonicTimestamp(), robotPose);
+    robotPoseBuffer.AddSample(clock->Now(), robotPose);
   }
   wpi::Field2d& GetDebugField() { return dbgField; }
 
@@ -419,57 +562,121 @@ class VisionSystemSim {
    * @param robotPoseMeters The simulated robot pose in meters
    */
   void Update(const wpi::math::Pose3d& robotPose) {
-    for (auto& set : targetSets) {
-      std::vector<wpi::math::Pose2d> posesToAdd{};
-      for (auto& target : set.second) {
-        posesToAdd.emplace_back(target.GetPose().ToPose2d());
-      }
-      dbgField.GetObject(set.first)->SetPoses(posesToAdd);
+    auto types = targetStore.Types();
+    std::vector<std::vector<wpi::math::Pose2d>> posesByType(types.size());
+    auto targets = targetStore.Targets();
+    for (size_t i = 0; i < targets.size(); i++) {
+      posesByType[targetStore.TypeIndexAt(i)].emplace_back(
+          targets[i].GetPose().ToPose2d());
+    }
+    for (size_t i = 0; i < types.size(); i++) {
+      dbgField.GetObject(types[i])->SetPoses(posesByType[i]);
     }
 
-    wpi::units::second_t now = wpi::Timer::GetMonotonicTimestamp();
+    wpi::units::second_t now = clock->Now();
     robotPoseBuffer.AddSample(now, robotPose);
     dbgField.SetRobotPose(robotPose.ToPose2d());
 
-    std::vector<VisionTargetSim> allTargets{};
-    for (const auto& set : targetSets) {
-      for (const auto& target : set.second) {
-        allTargets.emplace_back(target);
-      }
-    }
-
-    std::vector<wpi::math::Pose2d> visTgtPoses2d{};
-    std::vector<wpi::math::Pose2d> cameraPoses2d{};
-    bool processed{false};
+    // Decide which cameras produce a frame this tick, in a fixed order so the
+    // published results don't depend on hash map iteration
+    struct CameraFrame {
+      PhotonCameraSim* camSim;
+      uint64_t timestampNt;
+      wpi::units::second_t latency;
+      wpi::math::Pose3d cameraPose;
+      PhotonPipelineResult result;
+      std::vector<const VisionTargetSim*> candidates;
+      std::vector<size_t> candidateIds;
+    };
+    std::vector<const std::string*> camNames{};
+    camNames.reserve(camSimMap.size());
     for (const auto& entry : camSimMap) {
-      auto camSim = entry.second;
+      camNames.push_back(&entry.first);
+    }
+    std::sort(camNames.begin(), camNames.end(),
+              [](const std::string* a, const std::string* b) {
+                return *a < *b;
+              });
+
+    std::vector<CameraFrame> frames{};
+    std::vector<PhotonCameraSim*> frameCams{};
+    std::vector<wpi::units::second_t> captureTimes{};
+    for (const auto* name : camNames) {
+      auto camSim = camSimMap.at(*name);
       auto optTimestamp = camSim->ConsumeNextEntryTime();
       if (!optTimestamp) {
         continue;
-      } else {
-        processed = true;
       }
       uint64_t timestampNt = optTimestamp.value();
       wpi::units::second_t latency = camSim->prop.EstLatency();
       wpi::units::second_t timestampCapture =
           wpi::units::microsecond_t{static_cast<double>(timestampNt)} - latency;
+      frames.push_back({camSim, timestampNt, latency, {}, {}, {}, {}});
+      frameCams.push_back(camSim);
+      captureTimes.push_back(timestampCapture);
+    }
+
+    // Where each camera was when its frame was captured
+    std::vector<std::optional<wpi::math::Pose3d>> lateCameraPoses(
+        frames.size());
+    GetCameraPoses(frameCams, captureTimes, lateCameraPoses);
+    for (size_t i = 0; i < frames.size(); i++) {
+      frames[i].cameraPose = lateCameraPoses[i].value();
+    }
 
-      wpi::math::Pose3d lateRobotPose = GetRobotPose(timestampCapture);
-      wpi::math::Pose3d lateCameraPose =
-          lateRobotPose + GetRobotToCamera(camSim, timestampCapture).value();
-      cameraPoses2d.push_back(lateCameraPose.ToPose2d());
+    // Each camera only touches its own state while processing, so they can
+    // run concurrently
+    if (frames.size() > 1 && !workerPool) {
+      workerPool = std::make_unique<WorkerPool>();
+    }
+    auto processFrame = [&](size_t i) {
+      auto& frame = frames[i];
+      // Only hand the camera targets that could be in its view. The cone
+      // holds every direction within half the FOV in both yaw and pitch.
+      const auto& prop = frame.camSim->prop;
+      const double minCosAngle =
+          std::cos(prop.GetHorizFOV().Radians().value() / 2.0) *
+          std::cos(prop.GetVertFOV().Radians().value() / 2.0);
+      targetStore.QueryCone(frame.cameraPose, minCosAngle,
+                            frame.camSim->GetMaxSightRange(), frame.candidates,
+                            frame.candidateIds);
+      frame.result = frame.camSim->Process(frame.latency, frame.cameraPose,
+                                           frame.candidates);
+    };
+    if (workerPool) {
+      workerPool->ParallelFor(frames.size(), processFrame);
+    } else {
+      for (size_t i = 0; i < frames.size(); i++) {
+        processFrame(i);
+      }
+    }
 
-      auto camResult = camSim->Process(latency, lateCameraPose, allTargets);
-      camSim->SubmitProcessedFrame(camResult, timestampNt);
-      for (const auto& target : camResult.GetTargets()) {
+    std::vector<wpi::math::Pose2d> visTgtPoses2d{};
+    std::vector<wpi::math::Pose2d> cameraPoses2d{};
+    for (const auto& frame : frames) {
+      cameraPoses2d.push_back(frame.cameraPose.ToPose2d());
+      frame.camSim->StageProcessedFrame(frame.result, frame.timestampNt);
+      for (const auto& target : frame.result.GetTargets()) {
         auto trf = target.GetBestCameraToTarget();
         if (trf == kEmptyTrf) {
           continue;
         }
-        visTgtPoses2d.push_back(lateCameraPose.TransformBy(trf).ToPose2d());
+        visTgtPoses2d.push_back(frame.cameraPose.TransformBy(trf).ToPose2d());
       }
     }
-    if (processed) {
+    // One flush for every camera, rather than one each
+    std::vector<wpi::nt::NetworkTableInstance> instances{};
+    for (const auto& frame : frames) {
+      auto instance = frame.camSim->GetNetworkTableInstance();
+      if (std::find(instances.begin(), instances.end(), instance) ==
+          instances.end()) {
+        instances.push_back(instance);
+      }
+    }
+    for (auto& instance : instances) {
+      instance.Flush();
+    }
+    if (!frames.empty()) {
       dbgField.GetObject("visibleTargetPoses")->SetPoses(visTgtPoses2d);
     }
     if (cameraPoses2d.size() != 0) {
@@ -478,14 +685,14 @@ class VisionSystemSim {
   }
 
  private:
+  std::shared_ptr<const SimClock> clock;
+  std::optional<uint64_t> randomSeed{};
   std::unordered_map<std::string, PhotonCameraSim*> camSimMap{};
+  std::unique_ptr<WorkerPool> workerPool;
   static constexpr wpi::units::second_t bufferLength{1.5_s};
-  std::unordered_map<PhotonCameraSim*,
-                     wpi::math::TimeInterpolatableBuffer<wpi::math::Pose3d>>
-      camTrfMap;
-  wpi::math::TimeInterpolatableBuffer<wpi::math::Pose3d> robotPoseBuffer{
-      bufferLength};
-  std::unordered_map<std::string, std::vector<VisionTargetSim>> targetSets{};
+  std::unordered_map<PhotonCameraSim*, PoseHistory> camTrfMap;
+  PoseHistory robotPoseBuffer{bufferLength};
+  VisionTargetStore targetStore{};
   wpi::Field2d dbgField{};
   const wpi::math::Transform3d kEmptyTrf{};
 };
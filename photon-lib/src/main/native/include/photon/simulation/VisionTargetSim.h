@@ -114,7 +114,7 @@ class VisionTargetSim {
    *
    * @return The model of the target
    */
-  TargetModel GetModel() const { return model; }
+  const TargetModel& GetModel() const { return model; }
 
   /**
    * Returns the fiducial ID of this target, or -1 if not a fiducial target.
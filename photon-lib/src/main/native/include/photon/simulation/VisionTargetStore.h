@@ -0,0 +1,246 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <wpi/math/geometry/Pose3d.hpp>
+#include <wpi/units/length.hpp>
+
+#include "photon/simulation/TargetSpatialIndex.h"
+#include "photon/simulation/VisionTargetSim.h"
+
+namespace photon {
+/**
+ * Refers to one target in a VisionTargetStore. Handles stay valid while other
+ * targets are added or removed, and a handle to a removed target never
+ * refers to a different target later.
+ */
+struct VisionTargetHandle {
+  uint32_t slot{std::numeric_limits<uint32_t>::max()};
+  uint32_t generation{0};
+
+  bool operator==(const VisionTargetHandle&) const = default;
+};
+
+/**
+ * Every target on the simulated field, kept in one contiguous array so
+ * cameras can read them without copies. Adding, removing, and moving a single
+ * target through its handle are O(1), and the spatial index used to cull
+ * targets outside a camera's view is updated in place.
+ *
+ * Removing a target moves the last target into its place, so the order of
+ * Targets() is not preserved across removals.
+ */
+class VisionTargetStore {
+ public:
+  /**
+   * Adds a target under the given type.
+   *
+   * @return A handle for updating or removing the target later
+   */
+  VisionTargetHandle Add(std::string_view type, const VisionTargetSim& target) {
+    uint32_t slot;
+    if (freeSlots.empty()) {
+      slot = static_cast<uint32_t>(slots.size());
+      slots.push_back({});
+    } else {
+      slot = freeSlots.back();
+      freeSlots.pop_back();
+    }
+    slots[slot].index = static_cast<uint32_t>(targets.size());
+    targets.push_back(target);
+    denseSlots.push_back(slot);
+    denseTypes.push_back(TypeId(type));
+    index.Insert(slot, target.GetPose().Translation());
+    return {slot, slots[slot].generation};
+  }
+
+  /**
+   * Removes a target.
+   *
+   * @return If the handle referred to a target in this store
+   */
+  bool Remove(VisionTargetHandle handle) {
+    if (!Contains(handle)) {
+      return false;
+    }
+    RemoveAt(slots[handle.slot].index);
+    return true;
+  }
+
+  /**
+   * Removes every target of the given type.
+   *
+   * @return The number of targets removed
+   */
+  size_t RemoveType(std::string_view type) {
+    size_t removed = 0;
+    for (size_t i = targets.size(); i-- > 0;) {
+      if (typeNames[denseTypes[i]] == type) {
+        RemoveAt(i);
+        removed++;
+      }
+    }
+    return removed;
+  }
+
+  /** Whether the handle refers to a target in this store. */
+  bool Contains(VisionTargetHandle handle) const {
+    return handle.slot < slots.size() &&
+           slots[handle.slot].generation == handle.generation &&
+           slots[handle.slot].index != kNoIndex;
+  }
+
+  /** The target a handle refers to, or nullptr if it was removed. */
+  const VisionTargetSim* Get(VisionTargetHandle handle) const {
+    return Contains(handle) ? &targets[slots[handle.slot].index] : nullptr;
+  }
+
+  /**
+   * Moves a target without copying it.
+   *
+   * @return If the handle referred to a target in this store
+   */
+  bool SetPose(VisionTargetHandle handle, const wpi::math::Pose3d& pose) {
+    if (!Contains(handle)) {
+      return false;
+    }
+    targets[slots[handle.slot].index].SetPose(pose);
+    index.Move(handle.slot, pose.Translation());
+    return true;
+  }
+
+  void Clear() {
+    targets.clear();
+    denseSlots.clear();
+    denseTypes.clear();
+    freeSlots.clear();
+    index.Clear();
+    // Keep the generations so old handles stay invalid
+    for (uint32_t slot = static_cast<uint32_t>(slots.size()); slot-- > 0;) {
+      if (slots[slot].index != kNoIndex) {
+        slots[slot].index = kNoIndex;
+        slots[slot].generation++;
+      }
+      freeSlots.push_back(slot);
+    }
+  }
+
+  size_t Size() const { return targets.size(); }
+
+  /** All targets, in no particular order. */
+  std::span<const VisionTargetSim> Targets() const { return targets; }
+
+  /** The handle of Targets()[i]. */
+  VisionTargetHandle HandleAt(size_t i) const {
+    return {denseSlots[i], slots[denseSlots[i]].generation};
+  }
+
+  /** The type Targets()[i] was added under. */
+  const std::string& TypeAt(size_t i) const {
+    return typeNames[denseTypes[i]];
+  }
+
+  /** Every type a target has been added under, including now-empty ones. */
+  std::span<const std::string> Types() const { return typeNames; }
+
+  /** The index into Types() of Targets()[i]. */
+  size_t TypeIndexAt(size_t i) const { return denseTypes[i]; }
+
+  /**
+   * Finds the targets that may be in a camera's view. See
+   * TargetSpatialIndex::QueryCone.
+   *
+   * @param candidates Output, cleared first
+   * @param scratch Reused between calls to avoid allocating
+   */
+  void QueryCone(const wpi::math::Pose3d& cameraPose, double minCosAngle,
+                 wpi::units::meter_t maxRange,
+                 std::vector<const VisionTargetSim*>& candidates,
+                 std::vector<size_t>& scratch) const {
+    index.QueryCone(cameraPose, minCosAngle, maxRange, scratch);
+    candidates.clear();
+    candidates.reserve(scratch.size());
+    for (size_t slot : scratch) {
+      candidates.push_back(&targets[slots[slot].index]);
+    }
+  }
+
+ private:
+  static constexpr uint32_t kNoIndex = std::numeric_limits<uint32_t>::max();
+
+  struct Slot {
+    uint32_t index{kNoIndex};
+    uint32_t generation{0};
+  };
+
+  uint32_t TypeId(std::string_view type) {
+    // There are only ever a handful of types
+    for (size_t i = 0; i < typeNames.size(); i++) {
+      if (typeNames[i] == type) {
+        return static_cast<uint32_t>(i);
+      }
+    }
+    typeNames.emplace_back(type);
+    return static_cast<uint32_t>(typeNames.size() - 1);
+  }
+
+  void RemoveAt(size_t i) {
+    const uint32_t slot = denseSlots[i];
+    index.Remove(slot);
+    slots[slot].index = kNoIndex;
+    slots[slot].generation++;
+    freeSlots.push_back(slot);
+
+    const size_t last = targets.size() - 1;
+    if (i != last) {
+      targets[i] = std::move(targets[last]);
+      denseSlots[i] = denseSlots[last];
+      denseTypes[i] = denseTypes[last];
+      slots[denseSlots[i]].index = static_cast<uint32_t>(i);
+    }
+    targets.pop_back();
+    denseSlots.pop_back();
+    denseTypes.pop_back();
+  }
+
+  std::vector<VisionTargetSim> targets;
+  // Parallel to targets
+  std::vector<uint32_t> denseSlots;
+  std::vector<uint32_t> denseTypes;
+  std::vector<Slot> slots;
+  std::vector<uint32_t> freeSlots;
+  std::vector<std::string> typeNames;
+  TargetSpatialIndex index;
+};
+}  // namespace photon
@@ -0,0 +1,197 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) PhotonVision
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Throughput benchmarks for VisionSystemSim. These take a while, so they only
+ * run when the PHOTON_SIM_BENCHMARK environment variable is set, e.g.
+ *
+ *   PHOTON_SIM_BENCHMARK=1 ./photonlibTest --gtest_filter='*Benchmark*'
+ *
+ * Each configuration runs on a virtual clock, so the numbers are how fast a
+ * simulation step can be computed rather than how fast it is paced.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <memory>
+#include <numbers>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fmt/core.h>
+#include <gtest/gtest.h>
+
+#include "photon/simulation/SimRandom.h"
+#include "photon/simulation/VideoSimUtil.h"
+#include "photon/simulation/VisionSystemSim.h"
+
+namespace {
+struct BenchmarkConfig {
+  int cameras;
+  int tags;
+  int spheres;
+  int width;
+  int height;
+  bool video;
+  bool wireframe;
+};
+
+constexpr int kWarmupUpdates = 5;
+constexpr int kUpdates = 50;
+
+// Tags on a ring facing the robot at its center, with game pieces scattered
+// on the floor inside the ring
+void AddTargets(photon::VisionSystemSim& visionSysSim, int tags,
+                int spheres) {
+  constexpr double kRingRadius = 4.0;
+  std::vector<photon::VisionTargetSim> targets;
+  for (int i = 0; i < tags; i++) {
+    const double angle = 2 * std::numbers::pi * i / tags;
+    targets.emplace_back(
+        wpi::math::Pose3d{
+            wpi::units::meter_t{kRingRadius * std::cos(angle)},
+            wpi::units::meter_t{kRingRadius * std::sin(angle)}, 0.6_m,
+            wpi::math::Rotation3d{
+                0_rad, 0_rad, wpi::units::radian_t{angle + std::numbers::pi}}},
+        photon::kAprilTag36h11, i % photon::VideoSimUtil::kNumTags36h11);
+  }
+  visionSysSim.AddVisionTargets("apriltag", targets);
+
+  targets.clear();
+  photon::SimRandom random{1};
+  const photon::TargetModel ball{0.24_m};
+  for (int i = 0; i < spheres; i++) {
+    const double radius = 1.0 + 2.5 * random.Uniform(2 * i);
+    const double angle = 2 * std::numbers::pi * random.Uniform(2 * i + 1);
+    targets.emplace_back(
+        wpi::math::Pose3d{wpi::units::meter_t{radius * std::cos(angle)},
+                          wpi::units::meter_t{radius * std::sin(angle)},
+                          0.12_m, wpi::math::Rotation3d{}},
+        ball, 0, -1.0f);
+  }
+  visionSysSim.AddVisionTargets("gamepiece", targets);
+}
+
+void RunBenchmark(const BenchmarkConfig& config) {
+  auto clock = std::make_shared<photon::VirtualSimClock>();
+  photon::VisionSystemSim visionSysSim{"Benchmark", clock};
+  AddTargets(visionSysSim, config.tags, config.spheres);
+
+  photon::SimCameraProperties prop{};
+  prop.SetCalibration(config.width, config.height,
+                      wpi::math::Rotation2d{90_deg});
+  prop.SetCalibError(0.25, 0.08);
+  prop.SetFPS(50_Hz);
+  const auto layout = wpi::apriltag::AprilTagFieldLayout::LoadField(
+      wpi::apriltag::AprilTagField::kDefaultField);
+
+  std::vector<std::unique_ptr<photon::PhotonCamera>> cameras;
+  std::vector<std::unique_ptr<photon::PhotonCameraSim>> cameraSims;
+  for (int i = 0; i < config.cameras; i++) {
+    cameras.push_back(std::make_unique<photon::PhotonCamera>(
+        "benchmark" + std::to_string(i)));
+    cameraSims.push_back(std::make_unique<photon::PhotonCameraSim>(
+        cameras.back().get(), prop, layout, !config.video));
+    cameraSims.back()->EnableDrawWireframe(config.wireframe);
+    // Spread the cameras evenly around the robot
+    visionSysSim.AddCamera(
+        cameraSims.back().get(),
+        wpi::math::Transform3d{
+            0_m, 0_m, 0.5_m,
+            wpi::math::Rotation3d{
+                0_rad, -10_deg,
+                wpi::units::radian_t{2 * std::numbers::pi * i /
+                                     config.cameras}}});
+  }
+
+  auto step = [&] {
+    clock->Step(20_ms);
+    visionSysSim.Update(wpi::math::Pose2d{});
+  };
+  for (int i = 0; i < kWarmupUpdates; i++) {
+    step();
+  }
+  for (auto& cameraSim : cameraSims) {
+    cameraSim->ResetStageTimings();
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < kUpdates; i++) {
+    step();
+  }
+  const double totalMs = std::chrono::duration<double, std::milli>{
+      std::chrono::steady_clock::now() - start}
+                             .count();
+
+  photon::PhotonCameraSim::StageTimings total{};
+  for (const auto& cameraSim : cameraSims) {
+    const auto& timings = cameraSim->GetStageTimings();
+    total.projection += timings.projection;
+    total.pnp += timings.pnp;
+    total.render += timings.render;
+    total.publish += timings.publish;
+    total.frames += timings.frames;
+  }
+  ASSERT_GT(total.frames, 0);
+  auto perFrameUs = [&](wpi::units::second_t time) {
+    return time.value() * 1e6 / total.frames;
+  };
+
+  fmt::println(
+      "{:>4} {:>5} {:>7} {:>5}x{:<4} {:>9} | {:>9.3f} | {:>9.1f} {:>9.1f} "
+      "{:>9.1f} {:>9.1f}",
+      config.cameras, config.tags, config.spheres, config.width,
+      config.height,
+      config.wireframe ? "wireframe" : (config.video ? "video" : "headless"),
+      totalMs / kUpdates, perFrameUs(total.projection), perFrameUs(total.pnp),
+      perFrameUs(total.render), perFrameUs(total.publish));
+}
+}  // namespace
+
+TEST(VisionSystemSimBenchmark, UpdateThroughput) {
+  if (std::getenv("PHOTON_SIM_BENCHMARK") == nullptr) {
+    GTEST_SKIP() << "Set PHOTON_SIM_BENCHMARK to run";
+  }
+  wpi::nt::NetworkTableInstance::GetDefault().StartServer();
+  photon::PhotonCamera::SetVersionCheckEnabled(false);
+
+  fmt::println(
+      "{:>4} {:>5} {:>7} {:>10} {:>9} | {:>9} | {:>9} {:>9} {:>9} {:>9}",
+      "cams", "tags", "spheres", "res", "video", "ms/update", "proj us",
+      "pnp us", "render us", "pub us");
+  for (int cameras : {1, 4}) {
+    for (int tags : {16, 64}) {
+      for (int spheres : {0, 100}) {
+        for (auto [width, height] :
+             {std::pair{640, 480}, std::pair{1280, 800}}) {
+          RunBenchmark({cameras, tags, spheres, width, height, false, false});
+          RunBenchmark({cameras, tags, spheres, width, height, true, false});
+          RunBenchmark({cameras, tags, spheres, width, height, true, true});
+        }
+      }
+    }
+  }
+}
@@ -24,6 +24,12 @@
 
 #include "photon/simulation/VisionSystemSim.h"
 
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <memory>
+#include <span>
+#include <string>
 #include <tuple>
 #include <vector>
 
@@ -32,6 +38,10 @@
 
 #include "photon/PhotonUtils.h"
 #include "photon/estimation/VisionEstimation.h"
+#include "photon/simulation/FieldCoverageAnalyzer.h"
+#include "photon/simulation/SimRandom.h"
+#include "photon/simulation/TargetSpatialIndex.h"
+#include "photon/simulation/VideoSimUtil.h"
 
 // Ignore GetLatestResult warnings
 WPI_IGNORE_DEPRECATED
@@ -376,6 +386,41 @@ INSTANTIATE_TEST_SUITE_P(
                     std::make_tuple(15_ft, -53_deg, 0_ft),
                     std::make_tuple(19.52_ft, -15.98_deg, 1.1_ft)));
 
+TEST_F(VisionSystemSimTest, TestSphericalTargets) {
+  photon::VisionSystemSim visionSysSim{"Test"};
+  photon::PhotonCamera camera{"camera"};
+  photon::PhotonCameraSim cameraSim{&camera};
+  visionSysSim.AddCamera(&cameraSim, wpi::math::Transform3d{});
+  cameraSim.prop.SetCalibration(640, 480, wpi::math::Rotation2d{80_deg});
+  cameraSim.SetMinTargetAreaPixels(0.0);
+  const photon::TargetModel ball{0.3_m};
+  auto handle = visionSysSim.AddVisionTarget(
+      "ball", photon::VisionTargetSim{wpi::math::Pose3d{}, ball});
+
+  for (const auto& [x, y] : std::vector<std::pair<double, double>>{
+           {3, 0}, {3, 1}, {2, -1.2}, {6, 0.5}}) {
+    visionSysSim.SetVisionTargetPose(
+        handle, wpi::math::Pose3d{wpi::units::meter_t{x},
+                                  wpi::units::meter_t{y}, 0_m,
+                                  wpi::math::Rotation3d{}});
+    visionSysSim.Update(wpi::math::Pose2d{});
+    const auto result = camera.GetLatestResult();
+    ASSERT_TRUE(result.HasTargets());
+    const auto& target = result.GetBestTarget();
+    EXPECT_NEAR(-std::atan2(y, x) * 180 / std::numbers::pi, target.GetYaw(),
+                0.25);
+    EXPECT_NEAR(0, target.GetPitch(), 0.25);
+    if (std::abs(y / x) < 0.2) {
+      // Near the center of the image the ball is about a circle, so its
+      // bounding box is close to a square
+      const double diameterPx = 2 * cameraSim.prop.GetIntrinsics()(0, 0) *
+                                std::tan(std::asin(0.15 / std::hypot(x, y)));
+      EXPECT_NEAR(diameterPx * diameterPx / (640 * 480) * 100,
+                  target.GetArea(), target.GetArea() * 0.05);
+    }
+  }
+}
+
 TEST_F(VisionSystemSimTest, TestMultipleTargets) {
   wpi::math::Pose3d targetPoseL{
       wpi::math::Translation3d{15.98_m, 2_m, 0_m},
@@ -643,3 +688,560 @@ TEST_F(VisionSystemSimTest, TestTagAmbiguity) {
   ambiguity = camera.GetLatestResult().GetBestTarget().GetPoseAmbiguity();
   ASSERT_TRUE(0 < ambiguity && ambiguity < 0.2);
 }
+
+TEST_F(VisionSystemSimTest, TestMultipleCameras) {
+  photon::VisionSystemSim visionSysSim{"Test"};
+  std::vector<std::unique_ptr<photon::PhotonCamera>> cameras;
+  std::vector<std::unique_ptr<photon::PhotonCameraSim>> cameraSims;
+  for (int i = 0; i < 4; i++) {
+    cameras.push_back(
+        std::make_unique<photon::PhotonCamera>("camera" + std::to_string(i)));
+    cameraSims.push_back(
+        std::make_unique<photon::PhotonCameraSim>(cameras.back().get()));
+    cameraSims.back()->prop.SetCalibration(640, 480,
+                                           wpi::math::Rotation2d{80_deg});
+    // Every other camera faces away from the tag
+    visionSysSim.AddCamera(
+        cameraSims.back().get(),
+        wpi::math::Transform3d{
+            wpi::math::Translation3d{0_m, i * 0.1_m, 0_m},
+            wpi::math::Rotation3d{0_deg, 0_deg, i % 2 == 0 ? 0_deg : 180_deg}});
+  }
+
+  wpi::math::Pose3d targetPose{
+      wpi::math::Translation3d{3_m, 0_m, 0_m},
+      wpi::math::Rotation3d{0_rad, 0_rad,
+                            wpi::units::radian_t{std::numbers::pi}}};
+  visionSysSim.AddVisionTargets(
+      {photon::VisionTargetSim{targetPose, photon::kAprilTag36h11, 3}});
+
+  visionSysSim.Update(wpi::math::Pose2d{});
+  for (int i = 0; i < 4; i++) {
+    auto result = cameras[i]->GetLatestResult();
+    ASSERT_EQ(i % 2 == 0, result.HasTargets()) << "camera" << i;
+    if (result.HasTargets()) {
+      EXPECT_EQ(3, result.GetBestTarget().GetFiducialId());
+    }
+  }
+}
+
+TEST_F(VisionSystemSimTest, TestMoveTargetByHandle) {
+  photon::VisionSystemSim visionSysSim{"Test"};
+  photon::PhotonCamera camera{"camera"};
+  photon::PhotonCameraSim cameraSim{&camera};
+  visionSysSim.AddCamera(&cameraSim, wpi::math::Transform3d{});
+  cameraSim.prop.SetCalibration(640, 480, wpi::math::Rotation2d{80_deg});
+
+  wpi::math::Rotation3d facingCamera{0_rad, 0_rad,
+                                     wpi::units::radian_t{std::numbers::pi}};
+  // Start behind the camera
+  auto handle = visionSysSim.AddVisionTarget(
+      "cargo", photon::VisionTargetSim{
+                   wpi::math::Pose3d{-3_m, 0_m, 0_m, facingCamera},
+                   photon::TargetModel{0.5_m, 0.5_m}});
+  auto other = visionSysSim.AddVisionTargets(
+      "cargo", {photon::VisionTargetSim{
+                   wpi::math::Pose3d{-4_m, 0_m, 0_m, facingCamera},
+                   photon::TargetModel{0.5_m, 0.5_m}}});
+
+  visionSysSim.Update(wpi::math::Pose2d{});
+  ASSERT_FALSE(camera.GetLatestResult().HasTargets());
+
+  ASSERT_TRUE(visionSysSim.SetVisionTargetPose(
+      handle, wpi::math::Pose3d{3_m, 0_m, 0_m, facingCamera}));
+  EXPECT_EQ(3_m, visionSysSim.GetVisionTarget(handle)->GetPose().X());
+  visionSysSim.Update(wpi::math::Pose2d{});
+  ASSERT_TRUE(camera.GetLatestResult().HasTargets());
+
+  // Removing another target must not disturb the handle
+  ASSERT_TRUE(visionSysSim.RemoveVisionTarget(other[0]));
+  EXPECT_EQ(nullptr, visionSysSim.GetVisionTarget(other[0]));
+  ASSERT_NE(nullptr, visionSysSim.GetVisionTarget(handle));
+  EXPECT_EQ(1u, visionSysSim.GetVisionTargets("cargo").size());
+
+  ASSERT_TRUE(visionSysSim.RemoveVisionTarget(handle));
+  EXPECT_FALSE(visionSysSim.RemoveVisionTarget(handle));
+  EXPECT_FALSE(visionSysSim.SetVisionTargetPose(
+      handle, wpi::math::Pose3d{3_m, 0_m, 0_m, facingCamera}));
+  visionSysSim.Update(wpi::math::Pose2d{});
+  ASSERT_FALSE(camera.GetLatestResult().HasTargets());
+
+  // A reused slot gets a new handle
+  auto reused = visionSysSim.AddVisionTarget(
+      "cargo", photon::VisionTargetSim{
+                   wpi::math::Pose3d{3_m, 0_m, 0_m, facingCamera},
+                   photon::TargetModel{0.5_m, 0.5_m}});
+  EXPECT_NE(handle, reused);
+  EXPECT_EQ(nullptr, visionSysSim.GetVisionTarget(handle));
+}
+
+TEST_F(VisionSystemSimTest, TestHeadlessVirtualClock) {
+  auto clock = std::make_shared<photon::VirtualSimClock>();
+  photon::VisionSystemSim visionSysSim{"Test", clock};
+  photon::PhotonCamera camera{"camera"};
+  photon::SimCameraProperties prop{};
+  prop.SetCalibration(640, 480, wpi::math::Rotation2d{80_deg});
+  prop.SetFPS(50_Hz);
+  photon::PhotonCameraSim cameraSim{
+      &camera, prop,
+      wpi::apriltag::AprilTagFieldLayout::LoadField(
+          wpi::apriltag::AprilTagField::kDefaultField),
+      true};
+  ASSERT_TRUE(cameraSim.IsHeadless());
+  visionSysSim.AddCamera(&cameraSim, wpi::math::Transform3d{});
+  // Drop whatever an earlier test left on the topic
+  camera.GetAllUnreadResults();
+  visionSysSim.AddVisionTargets({photon::VisionTargetSim{
+      wpi::math::Pose3d{3_m, 0_m, 0_m,
+                        wpi::math::Rotation3d{
+                            0_rad, 0_rad,
+                            wpi::units::radian_t{std::numbers::pi}}},
+      photon::TargetModel{0.5_m, 0.5_m}}});
+
+  // Ten simulated seconds, which take far less than that to run
+  int frames = 0;
+  for (int i = 0; i < 500; i++) {
+    clock->Step(20_ms);
+    visionSysSim.Update(wpi::math::Pose2d{});
+    for (const auto& result : camera.GetAllUnreadResults()) {
+      EXPECT_TRUE(result.HasTargets());
+      EXPECT_LE(result.GetTimestamp(), clock->Now());
+      frames++;
+    }
+  }
+  EXPECT_NEAR(500, frames, 2);
+}
+
+TEST_F(VisionSystemSimTest, TestSeededNoiseIsReproducible) {
+  auto runCorners = [](uint64_t seed) {
+    auto clock = std::make_shared<photon::VirtualSimClock>();
+    photon::VisionSystemSim visionSysSim{"Test", clock};
+    visionSysSim.SetRandomSeed(seed);
+    photon::PhotonCamera camera{"camera"};
+    photon::SimCameraProperties prop{};
+    prop.SetCalibration(640, 480, wpi::math::Rotation2d{80_deg});
+    prop.SetCalibError(0.5, 0.2);
+    prop.SetFPS(50_Hz);
+    prop.SetAvgLatency(30_ms);
+    prop.SetLatencyStdDev(10_ms);
+    photon::PhotonCameraSim cameraSim{
+        &camera, prop,
+        wpi::apriltag::AprilTagFieldLayout::LoadField(
+            wpi::apriltag::AprilTagField::kDefaultField),
+        true};
+    visionSysSim.AddCamera(&cameraSim, wpi::math::Transform3d{});
+    // Drop whatever an earlier run left on the topic
+    camera.GetAllUnreadResults();
+    visionSysSim.AddVisionTargets({photon::VisionTargetSim{
+        wpi::math::Pose3d{3_m, 0_m, 0_m,
+                          wpi::math::Rotation3d{
+                              0_rad, 0_rad,
+                              wpi::units::radian_t{std::numbers::pi}}},
+        photon::TargetModel{0.5_m, 0.5_m}, 1}});
+
+    std::vector<double> values;
+    for (int i = 0; i < 50; i++) {
+      clock->Step(20_ms);
+      visionSysSim.Update(wpi::math::Pose2d{});
+      for (const auto& result : camera.GetAllUnreadResults()) {
+        values.push_back(result.GetLatency().value());
+        for (const auto& target : result.GetTargets()) {
+          for (const auto& corner : target.GetDetectedCorners()) {
+            values.push_back(corner.x);
+            values.push_back(corner.y);
+          }
+        }
+      }
+    }
+    return values;
+  };
+
+  auto first = runCorners(1234);
+  ASSERT_FALSE(first.empty());
+  EXPECT_EQ(first, runCorners(1234));
+  EXPECT_NE(first, runCorners(4321));
+}
+
+TEST_F(VisionSystemSimTest, TestResetCameraTransforms) {
+  auto clock = std::make_shared<photon::VirtualSimClock>();
+  photon::VisionSystemSim visionSysSim{"Test", clock};
+  photon::PhotonCamera camera{"camera"};
+  photon::PhotonCameraSim cameraSim{&camera};
+  const wpi::math::Transform3d first{0.5_m, 0_m, 0_m,
+                                     wpi::math::Rotation3d{}};
+  const wpi::math::Transform3d second{0_m, 0.5_m, 0_m,
+                                      wpi::math::Rotation3d{}};
+  visionSysSim.AddCamera(&cameraSim, first);
+  const auto before = clock->Now();
+
+  clock->Step(100_ms);
+  visionSysSim.AdjustCamera(&cameraSim, second);
+  EXPECT_EQ(first, visionSysSim.GetRobotToCamera(&cameraSim, before));
+
+  // Only the latest mount should be left in the history
+  ASSERT_TRUE(visionSysSim.ResetCameraTransforms(&cameraSim));
+  EXPECT_EQ(second, visionSysSim.GetRobotToCamera(&cameraSim, before));
+  EXPECT_EQ(second, visionSysSim.GetRobotToCamera(&cameraSim));
+  EXPECT_FALSE(visionSysSim.ResetCameraTransforms(nullptr));
+}
+
+TEST(FieldCoverageAnalyzerTest, ComparesMounts) {
+  photon::SimCameraProperties prop{};
+  prop.SetCalibration(640, 480, wpi::math::Rotation2d{80_deg});
+  prop.SetCalibError(0.25, 0.08);
+  const auto layout = wpi::apriltag::AprilTagFieldLayout::LoadField(
+      wpi::apriltag::AprilTagField::kDefaultField);
+  photon::FieldCoverageConfig config{};
+  config.cellSize = 2_m;
+  config.headings = 4;
+
+  const std::vector<wpi::math::Transform3d> mounts{
+      {0.3_m, 0_m, 0.5_m, wpi::math::Rotation3d{0_deg, -15_deg, 0_deg}},
+      // Staring at the floor
+      {0.3_m, 0_m, 0.5_m, wpi::math::Rotation3d{0_deg, 90_deg, 0_deg}}};
+  config.threads = 3;
+  auto maps = photon::FieldCoverageAnalyzer{prop, layout, config}.Evaluate(
+      mounts);
+  ASSERT_EQ(2u, maps.size());
+
+  const auto& forward = maps[0];
+  EXPECT_EQ(static_cast<size_t>(forward.columns * forward.rows),
+            forward.tagsVisible.size());
+  EXPECT_GT(forward.EstimateFraction(), 0.3);
+  EXPECT_GT(forward.MultiTagFraction(), 0.0);
+  EXPECT_LT(forward.MeanPoseError(), 0.5);
+  EXPECT_EQ(0.0, maps[1].EstimateFraction());
+  EXPECT_TRUE(std::isnan(maps[1].MeanPoseError()));
+
+  // Noise is seeded per cell, so the thread count doesn't matter
+  config.threads = 1;
+  auto single = photon::FieldCoverageAnalyzer{prop, layout, config}.Evaluate(
+      mounts[0]);
+  EXPECT_EQ(forward.tagsVisible, single.tagsVisible);
+  for (size_t i = 0; i < single.poseError.size(); i++) {
+    if (!std::isnan(single.poseError[i])) {
+      EXPECT_EQ(forward.poseError[i], single.poseError[i]);
+    }
+  }
+
+  cv::Mat heatmap = forward.Heatmap(forward.tagsVisible, 4, 4);
+  EXPECT_EQ(forward.columns * 4, heatmap.cols);
+  EXPECT_EQ(forward.rows * 4, heatmap.rows);
+  EXPECT_EQ(CV_8UC3, heatmap.type());
+  EXPECT_TRUE(forward.Heatmap(std::vector<double>(3, 1.0), 4).empty());
+}
+
+TEST(FieldCoverageAnalyzerTest, MeanPoseErrorWeightsByEstimates) {
+  photon::FieldCoverageMap map{};
+  map.columns = 2;
+  map.rows = 1;
+  map.estimateFraction = {0.75, 0.25};
+  map.poseError = {0.1, 0.5};
+  // Three estimates at 0.1 m for every one at 0.5 m
+  EXPECT_NEAR(0.2, map.MeanPoseError(), 1e-12);
+
+  map.estimateFraction = {0.0, 0.0};
+  map.poseError = {std::numeric_limits<double>::quiet_NaN(),
+                   std::numeric_limits<double>::quiet_NaN()};
+  EXPECT_TRUE(std::isnan(map.MeanPoseError()));
+}
+
+TEST(PoseHistoryTest, MatchesInterpolation) {
+  photon::PoseHistory history{1_s};
+  EXPECT_FALSE(history.Sample(0_s));
+
+  const wpi::math::Pose3d a{};
+  const wpi::math::Pose3d b{1_m, 2_m, 0_m,
+                            wpi::math::Rotation3d{0_rad, 0_rad, 1_rad}};
+  history.AddSample(1_s, a);
+  history.AddSample(1.5_s, b);
+  EXPECT_EQ(a, history.Sample(0_s));
+  EXPECT_EQ(b, history.Sample(2_s));
+  EXPECT_EQ(a + (b - a) * 0.5, history.Sample(1.25_s));
+
+  // Late samples are inserted in order, and equal times replace
+  history.AddSample(1.25_s, b);
+  history.AddSample(1.25_s, a);
+  EXPECT_EQ(3u, history.Size());
+  EXPECT_EQ(a, history.Sample(1.25_s));
+
+  // Anything older than the history length is dropped
+  history.AddSample(2.4_s, a);
+  EXPECT_EQ(2u, history.Size());
+  EXPECT_EQ(b, history.Sample(1_s));
+
+  std::vector<wpi::units::second_t> times;
+  for (int i = 0; i < 40; i++) {
+    times.push_back(1_s + i * 40_ms);
+  }
+  std::vector<std::optional<wpi::math::Pose3d>> poses(times.size());
+  history.SampleMany(times, poses);
+  for (size_t i = 0; i < times.size(); i++) {
+    EXPECT_EQ(history.Sample(times[i]), poses[i]);
+  }
+
+  history.Clear();
+  EXPECT_TRUE(history.Empty());
+}
+
+TEST_F(VisionSystemSimTest, TestCalibrationPublishedOnChange) {
+  photon::VisionSystemSim visionSysSim{"Test"};
+  photon::PhotonCamera camera{"camera"};
+  photon::PhotonCameraSim cameraSim{&camera};
+  cameraSim.prop.SetCalibration(640, 480, wpi::math::Rotation2d{80_deg});
+  visionSysSim.AddCamera(&cameraSim, wpi::math::Transform3d{});
+  auto intrinsics = camera.GetCameraTable()
+                        ->GetDoubleArrayTopic("cameraIntrinsics")
+                        .Subscribe({});
+
+  auto expectPublished = [&] {
+    Eigen::Matrix<double, 3, 3, Eigen::RowMajor> expected =
+        cameraSim.prop.GetIntrinsics();
+    auto published = intrinsics.Get();
+    ASSERT_EQ(9u, published.size());
+    for (int i = 0; i < 9; i++) {
+      EXPECT_DOUBLE_EQ(expected.data()[i], published[i]);
+    }
+  };
+  visionSysSim.Update(wpi::math::Pose2d{});
+  expectPublished();
+  visionSysSim.Update(wpi::math::Pose2d{});
+  expectPublished();
+
+  cameraSim.prop.SetCalibration(1280, 720, wpi::math::Rotation2d{70_deg});
+  cameraSim.SubmitProcessedFrame(photon::PhotonPipelineResult{});
+  expectPublished();
+}
+
+TEST_F(VisionSystemSimTest, TestRawFramesAreReused) {
+  photon::PhotonCamera camera{"camera"};
+  photon::PhotonCameraSim cameraSim{&camera};
+  cameraSim.prop.SetCalibration(640, 480, wpi::math::Rotation2d{80_deg});
+  std::vector<photon::VisionTargetSim> targets{photon::VisionTargetSim{
+      wpi::math::Pose3d{3_m, 0_m, 0_m,
+                        wpi::math::Rotation3d{
+                            0_rad, 0_rad,
+                            wpi::units::radian_t{std::numbers::pi}}},
+      photon::TargetModel{0.5_m, 0.5_m}, 0}};
+
+  cameraSim.Process(0_s, wpi::math::Pose3d{}, targets);
+  cv::Mat first = cameraSim.GetVideoSimFrameRaw();
+  ASSERT_EQ(640, first.cols);
+  // Tag 0 is drawn
+  EXPECT_GT(cv::countNonZero(first), 0);
+
+  // The next frame goes to the other buffer, leaving the last one intact,
+  // and the one after that reuses the first buffer's memory
+  cameraSim.Process(0_s, wpi::math::Pose3d{}, targets);
+  cv::Mat second = cameraSim.GetVideoSimFrameRaw();
+  EXPECT_NE(first.data, second.data);
+  cameraSim.Process(0_s, wpi::math::Pose3d{}, targets);
+  EXPECT_EQ(first.data, cameraSim.GetVideoSimFrameRaw().data);
+}
+
+TEST_F(VisionSystemSimTest, TestOcclusion) {
+  photon::PhotonCamera camera{"camera"};
+  photon::SimCameraProperties prop{};
+  prop.SetCalibration(640, 480, wpi::math::Rotation2d{80_deg});
+  photon::PhotonCameraSim cameraSim{
+      &camera, prop,
+      wpi::apriltag::AprilTagFieldLayout::LoadField(
+          wpi::apriltag::AprilTagField::kDefaultField),
+      true};
+
+  const wpi::math::Rotation3d facingCamera{
+      0_rad, 0_rad, wpi::units::radian_t{std::numbers::pi}};
+  const std::vector<photon::VisionTargetSim> targets{
+      {wpi::math::Pose3d{4_m, 0_m, 0_m, facingCamera},
+       photon::kAprilTag36h11, 1},
+      {wpi::math::Pose3d{6_m, 1_m, 0_m, facingCamera},
+       photon::kAprilTag36h11, 2},
+      // Directly in front of tag 2
+      {wpi::math::Pose3d{5_m, 0.83_m, 0_m, facingCamera},
+       photon::kAprilTag36h11, 3}};
+  auto seenIds = [&] {
+    std::vector<int> ids;
+    for (const auto& target :
+         cameraSim.Process(0_s, wpi::math::Pose3d{}, targets).GetTargets()) {
+      ids.push_back(target.GetFiducialId());
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+  };
+
+  // Off by default, so stacked targets are all seen
+  EXPECT_EQ((std::vector<int>{1, 2, 3}), seenIds());
+
+  cameraSim.EnableOcclusion(true);
+  EXPECT_EQ((std::vector<int>{1, 3}), seenIds());
+
+  // A box between the camera and tag 1
+  cameraSim.SetOccluders({photon::VisionTargetSim{
+      wpi::math::Pose3d{2_m, 0_m, 0_m, wpi::math::Rotation3d{}},
+      photon::TargetModel{0.5_m, 0.5_m, 0.5_m}}});
+  EXPECT_EQ((std::vector<int>{3}), seenIds());
+
+  cameraSim.SetOccluders({});
+  EXPECT_EQ((std::vector<int>{1, 3}), seenIds());
+}
+
+TEST(SimCameraPropertiesTest, DistortionMapsMatchProjection) {
+  photon::SimCameraProperties prop{};
+  prop.SetCalibration(640, 480, wpi::math::Rotation2d{90_deg});
+  EXPECT_FALSE(prop.HasDistortionMaps());
+
+  Eigen::Matrix<double, 8, 1> distCoeffs;
+  distCoeffs << -0.3, 0.1, 0.001, -0.002, 0, 0, 0, 0;
+  prop.SetCalibration(640, 480, prop.GetIntrinsics(), distCoeffs);
+  ASSERT_TRUE(prop.HasDistortionMaps());
+
+  // A small blob drawn in the pinhole image should land where the distorted
+  // projection of the same point is
+  const Eigen::Vector3d point{0.45, 0.3, 1.0};
+  Eigen::Matrix2Xd distortedPx(2, 1);
+  Eigen::Matrix2Xd pinholePx(2, 1);
+  photon::CameraProjection::ProjectCameraPoints(
+      prop.GetIntrinsics(), distCoeffs, point, distortedPx);
+  photon::CameraProjection::ProjectCameraPoints(
+      prop.GetIntrinsics(), Eigen::Matrix<double, 8, 1>::Zero(), point,
+      pinholePx);
+
+  std::vector<cv::Point2f> corner{
+      cv::Point2f{static_cast<float>(distortedPx(0, 0)),
+                  static_cast<float>(distortedPx(1, 0))}};
+  prop.UndistortPixels(corner);
+  EXPECT_NEAR(pinholePx(0, 0), corner[0].x, 1e-3);
+  EXPECT_NEAR(pinholePx(1, 0), corner[0].y, 1e-3);
+
+  cv::Mat pinhole = cv::Mat::zeros(480, 640, CV_8UC1);
+  cv::circle(pinhole, cv::Point{cvRound(pinholePx(0, 0)),
+                                cvRound(pinholePx(1, 0))},
+             4, cv::Scalar{255}, -1);
+  cv::Mat distorted;
+  prop.ApplyDistortion(pinhole, distorted);
+  cv::Moments moments = cv::moments(distorted);
+  ASSERT_GT(moments.m00, 0);
+  EXPECT_NEAR(distortedPx(0, 0), moments.m10 / moments.m00, 1.5);
+  EXPECT_NEAR(distortedPx(1, 0), moments.m01 / moments.m00, 1.5);
+}
+
+TEST(SimRandomTest, StreamsAreIndependent) {
+  photon::SimRandom a{7, photon::SimRandom::HashName("left")};
+  photon::SimRandom b{7, photon::SimRandom::HashName("right")};
+  EXPECT_EQ(a.Bits(3), photon::SimRandom(7, a.GetStream()).Bits(3));
+  EXPECT_NE(a.Bits(3), b.Bits(3));
+
+  std::vector<double> normals(10000);
+  a.FillNormal(0, normals);
+  EXPECT_EQ(a.Normal(42), normals[42]);
+  double mean = 0;
+  double sumSq = 0;
+  for (double x : normals) {
+    mean += x;
+    sumSq += x * x;
+  }
+  mean /= normals.size();
+  EXPECT_NEAR(0.0, mean, 0.05);
+  EXPECT_NEAR(1.0, sumSq / normals.size() - mean * mean, 0.05);
+}
+
+TEST(SimRandomTest, FrameNoiseIgnoresEarlierFrames) {
+  // Neither is seeded, so both use the default seed
+  photon::SimCameraProperties a;
+  photon::SimCameraProperties b;
+  a.SetCalibError(0.5, 0.2);
+  b.SetCalibError(0.5, 0.2);
+
+  // One sees more corners than the other in the first frame...
+  std::vector<cv::Point2f> points(4, cv::Point2f{100, 100});
+  std::vector<cv::Point2f> morePoints(12, cv::Point2f{100, 100});
+  a.BeginNoiseFrame();
+  b.BeginNoiseFrame();
+  a.EstPixelNoise(std::span<cv::Point2f>{points});
+  b.EstPixelNoise(std::span<cv::Point2f>{morePoints});
+
+  // ...but the next frame's noise is the same for both
+  std::vector<cv::Point2f> fromA(4, cv::Point2f{100, 100});
+  std::vector<cv::Point2f> fromB(4, cv::Point2f{100, 100});
+  a.BeginNoiseFrame();
+  b.BeginNoiseFrame();
+  a.EstPixelNoise(std::span<cv::Point2f>{fromA});
+  b.EstPixelNoise(std::span<cv::Point2f>{fromB});
+  EXPECT_EQ(fromA, fromB);
+  EXPECT_NE(fromA, points);
+}
+
+TEST(VideoSimUtilTest, TagPyramidCoversFamily) {
+  using photon::VideoSimUtil::Get36h11TagPyramid;
+  EXPECT_EQ(nullptr, Get36h11TagPyramid(-1));
+  EXPECT_EQ(nullptr,
+            Get36h11TagPyramid(photon::VideoSimUtil::kNumTags36h11));
+
+  const auto* pyramid = Get36h11TagPyramid(586);
+  ASSERT_NE(nullptr, pyramid);
+  EXPECT_EQ(pyramid, Get36h11TagPyramid(586));
+  ASSERT_EQ(photon::VideoSimUtil::TagImagePyramid::kMaxLevel + 1,
+            static_cast<int>(pyramid->levels.size()));
+  for (size_t i = 0; i < pyramid->levels.size(); i++) {
+    EXPECT_EQ(10 << i, pyramid->levels[i].cols);
+    EXPECT_EQ(10 << i, pyramid->levels[i].rows);
+  }
+
+  int levelScale = 0;
+  EXPECT_EQ(16, pyramid->GetLevel(12.5, levelScale).cols / 10);
+  EXPECT_EQ(16, levelScale);
+  pyramid->GetLevel(400, levelScale);
+  EXPECT_EQ(1 << photon::VideoSimUtil::TagImagePyramid::kMaxLevel,
+            levelScale);
+}
+
+TEST(VideoSimUtilTest, FieldWireframeClipsLikeScalar) {
+  const auto& wireframe = photon::VideoSimUtil::GetFieldWireframe(6);
+  EXPECT_EQ(&wireframe, &photon::VideoSimUtil::GetFieldWireframe(6));
+  EXPECT_EQ(12, wireframe.floorSegments);
+  ASSERT_EQ(30, wireframe.starts.cols());
+
+  photon::SimCameraProperties prop{};
+  prop.SetCalibration(640, 480, wpi::math::Rotation2d{90_deg});
+  const std::vector<wpi::math::Pose3d> cameraPoses{
+      {1_m, 1_m, 0.5_m, wpi::math::Rotation3d{0_deg, 0_deg, 30_deg}},
+      {8_m, 4_m, 1_m, wpi::math::Rotation3d{0_deg, 20_deg, 170_deg}},
+      {15_m, 7_m, 0.3_m, wpi::math::Rotation3d{10_deg, -5_deg, -120_deg}}};
+  for (const auto& cameraPose : cameraPoses) {
+    auto camRt = photon::RotTrlTransform3d::MakeRelativeTo(cameraPose);
+    Eigen::Matrix2Xd ranges(2, wireframe.starts.cols());
+    prop.GetVisibleLines(camRt, wireframe.starts, wireframe.ends, ranges);
+
+    for (Eigen::Index i = 0; i < wireframe.starts.cols(); i++) {
+      wpi::math::Translation3d a{Eigen::Vector3d{wireframe.starts.col(i)}};
+      wpi::math::Translation3d b{Eigen::Vector3d{wireframe.ends.col(i)}};
+      auto [tMin, tMax] = prop.GetVisibleLine(camRt, a, b);
+      if (!tMax) {
+        EXPECT_TRUE(std::isnan(ranges(0, i)));
+        continue;
+      }
+      EXPECT_NEAR(*tMin, ranges(0, i), 1e-9);
+      EXPECT_NEAR(*tMax, ranges(1, i), 1e-9);
+    }
+  }
+}
+
+TEST(TargetSpatialIndexTest, QueryCone) {
+  photon::TargetSpatialIndex index{1_m};
+  index.Insert(0, wpi::math::Translation3d{3_m, 0_m, 0_m});
+  index.Insert(1, wpi::math::Translation3d{-3_m, 0_m, 0_m});
+  index.Insert(2, wpi::math::Translation3d{3_m, 2.5_m, 0_m});
+  index.Insert(3, wpi::math::Translation3d{30_m, 0_m, 0_m});
+
+  // Looking down +X with a 45 degree half angle and 10 m range
+  wpi::math::Pose3d cameraPose{};
+  std::vector<size_t> ids;
+  index.QueryCone(cameraPose, std::cos(std::numbers::pi / 4), 10_m, ids);
+  EXPECT_EQ((std::vector<size_t>{0, 2}), ids);
+
+  index.Move(1, wpi::math::Translation3d{5_m, -1_m, 0_m});
+  index.Remove(2);
+  index.QueryCone(cameraPose, std::cos(std::numbers::pi / 4), 10_m, ids);
+  EXPECT_EQ((std::vector<size_t>{0, 1}), ids);
+  EXPECT_EQ(3u, index.Size());
+}
@@ -17,7 +17,24 @@
 
 package org.photonvision.jni;
 
+import java.nio.ByteBuffer;
+
 public class ConstrainedSolvepnpJni {
+    /**
+     * Doubles at the start of each packed batch problem: heading free (0 or 1), nTags, fx, fy, cx,
+     * cy, robot2camera (16, row major), x guess (3), gyro θ, gyro error scale factor.
+     */
+    public static final int BATCH_HEADER_DOUBLES = 27;
+
+    /**
+     * Doubles following the header for each tag: field2points (4x4n, row major) then point
+     * observations (2x4n, row major).
+     */
+    public static final int BATCH_DOUBLES_PER_TAG = 24;
+
+    /** Doubles written per problem: exit status (0 on success), x, y, theta. */
+    public static final int BATCH_RESULT_DOUBLES = 4;
+
     public static native double[] do_optimization(
             boolean heading_free,
             int nTags,
@@ -28,4 +45,17 @@ public class ConstrainedSolvepnpJni {
             double[] point_observations,
             double gyro_θ,
             double gyro_error_scale_fac);
+
+    /**
+     * Solve a batch of independent problems in one call, in parallel for larger batches. Both
+     * buffers must be direct and in native byte order; problems are packed back to back as
+     * described by {@link #BATCH_HEADER_DOUBLES} and {@link #BATCH_DOUBLES_PER_TAG}.
+     *
+     * @param nProblems Number of problems packed into problems
+     * @param problems Packed problem data
+     * @param results Receives {@link #BATCH_RESULT_DOUBLES} doubles per problem
+     * @return The number of problems solved successfully, or -1 if the buffers are malformed
+     */
+    public static native int do_optimization_batch(
+            int nProblems, ByteBuffer problems, ByteBuffer results);
 }
@@ -17,9 +17,13 @@
 
 #include "net/TimeSyncClient.h"
 
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
 #include <cstdlib>
 #include <mutex>
+#include <utility>
 
 #include <Eigen/Core>
 #include <wpi/net/uv/util.hpp>
@@ -27,6 +31,7 @@
 #include <wpi/util/print.hpp>
 #include <wpi/util/struct/Struct.hpp>
 
+#include "net/UdpSocket.h"
 #include "wpi/nt/ntcore_cpp.hpp"
 
 static void ClientLoggerFunc(unsigned int level, const char* file,
@@ -57,10 +62,59 @@ void wpi::tsp::TimeSyncClient::UpdateStatistics(uint64_t pong_local_time,
   // server time = local time + offset
   // offset = (server time - local time) = (server time) - (send_time +
   // rtt2/2)
-  auto rtt2 = pong_local_time - ping.client_time;
+  auto rtt2 = static_cast<int64_t>(pong_local_time - ping.client_time);
   int64_t serverTimeOffsetUs = pong.server_time - rtt2 / 2 - ping.client_time;
 
-  auto filtered = m_lastOffsets.Calculate(serverTimeOffsetUs);
+  // The offset is measured as of the middle of the round trip
+  uint64_t sampleTime = ping.client_time + rtt2 / 2;
+  m_samples[m_nextSample] = {sampleTime, serverTimeOffsetUs, rtt2};
+  m_nextSample = (m_nextSample + 1) % kSampleWindow;
+  m_sampleCount = std::min(m_sampleCount + 1, kSampleWindow);
+
+  // Queueing only ever adds delay, and rarely the same amount both ways, so
+  // the samples with the shortest round trip have the least error in their
+  // offset (like NTP's clock filter). Only fit the fastest quarter.
+  std::array<OffsetSample, kSampleWindow> window;
+  std::copy_n(m_samples.begin(), m_sampleCount, window.begin());
+  const size_t fastest = std::max<size_t>(1, m_sampleCount / 4);
+  std::nth_element(
+      window.begin(), window.begin() + (fastest - 1),
+      window.begin() + m_sampleCount,
+      [](const auto& a, const auto& b) { return a.rtt2 < b.rtt2; });
+
+  // The two clocks drift apart at a nearly constant rate, so fit offset
+  // against local time. Theil-Sen (the median of the pairwise slopes) shrugs
+  // off the odd bad sample that still made it this far.
+  constexpr size_t kMaxPairs =
+      (kSampleWindow / 4) * (kSampleWindow / 4 - 1) / 2;
+  std::array<double, kMaxPairs> slopes;
+  size_t slopeCount = 0;
+  for (size_t i = 0; i < fastest; i++) {
+    for (size_t j = i + 1; j < fastest; j++) {
+      auto dt = static_cast<int64_t>(window[j].time - window[i].time);
+      if (dt != 0) {
+        slopes[slopeCount++] =
+            static_cast<double>(window[j].offset - window[i].offset) / dt;
+      }
+    }
+  }
+  double drift = 0;
+  if (slopeCount > 0) {
+    std::nth_element(slopes.begin(), slopes.begin() + slopeCount / 2,
+                     slopes.begin() + slopeCount);
+    drift = std::clamp(slopes[slopeCount / 2], -kMaxDrift, kMaxDrift);
+  }
+
+  // Line each sample up at the newest one, and take the median
+  std::array<int64_t, kSampleWindow> aligned;
+  for (size_t i = 0; i < fastest; i++) {
+    aligned[i] = window[i].offset +
+                 std::llround(drift * static_cast<int64_t>(
+                                          sampleTime - window[i].time));
+  }
+  std::nth_element(aligned.begin(), aligned.begin() + fastest / 2,
+                   aligned.begin() + fastest);
+  int64_t filtered = aligned[fastest / 2];
 
   // wpi::util::println("Ping-ponged! RTT2 {} uS, offset {}/filtered offset {}
   // uS", rtt2,
@@ -69,6 +123,8 @@ void wpi::tsp::TimeSyncClient::UpdateStatistics(uint64_t pong_local_time,
   {
     std::lock_guard lock{m_offsetMutex};
     m_metadata.offset = filtered;
+    m_metadata.offsetTime = sampleTime;
+    m_metadata.drift = drift;
     m_metadata.rtt2 = rtt2;
     m_metadata.pongsReceived++;
     m_metadata.lastPongTime = pong_local_time;
@@ -84,18 +140,43 @@ void wpi::tsp::TimeSyncClient::Tick() {
 
   TspPing ping{.version = 1, .message_id = 1, .client_time = ping_local_time};
 
-  wpi::util::SmallVector<uint8_t, wpi::util::Struct<TspPing>::GetSize()>
-      pingData(wpi::util::Struct<TspPing>::GetSize());
+  constexpr size_t kPingSize = wpi::util::Struct<TspPing>::GetSize();
+  constexpr size_t kReportSize = wpi::util::Struct<TspClientReport>::GetSize();
+  wpi::util::SmallVector<uint8_t, kPingSize + kReportSize> pingData(kPingSize);
   wpi::util::PackStruct(pingData, ping);
 
-  // Wrap our buffer - pingData should free itself
-  wpi::net::uv::Buffer pingBuf{pingData};
-  int sent =
-      m_udp->TrySend(wpi::util::SmallVector<wpi::net::uv::Buffer, 1>{pingBuf});
+  // Once there's something to report, let the server know how we're doing
+  {
+    std::lock_guard lock{m_offsetMutex};
+    if (m_metadata.pongsReceived > 0) {
+      pingData.resize(kPingSize + kReportSize);
+      wpi::util::PackStruct(
+          std::span{pingData}.subspan(kPingSize),
+          TspClientReport{m_metadata.rtt2, m_metadata.offset});
+    }
+  }
 
-  if (static_cast<size_t>(sent) != wpi::util::Struct<TspPing>::GetSize()) {
-    WPI_ERROR(m_logger, "Didn't send the whole ping out? sent {} bytes", sent);
-    return;
+  uint64_t send_time = ping_local_time;
+  if (m_poll) {
+    if (!UdpSocket::Send(m_socket, pingData, nullptr)) {
+      WPI_ERROR(m_logger, "Didn't send the whole ping out?");
+      return;
+    }
+    m_sendCount++;
+    send_time =
+        UdpSocket::ReadSendTime(m_socket, m_sendCount, m_timeProvider)
+            .value_or(ping_local_time);
+  } else {
+    // Wrap our buffer - pingData should free itself
+    wpi::net::uv::Buffer pingBuf{pingData};
+    int sent = m_udp->TrySend(
+        wpi::util::SmallVector<wpi::net::uv::Buffer, 1>{pingBuf});
+
+    if (static_cast<size_t>(sent) != pingData.size()) {
+      WPI_ERROR(m_logger, "Didn't send the whole ping out? sent {} bytes",
+                sent);
+      return;
+    }
   }
 
   {
@@ -103,22 +184,59 @@ void wpi::tsp::TimeSyncClient::Tick() {
     m_metadata.pingsSent++;
   }
 
-  m_lastPing = ping;
+  TrackPing(ping, send_time);
+}
+
+void wpi::tsp::TimeSyncClient::TrackPing(wpi::tsp::TspPing ping,
+                                         uint64_t send_time) {
+  m_inFlight[m_nextInFlight] = {ping.client_time, send_time};
+  m_nextInFlight = (m_nextInFlight + 1) % kMaxInFlight;
+}
+
+bool wpi::tsp::TimeSyncClient::HandlePong(uint64_t pong_local_time,
+                                          wpi::tsp::TspPong pong) {
+  // Zero marks an empty slot, and no real ping is sent at time zero
+  auto inFlight = std::find_if(
+      m_inFlight.begin(), m_inFlight.end(),
+      [&](const auto& sent) { return sent.clientTime == pong.client_time; });
+  if (pong.client_time == 0 || inFlight == m_inFlight.end()) {
+    return false;
+  }
+  TspPing ping{pong};
+  ping.client_time = inFlight->sendTime;
+  // Each ping is only answered once, so a duplicated pong is ignored
+  *inFlight = {};
+
+  UpdateStatistics(pong_local_time, ping, pong);
+  return true;
 }
 
 void wpi::tsp::TimeSyncClient::UdpCallback(wpi::net::uv::Buffer& buf,
                                            size_t nbytes,
                                            const sockaddr& sender,
                                            unsigned flags) {
-  uint64_t pong_local_time = m_timeProvider();
+  ReceivePong(buf.bytes().subspan(0, nbytes), m_timeProvider());
+}
 
-  if (static_cast<size_t>(nbytes) != wpi::util::Struct<TspPong>::GetSize()) {
-    WPI_ERROR(m_logger, "Got {} bytes for pong?", nbytes);
+void wpi::tsp::TimeSyncClient::PollCallback() {
+  std::array<uint8_t, 64> pongData;
+  uint64_t pong_local_time;
+  // One poll event can cover several pongs, so read until there are none left
+  while (auto n = UdpSocket::Receive(m_socket, pongData, nullptr,
+                                            m_timeProvider, pong_local_time)) {
+    ReceivePong(std::span{pongData}.subspan(0, *n), pong_local_time);
+  }
+}
+
+void wpi::tsp::TimeSyncClient::ReceivePong(std::span<const uint8_t> data,
+                                           uint64_t pong_local_time) {
+  if (data.size() != wpi::util::Struct<TspPong>::GetSize()) {
+    WPI_ERROR(m_logger, "Got {} bytes for pong?", data.size());
     return;
   }
 
   TspPong pong{
-      wpi::util::UnpackStruct<TspPong>(buf.bytes()),
+      wpi::util::UnpackStruct<TspPong>(data),
   };
 
   // wpi::util::println("->[client] Got pong: {} {} {} {}", pong.version,
@@ -133,17 +251,13 @@ void wpi::tsp::TimeSyncClient::UdpCallback(wpi::net::uv::Buffer& buf,
     return;
   }
 
-  TspPing ping = m_lastPing;
-
-  if (pong.client_time != ping.client_time) {
+  if (!HandlePong(pong_local_time, pong)) {
     WPI_WARNING(m_logger,
-                "Pong was not a reply to our ping? Got ping {} vs pong {}",
-                ping.client_time, pong.client_time);
+                "Pong was not a reply to any outstanding ping? Got pong {}",
+                pong.client_time);
     return;
   }
 
-  UpdateStatistics(pong_local_time, ping, pong);
-
   // using std::cout;
   // wpi::util::println("Ping-ponged! RTT2 {} uS, offset {} uS", rtt2,
   //              serverTimeOffsetUs);
@@ -151,30 +265,72 @@ void wpi::tsp::TimeSyncClient::UdpCallback(wpi::net::uv::Buffer& buf,
   //              (m_timeProvider() + serverTimeOffsetUs) / 1000000.0);
 }
 
+bool wpi::tsp::TimeSyncClient::StartKernelTimestamped(
+    wpi::net::uv::Loop& loop, const sockaddr_in& serverAddr) {
+  int fd = UdpSocket::Open(serverAddr, false, true);
+  if (fd < 0) {
+    return false;
+  }
+  m_poll = wpi::net::uv::Poll::CreateSocket(loop, fd);
+  if (!m_poll) {
+    UdpSocket::Close(fd);
+    return false;
+  }
+
+  m_socket = fd;
+  m_poll->closed.connect([fd] { UdpSocket::Close(fd); });
+  m_poll->pollEvent.connect([this](int) { PollCallback(); });
+  // A send timestamp that showed up late, or an ICMP error from a server
+  // that isn't up yet, makes libuv stop polling
+  m_poll->error.connect([this](wpi::net::uv::Error) {
+    UdpSocket::ClearErrors(m_socket);
+    m_poll->Start(UV_READABLE);
+  });
+  m_poll->Start(UV_READABLE);
+  return true;
+}
+
 wpi::tsp::TimeSyncClient::TimeSyncClient(std::string_view server,
                                          int remote_port,
-                                         std::chrono::milliseconds ping_delay)
+                                         std::chrono::milliseconds ping_delay,
+                                         bool kernelTimestamps)
     : m_logger(::ClientLoggerFunc),
       m_timeProvider(wpi::nt::Now),
       m_udp{},
       m_pingTimer{},
       m_serverIP{server},
       m_serverPort{remote_port},
-      m_loopDelay(ping_delay) {
+      m_loopDelay(ping_delay),
+      m_kernelTimestamps(kernelTimestamps) {
   // wpi::util::println("Starting client (with server address {}:{})", server,
   //              remote_port);
 }
 
+void wpi::tsp::TimeSyncClient::SetTimeProvider(
+    std::function<uint64_t()> timeProvider) {
+  m_timeProvider = std::move(timeProvider);
+}
+
 void wpi::tsp::TimeSyncClient::Start() {
   // wpi::util::println("Connecting received");
 
-  m_loopRunner.ExecSync([this](wpi::net::uv::Loop&) {
+  m_loopRunner.ExecSync([this](wpi::net::uv::Loop& loop) {
     struct sockaddr_in serverAddr;
     wpi::net::uv::NameToAddr(m_serverIP, m_serverPort, &serverAddr);
 
-    m_udp = {wpi::net::uv::Udp::Create(m_loopRunner.GetLoop(), AF_INET)};
     m_pingTimer = {wpi::net::uv::Timer::Create(m_loopRunner.GetLoop())};
 
+    if (m_kernelTimestamps) {
+      if (StartKernelTimestamped(loop, serverAddr)) {
+        std::lock_guard lock{m_offsetMutex};
+        m_metadata.kernelTimestamps = true;
+        return;
+      }
+      WPI_WARNING(m_logger,
+                  "Kernel timestamps unavailable, using event loop time");
+    }
+
+    m_udp = {wpi::net::uv::Udp::Create(m_loopRunner.GetLoop(), AF_INET)};
     m_udp->Connect(serverAddr);
     m_udp->received.connect(&wpi::tsp::TimeSyncClient::UdpCallback, this);
     m_udp->StartRecv();
@@ -192,8 +348,14 @@ void wpi::tsp::TimeSyncClient::Start() {
 void wpi::tsp::TimeSyncClient::Stop() { m_loopRunner.Stop(); }
 
 int64_t wpi::tsp::TimeSyncClient::GetOffset() {
+  return GetOffset(m_timeProvider());
+}
+
+int64_t wpi::tsp::TimeSyncClient::GetOffset(uint64_t localTime) {
   std::lock_guard lock{m_offsetMutex};
-  return m_metadata.offset;
+  return m_metadata.offset +
+         std::llround(m_metadata.drift *
+                      static_cast<int64_t>(localTime - m_metadata.offsetTime));
 }
 
 wpi::tsp::TimeSyncClient::Metadata wpi::tsp::TimeSyncClient::GetMetadata() {
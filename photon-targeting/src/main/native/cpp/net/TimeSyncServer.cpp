@@ -17,9 +17,15 @@
 
 #include "net/TimeSyncServer.h"
 
+#include <algorithm>
+#include <array>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include <wpi/net/UDPClient.hpp>
 #include <wpi/net/uv/util.hpp>
@@ -29,6 +35,13 @@
 #include <wpi/util/struct/Struct.hpp>
 
 #include "net/TimeSyncStructs.h"
+#include "net/UdpSocket.h"
+
+struct wpi::tsp::TimeSyncServer::Batch {
+  static constexpr size_t kSize = 32;
+  std::array<UdpSocket::Datagram, kSize> pings;
+  std::array<UdpSocket::Datagram, kSize> pongs;
+};
 
 static void ServerLoggerFunc(unsigned int level, const char* file,
                              unsigned int line, const char* msg) {
@@ -51,30 +64,57 @@ static void ServerLoggerFunc(unsigned int level, const char* file,
              line);
 }
 
-void wpi::tsp::TimeSyncServer::UdpCallback(wpi::net::uv::Buffer& data, size_t n,
-                                           const sockaddr& sender,
-                                           unsigned flags) {
-  // wpi::util::println("TimeSyncServer got ping!");
+std::optional<wpi::tsp::TspPong> wpi::tsp::TimeSyncServer::HandlePing(
+    std::span<const uint8_t> data, uint64_t receive_time,
+    const sockaddr_in& sender) {
+  constexpr size_t kPingSize = wpi::util::Struct<TspPing>::GetSize();
+  constexpr size_t kReportSize = wpi::util::Struct<TspClientReport>::GetSize();
+  if (data.size() != kPingSize && data.size() != kPingSize + kReportSize) {
+    WPI_ERROR(m_logger, "Got {} bytes for ping?", data.size());
+    return std::nullopt;
+  }
 
-  TspPing ping{wpi::util::UnpackStruct<TspPing>(data.bytes())};
+  TspPing ping{wpi::util::UnpackStruct<TspPing>(data)};
 
   if (ping.version != 1) {
     WPI_ERROR(m_logger, "Bad version from client?");
-    return;
+    return std::nullopt;
   }
   if (ping.message_id != 1) {
     WPI_ERROR(m_logger, "Bad message id from client?");
-    return;
+    return std::nullopt;
   }
 
-  uint64_t current_time = m_timeProvider();
+  std::optional<TspClientReport> report;
+  if (data.size() == kPingSize + kReportSize) {
+    report = wpi::util::UnpackStruct<TspClientReport>(data.subspan(kPingSize));
+  }
+  RecordPing(sender, receive_time, report);
 
-  TspPong pong{ping, current_time};
+  TspPong pong{ping, receive_time};
   pong.message_id = 2;
 
+  // WPI_INFO(m_logger, "Got ping: {} {} {}", ping.version, ping.message_id,
+  //          ping.client_time);
+  // WPI_INFO(m_logger, "Sent pong: {} {} {} {}", pong.version, pong.message_id,
+  //          pong.client_time, pong.server_time);
+  return pong;
+}
+
+void wpi::tsp::TimeSyncServer::UdpCallback(wpi::net::uv::Buffer& data, size_t n,
+                                           const sockaddr& sender,
+                                           unsigned flags) {
+  // wpi::util::println("TimeSyncServer got ping!");
+
+  auto pong = HandlePing(data.bytes().subspan(0, n), m_timeProvider(),
+                         reinterpret_cast<const sockaddr_in&>(sender));
+  if (!pong) {
+    return;
+  }
+
   wpi::util::SmallVector<uint8_t, wpi::util::Struct<TspPong>::GetSize()>
       pongData(wpi::util::Struct<TspPong>::GetSize());
-  wpi::util::PackStruct(pongData, pong);
+  wpi::util::PackStruct(pongData, *pong);
 
   // Wrap our buffer - pongData should free itself for free
   wpi::net::uv::Buffer pongBuf{pongData};
@@ -83,23 +123,140 @@ void wpi::tsp::TimeSyncServer::UdpCallback(wpi::net::uv::Buffer& data, size_t n,
   // wpi::util::println("Pong ret: {}", sent);
   if (static_cast<size_t>(sent) != wpi::util::Struct<TspPong>::GetSize()) {
     WPI_ERROR(m_logger, "Didn't send the whole pong back?");
-    return;
   }
+}
 
-  // WPI_INFO(m_logger, "Got ping: {} {} {}", ping.version, ping.message_id,
-  //          ping.client_time);
-  // WPI_INFO(m_logger, "Sent pong: {} {} {} {}", pong.version, pong.message_id,
-  //          pong.client_time, pong.server_time);
+void wpi::tsp::TimeSyncServer::RecordPing(
+    const sockaddr_in& sender, uint64_t receive_time,
+    const std::optional<TspClientReport>& report) {
+  // Byte order doesn't matter, so long as it's unique
+  uint64_t key = (uint64_t{sender.sin_addr.s_addr} << 16) | sender.sin_port;
+
+  std::lock_guard lock{m_clientsMutex};
+  if (m_clients.size() >= kMaxClients && !m_clients.contains(key)) {
+    m_clients.erase(std::min_element(
+        m_clients.begin(), m_clients.end(), [](const auto& a, const auto& b) {
+          return a.second.stats.lastPingTime < b.second.stats.lastPingTime;
+        }));
+  }
+
+  auto [it, inserted] = m_clients.try_emplace(key);
+  ClientState& client = it->second;
+  if (inserted) {
+    std::string ip;
+    unsigned int port;
+    wpi::net::uv::AddrToName(sender, &ip, &port);
+    client.stats.address = fmt::format("{}:{}", ip, port);
+  } else {
+    // Weight the latest interval by a tenth, so the rate follows changes
+    // within a few seconds at typical ping rates
+    auto interval =
+        static_cast<double>(receive_time - client.stats.lastPingTime);
+    client.meanInterval = client.meanInterval == 0
+                              ? interval
+                              : client.meanInterval +
+                                    0.1 * (interval - client.meanInterval);
+    client.stats.pingRate =
+        client.meanInterval > 0 ? 1e6 / client.meanInterval : 0;
+  }
+
+  client.stats.pingsReceived++;
+  client.stats.lastPingTime = receive_time;
+  if (report) {
+    client.stats.reportsStats = true;
+    client.stats.rtt2 = report->rtt2;
+    client.stats.offset = report->offset;
+  }
+}
+
+void wpi::tsp::TimeSyncServer::PollCallback() {
+  // One poll event can cover many pings, so keep going until a batch comes
+  // back short
+  constexpr size_t kPongSize = wpi::util::Struct<TspPong>::GetSize();
+  size_t received;
+  do {
+    received =
+        UdpSocket::ReceiveBatch(m_socket, m_batch->pings, m_timeProvider);
+
+    size_t replies = 0;
+    for (size_t i = 0; i < received; i++) {
+      const UdpSocket::Datagram& ping = m_batch->pings[i];
+      auto pong = HandlePing(ping.Bytes(), ping.time, ping.peer);
+      if (!pong) {
+        continue;
+      }
+      UdpSocket::Datagram& reply = m_batch->pongs[replies++];
+      wpi::util::PackStruct(std::span{reply.data}.first(kPongSize), *pong);
+      reply.size = kPongSize;
+      reply.peer = ping.peer;
+    }
+
+    auto sent = UdpSocket::SendBatch(
+        m_socket, std::span{m_batch->pongs}.first(replies));
+    if (sent.failed > 0) {
+      WPI_ERROR(m_logger, "Failed to send {} of {} pongs", sent.failed,
+                replies);
+    }
+    if (sent.sent + sent.failed < replies) {
+      WPI_WARNING(m_logger, "Socket buffer full, dropped {} pongs",
+                  replies - sent.sent - sent.failed);
+    }
+  } while (received == Batch::kSize);
+}
+
+bool wpi::tsp::TimeSyncServer::StartBatched(wpi::net::uv::Loop& loop) {
+  struct sockaddr_in addr;
+  wpi::net::uv::NameToAddr("0.0.0.0", m_port, &addr);
+  int fd = UdpSocket::Open(addr, true, m_kernelTimestamps);
+  if (fd < 0 && m_kernelTimestamps) {
+    WPI_WARNING(m_logger,
+                "Kernel timestamps unavailable, using event loop time");
+    fd = UdpSocket::Open(addr, true, false);
+  }
+  if (fd < 0) {
+    return false;
+  }
+  m_poll = wpi::net::uv::Poll::CreateSocket(loop, fd);
+  if (!m_poll) {
+    UdpSocket::Close(fd);
+    return false;
+  }
+
+  m_socket = fd;
+  m_batch = std::make_unique<Batch>();
+  m_poll->closed.connect([fd] { UdpSocket::Close(fd); });
+  m_poll->pollEvent.connect([this](int) { PollCallback(); });
+  m_poll->error.connect([this](wpi::net::uv::Error) {
+    UdpSocket::ClearErrors(m_socket);
+    m_poll->Start(UV_READABLE);
+  });
+  m_poll->Start(UV_READABLE);
+  return true;
 }
 
-wpi::tsp::TimeSyncServer::TimeSyncServer(int port)
+wpi::tsp::TimeSyncServer::TimeSyncServer(int port, bool kernelTimestamps)
     : m_logger{::ServerLoggerFunc},
       m_timeProvider{wpi::nt::Now},
       m_udp{},
-      m_port(port) {}
+      m_port(port),
+      m_kernelTimestamps(kernelTimestamps) {}
+
+wpi::tsp::TimeSyncServer::~TimeSyncServer() {
+  // The loop thread uses the batch buffers, so stop it before they go
+  Stop();
+}
+
+void wpi::tsp::TimeSyncServer::SetTimeProvider(
+    std::function<uint64_t()> timeProvider) {
+  m_timeProvider = std::move(timeProvider);
+}
 
 void wpi::tsp::TimeSyncServer::Start() {
-  m_loopRunner.ExecSync([this](wpi::net::uv::Loop&) {
+  m_loopRunner.ExecSync([this](wpi::net::uv::Loop& loop) {
+    if (StartBatched(loop)) {
+      return;
+    }
+
     m_udp = {wpi::net::uv::Udp::Create(m_loopRunner.GetLoop(), AF_INET)};
     m_udp->Bind("0.0.0.0", m_port);
     m_udp->received.connect(&wpi::tsp::TimeSyncServer::UdpCallback, this);
@@ -108,3 +265,19 @@ void wpi::tsp::TimeSyncServer::Start() {
 }
 
 void wpi::tsp::TimeSyncServer::Stop() { m_loopRunner.Stop(); }
+
+std::vector<wpi::tsp::TimeSyncServer::ClientStats>
+wpi::tsp::TimeSyncServer::GetClientStats() {
+  std::vector<ClientStats> stats;
+  {
+    std::lock_guard lock{m_clientsMutex};
+    stats.reserve(m_clients.size());
+    for (const auto& [key, client] : m_clients) {
+      stats.push_back(client.stats);
+    }
+  }
+  std::sort(stats.begin(), stats.end(), [](const auto& a, const auto& b) {
+    return a.address < b.address;
+  });
+  return stats;
+}
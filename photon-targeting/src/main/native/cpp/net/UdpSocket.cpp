@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "net/UdpSocket.h"
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <cstring>
+#endif
+
+namespace wpi {
+namespace tsp {
+namespace UdpSocket {
+
+#ifdef __linux__
+namespace {
+// Room for a timestamp, plus the extended error that tags a send timestamp
+constexpr size_t kControlSize = 256;
+// Received datagrams only ever carry the timestamp
+constexpr size_t kReceiveControlSize = CMSG_SPACE(sizeof(scm_timestamping));
+// recvmmsg and sendmmsg take at most this many at once
+constexpr size_t kMaxBatch = 64;
+
+uint64_t ToClock(const timespec& stamp,
+                 const std::function<uint64_t()>& clock) {
+  uint64_t now = clock();
+  timespec realtime;
+  clock_gettime(CLOCK_REALTIME, &realtime);
+  int64_t age = (realtime.tv_sec - stamp.tv_sec) * 1000000 +
+                (realtime.tv_nsec - stamp.tv_nsec) / 1000;
+  // A stamp from the future, or from ages ago, means the realtime clock
+  // stepped since it was taken
+  if (age < 0 || age > 1000000) {
+    return now;
+  }
+  return now - age;
+}
+
+// The software timestamp among a message's control data, if any
+std::optional<timespec> FindStamp(msghdr& msg) {
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET ||
+        cmsg->cmsg_type != SCM_TIMESTAMPING) {
+      continue;
+    }
+    scm_timestamping stamps;
+    std::memcpy(&stamps, CMSG_DATA(cmsg), sizeof(stamps));
+    if (stamps.ts[0].tv_sec != 0 || stamps.ts[0].tv_nsec != 0) {
+      return stamps.ts[0];
+    }
+  }
+  return std::nullopt;
+}
+
+// Which datagram a send timestamp belongs to, from SOF_TIMESTAMPING_OPT_ID
+std::optional<uint32_t> FindSendId(msghdr& msg) {
+  for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+       cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) {
+      continue;
+    }
+    sock_extended_err err;
+    std::memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+    if (err.ee_errno == ENOMSG &&
+        err.ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+      return err.ee_data;
+    }
+  }
+  return std::nullopt;
+}
+}  // namespace
+
+int Open(const sockaddr_in& addr, bool server, bool kernelTimestamps) {
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (kernelTimestamps) {
+    int flags = SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (!server) {
+      // TSONLY keeps the kernel from looping each whole ping back to us
+      flags |= SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+               SOF_TIMESTAMPING_OPT_TSONLY;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) !=
+        0) {
+      close(fd);
+      return -1;
+    }
+  }
+
+  const auto* sa = reinterpret_cast<const sockaddr*>(&addr);
+  if ((server ? bind(fd, sa, sizeof(addr)) : connect(fd, sa, sizeof(addr))) !=
+      0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+void Close(int fd) { close(fd); }
+
+std::optional<size_t> Receive(int fd, std::span<uint8_t> data,
+                              sockaddr_in* sender,
+                              const std::function<uint64_t()>& clock,
+                              uint64_t& receiveTime) {
+  iovec iov{data.data(), data.size()};
+  alignas(cmsghdr) char control[kControlSize];
+  msghdr msg{};
+  msg.msg_name = sender;
+  msg.msg_namelen = sender ? sizeof(*sender) : 0;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof(control);
+
+  ssize_t n = recvmsg(fd, &msg, MSG_DONTWAIT);
+  if (n < 0) {
+    return std::nullopt;
+  }
+  auto stamp = FindStamp(msg);
+  receiveTime = stamp ? ToClock(*stamp, clock) : clock();
+  return static_cast<size_t>(n);
+}
+
+size_t ReceiveBatch(int fd, std::span<Datagram> batch,
+                    const std::function<uint64_t()>& clock) {
+  const size_t count = std::min(batch.size(), kMaxBatch);
+  std::array<mmsghdr, kMaxBatch> msgs{};
+  std::array<iovec, kMaxBatch> iovs;
+  alignas(cmsghdr) char control[kMaxBatch][kReceiveControlSize];
+  for (size_t i = 0; i < count; i++) {
+    iovs[i] = {batch[i].data.data(), batch[i].data.size()};
+    msghdr& hdr = msgs[i].msg_hdr;
+    hdr.msg_name = &batch[i].peer;
+    hdr.msg_namelen = sizeof(batch[i].peer);
+    hdr.msg_iov = &iovs[i];
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control[i];
+    hdr.msg_controllen = sizeof(control[i]);
+  }
+
+  int n = recvmmsg(fd, msgs.data(), count, MSG_DONTWAIT, nullptr);
+  if (n <= 0) {
+    return 0;
+  }
+  // Only read the clock once for everything that wasn't stamped
+  std::optional<uint64_t> now;
+  for (int i = 0; i < n; i++) {
+    batch[i].size = msgs[i].msg_len;
+    if (auto stamp = FindStamp(msgs[i].msg_hdr)) {
+      batch[i].time = ToClock(*stamp, clock);
+    } else {
+      if (!now) {
+        now = clock();
+      }
+      batch[i].time = *now;
+    }
+  }
+  return n;
+}
+
+bool Send(int fd, std::span<const uint8_t> data,
+          const sockaddr_in* recipient) {
+  ssize_t n = sendto(fd, data.data(), data.size(), MSG_DONTWAIT,
+                     reinterpret_cast<const sockaddr*>(recipient),
+                     recipient ? sizeof(*recipient) : 0);
+  return n == static_cast<ssize_t>(data.size());
+}
+
+SendBatchResult SendBatch(int fd, std::span<const Datagram> batch) {
+  SendBatchResult result;
+  size_t next = 0;
+  while (next < batch.size()) {
+    const size_t count = std::min(batch.size() - next, kMaxBatch);
+    std::array<mmsghdr, kMaxBatch> msgs{};
+    std::array<iovec, kMaxBatch> iovs;
+    for (size_t i = 0; i < count; i++) {
+      const Datagram& datagram = batch[next + i];
+      iovs[i] = {const_cast<uint8_t*>(datagram.data.data()), datagram.size};
+      msghdr& hdr = msgs[i].msg_hdr;
+      hdr.msg_name = const_cast<sockaddr_in*>(&datagram.peer);
+      hdr.msg_namelen = sizeof(datagram.peer);
+      hdr.msg_iov = &iovs[i];
+      hdr.msg_iovlen = 1;
+    }
+    int n = sendmmsg(fd, msgs.data(), count, MSG_DONTWAIT);
+    if (n > 0) {
+      result.sent += n;
+      next += n;
+      continue;
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      // The socket buffer is full, so the rest would fail the same way
+      break;
+    }
+    if (errno != EINTR) {
+      // sendmmsg stops at the first datagram that fails and only reports an
+      // error if it was the first one in the call. Skip just that one.
+      result.failed++;
+      next++;
+    }
+  }
+  return result;
+}
+
+std::optional<uint64_t> ReadSendTime(int fd, uint32_t sendCount,
+                                     const std::function<uint64_t()>& clock) {
+  std::optional<uint64_t> sendTime;
+  while (true) {
+    alignas(cmsghdr) char control[kControlSize];
+    msghdr msg{};
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      break;
+    }
+    // IDs count up from zero with each send
+    auto id = FindSendId(msg);
+    auto stamp = FindStamp(msg);
+    if (id && stamp && *id == sendCount - 1) {
+      sendTime = ToClock(*stamp, clock);
+    }
+  }
+  return sendTime;
+}
+
+void ClearErrors(int fd) {
+  alignas(cmsghdr) char control[kControlSize];
+  msghdr msg{};
+  do {
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+  } while (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0);
+  int err;
+  socklen_t len = sizeof(err);
+  getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+}
+#else
+int Open(const sockaddr_in&, bool, bool) { return -1; }
+
+void Close(int) {}
+
+std::optional<size_t> Receive(int, std::span<uint8_t>, sockaddr_in*,
+                              const std::function<uint64_t()>&, uint64_t&) {
+  return std::nullopt;
+}
+
+size_t ReceiveBatch(int, std::span<Datagram>,
+                    const std::function<uint64_t()>&) {
+  return 0;
+}
+
+bool Send(int, std::span<const uint8_t>, const sockaddr_in*) { return false; }
+
+SendBatchResult SendBatch(int, std::span<const Datagram>) { return {}; }
+
+std::optional<uint64_t> ReadSendTime(int, uint32_t,
+                                     const std::function<uint64_t()>&) {
+  return std::nullopt;
+}
+
+void ClearErrors(int) {}
+#endif
+
+}  // namespace UdpSocket
+}  // namespace tsp
+}  // namespace wpi
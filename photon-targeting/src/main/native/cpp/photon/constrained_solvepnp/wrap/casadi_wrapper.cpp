@@ -27,133 +27,11 @@
 #include <wpi/math/fmt/Eigen.hpp>
 #include <wpi/util/timestamp.hpp>
 
-#include "../generate/constrained_solvepnp_10_tags_fixed.h"
-#include "../generate/constrained_solvepnp_10_tags_free.h"
-#include "../generate/constrained_solvepnp_1_tags_fixed.h"
-#include "../generate/constrained_solvepnp_1_tags_free.h"
-#include "../generate/constrained_solvepnp_2_tags_fixed.h"
-#include "../generate/constrained_solvepnp_2_tags_free.h"
-#include "../generate/constrained_solvepnp_3_tags_fixed.h"
-#include "../generate/constrained_solvepnp_3_tags_free.h"
-#include "../generate/constrained_solvepnp_4_tags_fixed.h"
-#include "../generate/constrained_solvepnp_4_tags_free.h"
-#include "../generate/constrained_solvepnp_5_tags_fixed.h"
-#include "../generate/constrained_solvepnp_5_tags_free.h"
-#include "../generate/constrained_solvepnp_6_tags_fixed.h"
-#include "../generate/constrained_solvepnp_6_tags_free.h"
-#include "../generate/constrained_solvepnp_7_tags_fixed.h"
-#include "../generate/constrained_solvepnp_7_tags_free.h"
-#include "../generate/constrained_solvepnp_8_tags_fixed.h"
-#include "../generate/constrained_solvepnp_8_tags_free.h"
-#include "../generate/constrained_solvepnp_9_tags_fixed.h"
-#include "../generate/constrained_solvepnp_9_tags_free.h"
+#include "problem.h"
 #include "wpi/nt/ntcore_cpp.hpp"
 
 constexpr bool VERBOSE = false;
 
-struct Problem {
-  int numTags;
-  bool headingFree;
-  int (*calc_J)(const casadi_real** arg, casadi_real** res, casadi_int* iw,
-                casadi_real* w, int mem);
-  int (*calc_gradJ)(const casadi_real** arg, casadi_real** res, casadi_int* iw,
-                    casadi_real* w, int mem);
-  int (*calc_hessJ)(const casadi_real** arg, casadi_real** res, casadi_int* iw,
-                    casadi_real* w, int mem);
-};
-
-static std::optional<Problem> createProblem(int numTags, bool heading_free) {
-#define MAKE_P(tags, suffix)                                         \
-  Problem{tags, heading_free, calc_J_##tags##_tags_heading_##suffix, \
-          calc_gradJ_##tags##_tags_heading_##suffix,                 \
-          calc_hessJ_##tags##_tags_heading_##suffix}
-#define MAKE_CASE(n) \
-  case n:            \
-    return heading_free ? MAKE_P(n, free) : MAKE_P(n, fixed);
-  switch (numTags) {
-    MAKE_CASE(1)
-    MAKE_CASE(2)
-    MAKE_CASE(3)
-    MAKE_CASE(4)
-    MAKE_CASE(5)
-    MAKE_CASE(6)
-    MAKE_CASE(7)
-    MAKE_CASE(8)
-    MAKE_CASE(9)
-    MAKE_CASE(10)
-    // TODO include more cases here
-    default:
-      return std::nullopt;
-  }
-#undef MAKE_P
-#undef MAKE_CASE
-}
-
-template <int nState>
-struct ProblemState {
-  // Note that we use the full state vector regardless of if we optimize for it,
-  // as we need to remember robot heading
-  using FullStateMat = Eigen::Matrix<casadi_real, 3, 1, Eigen::ColMajor>;
-  using StateMat = Eigen::Matrix<casadi_real, nState, 1, Eigen::ColMajor>;
-  using GradientMat = Eigen::Matrix<casadi_real, nState, 1>;
-  using HessianMat =
-      Eigen::Matrix<casadi_real, nState, nState, Eigen::ColMajor>;
-
-  // Parameters held constant through optimization
-  Eigen::Matrix<casadi_real, 4, 4, Eigen::ColMajor> robot2camera;
-  Eigen::Matrix<casadi_real, 4, Eigen::Dynamic, Eigen::ColMajor> field2points;
-  Eigen::Matrix<casadi_real, 2, Eigen::Dynamic, Eigen::ColMajor>
-      point_observations;
-  constrained_solvepnp::CameraCalibration cameraCal;
-
-  // our Problem with function pointers
-  Problem problemSelected;
-
-  // Measurements from external gyro
-  casadi_real gyro_θ;
-  casadi_real gyro_error_scale_fac;
-
-#define MAKE_ARGV(x)                                      \
-  const casadi_real* argv[] = {&x[0],                     \
-                               &x[1],                     \
-                               &x[2],                     \
-                               robot2camera.data(),       \
-                               field2points.data(),       \
-                               point_observations.data(), \
-                               &gyro_θ,                   \
-                               &gyro_error_scale_fac}
-
-  // helpers
-  inline casadi_real calculateJ(FullStateMat x) {
-    MAKE_ARGV(x);
-    casadi_real J;
-    casadi_real* j_out[] = {&J};
-    if (problemSelected.calc_J(argv, j_out, NULL, NULL, 0)) {
-      throw std::runtime_error("Failure calculating J!");
-    }
-    return J;
-  }
-  inline GradientMat calculateGradJ(FullStateMat x) {
-    MAKE_ARGV(x);
-    GradientMat g;
-    casadi_real* grad_j_out[] = {g.data()};
-    if (problemSelected.calc_gradJ(argv, grad_j_out, 0, 0, 0)) {
-      throw std::runtime_error("Failure calculating gradJ!");
-    }
-    return g;
-  }
-  inline HessianMat calculateHessJ(FullStateMat x) {
-    MAKE_ARGV(x);
-    HessianMat H;
-    casadi_real* hess_j_out[] = {H.data()};
-    if (problemSelected.calc_hessJ(argv, hess_j_out, 0, 0, 0)) {
-      throw std::runtime_error("Failure calculating hessJ!");
-    }
-    return H;
-  }
-#undef MAKE_ARGV
-};
-
 wpi::util::expected<constrained_solvepnp::RobotStateMat, slp::ExitStatus>
 constrained_solvepnp::do_optimization(
     bool heading_free, int nTags,
@@ -0,0 +1,444 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "photon/constrained_solvepnp/wrap/sliding_window_solver.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Cholesky>
+#include <Eigen/Core>
+
+#include "problem.h"
+
+using namespace constrained_solvepnp;
+
+namespace {
+using Mat3 = Eigen::Matrix<casadi_real, 3, 3>;
+using DynMat = Eigen::Matrix<casadi_real, Eigen::Dynamic, Eigen::Dynamic>;
+using DynVec = Eigen::Matrix<casadi_real, Eigen::Dynamic, 1>;
+
+constexpr double ERROR_TOL = 1e-4;
+constexpr double STEP_TOL = 1e-9;
+constexpr int MAX_ITERATIONS = 100;
+
+double wrapAngle(double θ) {
+  return std::remainder(θ, 2.0 * std::numbers::pi);
+}
+
+/**
+ * Odometry residual between two consecutive poses and its Jacobians. The
+ * translation part is expressed in the earlier pose's robot frame.
+ */
+struct OdometryResidual {
+  RobotStateMat r;
+  Mat3 J_prev;
+  Mat3 J_next;
+};
+
+OdometryResidual odometryResidual(const RobotStateMat& prev,
+                                  const RobotStateMat& next,
+                                  const RobotStateMat& delta) {
+  const double c = std::cos(prev(2));
+  const double s = std::sin(prev(2));
+  const double dx = next(0) - prev(0);
+  const double dy = next(1) - prev(1);
+
+  OdometryResidual res;
+  res.r << c * dx + s * dy - delta(0), -s * dx + c * dy - delta(1),
+      wrapAngle(next(2) - prev(2) - delta(2));
+
+  // ∂/∂prev of Rᵀ(θ_prev)(p_next - p_prev)
+  // clang-format off
+  res.J_prev <<
+    -c, -s, -s * dx + c * dy,
+     s, -c, -c * dx - s * dy,
+     0,  0, -1;
+  res.J_next <<
+     c,  s, 0,
+    -s,  c, 0,
+     0,  0, 1;
+  // clang-format on
+  return res;
+}
+
+RobotStateMat composeOdometry(const RobotStateMat& prev,
+                              const RobotStateMat& delta) {
+  const double c = std::cos(prev(2));
+  const double s = std::sin(prev(2));
+  return RobotStateMat{prev(0) + c * delta(0) - s * delta(1),
+                       prev(1) + s * delta(0) + c * delta(1),
+                       prev(2) + delta(2)};
+}
+
+RobotStateMat stateDifference(const RobotStateMat& a, const RobotStateMat& b) {
+  RobotStateMat d = a - b;
+  d(2) = wrapAngle(d(2));
+  return d;
+}
+}  // namespace
+
+struct SlidingWindowSolver::Frame {
+  // Empty for odometry-only frames
+  std::optional<ProblemState<3>> problem;
+  // Weight applied to this frame's reprojection cost
+  double scale;
+  // Odometry from the previous frame to this one. Unused for the oldest frame.
+  RobotStateMat odometryDelta;
+  RobotStateMat x;
+};
+
+/**
+ * Quadratic prior left behind by marginalization:
+ * ½(x - x̄)ᵀS(x - x̄) + bᵀ(x - x̄), linearized about x̄.
+ */
+struct SlidingWindowSolver::Prior {
+  RobotStateMat x̄;
+  Mat3 S;
+  RobotStateMat b;
+
+  double cost(const RobotStateMat& x) const {
+    RobotStateMat d = stateDifference(x, x̄);
+    return 0.5 * d.dot(S * d) + b.dot(d);
+  }
+  RobotStateMat gradient(const RobotStateMat& x) const {
+    return S * stateDifference(x, x̄) + b;
+  }
+};
+
+SlidingWindowSolver::SlidingWindowSolver(int windowSize, double pixelStdDev,
+                                         RobotStateMat odometryStdDevs)
+    : m_windowSize{std::max(windowSize, 1)},
+      m_pixelVariance{pixelStdDev * pixelStdDev},
+      m_odometryWeights{
+          odometryStdDevs.array().square().inverse().matrix()} {}
+
+SlidingWindowSolver::~SlidingWindowSolver() = default;
+SlidingWindowSolver::SlidingWindowSolver(SlidingWindowSolver&&) = default;
+SlidingWindowSolver& SlidingWindowSolver::operator=(SlidingWindowSolver&&) =
+    default;
+
+void SlidingWindowSolver::reset() {
+  m_frames.clear();
+  m_prior.reset();
+  m_δ = 1e-4 * 2.0;
+}
+
+int SlidingWindowSolver::size() const {
+  return static_cast<int>(m_frames.size());
+}
+
+std::optional<RobotStateMat> SlidingWindowSolver::latest_estimate() const {
+  if (m_frames.empty()) {
+    return std::nullopt;
+  }
+  return m_frames.back()->x;
+}
+
+std::vector<RobotStateMat> SlidingWindowSolver::window_states() const {
+  std::vector<RobotStateMat> ret;
+  ret.reserve(m_frames.size());
+  for (const auto& frame : m_frames) {
+    ret.push_back(frame->x);
+  }
+  return ret;
+}
+
+wpi::util::expected<RobotStateMat, slp::ExitStatus>
+SlidingWindowSolver::add_frame(FrameObservation obs,
+                               RobotStateMat odometryDelta,
+                               RobotStateMat x_guess) {
+  auto frame = std::make_unique<Frame>();
+  frame->odometryDelta = odometryDelta;
+  frame->scale = obs.cameraCal.fx * obs.cameraCal.fy / m_pixelVariance;
+
+  // Observations we can't build a problem for, e.g. more tags than we have
+  // generated code for
+  bool rejected = false;
+  if (obs.nTags > 0) {
+    std::optional<Problem> problemOpt;
+    if (obs.field2points.cols() == (obs.nTags * 4) &&
+        obs.point_observations.cols() == (obs.nTags * 4)) {
+      problemOpt = createProblem(obs.nTags, obs.heading_free);
+    }
+    rejected = !problemOpt;
+
+    if (problemOpt) {
+      // rescale observations to homogenous pixel coordinates
+      auto& obsPts = obs.point_observations;
+      obsPts.row(0).array() =
+          (obsPts.row(0).array() - obs.cameraCal.cx) / obs.cameraCal.fx;
+      obsPts.row(1).array() =
+          (obsPts.row(1).array() - obs.cameraCal.cy) / obs.cameraCal.fy;
+
+      frame->problem.emplace(ProblemState<3>{
+          obs.robot2camera, std::move(obs.field2points), std::move(obsPts),
+          obs.cameraCal, *problemOpt, obs.gyroθ, obs.gyroErrorScaleFac});
+    }
+  }
+
+  if (m_frames.empty()) {
+    if (rejected) {
+      return wpi::util::unexpected{slp::ExitStatus::NONFINITE_INITIAL_GUESS};
+    }
+    frame->x = x_guess;
+  } else {
+    // Seed from odometry, composed onto the latest estimate
+    frame->x = composeOdometry(m_frames.back()->x, odometryDelta);
+  }
+
+  if (rejected) {
+    // Keep the frame as odometry-only so later deltas still chain. Its zero
+    // odometry residual leaves the rest of the window at its optimum, so
+    // there's nothing to re-solve.
+    m_frames.push_back(std::move(frame));
+    if (static_cast<int>(m_frames.size()) > m_windowSize) {
+      marginalize_oldest();
+    }
+    return wpi::util::unexpected{slp::ExitStatus::NONFINITE_INITIAL_GUESS};
+  }
+
+  std::vector<RobotStateMat> saved = window_states();
+  m_frames.push_back(std::move(frame));
+
+  if (auto result = solve(); !result) {
+    if (m_frames.size() == 1) {
+      m_frames.clear();
+      return wpi::util::unexpected{result.error()};
+    }
+
+    // Keep the frame's odometry so later deltas still chain, but drop its
+    // observations. The previous solution plus the odometry prediction is
+    // already optimal for that window.
+    for (size_t i = 0; i < saved.size(); i++) {
+      m_frames[i]->x = saved[i];
+    }
+    auto& newest = *m_frames.back();
+    newest.problem.reset();
+    newest.x = composeOdometry(saved.back(), odometryDelta);
+
+    if (static_cast<int>(m_frames.size()) > m_windowSize) {
+      marginalize_oldest();
+    }
+    return wpi::util::unexpected{result.error()};
+  }
+
+  if (static_cast<int>(m_frames.size()) > m_windowSize) {
+    marginalize_oldest();
+  }
+
+  return m_frames.back()->x;
+}
+
+double SlidingWindowSolver::cost(const std::vector<RobotStateMat>& x) const {
+  double J = 0.0;
+  if (m_prior) {
+    J += m_prior->cost(x[0]);
+  }
+  for (size_t k = 0; k < m_frames.size(); k++) {
+    auto& frame = *m_frames[k];
+    if (frame.problem) {
+      J += frame.scale * frame.problem->calculateJ(x[k]);
+    }
+    if (k > 0) {
+      auto odom = odometryResidual(x[k - 1], x[k], frame.odometryDelta);
+      J += odom.r.dot(m_odometryWeights.asDiagonal() * odom.r);
+    }
+  }
+  return J;
+}
+
+wpi::util::expected<void, slp::ExitStatus> SlidingWindowSolver::solve() {
+  const int K = static_cast<int>(m_frames.size());
+  const int n = 3 * K;
+
+  std::vector<RobotStateMat> x = window_states();
+
+  DynMat H(n, n);
+  DynVec g(n);
+
+  // Same regularized Newton iteration as do_optimization, over all of the
+  // poses in the window at once
+  for (int iter = 0; iter < MAX_ITERATIONS; iter++) {
+    for (const auto& x_k : x) {
+      if (x_k.lpNorm<Eigen::Infinity>() > 1e20 || !x_k.allFinite()) {
+        return wpi::util::unexpected{slp::ExitStatus::DIVERGING_ITERATES};
+      }
+    }
+
+    H.setZero();
+    g.setZero();
+
+    if (m_prior) {
+      g.segment<3>(0) += m_prior->gradient(x[0]);
+      H.block<3, 3>(0, 0) += m_prior->S;
+    }
+    for (int k = 0; k < K; k++) {
+      auto& frame = *m_frames[k];
+      if (frame.problem) {
+        g.segment<3>(3 * k) +=
+            frame.scale * frame.problem->calculateGradJ(x[k]);
+        H.block<3, 3>(3 * k, 3 * k) +=
+            frame.scale * frame.problem->calculateHessJ(x[k]);
+      }
+      if (k > 0) {
+        // Gauss-Newton approximation for rᵀWr
+        auto odom = odometryResidual(x[k - 1], x[k], frame.odometryDelta);
+        auto W = m_odometryWeights.asDiagonal();
+        const int i = 3 * (k - 1);
+        const int j = 3 * k;
+        g.segment<3>(i) += 2.0 * odom.J_prev.transpose() * (W * odom.r);
+        g.segment<3>(j) += 2.0 * odom.J_next.transpose() * (W * odom.r);
+        H.block<3, 3>(i, i) += 2.0 * odom.J_prev.transpose() * W * odom.J_prev;
+        H.block<3, 3>(i, j) += 2.0 * odom.J_prev.transpose() * W * odom.J_next;
+        H.block<3, 3>(j, i) += 2.0 * odom.J_next.transpose() * W * odom.J_prev;
+        H.block<3, 3>(j, j) += 2.0 * odom.J_next.transpose() * W * odom.J_next;
+      }
+    }
+
+    if (g.lpNorm<Eigen::Infinity>() < ERROR_TOL) {
+      break;
+    }
+
+    // Regularize until H is positive definite, starting from half of the last
+    // δ we needed so it can trend back down
+    auto H_ldlt = H.ldlt();
+    if (H_ldlt.info() != Eigen::Success) {
+      return wpi::util::unexpected{slp::ExitStatus::LOCALLY_INFEASIBLE};
+    }
+    if ((H_ldlt.vectorD().array() <= 0.0).any()) {
+      m_δ /= 2.0;
+      while (true) {
+        H_ldlt.compute(H + DynMat::Identity(n, n) * m_δ);
+        if (H_ldlt.info() != Eigen::Success) {
+          return wpi::util::unexpected{slp::ExitStatus::LOCALLY_INFEASIBLE};
+        }
+        if (!(H_ldlt.vectorD().array() <= 0.0).any()) {
+          break;
+        }
+        m_δ *= 10.0;
+        if (m_δ > 1e20) {
+          return wpi::util::unexpected{slp::ExitStatus::LOCALLY_INFEASIBLE};
+        }
+      }
+    }
+
+    DynVec p = H_ldlt.solve(-g);
+
+    // Backtrack until the step decreases the total cost
+    const double old_cost = cost(x);
+    double alpha = 1.0;
+    std::vector<RobotStateMat> trial_x = x;
+    bool stalled = false;
+    while (true) {
+      for (int k = 0; k < K; k++) {
+        trial_x[k] = x[k] + alpha * p.segment<3>(3 * k);
+      }
+      double new_cost = cost(trial_x);
+      if (std::isfinite(new_cost) && new_cost < old_cost) {
+        x = trial_x;
+        break;
+      }
+      alpha *= 0.5;
+
+      // Safety factor for the minimal step size
+      constexpr double α_min_frac = 0.05;
+      constexpr double γConstraint = 1e-5;
+      if (alpha < α_min_frac * γConstraint) {
+        // Can't make progress from here. If we're already at a stationary
+        // point to within numerical noise, accept it.
+        if ((alpha * p).lpNorm<Eigen::Infinity>() < STEP_TOL) {
+          stalled = true;
+          break;
+        }
+        return wpi::util::unexpected{slp::ExitStatus::LOCALLY_INFEASIBLE};
+      }
+    }
+
+    if (stalled || (alpha * p).lpNorm<Eigen::Infinity>() < STEP_TOL) {
+      break;
+    }
+  }
+
+  for (int k = 0; k < K; k++) {
+    m_frames[k]->x = x[k];
+  }
+  return {};
+}
+
+void SlidingWindowSolver::marginalize_oldest() {
+  // Linearize every term touching the oldest pose x₀ about the current
+  // solution, then take the Schur complement onto x₁
+  const Frame& f0 = *m_frames[0];
+  const Frame& f1 = *m_frames[1];
+
+  Mat3 H00 = Mat3::Zero();
+  Mat3 H01;
+  Mat3 H11;
+  RobotStateMat g0 = RobotStateMat::Zero();
+  RobotStateMat g1;
+
+  if (m_prior) {
+    g0 += m_prior->gradient(f0.x);
+    H00 += m_prior->S;
+  }
+  if (f0.problem) {
+    g0 += f0.scale * f0.problem->calculateGradJ(f0.x);
+    H00 += f0.scale * f0.problem->calculateHessJ(f0.x);
+  }
+
+  auto odom = odometryResidual(f0.x, f1.x, f1.odometryDelta);
+  auto W = m_odometryWeights.asDiagonal();
+  g0 += 2.0 * odom.J_prev.transpose() * (W * odom.r);
+  g1 = 2.0 * odom.J_next.transpose() * (W * odom.r);
+  H00 += 2.0 * odom.J_prev.transpose() * W * odom.J_prev;
+  H01 = 2.0 * odom.J_prev.transpose() * W * odom.J_next;
+  H11 = 2.0 * odom.J_next.transpose() * W * odom.J_next;
+
+  // The reprojection Hessian is exact and can be indefinite away from the
+  // optimum; regularize the same way the solver does, up to the same limit
+  auto isPositiveDefinite = [](const Eigen::LDLT<Mat3>& ldlt) {
+    return ldlt.info() == Eigen::Success &&
+           !(ldlt.vectorD().array() <= 0.0).any();
+  };
+  auto H00_ldlt = H00.ldlt();
+  for (double δ = 1e-6;
+       !isPositiveDefinite(H00_ldlt) && δ <= 1e20; δ *= 10.0) {
+    H00_ldlt.compute(H00 + Mat3::Identity() * δ);
+  }
+  if (!H00.allFinite() || !g0.allFinite() || !isPositiveDefinite(H00_ldlt)) {
+    // x₀ can't be eliminated cleanly. Dropping its information is better than
+    // leaving a prior that would poison every later solve.
+    m_prior.reset();
+    m_frames.pop_front();
+    return;
+  }
+
+  Mat3 S = H11 - H01.transpose() * H00_ldlt.solve(H01);
+  RobotStateMat b = g1 - H01.transpose() * H00_ldlt.solve(g0);
+
+  auto prior = std::make_unique<Prior>();
+  prior->x̄ = f1.x;
+  prior->S = 0.5 * (S + S.transpose());
+  prior->b = b;
+  m_prior = std::move(prior);
+
+  m_frames.pop_front();
+}
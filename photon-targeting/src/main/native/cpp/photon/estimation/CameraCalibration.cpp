@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "photon/estimation/CameraCalibration.h"
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include <opencv2/imgproc.hpp>
+
+namespace photon {
+
+struct CameraCalibration::Cache {
+  std::mutex mutex;
+  std::unique_ptr<CameraCalibration> pinhole;
+  std::map<std::pair<int, int>, UndistortionMap> maps;
+};
+
+CameraCalibration::CameraCalibration(
+    const CameraProjection::CameraMatrix& cameraMatrix,
+    const CameraProjection::DistortionCoeffs& distCoeffs)
+    : cameraMatrix(cameraMatrix),
+      distCoeffs(distCoeffs),
+      invCameraMatrix(cameraMatrix.inverse()),
+      hasDistortion(!distCoeffs.isZero()),
+      cache(std::make_shared<Cache>()) {
+  cv::eigen2cv(cameraMatrix, cvCameraMatrix);
+  cv::eigen2cv(distCoeffs, cvDistCoeffs);
+}
+
+const CameraCalibration& CameraCalibration::GetPinhole() const {
+  if (!hasDistortion) {
+    return *this;
+  }
+  std::scoped_lock lock{cache->mutex};
+  if (!cache->pinhole) {
+    cache->pinhole = std::make_unique<CameraCalibration>(
+        cameraMatrix, CameraProjection::DistortionCoeffs::Zero());
+  }
+  return *cache->pinhole;
+}
+
+CameraCalibration::UndistortionMap CameraCalibration::GetUndistortionMap(
+    int width, int height) const {
+  if (!hasDistortion) {
+    return {};
+  }
+  std::scoped_lock lock{cache->mutex};
+  auto [it, inserted] = cache->maps.try_emplace(std::pair{width, height});
+  if (!inserted) {
+    return it->second;
+  }
+
+  // cv::initUndistortRectifyMap maps the other way, from an undistorted
+  // output back into a distorted source, so undistort every output pixel
+  // instead. One row at a time keeps the scratch space small.
+  const double fx = cameraMatrix(0, 0);
+  const double fy = cameraMatrix(1, 1);
+  const double cx = cameraMatrix(0, 2);
+  const double cy = cameraMatrix(1, 2);
+  cv::Mat mapX(height, width, CV_32FC1);
+  cv::Mat mapY(height, width, CV_32FC1);
+  Eigen::Matrix2Xd pixels(2, width);
+  Eigen::Matrix2Xd normalized(2, width);
+  pixels.row(0) = Eigen::RowVectorXd::LinSpaced(width, 0, width - 1);
+  for (int y = 0; y < height; y++) {
+    pixels.row(1).setConstant(y);
+    UndistortPoints(pixels, normalized);
+    float* rowX = mapX.ptr<float>(y);
+    float* rowY = mapY.ptr<float>(y);
+    for (int x = 0; x < width; x++) {
+      rowX[x] = static_cast<float>(fx * normalized(0, x) + cx);
+      rowY[x] = static_cast<float>(fy * normalized(1, x) + cy);
+    }
+  }
+  cv::convertMaps(mapX, mapY, it->second.map1, it->second.map2, CV_16SC2);
+  return it->second;
+}
+
+}  // namespace photon
@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "photon/estimation/IPPE.h"
+
+#include <algorithm>
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#include <Eigen/Cholesky>
+#include <Eigen/Geometry>
+#include <Eigen/LU>
+
+namespace photon {
+namespace IPPE {
+
+namespace {
+using Rt = std::pair<Eigen::Matrix3d, Eigen::Vector3d>;
+
+/**
+ * Homography mapping object-plane (x, y) to normalized image coordinates,
+ * scaled so H(2, 2) = 1.
+ */
+std::optional<Eigen::Matrix3d> QuadHomography(
+    const Eigen::Matrix<double, 2, 4>& plane,
+    const Eigen::Matrix<double, 2, 4>& image) {
+  Eigen::Matrix<double, 8, 8> A;
+  Eigen::Matrix<double, 8, 1> b;
+  for (int i = 0; i < 4; i++) {
+    const double x = plane(0, i);
+    const double y = plane(1, i);
+    const double u = image(0, i);
+    const double v = image(1, i);
+    A.row(2 * i) << x, y, 1, 0, 0, 0, -u * x, -u * y;
+    A.row(2 * i + 1) << 0, 0, 0, x, y, 1, -v * x, -v * y;
+    b(2 * i) = u;
+    b(2 * i + 1) = v;
+  }
+
+  auto lu = A.fullPivLu();
+  if (!lu.isInvertible()) {
+    return std::nullopt;
+  }
+  Eigen::Matrix<double, 8, 1> h = lu.solve(b);
+
+  Eigen::Matrix3d H;
+  H << h(0), h(1), h(2), h(3), h(4), h(5), h(6), h(7), 1.0;
+  return H;
+}
+
+/**
+ * The two rotations consistent with the homography's Jacobian J at the
+ * origin, which projects to the normalized point v.
+ */
+std::optional<std::pair<Eigen::Matrix3d, Eigen::Matrix3d>> IPPERotations(
+    const Eigen::Matrix2d& J, const Eigen::Vector2d& v) {
+  // Rv rotates the optical axis onto the ray through v
+  Eigen::Matrix3d Rv = Eigen::Matrix3d::Identity();
+  const double t = v.norm();
+  if (t > 0) {
+    const double s = std::sqrt(t * t + 1);
+    const double cosθ = 1 / s;
+    const double sinθ = std::sqrt(1 - 1 / (s * s));
+    const Eigen::Vector2d k = v / t;
+    Rv.topLeftCorner<2, 2>() =
+        Eigen::Matrix2d::Identity() + (cosθ - 1) * k * k.transpose();
+    Rv.block<2, 1>(0, 2) = k * sinθ;
+    Rv.block<1, 2>(2, 0) = -k.transpose() * sinθ;
+    Rv(2, 2) = cosθ;
+  }
+
+  // Express J in the rotated frame, where the closest rotation has a closed
+  // form from A's largest singular value γ
+  Eigen::Matrix2d B = Rv.topLeftCorner<2, 2>() - v * Rv.block<1, 2>(2, 0);
+  const double det = B.determinant();
+  if (det == 0 || !std::isfinite(det)) {
+    return std::nullopt;
+  }
+  Eigen::Matrix2d A = B.inverse() * J;
+  Eigen::Matrix2d AtA = A.transpose() * A;
+  const double γ = std::sqrt(
+      0.5 * (AtA(0, 0) + AtA(1, 1) +
+             std::sqrt((AtA(0, 0) - AtA(1, 1)) * (AtA(0, 0) - AtA(1, 1)) +
+                       4.0 * AtA(0, 1) * AtA(0, 1))));
+  if (!(γ > 0)) {
+    return std::nullopt;
+  }
+  Eigen::Matrix2d Rtilde = A / γ;
+
+  const double b0 = std::sqrt(std::max(0.0, 1 - Rtilde.col(0).squaredNorm()));
+  double b1 = std::sqrt(std::max(0.0, 1 - Rtilde.col(1).squaredNorm()));
+  if (Rtilde.col(0).dot(Rtilde.col(1)) > 0) {
+    b1 = -b1;
+  }
+
+  auto complete = [&](double sign) {
+    Eigen::Vector3d c0{Rtilde(0, 0), Rtilde(1, 0), sign * b0};
+    Eigen::Vector3d c1{Rtilde(0, 1), Rtilde(1, 1), sign * b1};
+    Eigen::Matrix3d M;
+    M << c0, c1, c0.cross(c1);
+    return Eigen::Matrix3d{Rv * M};
+  };
+  return std::pair{complete(1), complete(-1)};
+}
+
+/** Least-squares translation given a rotation, in normalized coordinates. */
+Eigen::Vector3d IPPETranslation(const Eigen::Matrix<double, 2, 4>& plane,
+                                const Eigen::Matrix<double, 2, 4>& image,
+                                const Eigen::Matrix3d& R) {
+  Eigen::Matrix3d AtA = Eigen::Matrix3d::Zero();
+  Eigen::Vector3d Atb = Eigen::Vector3d::Zero();
+  for (int i = 0; i < 4; i++) {
+    Eigen::Vector3d p = R.leftCols<2>() * plane.col(i);
+    const double u = image(0, i);
+    const double v = image(1, i);
+    // tx - u tz = u pz - px, ty - v tz = v pz - py
+    Eigen::Vector3d a0{1, 0, -u};
+    Eigen::Vector3d a1{0, 1, -v};
+    AtA += a0 * a0.transpose() + a1 * a1.transpose();
+    Atb += a0 * (u * p.z() - p.x()) + a1 * (v * p.z() - p.y());
+  }
+  return AtA.ldlt().solve(Atb);
+}
+
+/** Both IPPE poses for a quad whose corners are already undistorted. */
+std::optional<std::pair<Rt, Rt>> SolveNormalized(
+    const ObjectQuad& objectPoints, const Eigen::Matrix<double, 2, 4>& image) {
+  // IPPE works about the plane's origin, so center the model first and shift
+  // the translation back afterwards
+  const Eigen::Vector3d centroid = objectPoints.rowwise().mean();
+  Eigen::Matrix<double, 2, 4> plane =
+      objectPoints.topRows<2>().colwise() - centroid.head<2>();
+
+  auto H = QuadHomography(plane, image);
+  if (!H) {
+    return std::nullopt;
+  }
+  const Eigen::Matrix3d& h = *H;
+  Eigen::Matrix2d J;
+  J << h(0, 0) - h(2, 0) * h(0, 2), h(0, 1) - h(2, 1) * h(0, 2),
+      h(1, 0) - h(2, 0) * h(1, 2), h(1, 1) - h(2, 1) * h(1, 2);
+
+  auto rotations = IPPERotations(J, Eigen::Vector2d{h(0, 2), h(1, 2)});
+  if (!rotations) {
+    return std::nullopt;
+  }
+
+  auto solve = [&](const Eigen::Matrix3d& R) {
+    Eigen::Vector3d t = IPPETranslation(plane, image, R);
+    return Rt{R, t - R * centroid};
+  };
+  auto first = solve(rotations->first);
+  auto second = solve(rotations->second);
+  if (!first.first.allFinite() || !first.second.allFinite() ||
+      !second.first.allFinite() || !second.second.allFinite()) {
+    return std::nullopt;
+  }
+  return std::pair{first, second};
+}
+
+double RmsError(const Eigen::Matrix<double, 2, 4>& projected,
+                const ImageQuad& observed) {
+  return std::sqrt((projected - observed).squaredNorm() / 8.0);
+}
+}  // namespace
+
+std::optional<QuadSolutions> SolveQuad(
+    const CameraProjection::CameraMatrix& cameraMatrix,
+    const CameraProjection::DistortionCoeffs& distCoeffs,
+    const ObjectQuad& objectPoints, const ImageQuad& imagePoints) {
+  std::optional<QuadSolutions> solution;
+  SolveQuadBatch(cameraMatrix, distCoeffs, {&objectPoints, 1},
+                 {&imagePoints, 1}, {&solution, 1});
+  return solution;
+}
+
+void SolveQuadBatch(const CameraProjection::CameraMatrix& cameraMatrix,
+                    const CameraProjection::DistortionCoeffs& distCoeffs,
+                    std::span<const ObjectQuad> objectPoints,
+                    std::span<const ImageQuad> imagePoints,
+                    std::span<std::optional<QuadSolutions>> solutions) {
+  const size_t n = std::min(imagePoints.size(), solutions.size());
+  if (n == 0 || objectPoints.empty()) {
+    return;
+  }
+  auto model = [&](size_t i) -> const ObjectQuad& {
+    return objectPoints.size() == 1 ? objectPoints[0] : objectPoints[i];
+  };
+
+  // ImageQuad is a fixed-size column major 2x4, so a span of them is already
+  // a contiguous 2x4n matrix
+  Eigen::Map<const Eigen::Matrix2Xd> pixels{imagePoints.data()->data(), 2,
+                                            static_cast<Eigen::Index>(4 * n)};
+  Eigen::Matrix2Xd normalized(2, 4 * n);
+  CameraProjection::UndistortPoints(cameraMatrix, distCoeffs, pixels,
+                                    normalized);
+
+  // Both candidate poses for each quad, then reproject them all at once
+  Eigen::Matrix3Xd cameraPoints(3, 8 * n);
+  std::vector<std::optional<std::pair<Rt, Rt>>> candidates(n);
+  for (size_t i = 0; i < n; i++) {
+    candidates[i] = SolveNormalized(model(i), normalized.middleCols<4>(4 * i));
+    if (!candidates[i]) {
+      cameraPoints.middleCols<8>(8 * i).setZero();
+      continue;
+    }
+    const auto& [first, second] = *candidates[i];
+    cameraPoints.middleCols<4>(8 * i) =
+        (first.first * model(i)).colwise() + first.second;
+    cameraPoints.middleCols<4>(8 * i + 4) =
+        (second.first * model(i)).colwise() + second.second;
+  }
+
+  Eigen::Matrix2Xd reprojected(2, 8 * n);
+  CameraProjection::ProjectCameraPoints(cameraMatrix, distCoeffs,
+                                        cameraPoints, reprojected);
+
+  for (size_t i = 0; i < n; i++) {
+    if (!candidates[i]) {
+      solutions[i] = std::nullopt;
+      continue;
+    }
+    const auto& [first, second] = *candidates[i];
+    Solution a{first.first, first.second,
+               RmsError(reprojected.middleCols<4>(8 * i), imagePoints[i])};
+    Solution b{second.first, second.second,
+               RmsError(reprojected.middleCols<4>(8 * i + 4), imagePoints[i])};
+    if (!std::isfinite(a.reprojectionError) ||
+        !std::isfinite(b.reprojectionError)) {
+      solutions[i] = std::nullopt;
+    } else if (a.reprojectionError <= b.reprojectionError) {
+      solutions[i] = QuadSolutions{a, b};
+    } else {
+      solutions[i] = QuadSolutions{b, a};
+    }
+  }
+}
+
+}  // namespace IPPE
+}  // namespace photon
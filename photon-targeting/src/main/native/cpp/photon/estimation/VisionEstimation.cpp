@@ -40,8 +40,7 @@ std::vector<wpi::apriltag::AprilTag> GetVisibleLayoutTags(
 }
 
 std::optional<PnpResult> EstimateCamPosePNP(
-    const Eigen::Matrix<double, 3, 3>& cameraMatrix,
-    const Eigen::Matrix<double, 8, 1>& distCoeffs,
+    const CameraCalibration& calibration,
     const std::vector<PhotonTrackedTarget>& visTags,
     const wpi::apriltag::AprilTagFieldLayout& layout,
     const TargetModel& tagModel) {
@@ -69,8 +68,8 @@ std::optional<PnpResult> EstimateCamPosePNP(
   std::vector<cv::Point2f> points = OpenCVHelp::CornersToPoints(corners);
 
   if (knownTags.size() == 1) {
-    auto camToTag = OpenCVHelp::SolvePNP_Square(cameraMatrix, distCoeffs,
-                                                tagModel.GetVertices(), points);
+    auto camToTag = OpenCVHelp::SolvePNP_Square(
+        calibration, tagModel.GetVertices(), points);
     if (!camToTag) {
       return PnpResult{};
     }
@@ -94,8 +93,7 @@ std::optional<PnpResult> EstimateCamPosePNP(
       auto verts = tagModel.GetFieldVertices(tag.pose);
       objectTrls.insert(objectTrls.end(), verts.begin(), verts.end());
     }
-    auto ret = OpenCVHelp::SolvePNP_SQPNP(cameraMatrix, distCoeffs, objectTrls,
-                                          points);
+    auto ret = OpenCVHelp::SolvePNP_SQPNP(calibration, objectTrls, points);
     if (ret) {
       // Invert best/alt transforms
       ret->best = ret->best.Inverse();
@@ -106,9 +104,18 @@ std::optional<PnpResult> EstimateCamPosePNP(
   }
 }
 
-std::optional<photon::PnpResult> EstimateRobotPoseConstrainedSolvePNP(
+std::optional<PnpResult> EstimateCamPosePNP(
     const Eigen::Matrix<double, 3, 3>& cameraMatrix,
     const Eigen::Matrix<double, 8, 1>& distCoeffs,
+    const std::vector<PhotonTrackedTarget>& visTags,
+    const wpi::apriltag::AprilTagFieldLayout& layout,
+    const TargetModel& tagModel) {
+  return EstimateCamPosePNP(CameraCalibration{cameraMatrix, distCoeffs},
+                            visTags, layout, tagModel);
+}
+
+std::optional<photon::PnpResult> EstimateRobotPoseConstrainedSolvePNP(
+    const CameraCalibration& calibration,
     const std::vector<photon::PhotonTrackedTarget>& visTags,
     const wpi::math::Transform3d& robot2Camera,
     const wpi::math::Pose3d& robotPoseSeed,
@@ -139,12 +146,10 @@ std::optional<photon::PnpResult> EstimateRobotPoseConstrainedSolvePNP(
   std::vector<cv::Point2f> points =
       photon::OpenCVHelp::CornersToPoints(corners);
 
-  cv::Mat cameraMat(cameraMatrix.rows(), cameraMatrix.cols(), CV_64F);
-  cv::eigen2cv(cameraMatrix, cameraMat);
-  cv::Mat distCoeffsMat(distCoeffs.rows(), distCoeffs.cols(), CV_64F);
-  cv::eigen2cv(distCoeffs, distCoeffsMat);
-
-  cv::undistortImagePoints(points, points, cameraMat, distCoeffsMat);
+  if (calibration.HasDistortion()) {
+    cv::undistortImagePoints(points, points, calibration.GetCvCameraMatrix(),
+                             calibration.GetCvDistCoeffs());
+  }
 
   Eigen::Matrix4d robotToCameraBase{
       (Eigen::Matrix4d() << 0, 0, 1, 0, -1, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, 1)
@@ -180,6 +185,7 @@ std::optional<photon::PnpResult> EstimateRobotPoseConstrainedSolvePNP(
 
   wpi::math::Pose2d guess2 = robotPoseSeed.ToPose2d();
 
+  const auto& cameraMatrix = calibration.GetCameraMatrix();
   constrained_solvepnp::CameraCalibration cameraCal{
       cameraMatrix(0, 0),
       cameraMatrix(1, 1),
@@ -211,5 +217,20 @@ std::optional<photon::PnpResult> EstimateRobotPoseConstrainedSolvePNP(
   }
 }
 
+std::optional<photon::PnpResult> EstimateRobotPoseConstrainedSolvePNP(
+    const Eigen::Matrix<double, 3, 3>& cameraMatrix,
+    const Eigen::Matrix<double, 8, 1>& distCoeffs,
+    const std::vector<photon::PhotonTrackedTarget>& visTags,
+    const wpi::math::Transform3d& robot2Camera,
+    const wpi::math::Pose3d& robotPoseSeed,
+    const wpi::apriltag::AprilTagFieldLayout& layout,
+    const photon::TargetModel& tagModel, bool headingFree,
+    wpi::math::Rotation2d gyroTheta, double gyroErrorScaleFac) {
+  return EstimateRobotPoseConstrainedSolvePNP(
+      CameraCalibration{cameraMatrix, distCoeffs}, visTags, robot2Camera,
+      robotPoseSeed, layout, tagModel, headingFree, gyroTheta,
+      gyroErrorScaleFac);
+}
+
 }  // namespace VisionEstimation
 }  // namespace photon
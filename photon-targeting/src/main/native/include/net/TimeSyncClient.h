@@ -17,16 +17,18 @@
 
 #pragma once
 
+#include <array>
 #include <chrono>
 #include <cstdlib>
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <span>
 #include <string>
 
-#include <wpi/math/filter/MedianFilter.hpp>
 #include <wpi/net/EventLoopRunner.hpp>
 #include <wpi/net/uv/Buffer.hpp>
+#include <wpi/net/uv/Poll.hpp>
 #include <wpi/net/uv/Timer.hpp>
 #include <wpi/net/uv/Udp.hpp>
 #include <wpi/util/Logger.hpp>
@@ -39,16 +41,24 @@ namespace tsp {
 class TimeSyncClient {
  public:
   struct Metadata {
+    // Server time minus local time, as of offsetTime
     int64_t offset{0};
+    // Local time the offset was estimated for
+    uint64_t offsetTime{0};
+    // How fast the offset changes, in microseconds per microsecond
+    double drift{0};
     int64_t rtt2{0};
     size_t pingsSent{0};
     size_t pongsReceived{0};
     uint64_t lastPongTime{0};
+    // Whether the kernel stamps pings and pongs, instead of the event loop
+    bool kernelTimestamps{false};
   };
 
  private:
   using SharedUdpPtr = std::shared_ptr<wpi::net::uv::Udp>;
   using SharedTimerPtr = std::shared_ptr<wpi::net::uv::Timer>;
+  using SharedPollPtr = std::shared_ptr<wpi::net::uv::Poll>;
 
   wpi::net::EventLoopRunner m_loopRunner{};
 
@@ -63,32 +73,78 @@ class TimeSyncClient {
 
   std::chrono::milliseconds m_loopDelay;
 
+  // With kernel timestamps, a raw socket polled by libuv stands in for m_udp
+  bool m_kernelTimestamps;
+  SharedPollPtr m_poll;
+  int m_socket{-1};
+  uint32_t m_sendCount{0};
+
   std::mutex m_offsetMutex{};
   Metadata m_metadata{};
 
-  // We only allow the most recent ping to stay alive, so only keep track of it
-  TspPing m_lastPing{};
-
-  // 30s is a reasonable guess
-  wpi::math::MedianFilter<int64_t> m_lastOffsets{30};
+  // Pings still waiting on a pong, identified by their client_time, which the
+  // server echoes back. A new ping doesn't cancel older ones, so a late pong
+  // still counts. Once this many are outstanding, the oldest is given up on.
+  struct InFlightPing {
+    uint64_t clientTime;
+    // When the ping actually left, which the kernel may know better
+    uint64_t sendTime;
+  };
+  static constexpr size_t kMaxInFlight = 8;
+  std::array<InFlightPing, kMaxInFlight> m_inFlight{};
+  size_t m_nextInFlight{0};
+
+  struct OffsetSample {
+    uint64_t time;
+    int64_t offset;
+    int64_t rtt2;
+  };
+  // The most recent samples, oldest overwritten first. 30 pings is a
+  // reasonable guess at how long the offset holds steady.
+  static constexpr size_t kSampleWindow = 30;
+  std::array<OffsetSample, kSampleWindow> m_samples{};
+  size_t m_sampleCount{0};
+  size_t m_nextSample{0};
+  // Crystal oscillators are good to within about 100 ppm, so anything much
+  // past that is a bad fit rather than real drift
+  static constexpr double kMaxDrift = 500e-6;
 
   void Tick();
 
   void UdpCallback(wpi::net::uv::Buffer& buf, size_t nbytes,
                    const sockaddr& sender, unsigned flags);
+  void PollCallback();
+  bool StartKernelTimestamped(wpi::net::uv::Loop& loop,
+                              const sockaddr_in& serverAddr);
+  void ReceivePong(std::span<const uint8_t> data, uint64_t pong_local_time);
 
  public:
+  /**
+   * @param kernelTimestamps Use the times the kernel sent each ping and
+   * received each pong (Linux only), so event loop delays stay out of the
+   * round trip. Falls back to the event loop's time if unsupported.
+   */
   TimeSyncClient(std::string_view server, int remote_port,
-                 std::chrono::milliseconds ping_delay);
+                 std::chrono::milliseconds ping_delay,
+                 bool kernelTimestamps = false);
 
+  // Replace the local clock. Only call this before Start().
+  void SetTimeProvider(std::function<uint64_t()> timeProvider);
   void Start();
   void Stop();
+  // The offset at the current local time
   int64_t GetOffset();
+  // The offset at the given local time, in microseconds, extrapolated from
+  // the last estimate using the measured drift
+  int64_t GetOffset(uint64_t localTime);
   Metadata GetMetadata();
 
   // public for testability
   void UpdateStatistics(uint64_t pong_local_time, wpi::tsp::TspPing ping,
                         wpi::tsp::TspPong pong);
+  void TrackPing(wpi::tsp::TspPing ping) { TrackPing(ping, ping.client_time); }
+  void TrackPing(wpi::tsp::TspPing ping, uint64_t send_time);
+  bool HandlePong(uint64_t pong_local_time, wpi::tsp::TspPong pong);
 };
 
 }  // namespace tsp
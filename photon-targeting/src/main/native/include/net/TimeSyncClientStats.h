@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+namespace wpi {
+namespace tsp {
+
+/**
+ * What a TimeSyncServer knows about one client. Kept apart from the server so
+ * code that only reads these doesn't pull in its networking headers.
+ */
+struct TimeSyncClientStats {
+  // The client's address, as ip:port
+  std::string address;
+  size_t pingsReceived{0};
+  // Pings per second, smoothed over the last several
+  double pingRate{0};
+  // Server time the latest ping arrived
+  uint64_t lastPingTime{0};
+  // Whether the client reports its own view of the link, below
+  bool reportsStats{false};
+  // The client's latest round trip time and offset estimate
+  int64_t rtt2{0};
+  int64_t offset{0};
+};
+
+}  // namespace tsp
+}  // namespace wpi
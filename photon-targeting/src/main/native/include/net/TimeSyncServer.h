@@ -22,18 +22,32 @@
 #include <ctime>
 #include <functional>
 #include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <wpi/net/EventLoopRunner.hpp>
 #include <wpi/net/uv/Buffer.hpp>
+#include <wpi/net/uv/Poll.hpp>
 #include <wpi/net/uv/Udp.hpp>
 #include <wpi/util/Logger.hpp>
 
+#include "TimeSyncClientStats.h"
+#include "TimeSyncStructs.h"
+
 namespace wpi {
 namespace tsp {
 
 class TimeSyncServer {
+ public:
+  using ClientStats = TimeSyncClientStats;
+
+ private:
   using SharedUdpPtr = std::shared_ptr<wpi::net::uv::Udp>;
+  using SharedPollPtr = std::shared_ptr<wpi::net::uv::Poll>;
 
   wpi::net::EventLoopRunner m_loopRunner{};
 
@@ -42,14 +56,58 @@ class TimeSyncServer {
   SharedUdpPtr m_udp;
   int m_port;
 
+  // Where it can, a raw socket polled by libuv stands in for m_udp, so pings
+  // can be answered in batches and, optionally, kernel timestamped
+  bool m_kernelTimestamps;
+  SharedPollPtr m_poll;
+  int m_socket{-1};
+  // Pings and pongs for the raw socket, only allocated if it's used
+  struct Batch;
+  std::unique_ptr<Batch> m_batch;
+
+  struct ClientState {
+    ClientStats stats;
+    // Smoothed time between pings, in microseconds
+    double meanInterval{0};
+  };
+  // Keyed by address and port. Once full, the longest quiet client is
+  // forgotten to make room.
+  static constexpr size_t kMaxClients = 64;
+  std::mutex m_clientsMutex;
+  std::unordered_map<uint64_t, ClientState> m_clients;
+
   std::thread m_listener;
 
  private:
   void UdpCallback(wpi::net::uv::Buffer& buf, size_t nbytes,
                    const sockaddr& sender, unsigned flags);
+  void PollCallback();
+  bool StartBatched(wpi::net::uv::Loop& loop);
+  std::optional<TspPong> HandlePing(std::span<const uint8_t> data,
+                                    uint64_t receive_time,
+                                    const sockaddr_in& sender);
+  void RecordPing(const sockaddr_in& sender, uint64_t receive_time,
+                  const std::optional<TspClientReport>& report);
 
  public:
-  explicit TimeSyncServer(int port = 5810);
+  /**
+   * On Linux, pings are drained and answered in batches, a syscall per batch
+   * rather than a callback and send per ping. Elsewhere each ping goes
+   * through libuv.
+   *
+   * @param port The port to listen for pings on
+   * @param kernelTimestamps Stamp each pong with when the kernel received the
+   * ping (Linux only), so event loop delays don't count against the server.
+   * Falls back to the event loop's time if unsupported.
+   */
+  explicit TimeSyncServer(int port = 5810, bool kernelTimestamps = false);
+  ~TimeSyncServer();
+
+  /**
+   * Replace the clock pongs are stamped with, e.g. to simulate a server
+   * whose clock is offset or drifting. Only call this before Start().
+   */
+  void SetTimeProvider(std::function<uint64_t()> timeProvider);
 
   /**
    * Start listening for pings
@@ -59,6 +117,12 @@ class TimeSyncServer {
    * Stop our loop runner. After stopping, we cannot restart.
    */
   void Stop();
+
+  /**
+   * Everyone who has pinged this server recently, sorted by address. Safe to
+   * call from any thread.
+   */
+  std::vector<ClientStats> GetClientStats();
 };
 
 }  // namespace tsp
@@ -35,6 +35,15 @@ struct TspPong : public TspPing {
   uint64_t server_time;
 };
 
+// Optionally tacked onto the end of a ping, so the server can tell which
+// clients are out of sync. Servers that don't know about it read the ping
+// and ignore the rest.
+struct TspClientReport {
+  // The client's latest round trip time and offset estimate, in microseconds
+  int64_t rtt2;
+  int64_t offset;
+};
+
 }  // namespace tsp
 }  // namespace wpi
 
@@ -87,5 +96,27 @@ struct wpi::util::Struct<wpi::tsp::TspPong> {
   }
 };
 
+template <>
+struct wpi::util::Struct<wpi::tsp::TspClientReport> {
+  static constexpr std::string_view GetTypeName() { return "TspClientReport"; }
+  static constexpr size_t GetSize() { return 16; }
+  static constexpr std::string_view GetSchema() {
+    return "int64 rtt2;int64 offset";
+  }
+
+  static wpi::tsp::TspClientReport Unpack(std::span<const uint8_t> data) {
+    return wpi::tsp::TspClientReport{
+        wpi::util::UnpackStruct<int64_t, 0>(data),
+        wpi::util::UnpackStruct<int64_t, 8>(data),
+    };
+  }
+  static void Pack(std::span<uint8_t> data,
+                   const wpi::tsp::TspClientReport& value) {
+    wpi::util::PackStruct<0>(data, value.rtt2);
+    wpi::util::PackStruct<8>(data, value.offset);
+  }
+};
+
 static_assert(wpi::util::StructSerializable<wpi::tsp::TspPong>);
 static_assert(wpi::util::StructSerializable<wpi::tsp::TspPing>);
+static_assert(wpi::util::StructSerializable<wpi::tsp::TspClientReport>);
@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <uv.h>
+
+#include <array>
+#include <functional>
+#include <optional>
+#include <span>
+
+namespace wpi {
+namespace tsp {
+
+/**
+ * Plain nonblocking UDP sockets for when libuv's UDP handle isn't enough,
+ * Linux only. Everywhere else Open fails and callers fall back to libuv.
+ *
+ * Two things need the raw socket:
+ * - Receiving and sending in batches (recvmmsg/sendmmsg), one syscall for
+ *   many datagrams instead of one callback and send each.
+ * - Kernel timestamps (SO_TIMESTAMPING), which stamp packets when they cross
+ *   the kernel instead of whenever the event loop gets to them. Only
+ *   software timestamps are used, which every network driver supports,
+ *   including loopback. They're on CLOCK_REALTIME and are converted to the
+ *   caller's clock by their age, so a clock step only affects packets
+ *   already in flight.
+ */
+namespace UdpSocket {
+
+/** The largest datagram a batch holds. TimeSync packets are much smaller. */
+constexpr size_t kMaxDatagramSize = 64;
+
+/** One datagram in a batch, along with where and when it came from. */
+struct Datagram {
+  std::array<uint8_t, kMaxDatagramSize> data;
+  size_t size;
+  // The sender when received, or the recipient when sent
+  sockaddr_in peer;
+  // When it was received, on the clock passed to ReceiveBatch
+  uint64_t time;
+
+  std::span<const uint8_t> Bytes() const { return {data.data(), size}; }
+};
+
+/**
+ * Open a nonblocking UDP socket.
+ *
+ * @param addr The address to connect to, or for a server, to bind to
+ * @param server Bind rather than connect
+ * @param kernelTimestamps Have the kernel stamp received datagrams, and for
+ * clients, sent ones as well
+ * @return The socket, or -1 if it couldn't be opened or timestamped
+ */
+int Open(const sockaddr_in& addr, bool server, bool kernelTimestamps);
+
+/** Close a socket from Open. */
+void Close(int fd);
+
+/**
+ * Receive one datagram.
+ *
+ * @param data Receives the payload
+ * @param sender Receives the sender's address, if not null
+ * @param clock The clock to report receiveTime on
+ * @param receiveTime When the kernel received the packet, or the current time
+ * if it wasn't stamped
+ * @return The datagram's length, or nullopt once there's nothing left to read
+ */
+std::optional<size_t> Receive(int fd, std::span<uint8_t> data,
+                              sockaddr_in* sender,
+                              const std::function<uint64_t()>& clock,
+                              uint64_t& receiveTime);
+
+/**
+ * Receive as many datagrams as are waiting, up to the size of the batch, in
+ * one syscall. Datagrams with no kernel timestamp get the current time.
+ *
+ * @return How many of the batch were filled in
+ */
+size_t ReceiveBatch(int fd, std::span<Datagram> batch,
+                    const std::function<uint64_t()>& clock);
+
+/**
+ * Send one datagram.
+ *
+ * @param recipient Where to send it, or null on a connected socket
+ * @return Whether the whole datagram was sent
+ */
+bool Send(int fd, std::span<const uint8_t> data, const sockaddr_in* recipient);
+
+/** How a SendBatch went. Datagrams in neither count weren't attempted. */
+struct SendBatchResult {
+  // Accepted by the kernel
+  size_t sent = 0;
+  // Rejected outright, e.g. because the peer was unreachable, and skipped
+  size_t failed = 0;
+};
+
+/**
+ * Send each datagram in the batch to its peer, in one syscall where the
+ * kernel allows it. A datagram that fails is skipped so it doesn't hold up
+ * the rest. Sending stops early only if the socket's buffer is full.
+ */
+SendBatchResult SendBatch(int fd, std::span<const Datagram> batch);
+
+/**
+ * Pull the send timestamp for a client socket's most recent datagram off its
+ * error queue. Software timestamps are taken before Send returns, so this is
+ * only empty if the kernel dropped it. Older timestamps are discarded.
+ *
+ * @param sendCount How many datagrams have been sent on this socket
+ * @param clock The clock to report the time on
+ */
+std::optional<uint64_t> ReadSendTime(int fd, uint32_t sendCount,
+                                     const std::function<uint64_t()>& clock);
+
+/**
+ * Throw away anything on a socket's error queue, such as late send
+ * timestamps or ICMP errors. libuv stops polling a socket that reports an
+ * error, so this has to happen before polling it again.
+ */
+void ClearErrors(int fd);
+
+}  // namespace UdpSocket
+
+}  // namespace tsp
+}  // namespace wpi
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <deque>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include <Eigen/Core>
+#include <sleipnir/optimization/solver/exit_status.hpp>
+#include <wpi/util/expected>
+
+#include "photon/constrained_solvepnp/wrap/casadi_wrapper.h"
+
+namespace constrained_solvepnp {
+
+/**
+ * Tag corner observations from a single camera frame, in the same form
+ * do_optimization takes them. Observations are in (undistorted) pixels. A frame
+ * with nTags = 0 only contributes its odometry delta.
+ */
+struct FrameObservation {
+  bool heading_free;
+  int nTags;
+  CameraCalibration cameraCal;
+  Eigen::Matrix<casadi_real, 4, 4, Eigen::ColMajor> robot2camera;
+  Eigen::Matrix<casadi_real, 4, Eigen::Dynamic, Eigen::ColMajor> field2points;
+  Eigen::Matrix<casadi_real, 2, Eigen::Dynamic, Eigen::ColMajor>
+      point_observations;
+  double gyroθ;
+  double gyroErrorScaleFac;
+};
+
+/**
+ * Fixed-lag smoother over the last windowSize robot poses. Each frame adds its
+ * tag reprojection cost, and consecutive frames are tied together by an
+ * odometry delta. When the window is full the oldest pose is marginalized
+ * into a quadratic prior on its successor instead of being dropped, so the
+ * information it carried is kept.
+ *
+ * The reprojection cost is weighted by (f/pixelStdDev)², and odometry residuals
+ * by 1/σ², so the two are in the same units.
+ */
+class SlidingWindowSolver {
+ public:
+  /**
+   * @param windowSize Number of poses optimized jointly. Must be at least 1.
+   * @param pixelStdDev Expected corner noise, in pixels.
+   * @param odometryStdDevs Expected odometry delta noise, [x, y, theta] in the
+   * robot frame of the earlier pose.
+   */
+  SlidingWindowSolver(int windowSize, double pixelStdDev,
+                      RobotStateMat odometryStdDevs);
+  ~SlidingWindowSolver();
+
+  SlidingWindowSolver(SlidingWindowSolver&&);
+  SlidingWindowSolver& operator=(SlidingWindowSolver&&);
+
+  /**
+   * Add a frame and re-solve the window.
+   *
+   * @param frame The new frame's observations.
+   * @param odometryDelta Robot motion since the previous frame, expressed in
+   * the previous frame's robot coordinates. Ignored for the first frame.
+   * @param x_guess Initial guess for the first frame. Later frames are seeded
+   * by composing odometryDelta onto the latest estimate.
+   * @return The estimate for the newest frame. On failure the frame is kept
+   * as odometry-only so later deltas still chain, unless it was the first one.
+   * As with do_optimization, NONFINITE_INITIAL_GUESS means the observations
+   * were rejected before solving: there's no generated problem for nTags, or
+   * the point matrices aren't 4 * nTags columns wide. Any other error comes
+   * from the solver.
+   */
+  wpi::util::expected<RobotStateMat, slp::ExitStatus> add_frame(
+      FrameObservation frame, RobotStateMat odometryDelta,
+      RobotStateMat x_guess);
+
+  /** Drop all frames and the marginalized prior. */
+  void reset();
+
+  /** Number of poses currently in the window. */
+  int size() const;
+
+  /** The newest estimate, if any frame has been added. */
+  std::optional<RobotStateMat> latest_estimate() const;
+
+  /** Current estimates for every pose in the window, oldest first. */
+  std::vector<RobotStateMat> window_states() const;
+
+ private:
+  struct Frame;
+  struct Prior;
+
+  wpi::util::expected<void, slp::ExitStatus> solve();
+  double cost(const std::vector<RobotStateMat>& x) const;
+  void marginalize_oldest();
+
+  int m_windowSize;
+  double m_pixelVariance;
+  RobotStateMat m_odometryWeights;
+
+  std::deque<std::unique_ptr<Frame>> m_frames;
+  std::unique_ptr<Prior> m_prior;
+  double m_δ = 1e-4 * 2.0;
+};
+
+}  // namespace constrained_solvepnp
@@ -0,0 +1,123 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <memory>
+
+#include <Eigen/Core>
+#include <Eigen/LU>
+#include <opencv2/core.hpp>
+
+#define OPENCV_DISABLE_EIGEN_TENSOR_SUPPORT
+#include <opencv2/core/eigen.hpp>
+
+#include "CameraProjection.h"
+
+namespace photon {
+/**
+ * A camera's intrinsics and distortion, along with everything derived from
+ * them that the estimators need. Build one whenever the calibration changes
+ * and pass it around instead of the raw matrices, so the OpenCV copies and
+ * the inverse intrinsics aren't rebuilt on every call.
+ *
+ * Copies share the underlying cv::Mat data, which is never modified, and the
+ * lazily built undistortion data, so it is computed once per calibration.
+ */
+class CameraCalibration {
+ public:
+  /**
+   * Fixed-point cv::remap tables, as cv::convertMaps builds them for CV_16SC2.
+   * Both are empty when the calibration has no distortion.
+   */
+  struct UndistortionMap {
+    cv::Mat map1;
+    cv::Mat map2;
+  };
+
+  CameraCalibration(const CameraProjection::CameraMatrix& cameraMatrix,
+                    const CameraProjection::DistortionCoeffs& distCoeffs);
+
+  const CameraProjection::CameraMatrix& GetCameraMatrix() const {
+    return cameraMatrix;
+  }
+
+  const CameraProjection::DistortionCoeffs& GetDistCoeffs() const {
+    return distCoeffs;
+  }
+
+  /** The inverse of the camera matrix, mapping pixels to normalized rays. */
+  const Eigen::Matrix3d& GetInverseCameraMatrix() const {
+    return invCameraMatrix;
+  }
+
+  /** The camera matrix as a 3x3 CV_64F mat. */
+  const cv::Mat& GetCvCameraMatrix() const { return cvCameraMatrix; }
+
+  /** The distortion coefficients as an 8x1 CV_64F mat. */
+  const cv::Mat& GetCvDistCoeffs() const { return cvDistCoeffs; }
+
+  /** Whether any distortion coefficient is nonzero. */
+  bool HasDistortion() const { return hasDistortion; }
+
+  /**
+   * Maps pixels to undistorted normalized image coordinates. Without
+   * distortion this is just the inverse intrinsics.
+   */
+  void UndistortPoints(const Eigen::Ref<const Eigen::Matrix2Xd>& imagePoints,
+                       Eigen::Ref<Eigen::Matrix2Xd> normalizedPoints) const {
+    if (hasDistortion) {
+      CameraProjection::UndistortPoints(cameraMatrix, distCoeffs, imagePoints,
+                                        normalizedPoints);
+    } else {
+      normalizedPoints =
+          (invCameraMatrix.topLeftCorner<2, 2>() * imagePoints).colwise() +
+          invCameraMatrix.topRightCorner<2, 1>();
+    }
+  }
+
+  /**
+   * The same intrinsics with no distortion. Built on first use and shared by
+   * copies; without distortion this is the calibration itself.
+   */
+  const CameraCalibration& GetPinhole() const;
+
+  /**
+   * For every pixel of a width x height image seen through this calibration,
+   * where it lands in the image GetPinhole() would see. Remapping a pinhole
+   * image with these tables distorts it. Each resolution is built the first
+   * time it's asked for and then shared by copies.
+   */
+  UndistortionMap GetUndistortionMap(int width, int height) const;
+
+  bool operator==(const CameraCalibration& other) const {
+    return cameraMatrix == other.cameraMatrix &&
+           distCoeffs == other.distCoeffs;
+  }
+
+ private:
+  CameraProjection::CameraMatrix cameraMatrix;
+  CameraProjection::DistortionCoeffs distCoeffs;
+  Eigen::Matrix3d invCameraMatrix;
+  bool hasDistortion;
+  cv::Mat cvCameraMatrix;
+  cv::Mat cvDistCoeffs;
+
+  struct Cache;
+  std::shared_ptr<Cache> cache;
+};
+}  // namespace photon
@@ -0,0 +1,272 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <span>
+
+#include <Eigen/Core>
+
+namespace photon {
+/**
+ * Batch point projection for the 8-coefficient OpenCV camera model
+ * (k1, k2, p1, p2, k3, k4, k5, k6), matching cv::projectPoints without going
+ * through cv::Mat. Points are stored as columns and processed in fixed-size
+ * blocks so the per-point math vectorizes and nothing is heap allocated.
+ */
+namespace CameraProjection {
+
+using CameraMatrix = Eigen::Matrix<double, 3, 3>;
+using DistortionCoeffs = Eigen::Matrix<double, 8, 1>;
+
+namespace detail {
+inline constexpr Eigen::Index kBlockSize = 16;
+using BlockRow = Eigen::Array<double, 1, Eigen::Dynamic, Eigen::RowMajor, 1,
+                              kBlockSize>;
+}  // namespace detail
+
+/**
+ * Projects points already in the camera's EDN frame into pixels.
+ *
+ * @param cameraMatrix Camera intrinsics. Skew is ignored, like OpenCV.
+ * @param distCoeffs OpenCV distortion coefficients
+ * @param cameraPoints 3xN points in the camera frame
+ * @param imagePoints 2xN output, in pixels
+ */
+inline void ProjectCameraPoints(
+    const CameraMatrix& cameraMatrix, const DistortionCoeffs& distCoeffs,
+    const Eigen::Ref<const Eigen::Matrix3Xd>& cameraPoints,
+    Eigen::Ref<Eigen::Matrix2Xd> imagePoints) {
+  using detail::BlockRow;
+
+  const double fx = cameraMatrix(0, 0);
+  const double fy = cameraMatrix(1, 1);
+  const double cx = cameraMatrix(0, 2);
+  const double cy = cameraMatrix(1, 2);
+  const double k1 = distCoeffs(0);
+  const double k2 = distCoeffs(1);
+  const double p1 = distCoeffs(2);
+  const double p2 = distCoeffs(3);
+  const double k3 = distCoeffs(4);
+  const double k4 = distCoeffs(5);
+  const double k5 = distCoeffs(6);
+  const double k6 = distCoeffs(7);
+
+  const Eigen::Index n = cameraPoints.cols();
+  for (Eigen::Index start = 0; start < n; start += detail::kBlockSize) {
+    const Eigen::Index len = std::min(detail::kBlockSize, n - start);
+    auto block = cameraPoints.middleCols(start, len);
+
+    // OpenCV treats z = 0 as z = 1 rather than dividing by zero
+    BlockRow z = block.row(2).array();
+    BlockRow invZ = (z != 0.0).select(z.inverse(), 1.0);
+    BlockRow x = block.row(0).array() * invZ;
+    BlockRow y = block.row(1).array() * invZ;
+
+    BlockRow r2 = x.square() + y.square();
+    BlockRow r4 = r2.square();
+    BlockRow r6 = r4 * r2;
+    BlockRow radial = (1.0 + k1 * r2 + k2 * r4 + k3 * r6) /
+                      (1.0 + k4 * r2 + k5 * r4 + k6 * r6);
+    BlockRow xy2 = 2.0 * x * y;
+
+    imagePoints.row(0).segment(start, len) =
+        (fx * (x * radial + p1 * xy2 + p2 * (r2 + 2.0 * x.square())) + cx)
+            .matrix();
+    imagePoints.row(1).segment(start, len) =
+        (fy * (y * radial + p1 * (r2 + 2.0 * y.square()) + p2 * xy2) + cy)
+            .matrix();
+  }
+}
+
+/**
+ * Projects object points through a rigid transform into pixels, i.e. the
+ * camera-frame point is rotation * p + translation.
+ *
+ * @param cameraMatrix Camera intrinsics
+ * @param distCoeffs OpenCV distortion coefficients
+ * @param rotation Rotation from the object frame to the camera's EDN frame
+ * @param translation Translation in the camera's EDN frame
+ * @param objectPoints 3xN points in the object frame
+ * @param imagePoints 2xN output, in pixels
+ */
+inline void ProjectPoints(
+    const CameraMatrix& cameraMatrix, const DistortionCoeffs& distCoeffs,
+    const Eigen::Matrix3d& rotation, const Eigen::Vector3d& translation,
+    const Eigen::Ref<const Eigen::Matrix3Xd>& objectPoints,
+    Eigen::Ref<Eigen::Matrix2Xd> imagePoints) {
+  using BlockPoints = Eigen::Matrix<double, 3, Eigen::Dynamic, Eigen::ColMajor,
+                                    3, detail::kBlockSize>;
+
+  const Eigen::Index n = objectPoints.cols();
+  for (Eigen::Index start = 0; start < n; start += detail::kBlockSize) {
+    const Eigen::Index len = std::min(detail::kBlockSize, n - start);
+    BlockPoints cameraPoints =
+        (rotation * objectPoints.middleCols(start, len)).colwise() +
+        translation;
+    ProjectCameraPoints(cameraMatrix, distCoeffs, cameraPoints,
+                        imagePoints.middleCols(start, len));
+  }
+}
+
+/**
+ * Inverts ProjectCameraPoints: maps pixels back to undistorted normalized
+ * image coordinates (x/z, y/z) using OpenCV's fixed-point iteration.
+ *
+ * @param cameraMatrix Camera intrinsics
+ * @param distCoeffs OpenCV distortion coefficients
+ * @param imagePoints 2xN points, in pixels
+ * @param normalizedPoints 2xN output, may alias imagePoints
+ * @param iterations Fixed-point iterations. The default matches OpenCV's
+ * undistortPoints, so results agree with the OpenCV calls this replaces.
+ */
+inline void UndistortPoints(
+    const CameraMatrix& cameraMatrix, const DistortionCoeffs& distCoeffs,
+    const Eigen::Ref<const Eigen::Matrix2Xd>& imagePoints,
+    Eigen::Ref<Eigen::Matrix2Xd> normalizedPoints, int iterations = 5) {
+  using detail::BlockRow;
+
+  const double k1 = distCoeffs(0);
+  const double k2 = distCoeffs(1);
+  const double p1 = distCoeffs(2);
+  const double p2 = distCoeffs(3);
+  const double k3 = distCoeffs(4);
+  const double k4 = distCoeffs(5);
+  const double k5 = distCoeffs(6);
+  const double k6 = distCoeffs(7);
+  const bool distorted = !distCoeffs.isZero();
+
+  const Eigen::Index n = imagePoints.cols();
+  for (Eigen::Index start = 0; start < n; start += detail::kBlockSize) {
+    const Eigen::Index len = std::min(detail::kBlockSize, n - start);
+
+    const BlockRow x0 =
+        (imagePoints.row(0).segment(start, len).array() - cameraMatrix(0, 2)) /
+        cameraMatrix(0, 0);
+    const BlockRow y0 =
+        (imagePoints.row(1).segment(start, len).array() - cameraMatrix(1, 2)) /
+        cameraMatrix(1, 1);
+    BlockRow x = x0;
+    BlockRow y = y0;
+
+    for (int i = 0; distorted && i < iterations; i++) {
+      BlockRow r2 = x.square() + y.square();
+      BlockRow r4 = r2.square();
+      BlockRow r6 = r4 * r2;
+      BlockRow icdist = (1.0 + k4 * r2 + k5 * r4 + k6 * r6) /
+                        (1.0 + k1 * r2 + k2 * r4 + k3 * r6);
+      BlockRow xy2 = 2.0 * x * y;
+      BlockRow deltaX = p1 * xy2 + p2 * (r2 + 2.0 * x.square());
+      BlockRow deltaY = p1 * (r2 + 2.0 * y.square()) + p2 * xy2;
+      // Like OpenCV, give up on points the model can't invert
+      x = (icdist < 0.0).select(x0, (x0 - deltaX) * icdist);
+      y = (icdist < 0.0).select(y0, (y0 - deltaY) * icdist);
+    }
+
+    normalizedPoints.row(0).segment(start, len) = x.matrix();
+    normalizedPoints.row(1).segment(start, len) = y.matrix();
+  }
+}
+
+/**
+ * Finds the image of each sphere analytically, rather than by projecting
+ * points on its surface. Without distortion a sphere's silhouette is exactly
+ * an ellipse, found from the tangent cone's conic. Each sphere is reported as
+ * the four corners of the rectangle bounding that ellipse along its axes, in
+ * the same order as cv::RotatedRect::points. With distortion, the corners
+ * are then distorted together in one batch.
+ *
+ * @param cameraMatrix Camera intrinsics. Skew is ignored, like OpenCV.
+ * @param distCoeffs OpenCV distortion coefficients
+ * @param centers 3xN sphere centers in the camera's EDN frame
+ * @param radii The radius of each sphere
+ * @param corners 2x4N output, in pixels. Spheres that aren't entirely in front
+ * of the camera, or that contain it, get NaN corners.
+ */
+inline void ProjectSphereBounds(
+    const CameraMatrix& cameraMatrix, const DistortionCoeffs& distCoeffs,
+    const Eigen::Ref<const Eigen::Matrix3Xd>& centers,
+    std::span<const double> radii, Eigen::Ref<Eigen::Matrix2Xd> corners) {
+  const double fx = cameraMatrix(0, 0);
+  const double fy = cameraMatrix(1, 1);
+  const double cx = cameraMatrix(0, 2);
+  const double cy = cameraMatrix(1, 2);
+  Eigen::Matrix3d invK;
+  invK << 1 / fx, 0, -cx / fx, 0, 1 / fy, -cy / fy, 0, 0, 1;
+
+  const Eigen::Index n = centers.cols();
+  for (Eigen::Index i = 0; i < n; i++) {
+    auto rect = corners.middleCols<4>(4 * i);
+    const Eigen::Vector3d c = centers.col(i);
+    const double r = radii[i];
+
+    // A ray x is tangent to the sphere when (x.c)^2 = |x|^2 (|c|^2 - r^2),
+    // so the silhouette is the conic x^T (c c^T - (|c|^2 - r^2) I) x = 0.
+    // Negated here so the inside of the silhouette is negative.
+    const Eigen::Matrix3d conic =
+        invK.transpose() *
+        ((c.squaredNorm() - r * r) * Eigen::Matrix3d::Identity() -
+         c * c.transpose()) *
+        invK;
+    const Eigen::Matrix2d S = conic.topLeftCorner<2, 2>();
+    const Eigen::Vector2d g = conic.topRightCorner<2, 1>();
+    // Only an ellipse if the whole sphere is in front of the camera
+    const double det = S(0, 0) * S(1, 1) - S(0, 1) * S(0, 1);
+    if (!(c.z() > 0 && c.squaredNorm() > r * r && S(0, 0) > 0 && det > 0)) {
+      rect.setConstant(std::numeric_limits<double>::quiet_NaN());
+      continue;
+    }
+
+    const Eigen::Vector2d center =
+        Eigen::Vector2d{S(0, 1) * g.y() - S(1, 1) * g.x(),
+                        S(0, 1) * g.x() - S(0, 0) * g.y()} /
+        det;
+    const double k = -(conic(2, 2) + g.dot(center));
+    // Principal axes of S, from its closed-form eigendecomposition
+    const double mean = 0.5 * (S(0, 0) + S(1, 1));
+    const double spread = std::hypot(0.5 * (S(0, 0) - S(1, 1)), S(0, 1));
+    const double phi = 0.5 * std::atan2(2 * S(0, 1), S(0, 0) - S(1, 1));
+    const Eigen::Vector2d widthAxis{std::cos(phi), std::sin(phi)};
+    const Eigen::Vector2d heightAxis{-widthAxis.y(), widthAxis.x()};
+    const Eigen::Vector2d halfWidth =
+        widthAxis * std::sqrt(k / (mean + spread));
+    const Eigen::Vector2d halfHeight =
+        heightAxis * std::sqrt(k / (mean - spread));
+
+    rect.col(0) = center - halfWidth + halfHeight;
+    rect.col(1) = center - halfWidth - halfHeight;
+    rect.col(2) = center + halfWidth - halfHeight;
+    rect.col(3) = center + halfWidth + halfHeight;
+  }
+
+  if (distCoeffs.isZero()) {
+    return;
+  }
+  // Back to normalized coordinates, then through the distortion model
+  Eigen::Matrix3Xd rays(3, corners.cols());
+  rays.topRows<2>() =
+      (invK.topLeftCorner<2, 2>() * corners).colwise() +
+      invK.topRightCorner<2, 1>();
+  rays.row(2).setOnes();
+  ProjectCameraPoints(cameraMatrix, distCoeffs, rays, corners);
+}
+
+}  // namespace CameraProjection
+}  // namespace photon
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <optional>
+#include <span>
+
+#include <Eigen/Core>
+
+#include "CameraProjection.h"
+
+namespace photon {
+/**
+ * Infinitesimal Plane-based Pose Estimation (Collins & Bartoli, 2014) for four
+ * coplanar points, e.g. the corners of an AprilTag. This follows the same math
+ * as OpenCV's SOLVEPNP_IPPE_SQUARE but works directly on Eigen types, so a
+ * solve costs a handful of small fixed-size matrix operations.
+ *
+ * All poses are object-to-camera, with the camera in OpenCV's EDN convention.
+ */
+namespace IPPE {
+
+/** Four object points, as columns. All must have z = 0. */
+using ObjectQuad = Eigen::Matrix<double, 3, 4>;
+/** Four observed image points, as columns, in pixels. */
+using ImageQuad = Eigen::Matrix<double, 2, 4>;
+
+struct Solution {
+  Eigen::Matrix3d rotation;
+  Eigen::Vector3d translation;
+  /** RMS reprojection error, in pixels */
+  double reprojectionError;
+};
+
+/**
+ * Both of IPPE's candidate poses. A planar target seen from far away is
+ * ambiguous, so the alternate is often nearly as good as the best.
+ */
+struct QuadSolutions {
+  Solution best;
+  Solution alt;
+};
+
+/**
+ * Solve for the pose of one quad.
+ *
+ * @return Both solutions sorted by reprojection error, or nullopt if the
+ * observation is degenerate.
+ */
+std::optional<QuadSolutions> SolveQuad(
+    const CameraProjection::CameraMatrix& cameraMatrix,
+    const CameraProjection::DistortionCoeffs& distCoeffs,
+    const ObjectQuad& objectPoints, const ImageQuad& imagePoints);
+
+/**
+ * Solve for the pose of every quad in one call. Undistortion and reprojection
+ * run over all corners at once.
+ *
+ * @param objectPoints Either one model shared by every quad, or one per quad
+ * @param imagePoints Observed corners for each quad
+ * @param solutions Receives one entry per quad
+ */
+void SolveQuadBatch(const CameraProjection::CameraMatrix& cameraMatrix,
+                    const CameraProjection::DistortionCoeffs& distCoeffs,
+                    std::span<const ObjectQuad> objectPoints,
+                    std::span<const ImageQuad> imagePoints,
+                    std::span<std::optional<QuadSolutions>> solutions);
+
+}  // namespace IPPE
+}  // namespace photon
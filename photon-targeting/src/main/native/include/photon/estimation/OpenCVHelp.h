@@ -17,14 +17,20 @@
 
 #pragma once
 
+#include <algorithm>
+#include <optional>
 #include <utility>
 #include <vector>
 
 #include <Eigen/Core>
+#include <Eigen/Geometry>
 #include <opencv2/calib3d.hpp>
 #include <opencv2/core.hpp>
 #include <opencv2/imgproc.hpp>
 
+#include "CameraCalibration.h"
+#include "CameraProjection.h"
+#include "IPPE.h"
 #include "RotTrlTransform3d.h"
 
 #define OPENCV_DISABLE_EIGEN_TENSOR_SUPPORT
@@ -150,19 +156,38 @@ static std::vector<cv::Point3f> RotationToRVec(
     const Eigen::Matrix<double, 8, 1>& distCoeffs,
     const RotTrlTransform3d& camRt,
     const std::vector<wpi::math::Translation3d>& objectTranslations) {
-  std::vector<cv::Point3f> objectPoints = TranslationToTVec(objectTranslations);
-  std::vector<cv::Point3f> rvec = RotationToRVec(camRt.GetRotation());
-  std::vector<cv::Point3f> tvec = TranslationToTVec({camRt.GetTranslation()});
-  cv::Mat cameraMat(cameraMatrix.rows(), cameraMatrix.cols(), CV_64F);
-  cv::eigen2cv(cameraMatrix, cameraMat);
-  cv::Mat distCoeffsMat(distCoeffs.rows(), distCoeffs.cols(), CV_64F);
-  cv::eigen2cv(distCoeffs, distCoeffsMat);
-  std::vector<cv::Point2f> imagePoints{};
-  cv::projectPoints(objectPoints, rvec, tvec, cameraMat, distCoeffsMat,
-                    imagePoints);
+  // Go straight from NWU field points to EDN camera points, p' = N(Rp + t),
+  // instead of converting each point and the rvec/tvec separately
+  const Eigen::Matrix3d nwuToEdn = NWU_TO_EDN.ToMatrix();
+  const Eigen::Matrix3d rotation = nwuToEdn * camRt.GetRotation().ToMatrix();
+  const Eigen::Vector3d translation =
+      nwuToEdn * camRt.GetTranslation().ToVector();
+
+  const Eigen::Index n = objectTranslations.size();
+  Eigen::Matrix3Xd objectPoints(3, n);
+  for (Eigen::Index i = 0; i < n; i++) {
+    objectPoints.col(i) = objectTranslations[i].ToVector();
+  }
+  Eigen::Matrix2Xd projected(2, n);
+  CameraProjection::ProjectPoints(cameraMatrix, distCoeffs, rotation,
+                                  translation, objectPoints, projected);
+
+  std::vector<cv::Point2f> imagePoints;
+  imagePoints.reserve(n);
+  for (Eigen::Index i = 0; i < n; i++) {
+    imagePoints.emplace_back(static_cast<float>(projected(0, i)),
+                             static_cast<float>(projected(1, i)));
+  }
   return imagePoints;
 }
 
+[[maybe_unused]] static std::vector<cv::Point2f> ProjectPoints(
+    const CameraCalibration& calibration, const RotTrlTransform3d& camRt,
+    const std::vector<wpi::math::Translation3d>& objectTranslations) {
+  return ProjectPoints(calibration.GetCameraMatrix(),
+                       calibration.GetDistCoeffs(), camRt, objectTranslations);
+}
+
 template <typename T>
 static std::vector<T> ReorderCircular(const std::vector<T> elements,
                                       bool backwards, int shiftStart) {
@@ -208,78 +233,147 @@ static wpi::math::Rotation3d RVecToRotation(const cv::Mat& rvecInput) {
       wpi::math::Rotation3d{Eigen::Vector3d{data[0], data[1], data[2]}});
 }
 
+static wpi::math::Transform3d EDNPoseToTransform(
+    const Eigen::Matrix3d& rotation, const Eigen::Vector3d& translation) {
+  const Eigen::Matrix3d ednToNwu = EDN_TO_NWU.ToMatrix();
+  // Go through a quaternion so round-off can't trip Rotation3d's
+  // orthonormality check
+  Eigen::Quaterniond q{ednToNwu * rotation * ednToNwu.transpose()};
+  q.normalize();
+  return wpi::math::Transform3d{
+      wpi::math::Translation3d{Eigen::Vector3d{ednToNwu * translation}},
+      wpi::math::Rotation3d{wpi::math::Quaternion{q.w(), q.x(), q.y(), q.z()}}};
+}
+
+static IPPE::ObjectQuad ModelToObjectQuad(
+    const std::vector<wpi::math::Translation3d>& modelTrls) {
+  const Eigen::Matrix3d nwuToEdn = NWU_TO_EDN.ToMatrix();
+  IPPE::ObjectQuad objectPoints;
+  for (int i = 0; i < 4; i++) {
+    objectPoints.col(i) = nwuToEdn * modelTrls[i].ToVector();
+  }
+  return objectPoints;
+}
+
+static IPPE::ImageQuad PointsToImageQuad(
+    const std::vector<cv::Point2f>& imagePoints) {
+  IPPE::ImageQuad quad;
+  for (int i = 0; i < 4; i++) {
+    quad.col(i) << imagePoints[i].x, imagePoints[i].y;
+  }
+  return quad;
+}
+
+static photon::PnpResult ToPnpResult(const IPPE::QuadSolutions& solutions) {
+  photon::PnpResult result;
+  result.best = EDNPoseToTransform(solutions.best.rotation,
+                                   solutions.best.translation);
+  result.alt =
+      EDNPoseToTransform(solutions.alt.rotation, solutions.alt.translation);
+  result.ambiguity =
+      solutions.best.reprojectionError / solutions.alt.reprojectionError;
+  result.bestReprojErr = solutions.best.reprojectionError;
+  result.altReprojErr = solutions.alt.reprojectionError;
+  return result;
+}
+
+/**
+ * Solves for the pose of a square fiducial with IPPE. Both the model and the
+ * image points must list the four corners in the same order.
+ *
+ * @param modelTrls The tag's corners in its own NWU frame
+ * @param imagePoints The observed corners, in pixels
+ */
 [[maybe_unused]] static std::optional<photon::PnpResult> SolvePNP_Square(
     const Eigen::Matrix<double, 3, 3>& cameraMatrix,
     const Eigen::Matrix<double, 8, 1>& distCoeffs,
-    std::vector<wpi::math::Translation3d> modelTrls,
-    std::vector<cv::Point2f> imagePoints) {
-  modelTrls = ReorderCircular(modelTrls, true, -1);
-  imagePoints = ReorderCircular(imagePoints, true, -1);
-  std::vector<cv::Point3f> objectMat = TranslationToTVec(modelTrls);
-  std::vector<cv::Mat> rvecs;
-  std::vector<cv::Mat> tvecs;
-  cv::Mat rvec = cv::Mat::zeros(3, 1, CV_32F);
-  cv::Mat tvec = cv::Mat::zeros(3, 1, CV_32F);
-  cv::Mat reprojectionError = cv::Mat::zeros(2, 1, CV_32F);
-
-  cv::Mat cameraMat(cameraMatrix.rows(), cameraMatrix.cols(), CV_32F);
-  cv::eigen2cv(cameraMatrix, cameraMat);
-  cv::Mat distCoeffsMat(distCoeffs.rows(), distCoeffs.cols(), CV_32F);
-  cv::eigen2cv(distCoeffs, distCoeffsMat);
-
-  cv::Vec2d errors{};
-  wpi::math::Transform3d best{};
-  std::optional<wpi::math::Transform3d> alt{std::nullopt};
+    const std::vector<wpi::math::Translation3d>& modelTrls,
+    const std::vector<cv::Point2f>& imagePoints) {
+  if (modelTrls.size() != 4 || imagePoints.size() != 4) {
+    return std::nullopt;
+  }
+  const IPPE::ObjectQuad objectPoints = ModelToObjectQuad(modelTrls);
+  IPPE::ImageQuad quad = PointsToImageQuad(imagePoints);
 
   for (int tries = 0; tries < 2; tries++) {
-    cv::solvePnPGeneric(objectMat, imagePoints, cameraMat, distCoeffsMat, rvecs,
-                        tvecs, false, cv::SOLVEPNP_IPPE_SQUARE, rvec, tvec,
-                        reprojectionError);
+    auto solutions =
+        IPPE::SolveQuad(cameraMatrix, distCoeffs, objectPoints, quad);
+    if (solutions) {
+      return ToPnpResult(*solutions);
+    }
+    // Nudge a corner off of whatever degenerate configuration we hit
+    quad.col(0).array() -= 0.001;
+  }
 
-    errors = reprojectionError.at<cv::Vec2f>(cv::Point{0, 0});
-    best = wpi::math::Transform3d{TVecToTranslation(tvecs.at(0)),
-                                  RVecToRotation(rvecs[0])};
+  fmt::print("SolvePNP_Square failed!\n");
+  return std::nullopt;
+}
 
-    if (tvecs.size() > 1) {
-      alt = wpi::math::Transform3d{TVecToTranslation(tvecs.at(1)),
-                                   RVecToRotation(rvecs[1])};
+/**
+ * Solves every square fiducial seen in one frame at once. Each entry of the
+ * result corresponds to the same entry of modelTrls and imagePoints.
+ */
+[[maybe_unused]] static std::vector<std::optional<photon::PnpResult>>
+SolvePNP_SquareBatch(
+    const Eigen::Matrix<double, 3, 3>& cameraMatrix,
+    const Eigen::Matrix<double, 8, 1>& distCoeffs,
+    const std::vector<std::vector<wpi::math::Translation3d>>& modelTrls,
+    const std::vector<std::vector<cv::Point2f>>& imagePoints) {
+  const size_t n = std::min(modelTrls.size(), imagePoints.size());
+  std::vector<IPPE::ObjectQuad> objectQuads;
+  std::vector<IPPE::ImageQuad> imageQuads;
+  std::vector<size_t> indices;
+  objectQuads.reserve(n);
+  imageQuads.reserve(n);
+  indices.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    if (modelTrls[i].size() == 4 && imagePoints[i].size() == 4) {
+      objectQuads.push_back(ModelToObjectQuad(modelTrls[i]));
+      imageQuads.push_back(PointsToImageQuad(imagePoints[i]));
+      indices.push_back(i);
     }
+  }
+
+  std::vector<std::optional<IPPE::QuadSolutions>> solutions(indices.size());
+  IPPE::SolveQuadBatch(cameraMatrix, distCoeffs, objectQuads, imageQuads,
+                       solutions);
 
-    if (!std::isnan(errors[0])) {
-      break;
+  std::vector<std::optional<photon::PnpResult>> results(n);
+  for (size_t k = 0; k < indices.size(); k++) {
+    const size_t i = indices[k];
+    if (solutions[k]) {
+      results[i] = ToPnpResult(*solutions[k]);
     } else {
-      cv::Point2f pt = imagePoints[0];
-      pt.x -= 0.001f;
-      pt.y -= 0.001f;
-      imagePoints[0] = pt;
+      // Rare enough that retrying one at a time is fine
+      results[i] = SolvePNP_Square(cameraMatrix, distCoeffs, modelTrls[i],
+                                   imagePoints[i]);
     }
   }
+  return results;
+}
 
-  if (std::isnan(errors[0])) {
-    fmt::print("SolvePNP_Square failed!\n");
-    return std::nullopt;
-  }
-  if (alt) {
-    photon::PnpResult result;
-    result.best = best;
-    result.alt = alt.value();
-    result.ambiguity = errors[0] / errors[1];
-    result.bestReprojErr = errors[0];
-    result.altReprojErr = errors[1];
-    return result;
-  } else {
-    photon::PnpResult result;
-    result.best = best;
-    result.bestReprojErr = errors[0];
-    return result;
-  }
+[[maybe_unused]] static std::optional<photon::PnpResult> SolvePNP_Square(
+    const CameraCalibration& calibration,
+    const std::vector<wpi::math::Translation3d>& modelTrls,
+    const std::vector<cv::Point2f>& imagePoints) {
+  return SolvePNP_Square(calibration.GetCameraMatrix(),
+                         calibration.GetDistCoeffs(), modelTrls, imagePoints);
+}
+
+[[maybe_unused]] static std::vector<std::optional<photon::PnpResult>>
+SolvePNP_SquareBatch(
+    const CameraCalibration& calibration,
+    const std::vector<std::vector<wpi::math::Translation3d>>& modelTrls,
+    const std::vector<std::vector<cv::Point2f>>& imagePoints) {
+  return SolvePNP_SquareBatch(calibration.GetCameraMatrix(),
+                              calibration.GetDistCoeffs(), modelTrls,
+                              imagePoints);
 }
 
 [[maybe_unused]] static std::optional<photon::PnpResult> SolvePNP_SQPNP(
-    const Eigen::Matrix<double, 3, 3>& cameraMatrix,
-    const Eigen::Matrix<double, 8, 1>& distCoeffs,
-    std::vector<wpi::math::Translation3d> modelTrls,
-    std::vector<cv::Point2f> imagePoints) {
+    const CameraCalibration& calibration,
+    const std::vector<wpi::math::Translation3d>& modelTrls,
+    const std::vector<cv::Point2f>& imagePoints) {
   std::vector<cv::Point3f> objectMat = TranslationToTVec(modelTrls);
   std::vector<cv::Mat> rvecs{};
   std::vector<cv::Mat> tvecs{};
@@ -287,17 +381,12 @@ static wpi::math::Rotation3d RVecToRotation(const cv::Mat& rvecInput) {
   cv::Mat tvec = cv::Mat::zeros(3, 1, CV_32F);
   cv::Mat reprojectionError = cv::Mat::zeros(2, 1, CV_32F);
 
-  cv::Mat cameraMat(cameraMatrix.rows(), cameraMatrix.cols(), CV_64F);
-  cv::eigen2cv(cameraMatrix, cameraMat);
-  cv::Mat distCoeffsMat(distCoeffs.rows(), distCoeffs.cols(), CV_64F);
-  cv::eigen2cv(distCoeffs, distCoeffsMat);
-
   float error = 0;
   wpi::math::Transform3d best{};
 
-  cv::solvePnPGeneric(objectMat, imagePoints, cameraMat, distCoeffsMat, rvecs,
-                      tvecs, false, cv::SOLVEPNP_SQPNP, rvec, tvec,
-                      reprojectionError);
+  cv::solvePnPGeneric(objectMat, imagePoints, calibration.GetCvCameraMatrix(),
+                      calibration.GetCvDistCoeffs(), rvecs, tvecs, false,
+                      cv::SOLVEPNP_SQPNP, rvec, tvec, reprojectionError);
 
   error = reprojectionError.at<float>(cv::Point{0, 0});
   best = wpi::math::Transform3d{TVecToTranslation(tvecs.at(0)),
@@ -311,5 +400,14 @@ static wpi::math::Rotation3d RVecToRotation(const cv::Mat& rvecInput) {
   result.bestReprojErr = error;
   return result;
 }
+
+[[maybe_unused]] static std::optional<photon::PnpResult> SolvePNP_SQPNP(
+    const Eigen::Matrix<double, 3, 3>& cameraMatrix,
+    const Eigen::Matrix<double, 8, 1>& distCoeffs,
+    const std::vector<wpi::math::Translation3d>& modelTrls,
+    const std::vector<cv::Point2f>& imagePoints) {
+  return SolvePNP_SQPNP(CameraCalibration{cameraMatrix, distCoeffs}, modelTrls,
+                        imagePoints);
+}
 }  // namespace OpenCVHelp
 }  // namespace photon
@@ -23,6 +23,7 @@
 #include <wpi/apriltag/AprilTag.hpp>
 #include <wpi/apriltag/AprilTagFieldLayout.hpp>
 
+#include "CameraCalibration.h"
 #include "TargetModel.h"
 #include "photon/targeting/PhotonTrackedTarget.h"
 #include "photon/targeting/PnpResult.h"
@@ -34,6 +35,12 @@ std::vector<wpi::apriltag::AprilTag> GetVisibleLayoutTags(
     const std::vector<PhotonTrackedTarget>& visTags,
     const wpi::apriltag::AprilTagFieldLayout& layout);
 
+std::optional<photon::PnpResult> EstimateCamPosePNP(
+    const CameraCalibration& calibration,
+    const std::vector<PhotonTrackedTarget>& visTags,
+    const wpi::apriltag::AprilTagFieldLayout& layout,
+    const TargetModel& tagModel);
+
 std::optional<photon::PnpResult> EstimateCamPosePNP(
     const Eigen::Matrix<double, 3, 3>& cameraMatrix,
     const Eigen::Matrix<double, 8, 1>& distCoeffs,
@@ -41,6 +48,15 @@ std::optional<photon::PnpResult> EstimateCamPosePNP(
     const wpi::apriltag::AprilTagFieldLayout& layout,
     const TargetModel& tagModel);
 
+std::optional<photon::PnpResult> EstimateRobotPoseConstrainedSolvePNP(
+    const CameraCalibration& calibration,
+    const std::vector<photon::PhotonTrackedTarget>& visTags,
+    const wpi::math::Transform3d& robot2Camera,
+    const wpi::math::Pose3d& robotPoseSeed,
+    const wpi::apriltag::AprilTagFieldLayout& layout,
+    const photon::TargetModel& tagModel, bool headingFree,
+    wpi::math::Rotation2d gyroTheta, double gyroErrorScaleFac);
+
 std::optional<photon::PnpResult> EstimateRobotPoseConstrainedSolvePNP(
     const Eigen::Matrix<double, 3, 3>& cameraMatrix,
     const Eigen::Matrix<double, 8, 1>& distCoeffs,
@@ -0,0 +1,195 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace photon {
+/**
+ * A small fixed-size thread pool for running independent work, like
+ * processing each simulated camera or solving each problem in a batch, in
+ * parallel. Work is submitted as a batch with ParallelFor, which blocks until
+ * every index has run. The calling thread helps with the batch, so a pool with
+ * no workers just runs it inline.
+ *
+ * One batch has the workers at a time. What a second, concurrent caller does
+ * is set by the pool's BusyPolicy.
+ */
+class WorkerPool {
+ public:
+  /** What ParallelFor does when another batch already has the workers. */
+  enum class BusyPolicy {
+    /** Wait for the other batch to finish, then use the workers. */
+    kWait,
+    /** Run this batch on the calling thread alone instead of waiting. */
+    kRunInline
+  };
+
+  /**
+   * @param numThreads Total threads to use, including the caller. Defaults to
+   * the number of hardware threads.
+   * @param busyPolicy What a caller does while another batch is running.
+   */
+  explicit WorkerPool(
+      unsigned int numThreads = std::thread::hardware_concurrency(),
+      BusyPolicy busyPolicy = BusyPolicy::kWait)
+      : busyPolicy{busyPolicy} {
+    const unsigned int numWorkers = std::max(1u, numThreads) - 1;
+    workers.reserve(numWorkers);
+    for (unsigned int i = 0; i < numWorkers; i++) {
+      workers.emplace_back([this] { WorkerLoop(); });
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::scoped_lock lock{mutex};
+      stopping = true;
+    }
+    workAvailable.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+  }
+
+  WorkerPool(const WorkerPool&) = delete;
+  WorkerPool& operator=(const WorkerPool&) = delete;
+
+  /** The number of threads work is spread across, including the caller. */
+  size_t GetThreadCount() const { return workers.size() + 1; }
+
+  /**
+   * Calls func(i) for every i in [0, count), spread across the pool, and
+   * returns once all of them have finished. Calls for different indices must
+   * not touch the same mutable state.
+   *
+   * A call that throws doesn't stop the others or take down a worker thread.
+   * The first exception is rethrown here after the rest finish.
+   */
+  void ParallelFor(size_t count, const std::function<void(size_t)>& func) {
+    if (count == 0) {
+      return;
+    }
+
+    std::unique_lock batchLock{batchMutex, std::defer_lock};
+    if (count > 1 && !workers.empty()) {
+      if (busyPolicy == BusyPolicy::kRunInline) {
+        batchLock.try_lock();
+      } else {
+        batchLock.lock();
+      }
+    }
+    if (!batchLock) {
+      for (size_t i = 0; i < count; i++) {
+        func(i);
+      }
+      return;
+    }
+
+    std::unique_lock lock{mutex};
+    job = &func;
+    jobCount = count;
+    nextIndex = 0;
+    remaining = count;
+    generation++;
+    lock.unlock();
+    workAvailable.notify_all();
+
+    RunJob();
+
+    lock.lock();
+    jobDone.wait(lock, [this] { return remaining == 0; });
+    job = nullptr;
+    if (error) {
+      std::rethrow_exception(std::exchange(error, nullptr));
+    }
+  }
+
+ private:
+  void WorkerLoop() {
+    size_t seenGeneration = 0;
+    while (true) {
+      {
+        std::unique_lock lock{mutex};
+        workAvailable.wait(lock, [&] {
+          return stopping || (job != nullptr && generation != seenGeneration);
+        });
+        if (stopping) {
+          return;
+        }
+        seenGeneration = generation;
+      }
+      RunJob();
+    }
+  }
+
+  // Claims indices from the current job until none are left
+  void RunJob() {
+    while (true) {
+      size_t index;
+      const std::function<void(size_t)>* func;
+      {
+        std::scoped_lock lock{mutex};
+        if (job == nullptr || nextIndex >= jobCount) {
+          return;
+        }
+        index = nextIndex++;
+        func = job;
+      }
+
+      std::exception_ptr thrown;
+      try {
+        (*func)(index);
+      } catch (...) {
+        thrown = std::current_exception();
+      }
+
+      std::scoped_lock lock{mutex};
+      if (thrown && !error) {
+        error = thrown;
+      }
+      if (--remaining == 0) {
+        jobDone.notify_all();
+      }
+    }
+  }
+
+  const BusyPolicy busyPolicy;
+  std::vector<std::thread> workers;
+  // Held by the batch that has the workers
+  std::mutex batchMutex;
+  std::mutex mutex;
+  std::condition_variable workAvailable;
+  std::condition_variable jobDone;
+  const std::function<void(size_t)>* job = nullptr;
+  size_t jobCount = 0;
+  size_t nextIndex = 0;
+  size_t remaining = 0;
+  size_t generation = 0;
+  std::exception_ptr error;
+  bool stopping = false;
+};
+}  // namespace photon
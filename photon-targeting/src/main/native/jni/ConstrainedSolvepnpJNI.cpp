@@ -15,24 +15,102 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <exception>
 #include <span>
+#include <thread>
 #include <vector>
 
+#include "jni_utils.h"
 #include "org_photonvision_jni_ConstrainedSolvepnpJni.h"
 #include "photon/constrained_solvepnp/wrap/casadi_wrapper.h"
+#include "photon/util/WorkerPool.h"
 
-std::vector<double> convertJDoubleArray(JNIEnv* env, jdoubleArray array) {
-  jsize length = env->GetArrayLength(array);
-  std::vector<double> result(length);
-  env->GetDoubleArrayRegion(array, 0, length, result.data());
-  return result;
-}
+namespace {
+/**
+ * Pins a Java double[] for the lifetime of this object. No other JNI calls may
+ * be made while one of these is alive, so only copy out of it.
+ */
+class CriticalDoubleArray {
+ public:
+  CriticalDoubleArray(JNIEnv* env, jdoubleArray array)
+      : m_env{env},
+        m_array{array},
+        m_data{static_cast<double*>(
+            env->GetPrimitiveArrayCritical(array, nullptr))} {}
+  ~CriticalDoubleArray() {
+    if (m_data) {
+      m_env->ReleasePrimitiveArrayCritical(m_array, m_data, JNI_ABORT);
+    }
+  }
+  CriticalDoubleArray(const CriticalDoubleArray&) = delete;
+  CriticalDoubleArray& operator=(const CriticalDoubleArray&) = delete;
+
+  double* data() const { return m_data; }
+
+ private:
+  JNIEnv* m_env;
+  jdoubleArray m_array;
+  double* m_data;
+};
+
+// Packed batch layout, in native-order doubles. Keep in sync with
+// ConstrainedSolvepnpJni.java
+constexpr size_t kHeaderDoubles = 27;
+constexpr size_t kDoublesPerTag = 24;
+constexpr size_t kResultDoubles = 4;
+
+// Below this many problems, waking the workers costs more than it saves
+constexpr size_t kMinParallelBatch = 4;
+
+struct BatchProblem {
+  bool headingFree;
+  int nTags;
+  constrained_solvepnp::CameraCalibration cameraCal;
+  const double* robot2camera;
+  const double* xGuess;
+  double gyroθ;
+  double gyroErrorScaleFac;
+  const double* field2points;
+  const double* pointObservations;
+};
 
-jdoubleArray createJDoubleArray(JNIEnv* env, const std::span<double> vec) {
-  jdoubleArray array = env->NewDoubleArray(vec.size());
-  env->SetDoubleArrayRegion(array, 0, vec.size(), vec.data());
-  return array;
+void solveInto(const BatchProblem& p, double* out) {
+  using RowMajor4x4 = Eigen::Matrix<double, 4, 4, Eigen::RowMajor>;
+  using RowMajor4xN =
+      Eigen::Matrix<double, 4, Eigen::Dynamic, Eigen::RowMajor>;
+  using RowMajor2xN =
+      Eigen::Matrix<double, 2, Eigen::Dynamic, Eigen::RowMajor>;
+  const int nPoints = p.nTags * 4;
+
+  slp::ExitStatus status = slp::ExitStatus::SUCCESS;
+  constrained_solvepnp::RobotStateMat x =
+      constrained_solvepnp::RobotStateMat::Zero();
+  try {
+    auto result = constrained_solvepnp::do_optimization(
+        p.headingFree, p.nTags, p.cameraCal,
+        Eigen::Map<const RowMajor4x4>{p.robot2camera},
+        Eigen::Map<const constrained_solvepnp::RobotStateMat>{p.xGuess},
+        Eigen::Map<const RowMajor4xN>{p.field2points, 4, nPoints},
+        Eigen::Map<const RowMajor2xN>{p.pointObservations, 2, nPoints},
+        p.gyroθ, p.gyroErrorScaleFac);
+    if (result) {
+      x = *result;
+    } else {
+      status = result.error();
+    }
+  } catch (const std::exception&) {
+    // The generated cost functions throw if CasADi fails to evaluate them.
+    // That can't unwind into the JVM, so fail just this problem.
+    status = slp::ExitStatus::LOCALLY_INFEASIBLE;
+  }
+
+  out[0] = static_cast<double>(static_cast<int>(status));
+  std::copy_n(x.data(), 3, out + 1);
 }
+}  // namespace
 
 extern "C" {
 /*
@@ -47,26 +125,54 @@ Java_org_photonvision_jni_ConstrainedSolvepnpJni_do_1optimization
    jdoubleArray field2points, jdoubleArray pointObservations, jdouble gyro_θ,
    jdouble gyro_error_scale_fac)
 {
-  auto cameraCalVec = convertJDoubleArray(env, cameraCal);
-  auto robot2cameraVec = convertJDoubleArray(env, robot2camera);
-  auto xGuessVec = convertJDoubleArray(env, xGuess);
-  auto field2pointsVec = convertJDoubleArray(env, field2points);
-  auto pointObservationsVec = convertJDoubleArray(env, pointObservations);
-
-  constrained_solvepnp::CameraCalibration cameraCal_{
-      cameraCalVec[0],
-      cameraCalVec[1],
-      cameraCalVec[2],
-      cameraCalVec[3],
-  };
-  Eigen::Map<Eigen::Matrix<double, 4, 4, Eigen::RowMajor>> robot2cameraMat(
-      robot2cameraVec.data());
-  Eigen::Map<Eigen::Matrix<double, 3, 1>> xGuessMat(xGuessVec.data());
-  Eigen::Map<Eigen::Matrix<double, 4, Eigen::Dynamic, Eigen::RowMajor>>
-      field2pointsMat(field2pointsVec.data(), 4, field2pointsVec.size() / 4);
-  Eigen::Map<Eigen::Matrix<double, 2, Eigen::Dynamic, Eigen::RowMajor>>
-      pointObservationsMat(pointObservationsVec.data(), 2,
-                           pointObservationsVec.size() / 2);
+  constrained_solvepnp::CameraCalibration cameraCal_;
+  Eigen::Matrix<double, 4, 4, Eigen::ColMajor> robot2cameraMat;
+  constrained_solvepnp::RobotStateMat xGuessMat;
+  Eigen::Matrix<double, 4, Eigen::Dynamic, Eigen::ColMajor> field2pointsMat;
+  Eigen::Matrix<double, 2, Eigen::Dynamic, Eigen::ColMajor>
+      pointObservationsMat;
+
+  CHECK_PTR_RETURN(cameraCal, nullptr);
+  CHECK_PTR_RETURN(robot2camera, nullptr);
+  CHECK_PTR_RETURN(xGuess, nullptr);
+  CHECK_PTR_RETURN(field2points, nullptr);
+  CHECK_PTR_RETURN(pointObservations, nullptr);
+  if (env->GetArrayLength(cameraCal) < 4 ||
+      env->GetArrayLength(robot2camera) < 16 ||
+      env->GetArrayLength(xGuess) < 3) {
+    return nullptr;
+  }
+  const jsize nField2points = env->GetArrayLength(field2points);
+  const jsize nObservations = env->GetArrayLength(pointObservations);
+
+  {
+    // Copy straight out of the Java heap instead of through intermediate
+    // vectors. Nothing in this scope may call back into the JVM.
+    CriticalDoubleArray cameraCalArr{env, cameraCal};
+    CriticalDoubleArray robot2cameraArr{env, robot2camera};
+    CriticalDoubleArray xGuessArr{env, xGuess};
+    CriticalDoubleArray field2pointsArr{env, field2points};
+    CriticalDoubleArray pointObservationsArr{env, pointObservations};
+    if (!cameraCalArr.data() || !robot2cameraArr.data() ||
+        !xGuessArr.data() || !field2pointsArr.data() ||
+        !pointObservationsArr.data()) {
+      return nullptr;
+    }
+
+    cameraCal_ = {cameraCalArr.data()[0], cameraCalArr.data()[1],
+                  cameraCalArr.data()[2], cameraCalArr.data()[3]};
+    robot2cameraMat =
+        Eigen::Map<Eigen::Matrix<double, 4, 4, Eigen::RowMajor>>(
+            robot2cameraArr.data());
+    xGuessMat = Eigen::Map<constrained_solvepnp::RobotStateMat>(
+        xGuessArr.data());
+    field2pointsMat =
+        Eigen::Map<Eigen::Matrix<double, 4, Eigen::Dynamic, Eigen::RowMajor>>(
+            field2pointsArr.data(), 4, nField2points / 4);
+    pointObservationsMat =
+        Eigen::Map<Eigen::Matrix<double, 2, Eigen::Dynamic, Eigen::RowMajor>>(
+            pointObservationsArr.data(), 2, nObservations / 2);
+  }
 
   wpi::util::expected<constrained_solvepnp::RobotStateMat, slp::ExitStatus>
       result = constrained_solvepnp::do_optimization(
@@ -74,11 +180,95 @@ Java_org_photonvision_jni_ConstrainedSolvepnpJni_do_1optimization
           field2pointsMat, pointObservationsMat, gyro_θ, gyro_error_scale_fac);
 
   if (result) {
-    std::vector<double> resultVec{result->data(),
-                                  result->data() + result->size()};
-    return createJDoubleArray(env, resultVec);
+    jdoubleArray array = env->NewDoubleArray(result->size());
+    env->SetDoubleArrayRegion(array, 0, result->size(), result->data());
+    return array;
   } else {
     return nullptr;
   }
 }
+
+/*
+ * Class:     org_photonvision_jni_ConstrainedSolvepnpJni
+ * Method:    do_optimization_batch
+ * Signature: (ILjava/nio/ByteBuffer;Ljava/nio/ByteBuffer;)I
+ */
+JNIEXPORT jint JNICALL
+Java_org_photonvision_jni_ConstrainedSolvepnpJni_do_1optimization_1batch
+  (JNIEnv* env, jclass, jint nProblems, jobject problems, jobject results)
+{
+  auto* in = static_cast<const double*>(env->GetDirectBufferAddress(problems));
+  auto* out = static_cast<double*>(env->GetDirectBufferAddress(results));
+  CHECK_PTR_RETURN(in, -1);
+  CHECK_PTR_RETURN(out, -1);
+  if (nProblems <= 0) {
+    return 0;
+  }
+
+  const size_t inCapacity = env->GetDirectBufferCapacity(problems) /
+                            sizeof(double);
+  const size_t outCapacity = env->GetDirectBufferCapacity(results) /
+                             sizeof(double);
+  if (outCapacity < static_cast<size_t>(nProblems) * kResultDoubles) {
+    return -1;
+  }
+
+  // Walk the packed buffer once to find where each problem starts
+  std::vector<BatchProblem> batch;
+  batch.reserve(nProblems);
+  size_t offset = 0;
+  for (int i = 0; i < nProblems; i++) {
+    if (offset + kHeaderDoubles > inCapacity) {
+      return -1;
+    }
+    const double* h = in + offset;
+    // Check the tag count while it's still a double. Casting NaN, or
+    // something too big for an int, is undefined.
+    const size_t maxTags = (inCapacity - offset - kHeaderDoubles) /
+                           kDoublesPerTag;
+    if (!(h[1] >= 1.0 && h[1] <= static_cast<double>(maxTags)) ||
+        h[1] != std::floor(h[1])) {
+      return -1;
+    }
+    const int nTags = static_cast<int>(h[1]);
+    const size_t size = kHeaderDoubles + kDoublesPerTag * nTags;
+    batch.push_back(BatchProblem{
+        .headingFree = h[0] != 0.0,
+        .nTags = nTags,
+        .cameraCal = {h[2], h[3], h[4], h[5]},
+        .robot2camera = h + 6,
+        .xGuess = h + 22,
+        .gyroθ = h[25],
+        .gyroErrorScaleFac = h[26],
+        .field2points = h + kHeaderDoubles,
+        .pointObservations = h + kHeaderDoubles + 16 * nTags,
+    });
+    offset += size;
+  }
+
+  // Each problem only reads its own slice of the input and writes its own
+  // slice of the output
+  auto solve = [&](size_t i) { solveInto(batch[i], out + i * kResultDoubles); };
+  if (batch.size() < kMinParallelBatch) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      solve(i);
+    }
+  } else {
+    // Shared by every call, so a call doesn't pay for creating and joining
+    // threads. A call that finds it busy solves on its own thread instead of
+    // waiting.
+    static photon::WorkerPool pool{
+        std::thread::hardware_concurrency(),
+        photon::WorkerPool::BusyPolicy::kRunInline};
+    pool.ParallelFor(batch.size(), solve);
+  }
+
+  jint nSolved = 0;
+  for (size_t i = 0; i < batch.size(); i++) {
+    if (out[i * kResultDoubles] == 0.0) {
+      nSolved++;
+    }
+  }
+  return nSolved;
+}
 }  // extern "C"
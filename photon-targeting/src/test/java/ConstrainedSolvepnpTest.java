@@ -15,10 +15,14 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+import static org.junit.jupiter.api.Assertions.assertArrayEquals;
+import static org.junit.jupiter.api.Assertions.assertEquals;
 import static org.junit.jupiter.api.Assertions.assertNotNull;
 import static org.junit.jupiter.api.Assertions.fail;
 
 import java.io.IOException;
+import java.nio.ByteBuffer;
+import java.nio.ByteOrder;
 import java.util.Arrays;
 import org.junit.jupiter.api.AfterAll;
 import org.junit.jupiter.api.BeforeAll;
@@ -99,4 +103,52 @@ public class ConstrainedSolvepnpTest {
         assertNotNull(ret);
         System.out.println(Arrays.toString(ret));
     }
+
+    @Test
+    public void batchMatchesSingle() {
+        double[] cameraCal = {600, 600, 300, 150};
+        double[] robot2camera = {0, 0, 1, 0, -1, 0, 0, 0, 0, -1, 0, 0, 0, 0, 0, 1};
+        double[] x_guess = {0.2, 0.1, -.05};
+        // Row major, 4x4 and 2x4
+        double[] field2points = {
+            2.5, 2.5, 2.5, 2.5,
+            -0.08255, -0.08255, 0.08255, 0.08255,
+            0.5 - 0.08255, 0.5 + 0.08255, 0.5 + 0.08255, 0.5 - 0.08255,
+            1, 1, 1, 1
+        };
+        double[] point_observations = {333, 333, 267, 267, -17, -83, -83, -17};
+
+        var single =
+                ConstrainedSolvepnpJni.do_optimization(
+                        true, 1, cameraCal, robot2camera, x_guess, field2points, point_observations, 0, 0);
+        assertNotNull(single);
+
+        int nProblems = 8;
+        int problemDoubles =
+                ConstrainedSolvepnpJni.BATCH_HEADER_DOUBLES + ConstrainedSolvepnpJni.BATCH_DOUBLES_PER_TAG;
+        var problems =
+                ByteBuffer.allocateDirect(nProblems * problemDoubles * Double.BYTES)
+                        .order(ByteOrder.nativeOrder());
+        var results =
+                ByteBuffer.allocateDirect(
+                                nProblems * ConstrainedSolvepnpJni.BATCH_RESULT_DOUBLES * Double.BYTES)
+                        .order(ByteOrder.nativeOrder());
+
+        var problemDbl = problems.asDoubleBuffer();
+        for (int i = 0; i < nProblems; i++) {
+            problemDbl.put(1).put(1).put(cameraCal).put(robot2camera).put(x_guess).put(0).put(0);
+            problemDbl.put(field2points).put(point_observations);
+        }
+
+        assertEquals(
+                nProblems, ConstrainedSolvepnpJni.do_optimization_batch(nProblems, problems, results));
+
+        var resultDbl = results.asDoubleBuffer();
+        for (int i = 0; i < nProblems; i++) {
+            double[] result = new double[ConstrainedSolvepnpJni.BATCH_RESULT_DOUBLES];
+            resultDbl.get(result);
+            assertEquals(0, result[0]);
+            assertArrayEquals(single, Arrays.copyOfRange(result, 1, 4), 1e-9);
+        }
+    }
 }
@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "photon/estimation/CameraProjection.h"
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <random>
+#include <vector>
+
+#include <opencv2/calib3d.hpp>
+#include <opencv2/core.hpp>
+
+#include "gtest/gtest.h"
+#include "photon/estimation/CameraCalibration.h"
+#include "photon/estimation/IPPE.h"
+
+using namespace photon;
+
+namespace {
+CameraProjection::CameraMatrix TestCameraMatrix() {
+  CameraProjection::CameraMatrix cameraMatrix;
+  cameraMatrix << 900, 0, 640, 0, 910, 360, 0, 0, 1;
+  return cameraMatrix;
+}
+
+CameraProjection::DistortionCoeffs TestDistortion() {
+  CameraProjection::DistortionCoeffs distCoeffs;
+  distCoeffs << 0.1, -0.2, 0.001, -0.002, 0.05, 0.01, -0.02, 0.03;
+  return distCoeffs;
+}
+}  // namespace
+
+TEST(CameraProjectionTest, MatchesOpenCV) {
+  auto cameraMatrix = TestCameraMatrix();
+  auto distCoeffs = TestDistortion();
+
+  // Enough points to cover several full blocks and a partial one
+  constexpr int kNumPoints = 37;
+  std::mt19937 gen{42};
+  std::uniform_real_distribution<double> dist{-1.0, 1.0};
+  Eigen::Matrix3Xd objectPoints(3, kNumPoints);
+  std::vector<cv::Point3d> cvObjectPoints;
+  for (int i = 0; i < kNumPoints; i++) {
+    objectPoints.col(i) << dist(gen), dist(gen), 2.0 + dist(gen);
+    cvObjectPoints.emplace_back(objectPoints(0, i), objectPoints(1, i),
+                                objectPoints(2, i));
+  }
+
+  cv::Vec3d rvec{0.1, -0.2, 0.3};
+  cv::Vec3d tvec{0.1, 0.2, 1.0};
+  cv::Matx33d cvRotation;
+  cv::Rodrigues(rvec, cvRotation);
+  Eigen::Matrix3d rotation;
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 3; c++) {
+      rotation(r, c) = cvRotation(r, c);
+    }
+  }
+
+  Eigen::Matrix2Xd imagePoints(2, kNumPoints);
+  CameraProjection::ProjectPoints(cameraMatrix, distCoeffs, rotation,
+                                  Eigen::Vector3d{tvec[0], tvec[1], tvec[2]},
+                                  objectPoints, imagePoints);
+
+  cv::Matx33d cvCameraMatrix{900, 0, 640, 0, 910, 360, 0, 0, 1};
+  std::vector<double> cvDistCoeffs{distCoeffs.data(), distCoeffs.data() + 8};
+  std::vector<cv::Point2d> expected;
+  cv::projectPoints(cvObjectPoints, rvec, tvec, cvCameraMatrix, cvDistCoeffs,
+                    expected);
+
+  for (int i = 0; i < kNumPoints; i++) {
+    EXPECT_NEAR(expected[i].x, imagePoints(0, i), 1e-6);
+    EXPECT_NEAR(expected[i].y, imagePoints(1, i), 1e-6);
+  }
+}
+
+TEST(CameraProjectionTest, NoDistortionIsPinhole) {
+  auto cameraMatrix = TestCameraMatrix();
+
+  Eigen::Matrix3Xd cameraPoints(3, 2);
+  cameraPoints << 0, 1, 0, -0.5, 2, 4;
+  Eigen::Matrix2Xd imagePoints(2, 2);
+  CameraProjection::ProjectCameraPoints(
+      cameraMatrix, CameraProjection::DistortionCoeffs::Zero(), cameraPoints,
+      imagePoints);
+
+  EXPECT_DOUBLE_EQ(640, imagePoints(0, 0));
+  EXPECT_DOUBLE_EQ(360, imagePoints(1, 0));
+  EXPECT_DOUBLE_EQ(640 + 900 * 0.25, imagePoints(0, 1));
+  EXPECT_DOUBLE_EQ(360 - 910 * 0.125, imagePoints(1, 1));
+}
+
+TEST(CameraProjectionTest, UndistortInvertsProjection) {
+  auto cameraMatrix = TestCameraMatrix();
+  auto distCoeffs = TestDistortion();
+
+  Eigen::Matrix3Xd cameraPoints(3, 3);
+  cameraPoints << 0.1, -0.3, 0.25, -0.2, 0.15, 0.3, 1, 1, 1;
+  Eigen::Matrix2Xd imagePoints(2, 3);
+  CameraProjection::ProjectCameraPoints(cameraMatrix, distCoeffs, cameraPoints,
+                                        imagePoints);
+  Eigen::Matrix2Xd normalized(2, 3);
+  CameraProjection::UndistortPoints(cameraMatrix, distCoeffs, imagePoints,
+                                    normalized, 50);
+
+  for (int i = 0; i < 3; i++) {
+    EXPECT_NEAR(cameraPoints(0, i), normalized(0, i), 1e-9);
+    EXPECT_NEAR(cameraPoints(1, i), normalized(1, i), 1e-9);
+  }
+}
+
+TEST(CameraProjectionTest, IPPEMatchesOpenCV) {
+  auto cameraMatrix = TestCameraMatrix();
+  auto distCoeffs = TestDistortion();
+
+  // The corner order OpenCV's IPPE_SQUARE expects
+  constexpr double kHalfSize = 0.0825;
+  IPPE::ObjectQuad objectPoints;
+  objectPoints << -kHalfSize, kHalfSize, kHalfSize, -kHalfSize, kHalfSize,
+      kHalfSize, -kHalfSize, -kHalfSize, 0, 0, 0, 0;
+
+  cv::Vec3d rvec{0.3, -0.4, 0.1};
+  cv::Vec3d tvec{0.2, -0.1, 2.5};
+  cv::Matx33d cvRotation;
+  cv::Rodrigues(rvec, cvRotation);
+  Eigen::Matrix3d rotation;
+  for (int r = 0; r < 3; r++) {
+    for (int c = 0; c < 3; c++) {
+      rotation(r, c) = cvRotation(r, c);
+    }
+  }
+
+  Eigen::Matrix2Xd projected(2, 4);
+  CameraProjection::ProjectPoints(cameraMatrix, distCoeffs, rotation,
+                                  Eigen::Vector3d{tvec[0], tvec[1], tvec[2]},
+                                  objectPoints, projected);
+  // A little noise so both solutions have nonzero error
+  IPPE::ImageQuad imagePoints = projected;
+  imagePoints(0, 0) += 0.4;
+  imagePoints(1, 2) -= 0.3;
+
+  auto solutions =
+      IPPE::SolveQuad(cameraMatrix, distCoeffs, objectPoints, imagePoints);
+  ASSERT_TRUE(solutions.has_value());
+  EXPECT_LE(solutions->best.reprojectionError,
+            solutions->alt.reprojectionError);
+
+  std::vector<cv::Point3d> cvObjectPoints;
+  std::vector<cv::Point2d> cvImagePoints;
+  for (int i = 0; i < 4; i++) {
+    cvObjectPoints.emplace_back(objectPoints(0, i), objectPoints(1, i), 0);
+    cvImagePoints.emplace_back(imagePoints(0, i), imagePoints(1, i));
+  }
+  cv::Matx33d cvCameraMatrix{900, 0, 640, 0, 910, 360, 0, 0, 1};
+  std::vector<double> cvDistCoeffs{distCoeffs.data(), distCoeffs.data() + 8};
+  std::vector<cv::Mat> rvecs;
+  std::vector<cv::Mat> tvecs;
+  std::vector<double> errors;
+  cv::solvePnPGeneric(cvObjectPoints, cvImagePoints, cvCameraMatrix,
+                      cvDistCoeffs, rvecs, tvecs, false,
+                      cv::SOLVEPNP_IPPE_SQUARE, cv::noArray(), cv::noArray(),
+                      errors);
+  ASSERT_EQ(2u, rvecs.size());
+
+  const IPPE::Solution* ours[] = {&solutions->best, &solutions->alt};
+  for (int k = 0; k < 2; k++) {
+    cv::Matx33d expectedRotation;
+    cv::Rodrigues(rvecs[k], expectedRotation);
+    for (int r = 0; r < 3; r++) {
+      for (int c = 0; c < 3; c++) {
+        EXPECT_NEAR(expectedRotation(r, c), ours[k]->rotation(r, c), 1e-6);
+      }
+      EXPECT_NEAR(tvecs[k].at<double>(r), ours[k]->translation(r), 1e-6);
+    }
+    EXPECT_NEAR(errors[k], ours[k]->reprojectionError, 1e-6);
+  }
+}
+
+TEST(CameraProjectionTest, IPPEBatchMatchesSingle) {
+  auto cameraMatrix = TestCameraMatrix();
+  auto distCoeffs = TestDistortion();
+
+  IPPE::ObjectQuad objectPoints;
+  objectPoints << -1, 1, 1, -1, 1, 1, -1, -1, 0, 0, 0, 0;
+  std::vector<IPPE::ImageQuad> imagePoints(3);
+  imagePoints[0] << 600, 700, 705, 598, 300, 302, 401, 398;
+  imagePoints[1] << 100, 160, 158, 101, 600, 603, 660, 655;
+  // Corners that all land on one pixel have no solution
+  imagePoints[2] << 50, 50, 50, 50, 80, 80, 80, 80;
+
+  std::vector<std::optional<IPPE::QuadSolutions>> batch(3);
+  IPPE::SolveQuadBatch(cameraMatrix, distCoeffs, {&objectPoints, 1},
+                       imagePoints, batch);
+
+  for (int i = 0; i < 2; i++) {
+    auto single =
+        IPPE::SolveQuad(cameraMatrix, distCoeffs, objectPoints, imagePoints[i]);
+    ASSERT_TRUE(single.has_value());
+    ASSERT_TRUE(batch[i].has_value());
+    EXPECT_TRUE(single->best.rotation.isApprox(batch[i]->best.rotation));
+    EXPECT_TRUE(single->best.translation.isApprox(batch[i]->best.translation));
+  }
+  EXPECT_FALSE(batch[2].has_value());
+}
+
+TEST(CameraProjectionTest, CalibrationUndistorts) {
+  Eigen::Matrix3Xd cameraPoints(3, 2);
+  cameraPoints << 0.1, -0.3, -0.2, 0.15, 1, 1;
+  Eigen::Matrix2Xd imagePoints(2, 2);
+  Eigen::Matrix2Xd normalized(2, 2);
+
+  for (const auto& distCoeffs :
+       {CameraProjection::DistortionCoeffs{TestDistortion()},
+        CameraProjection::DistortionCoeffs{
+            CameraProjection::DistortionCoeffs::Zero()}}) {
+    CameraCalibration calibration{TestCameraMatrix(), distCoeffs};
+    EXPECT_EQ(!distCoeffs.isZero(), calibration.HasDistortion());
+    EXPECT_EQ(3, calibration.GetCvCameraMatrix().rows);
+    EXPECT_EQ(8, calibration.GetCvDistCoeffs().rows);
+
+    CameraProjection::ProjectCameraPoints(calibration.GetCameraMatrix(),
+                                          calibration.GetDistCoeffs(),
+                                          cameraPoints, imagePoints);
+    calibration.UndistortPoints(imagePoints, normalized);
+    EXPECT_TRUE(normalized.isApprox(cameraPoints.topRows<2>(), 1e-6));
+  }
+}
+
+TEST(CameraProjectionTest, SphereBoundsFitSilhouette) {
+  auto cameraMatrix = TestCameraMatrix();
+
+  Eigen::Matrix3Xd centers(3, 3);
+  centers << 0.2, -0.8, 0, -0.1, 0.5, 0, 2, 3, -1;
+  std::vector<double> radii{0.15, 0.3, 0.2};
+  Eigen::Matrix2Xd corners(2, 12);
+  CameraProjection::ProjectSphereBounds(
+      cameraMatrix, CameraProjection::DistortionCoeffs::Zero(), centers, radii,
+      corners);
+
+  // Project points all over each sphere, and measure how far they reach
+  // along the rectangle's axes
+  std::mt19937 gen{7};
+  std::normal_distribution<double> dist{};
+  for (int i = 0; i < 2; i++) {
+    Eigen::Matrix<double, 2, 4> rect = corners.middleCols<4>(4 * i);
+    Eigen::Vector2d center = rect.rowwise().mean();
+    Eigen::Vector2d width = rect.col(2) - rect.col(1);
+    Eigen::Vector2d height = rect.col(0) - rect.col(1);
+    double maxWidth = 0;
+    double maxHeight = 0;
+    for (int k = 0; k < 20000; k++) {
+      Eigen::Vector3d point =
+          centers.col(i) +
+          radii[i] * Eigen::Vector3d{dist(gen), dist(gen), dist(gen)}
+                         .normalized();
+      Eigen::Vector2d pixel =
+          (cameraMatrix * point).head<2>() / point.z() - center;
+      maxWidth = std::max(maxWidth, std::abs(pixel.dot(width.normalized())));
+      maxHeight =
+          std::max(maxHeight, std::abs(pixel.dot(height.normalized())));
+    }
+    EXPECT_NEAR(width.norm() / 2, maxWidth, width.norm() * 0.01);
+    EXPECT_NEAR(height.norm() / 2, maxHeight, height.norm() * 0.01);
+    EXPECT_LE(maxWidth, width.norm() / 2 + 1e-6);
+    EXPECT_LE(maxHeight, height.norm() / 2 + 1e-6);
+  }
+  // Behind the camera
+  EXPECT_TRUE(corners.middleCols<4>(8).hasNaN());
+
+  // Distortion moves the corners the same as projecting them directly
+  auto distCoeffs = TestDistortion();
+  Eigen::Matrix2Xd distorted(2, 8);
+  CameraProjection::ProjectSphereBounds(cameraMatrix, distCoeffs,
+                                        centers.leftCols<2>(), radii,
+                                        distorted);
+  Eigen::Matrix3Xd rays(3, 8);
+  rays.topRows<2>() = (cameraMatrix.topLeftCorner<2, 2>().inverse() *
+                       (corners.leftCols<8>().colwise() -
+                        cameraMatrix.topRightCorner<2, 1>()));
+  rays.row(2).setOnes();
+  Eigen::Matrix2Xd expected(2, 8);
+  CameraProjection::ProjectCameraPoints(cameraMatrix, distCoeffs, rays,
+                                        expected);
+  EXPECT_TRUE(distorted.isApprox(expected, 1e-9));
+}
@@ -15,12 +15,19 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cmath>
+#include <random>
+#include <vector>
+
+#include <Eigen/LU>
 #include <gtest/gtest.h>
 #include <wpi/math/fmt/Eigen.hpp>
 #include <wpi/util/print.hpp>
 #include <wpi/util/timestamp.h>
 
 #include "photon/constrained_solvepnp/wrap/casadi_wrapper.h"
+#include "photon/constrained_solvepnp/wrap/sliding_window_solver.h"
 
 #define TAG_COUNT 6
 #if TAG_COUNT < 1
@@ -181,3 +188,142 @@ void print_cost(casadi_real robot_x, casadi_real robot_y,
 }
 
 TEST(CasadiWrapperTest, smoketest) { print_cost(0.1, 0.1, 0.0); }
+
+TEST(CasadiWrapperTest, SlidingWindowTracksTrajectory) {
+  using constrained_solvepnp::RobotStateMat;
+
+  const constrained_solvepnp::CameraCalibration cal{600, 600, 300, 150};
+
+  Eigen::Matrix<casadi_real, 4, 4, Eigen::ColMajor> robot2camera;
+  // clang-format off
+  robot2camera <<
+    0, 0, 1, 0,
+    -1, 0, 0, 0,
+    0, -1, 0, 0,
+    0, 0, 0, 1;
+  // clang-format on
+
+  // A single tag, so each frame on its own is poorly conditioned
+  Eigen::Matrix<casadi_real, 4, 4, Eigen::ColMajor> field2points;
+  // clang-format off
+  field2points <<
+    3, 3, 3, 3,
+    -0.08255, -0.08255, 0.08255, 0.08255,
+    0.5 - 0.08255, 0.5 + 0.08255, 0.5 + 0.08255, 0.5 - 0.08255,
+    1, 1, 1, 1;
+  // clang-format on
+
+  std::mt19937 gen{1234};
+  std::normal_distribution<double> pixelNoise{0.0, 1.0};
+
+  auto observe = [&](const RobotStateMat& x) {
+    Eigen::Matrix<casadi_real, 4, 4> field2robot;
+    // clang-format off
+    field2robot <<
+      std::cos(x(2)), -std::sin(x(2)), 0, x(0),
+      std::sin(x(2)), std::cos(x(2)), 0, x(1),
+      0, 0, 1, 0,
+      0, 0, 0, 1;
+    // clang-format on
+    Eigen::Matrix<casadi_real, 4, 4> camera2points =
+        (field2robot * robot2camera).inverse() * field2points;
+    Eigen::Matrix<casadi_real, 2, Eigen::Dynamic, Eigen::ColMajor> px(2, 4);
+    for (int i = 0; i < 4; i++) {
+      px(0, i) = cal.fx * camera2points(0, i) / camera2points(2, i) + cal.cx +
+                 pixelNoise(gen);
+      px(1, i) = cal.fy * camera2points(1, i) / camera2points(2, i) + cal.cy +
+                 pixelNoise(gen);
+    }
+    return px;
+  };
+
+  constrained_solvepnp::SlidingWindowSolver solver{
+      5, 1.0, RobotStateMat{0.01, 0.01, 0.005}};
+
+  RobotStateMat truth{0.0, 0.2, 0.1};
+  const RobotStateMat step{0.05, 0.0, -0.02};
+
+  // Accumulated squared position error, for the smoother vs independent solves
+  double windowErr = 0;
+  double singleErr = 0;
+
+  for (int frame = 0; frame < 20; frame++) {
+    if (frame > 0) {
+      const double c = std::cos(truth(2));
+      const double s = std::sin(truth(2));
+      truth = RobotStateMat{truth(0) + c * step(0) - s * step(1),
+                            truth(1) + s * step(0) + c * step(1),
+                            truth(2) + step(2)};
+    }
+
+    const RobotStateMat guess = truth + RobotStateMat{0.1, -0.1, 0.05};
+    constrained_solvepnp::FrameObservation obs{
+        true, 1, cal, robot2camera, field2points, observe(truth), 0, 0};
+
+    auto single = constrained_solvepnp::do_optimization(
+        true, 1, cal, robot2camera, guess, field2points,
+        obs.point_observations, 0, 0);
+    auto result = solver.add_frame(obs, step, guess);
+    ASSERT_TRUE(single.has_value()) << "frame " << frame;
+    ASSERT_TRUE(result.has_value()) << "frame " << frame;
+
+    EXPECT_LE(solver.size(), 5);
+    EXPECT_EQ(solver.window_states().back(), *result);
+
+    windowErr += (*result - truth).head<2>().squaredNorm();
+    singleErr += (*single - truth).head<2>().squaredNorm();
+  }
+
+  wpi::util::println("Sliding window RMS {} m, independent RMS {} m",
+                     std::sqrt(windowErr / 20), std::sqrt(singleErr / 20));
+  EXPECT_LT(windowErr, 0.5 * singleErr);
+
+  solver.reset();
+  EXPECT_EQ(0, solver.size());
+  EXPECT_FALSE(solver.latest_estimate().has_value());
+}
+
+TEST(CasadiWrapperTest, SlidingWindowKeepsOdometryOfRejectedFrames) {
+  using constrained_solvepnp::RobotStateMat;
+
+  const constrained_solvepnp::CameraCalibration cal{600, 600, 300, 150};
+  constrained_solvepnp::SlidingWindowSolver solver{
+      5, 1.0, RobotStateMat{0.01, 0.01, 0.005}};
+
+  RobotStateMat expected{0.0, 0.2, 0.1};
+  const RobotStateMat step{0.05, 0.0, -0.02};
+
+  for (int frame = 0; frame < 10; frame++) {
+    if (frame > 0) {
+      const double c = std::cos(expected(2));
+      const double s = std::sin(expected(2));
+      expected = RobotStateMat{expected(0) + c * step(0) - s * step(1),
+                               expected(1) + s * step(0) + c * step(1),
+                               expected(2) + step(2)};
+    }
+
+    // Frame 4 has more tags than there's generated code for, and frame 6 has
+    // too few corners for its tag count. The rest are odometry-only.
+    const int nTags = frame == 4 ? 11 : (frame == 6 ? 1 : 0);
+    const int nCorners = frame == 6 ? 3 : 4 * nTags;
+    constrained_solvepnp::FrameObservation obs{
+        true,
+        nTags,
+        cal,
+        Eigen::Matrix<casadi_real, 4, 4>::Identity(),
+        Eigen::Matrix<casadi_real, 4, Eigen::Dynamic>::Zero(4, nCorners),
+        Eigen::Matrix<casadi_real, 2, Eigen::Dynamic>::Zero(2, nCorners),
+        0,
+        0};
+
+    auto result = solver.add_frame(obs, step, expected);
+    EXPECT_EQ(frame != 4 && frame != 6, result.has_value())
+        << "frame " << frame;
+
+    // Rejected frames still advance the window along the odometry chain
+    EXPECT_EQ(std::min(frame + 1, 5), solver.size()) << "frame " << frame;
+    ASSERT_TRUE(solver.latest_estimate().has_value());
+    EXPECT_LT((*solver.latest_estimate() - expected).norm(), 1e-9)
+        << "frame " << frame;
+  }
+}
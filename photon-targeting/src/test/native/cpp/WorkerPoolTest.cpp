@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "photon/util/WorkerPool.h"
+
+TEST(WorkerPoolTest, RunsEveryIndexOnce) {
+  photon::WorkerPool pool{4};
+  std::vector<int> hits(1000, 0);
+  pool.ParallelFor(hits.size(), [&](size_t i) { hits[i]++; });
+  for (int hit : hits) {
+    EXPECT_EQ(1, hit);
+  }
+}
+
+TEST(WorkerPoolTest, RethrowsAfterTheRestFinish) {
+  photon::WorkerPool pool{4};
+  std::atomic<int> ran{0};
+  EXPECT_THROW(pool.ParallelFor(100,
+                                [&](size_t i) {
+                                  ran++;
+                                  if (i == 10) {
+                                    throw std::runtime_error{"bad index"};
+                                  }
+                                }),
+               std::runtime_error);
+  EXPECT_EQ(100, ran);
+
+  // The pool is still usable afterwards
+  ran = 0;
+  pool.ParallelFor(100, [&](size_t) { ran++; });
+  EXPECT_EQ(100, ran);
+}
+
+TEST(WorkerPoolTest, BusyPoolRunsInline) {
+  photon::WorkerPool pool{4, photon::WorkerPool::BusyPolicy::kRunInline};
+  std::atomic<bool> release{false};
+  std::atomic<bool> started{false};
+  std::thread first{[&] {
+    pool.ParallelFor(8, [&](size_t) {
+      started = true;
+      while (!release) {
+        std::this_thread::yield();
+      }
+    });
+  }};
+  while (!started) {
+    std::this_thread::yield();
+  }
+
+  // The workers are all taken, so this batch has to run on this thread
+  const auto caller = std::this_thread::get_id();
+  std::vector<std::thread::id> ranOn(8);
+  pool.ParallelFor(ranOn.size(),
+                   [&](size_t i) { ranOn[i] = std::this_thread::get_id(); });
+  for (const auto& id : ranOn) {
+    EXPECT_EQ(caller, id);
+  }
+
+  release = true;
+  first.join();
+}
@@ -0,0 +1,334 @@
+/*
+ * Copyright (C) Photon Vision.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Convergence and accuracy harness for TimeSync. A real server and client
+ * talk over loopback through a proxy that impairs the link, while the
+ * server's clock runs offset from, and drifting against, the client's. Both
+ * clocks are derived from one steady clock, so the client's error is known
+ * exactly at every instant.
+ *
+ * These use real sockets and wall-clock timing, and the full sweep takes a
+ * few minutes, so they only run when the PHOTON_TIMESYNC_HARNESS
+ * environment variable is set, e.g.
+ *
+ *   PHOTON_TIMESYNC_HARNESS=1 ./photon-targetingTest \
+ *       --gtest_filter='*Harness*'
+ *
+ * Run it before and after changing the client's filter to compare the two.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fmt/core.h>
+#include <gtest/gtest.h>
+#include <net/TimeSyncClient.h>
+#include <net/TimeSyncServer.h>
+#include <wpi/net/EventLoopRunner.hpp>
+#include <wpi/net/uv/Buffer.hpp>
+#include <wpi/net/uv/Timer.hpp>
+#include <wpi/net/uv/Udp.hpp>
+#include <wpi/net/uv/util.hpp>
+#include <wpi/util/SmallVector.hpp>
+
+namespace {
+using namespace std::chrono_literals;
+
+/** How one direction of the link misbehaves. */
+struct LinkImpairment {
+  // Fixed one way delay
+  std::chrono::milliseconds delay{0};
+  // Mean of an exponentially distributed queueing delay on top of that
+  std::chrono::milliseconds jitter{0};
+  // Fraction of packets dropped
+  double loss{0};
+  // Fraction of packets held back by reorderDelay, so later ones pass them
+  double reorder{0};
+  std::chrono::milliseconds reorderDelay{0};
+};
+
+/**
+ * Forwards UDP between one client and a server, impairing each direction
+ * independently. libuv timers tick in milliseconds, so delays are rounded
+ * to that.
+ */
+class ImpairmentProxy {
+ public:
+  ImpairmentProxy(int port, int serverPort, LinkImpairment up,
+                  LinkImpairment down, uint32_t seed)
+      : m_port{port},
+        m_serverPort{serverPort},
+        m_up{up},
+        m_down{down},
+        m_rng{seed} {}
+
+  void Start() {
+    m_loopRunner.ExecSync([this](wpi::net::uv::Loop& loop) {
+      struct sockaddr_in serverAddr;
+      wpi::net::uv::NameToAddr("127.0.0.1", m_serverPort, &serverAddr);
+
+      m_front = wpi::net::uv::Udp::Create(loop, AF_INET);
+      m_front->Bind("127.0.0.1", m_port);
+      m_front->received.connect([this](wpi::net::uv::Buffer& buf, size_t n,
+                                       const sockaddr& sender, unsigned) {
+        std::memcpy(&m_client, &sender, sizeof(m_client));
+        Forward(m_up, buf.bytes().subspan(0, n), true);
+      });
+
+      m_back = wpi::net::uv::Udp::Create(loop, AF_INET);
+      m_back->Connect(serverAddr);
+      m_back->received.connect([this](wpi::net::uv::Buffer& buf, size_t n,
+                                      const sockaddr&, unsigned) {
+        Forward(m_down, buf.bytes().subspan(0, n), false);
+      });
+
+      m_front->StartRecv();
+      m_back->StartRecv();
+    });
+  }
+
+  void Stop() { m_loopRunner.Stop(); }
+
+ private:
+  // Drops, delays, or passes on one datagram. Runs on the loop.
+  void Forward(const LinkImpairment& link, std::span<const uint8_t> data,
+               bool toServer) {
+    if (m_uniform(m_rng) < link.loss) {
+      return;
+    }
+    double delayMs = link.delay.count();
+    if (link.jitter > 0ms) {
+      delayMs += std::exponential_distribution<double>{
+          1.0 / link.jitter.count()}(m_rng);
+    }
+    if (m_uniform(m_rng) < link.reorder) {
+      delayMs += link.reorderDelay.count();
+    }
+
+    auto packet = std::make_shared<std::vector<uint8_t>>(data.begin(),
+                                                         data.end());
+    auto send = [this, packet, toServer] {
+      wpi::net::uv::Buffer buf{std::span<const uint8_t>{*packet}};
+      wpi::util::SmallVector<wpi::net::uv::Buffer, 1> bufs{buf};
+      if (toServer) {
+        m_back->TrySend(bufs);
+      } else {
+        m_front->TrySend(reinterpret_cast<const sockaddr&>(m_client), bufs);
+      }
+    };
+
+    wpi::net::uv::Timer::Time delay{
+        static_cast<uint64_t>(std::llround(delayMs))};
+    if (delay.count() == 0) {
+      send();
+    } else {
+      wpi::net::uv::Timer::SingleShot(m_loopRunner.GetLoop(), delay, send);
+    }
+  }
+
+  wpi::net::EventLoopRunner m_loopRunner;
+  int m_port;
+  int m_serverPort;
+  LinkImpairment m_up;
+  LinkImpairment m_down;
+  std::mt19937 m_rng;
+  std::uniform_real_distribution<double> m_uniform{0.0, 1.0};
+  std::shared_ptr<wpi::net::uv::Udp> m_front;
+  std::shared_ptr<wpi::net::uv::Udp> m_back;
+  sockaddr_in m_client{};
+};
+
+struct Scenario {
+  std::string name;
+  LinkImpairment up;
+  LinkImpairment down;
+  // Server clock minus client clock when the run starts
+  std::chrono::milliseconds offset{0};
+  // How much faster the server clock runs, in parts per million
+  double driftPpm{0};
+  bool kernelTimestamps{false};
+};
+
+struct Report {
+  // When the error settled within kConvergedError for good, if it ever did
+  std::optional<double> convergenceSeconds;
+  // Offset error once settled, or over the second half if it never did, in
+  // microseconds
+  double rmsError{0};
+  double maxError{0};
+  size_t pingsSent{0};
+  size_t pongsReceived{0};
+};
+
+constexpr double kConvergedError = 1000;
+constexpr auto kSamplePeriod = 10ms;
+constexpr uint32_t kSeed = 49;
+
+uint64_t LocalNow() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+Report Run(const Scenario& scenario, std::chrono::milliseconds duration,
+           std::chrono::milliseconds pingPeriod, int port) {
+  const uint64_t start = LocalNow();
+  const int64_t offset =
+      std::chrono::duration_cast<std::chrono::microseconds>(scenario.offset)
+          .count();
+  const double drift = scenario.driftPpm * 1e-6;
+  auto trueOffset = [=](uint64_t local) {
+    return offset + std::llround(drift * static_cast<int64_t>(local - start));
+  };
+
+  wpi::tsp::TimeSyncServer server{port, scenario.kernelTimestamps};
+  server.SetTimeProvider([=] {
+    uint64_t local = LocalNow();
+    return local + trueOffset(local);
+  });
+  ImpairmentProxy proxy{port + 1, port, scenario.up, scenario.down, kSeed};
+  wpi::tsp::TimeSyncClient client{"127.0.0.1", port + 1, pingPeriod,
+                                  scenario.kernelTimestamps};
+  client.SetTimeProvider(LocalNow);
+
+  server.Start();
+  proxy.Start();
+  client.Start();
+
+  // Seconds since the start, and the client's error at that moment
+  std::vector<std::pair<double, double>> errors;
+  const auto end = std::chrono::steady_clock::now() + duration;
+  while (std::chrono::steady_clock::now() < end) {
+    std::this_thread::sleep_for(kSamplePeriod);
+    uint64_t now = LocalNow();
+    errors.emplace_back(
+        (now - start) / 1e6,
+        static_cast<double>(client.GetOffset(now) - trueOffset(now)));
+  }
+
+  auto metadata = client.GetMetadata();
+  client.Stop();
+  proxy.Stop();
+  server.Stop();
+
+  Report report{.pingsSent = metadata.pingsSent,
+                .pongsReceived = metadata.pongsReceived};
+  auto lastUnsettled =
+      std::find_if(errors.rbegin(), errors.rend(), [](const auto& sample) {
+        return std::abs(sample.second) > kConvergedError;
+      });
+  size_t settled = errors.rend() - lastUnsettled;
+  if (settled < errors.size()) {
+    report.convergenceSeconds = errors[settled].first;
+  } else {
+    settled = errors.size() / 2;
+  }
+
+  double sumSquares = 0;
+  for (size_t i = settled; i < errors.size(); i++) {
+    sumSquares += errors[i].second * errors[i].second;
+    report.maxError = std::max(report.maxError, std::abs(errors[i].second));
+  }
+  report.rmsError = std::sqrt(sumSquares / (errors.size() - settled));
+  return report;
+}
+}  // namespace
+
+TEST(TimeSyncHarnessTest, ConvergesThroughImpairedLink) {
+  if (std::getenv("PHOTON_TIMESYNC_HARNESS") == nullptr) {
+    GTEST_SKIP() << "Set PHOTON_TIMESYNC_HARNESS to run";
+  }
+
+  // GIVEN a server half a second ahead, drifting 50 ppm, behind a jittery
+  // link that drops one packet in ten
+  LinkImpairment link{.delay = 1ms, .jitter = 2ms, .loss = 0.1};
+  Scenario scenario{"impaired", link, link, 500ms, 50};
+
+  // WHEN the client pings it for a few seconds
+  Report report = Run(scenario, 4s, 20ms, 5820);
+
+  // THEN it locks on well within a millisecond
+  EXPECT_GT(report.pongsReceived, 0u);
+  ASSERT_TRUE(report.convergenceSeconds.has_value());
+  EXPECT_LT(*report.convergenceSeconds, 2.0);
+  EXPECT_LT(report.rmsError, kConvergedError);
+}
+
+TEST(TimeSyncHarnessTest, Sweep) {
+  if (std::getenv("PHOTON_TIMESYNC_HARNESS") == nullptr) {
+    GTEST_SKIP() << "Set PHOTON_TIMESYNC_HARNESS to run";
+  }
+
+  LinkImpairment jittery{.delay = 2ms, .jitter = 3ms};
+  std::vector<Scenario> scenarios{
+      {"clean", {}, {}, 250ms},
+      {"jitter", jittery, jittery, 250ms},
+      // A fixed asymmetry can't be seen from one end, so expect it to bias
+      // the offset by half the difference
+      {"asymmetric delay", {.delay = 1ms}, {.delay = 5ms}, 250ms},
+      {"queueing on return", {.delay = 1ms}, {.delay = 1ms, .jitter = 5ms},
+       250ms},
+      {"20% loss",
+       {.delay = 2ms, .jitter = 3ms, .loss = 0.2},
+       {.delay = 2ms, .jitter = 3ms, .loss = 0.2},
+       250ms},
+      {"reordering",
+       {.delay = 2ms, .jitter = 3ms, .reorder = 0.2, .reorderDelay = 80ms},
+       {.delay = 2ms, .jitter = 3ms, .reorder = 0.2, .reorderDelay = 80ms},
+       250ms},
+      {"100 ppm drift", jittery, jittery, -1500ms, 100},
+      {"400 ppm drift", jittery, jittery, 1500ms, -400},
+      {"everything",
+       {.delay = 1ms, .jitter = 3ms, .loss = 0.1, .reorder = 0.1,
+        .reorderDelay = 80ms},
+       {.delay = 4ms, .jitter = 6ms, .loss = 0.1, .reorder = 0.1,
+        .reorderDelay = 80ms},
+       -1500ms, 100},
+  };
+
+  fmt::println("{:<22} {:>6} {:>10} {:>10} {:>10} {:>12}", "scenario",
+               "kernel", "converge", "rms (us)", "max (us)", "pongs/pings");
+  int port = 5830;
+  for (auto scenario : scenarios) {
+    for (bool kernelTimestamps : {false, true}) {
+      scenario.kernelTimestamps = kernelTimestamps;
+      Report report = Run(scenario, 15s, 50ms, port);
+      port += 2;
+
+      std::string converge =
+          report.convergenceSeconds
+              ? fmt::format("{:.2f} s", *report.convergenceSeconds)
+              : "never";
+      fmt::println("{:<22} {:>6} {:>10} {:>10.0f} {:>10.0f} {:>5}/{:<6}",
+                   scenario.name, kernelTimestamps ? "yes" : "no", converge,
+                   report.rmsError, report.maxError, report.pongsReceived,
+                   report.pingsSent);
+    }
+  }
+}
@@ -15,6 +15,8 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <cstdlib>
+
 #include <gtest/gtest.h>
 #include <net/TimeSyncClient.h>
 #include <net/TimeSyncServer.h>
@@ -40,6 +42,60 @@ TEST(TimeSyncProtocolTest, Smoketest) {
   server.Stop();
 }
 
+TEST(TimeSyncProtocolTest, KernelTimestamps) {
+  using namespace wpi::tsp;
+  using namespace std::chrono_literals;
+
+  // GIVEN a server and client both asking for kernel timestamps
+  TimeSyncServer server{5813, true};
+  TimeSyncClient client{"127.0.0.1", 5813, 50ms, true};
+
+  server.Start();
+  client.Start();
+  std::this_thread::sleep_for(500ms);
+  TimeSyncClient::Metadata m = client.GetMetadata();
+  server.Stop();
+
+  // THEN pongs keep coming either way, and on Linux the kernel stamps them
+#ifdef __linux__
+  EXPECT_TRUE(m.kernelTimestamps);
+#else
+  EXPECT_FALSE(m.kernelTimestamps);
+#endif
+  EXPECT_GT(m.pongsReceived, 0u);
+  // Both ends share a clock on loopback
+  EXPECT_LT(std::abs(m.offset), 1000);
+  EXPECT_GE(m.rtt2, 0);
+}
+
+TEST(TimeSyncProtocolTest, ServerTracksClients) {
+  using namespace wpi::tsp;
+  using namespace std::chrono_literals;
+
+  // GIVEN a server with two clients pinging it at 20 Hz
+  TimeSyncServer server{5814};
+  TimeSyncClient first{"127.0.0.1", 5814, 50ms};
+  TimeSyncClient second{"127.0.0.1", 5814, 50ms};
+
+  server.Start();
+  first.Start();
+  second.Start();
+  std::this_thread::sleep_for(1s);
+  auto stats = server.GetClientStats();
+  server.Stop();
+
+  // THEN the server tells them apart, and knows how each is doing
+  ASSERT_EQ(2u, stats.size());
+  for (const auto& client : stats) {
+    EXPECT_TRUE(client.address.starts_with("127.0.0.1:"));
+    EXPECT_GT(client.pingsReceived, 5u);
+    EXPECT_NEAR(20, client.pingRate, 10);
+    EXPECT_TRUE(client.reportsStats);
+    EXPECT_GE(client.rtt2, 0);
+  }
+  EXPECT_NE(stats[0].address, stats[1].address);
+}
+
 TEST(TimeSyncClientTest, CalculateZero) {
   using namespace wpi::tsp;
   using namespace std::chrono_literals;
@@ -151,3 +207,102 @@ TEST(TimeSyncClientTest, CalculateBoth) {
   EXPECT_EQ(1u, client.GetMetadata().pongsReceived);
   EXPECT_EQ(pong_client_time, client.GetMetadata().lastPongTime);
 }
+
+TEST(TimeSyncClientTest, PrefersLowRttSamples) {
+  using namespace wpi::tsp;
+  using namespace std::chrono_literals;
+
+  // GIVEN a fresh client
+  TimeSyncClient client{"127.0.0.1", 5812, 100ms};
+
+  // AND ping-pongs where most replies were queued on the way back, which
+  // makes their offsets look too small
+  int64_t offset{1000};
+  uint64_t client_time{100};
+  for (int i = 0; i < 30; i++) {
+    int64_t queued = i % 4 == 0 ? 0 : 500 + 100 * (i % 7);
+    TspPing ping{.version = 1, .message_id = 1, .client_time = client_time};
+    TspPong pong{ping, client_time + offset + 100};
+    client.UpdateStatistics(client_time + 200 + queued, ping, pong);
+    client_time += 100000;
+  }
+
+  // THEN the offset comes from the undelayed samples alone
+  EXPECT_EQ(offset, client.GetMetadata().offset);
+  EXPECT_EQ(30u, client.GetMetadata().pongsReceived);
+}
+
+TEST(TimeSyncClientTest, AcceptsLatePongs) {
+  using namespace wpi::tsp;
+  using namespace std::chrono_literals;
+
+  // GIVEN a client with three pings in flight
+  TimeSyncClient client{"127.0.0.1", 5812, 100ms};
+  for (uint64_t client_time : {100, 200, 300}) {
+    client.TrackPing(
+        TspPing{.version = 1, .message_id = 1, .client_time = client_time});
+  }
+  auto pong = [](uint64_t client_time) {
+    return TspPong{
+        TspPing{.version = 1, .message_id = 2, .client_time = client_time},
+        client_time + 10};
+  };
+
+  // THEN replies count in any order, but only once each
+  EXPECT_TRUE(client.HandlePong(320, pong(200)));
+  EXPECT_TRUE(client.HandlePong(330, pong(100)));
+  EXPECT_FALSE(client.HandlePong(340, pong(200)));
+  EXPECT_FALSE(client.HandlePong(350, pong(250)));
+  EXPECT_TRUE(client.HandlePong(360, pong(300)));
+  EXPECT_EQ(3u, client.GetMetadata().pongsReceived);
+}
+
+TEST(TimeSyncClientTest, TracksDrift) {
+  using namespace wpi::tsp;
+  using namespace std::chrono_literals;
+
+  // GIVEN a fresh client
+  TimeSyncClient client{"127.0.0.1", 5812, 100ms};
+
+  // AND a server clock running 100 ppm fast, seen through a jittery link
+  constexpr double drift{100e-6};
+  int64_t offset{5000};
+  uint64_t client_time{1000000};
+  for (int i = 0; i < 60; i++) {
+    int64_t queued = i % 3 == 0 ? 0 : 300 * (i % 5);
+    uint64_t server_time =
+        client_time + 100 + offset +
+        static_cast<int64_t>(drift * static_cast<double>(client_time + 100));
+    TspPing ping{.version = 1, .message_id = 1, .client_time = client_time};
+    TspPong pong{ping, server_time};
+    client.UpdateStatistics(client_time + 200 + queued, ping, pong);
+    client_time += 500000;
+  }
+
+  // THEN the drift is recovered, and offsets extrapolate along it
+  EXPECT_NEAR(drift, client.GetMetadata().drift, 1e-6);
+  uint64_t future = client_time + 10000000;
+  EXPECT_NEAR(
+      static_cast<double>(offset) + drift * static_cast<double>(future),
+      static_cast<double>(client.GetOffset(future)), 20);
+}
+
+TEST(TimeSyncClientTest, ClampsDrift) {
+  using namespace wpi::tsp;
+  using namespace std::chrono_literals;
+
+  // GIVEN a fresh client
+  TimeSyncClient client{"127.0.0.1", 5812, 100ms};
+
+  // AND a server that jumps a whole millisecond on every pong
+  uint64_t client_time{100};
+  for (int i = 0; i < 8; i++) {
+    TspPing ping{.version = 1, .message_id = 1, .client_time = client_time};
+    TspPong pong{ping, client_time + 1000 * i};
+    client.UpdateStatistics(client_time, ping, pong);
+    client_time += 100000;
+  }
+
+  // THEN the estimate stays within what a real oscillator could do
+  EXPECT_DOUBLE_EQ(500e-6, client.GetMetadata().drift);
+}